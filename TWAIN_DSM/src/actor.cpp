@@ -0,0 +1,1040 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+
+/**
+* @file actor.cpp
+* Driver threads.
+* Run every call to a driver on a thread that belongs to that driver,
+* so several drivers can work at once, and each one always sees the
+* same thread.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* Enviroment varible to turn the driver threads on...
+* @see CTwnDsmActor
+*/
+#define kACTORENV "TWAINDSM_ACTORS"
+
+/**
+* The most calls we'll hold for a driver...
+* @see CTwnDsmActor
+*/
+#define ACTOR_MAXITEMS  64
+
+
+
+/**
+* One call on its way to a driver.  DSM_Entry calls live on the
+* caller's stack, and the caller waits for bDone.  DAT_TWDSM_SUBMIT
+* calls are calloc'd, and sit on the ticket list until they're
+* collected.  DSM_EntryAsync calls with a callback are calloc'd too,
+* but they stay off the list, and go away once the callback returns...
+*/
+typedef struct ACTOR_ITEM_
+{
+  struct ACTOR_ITEM_ *pitemNext;  /**< the next ticket, for DAT_TWDSM_SUBMIT */
+  TW_IDENTITY        *pAppId;     /**< the application's identity */
+  TWID_T              AppId;      /**< the application */
+  bool                bSubmit;    /**< from DAT_TWDSM_SUBMIT, nobody is waiting on the stack */
+  bool                bDone;      /**< the driver answered, read under the pod's mutex */
+  DSMASYNCPROC        pfnDone;    /**< from DSM_EntryAsync, call it instead of keeping a ticket */
+  TW_MEMREF           pRefCon;    /**< for pfnDone */
+  TW_TWDSM_SUBMIT     submit;     /**< the triplet, and the answer */
+} ACTOR_ITEM;
+
+/**
+* One driver, hung on its DS_SESSION.  Callers add to the tail of the
+* ring, the driver's thread takes from the head, so the driver sees
+* calls in the order they were made...
+*/
+typedef struct ACTOR_
+{
+  struct ACTOR_  *pactorNext;  /**< the next one stopped from itself, waiting for Reap */
+  TWID_T          AppId;       /**< the application */
+  TWID_T          DsId;        /**< the driver */
+  TW_IDENTITY     appidentity; /**< our copy of the application's identity */
+  TW_IDENTITY     dsidentity;  /**< our copy of the driver's identity */
+  MUTEX           mutex;       /**< guards the rest */
+  COND            condReady;   /**< a call is waiting, or the thread should stop */
+  COND            condSpace;   /**< a slot is free */
+  THREAD          thread;      /**< the driver's thread */
+  bool            bThread;     /**< the thread needs to be joined */
+  bool            bStop;       /**< the thread should stop */
+  bool            bExited;     /**< the thread is out of its loop, and won't block a join */
+  UINT64          nThreadId;   /**< the thread's id */
+  UINT            nRefs;       /**< the DS_SESSION's, and one for each Find, under the pod's mutex */
+  UINT            nHead;       /**< the next call to make */
+  UINT            nCount;      /**< how many calls are waiting */
+  ACTOR_ITEM     *apitem[ACTOR_MAXITEMS]; /**< the ring */
+} ACTOR;
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmActorImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmActorImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Find a driver's thread, and take a reference to it, so a Stop
+    * on another thread can't free it under us...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @return the actor, or NULL, Release it when you're done
+    */
+    ACTOR *Find(const TWID_T _AppId,
+                const TWID_T _DsId);
+
+    /**
+    * Let go of a reference, the last one frees the actor...
+    * @param[in] _pactor the actor
+    */
+    void Release(ACTOR *_pactor);
+
+    /**
+    * Check if we're running on the driver's thread, which must
+    * never wait on itself...
+    * @param[in] _pactor the actor
+    * @return true if we are
+    */
+    static bool OnActor(ACTOR *_pactor);
+
+    /**
+    * Add a call to the ring.  The caller holds the actor's mutex...
+    * @param[in] _pactor the actor
+    * @param[in] _pitem the call
+    * @return false if we're stopping, or the ring is full and we
+    *         can't wait for room
+    */
+    static bool Push(ACTOR      *_pactor,
+                     ACTOR_ITEM *_pitem);
+
+    /**
+    * Tell whoever is waiting that a call is done, or make its
+    * callback...
+    * @param[in] _pitem the call
+    */
+    void Done(ACTOR_ITEM *_pitem);
+
+    /**
+    * Fail whatever is still queued...
+    * @param[in] _pactor the actor
+    */
+    void Drain(ACTOR *_pactor);
+
+    /**
+    * Stop a thread, and fail whatever is still queued.  The actor is
+    * already off its DS_SESSION, and we let go of its reference...
+    * @param[in] _pactor the actor
+    */
+    void Halt(ACTOR *_pactor);
+
+    /**
+    * Join and free the threads that were stopped from themselves
+    * and have since finished...
+    */
+    void Reap();
+
+    /**
+    * The driver's thread...
+    * @param[in] _pactor its actor
+    */
+    void Worker(ACTOR *_pactor);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      bool         m_bEnabled;       /**< TWAINDSM_ACTORS is set */
+      MUTEX        m_mutex;          /**< guards DS_SESSION.pactor, m_pactorStopped, the tickets and bDone */
+      COND         m_condDone;       /**< a call is done */
+      TW_UINT32    m_uTicket;        /**< the last ticket we gave out */
+      ACTOR_ITEM  *m_pitemTickets;   /**< DAT_TWDSM_SUBMIT calls without a callback, done or not */
+      ACTOR       *m_pactorStopped;  /**< stopped from themselves, and not reaped yet */
+    } pod;    /**< Pieces of data for CTwnDsmActorImpl*/
+};
+
+
+
+/**
+* We need this to get from the thread to the object...
+*/
+typedef struct
+{
+  CTwnDsmActorImpl *pimpl;   /**< the object */
+  ACTOR            *pactor;  /**< the driver */
+} ACTOR_START;
+
+
+
+/**
+* The driver's thread just runs the loop...
+*/
+static THREADPROC(ActorThread)
+{
+  ACTOR_START *pstart = (ACTOR_START*)_pv;
+  CTwnDsmActorImpl *pimpl = pstart->pimpl;
+  ACTOR *pactor = pstart->pactor;
+  free(pstart);
+  pimpl->Worker(pactor);
+  return 0;
+}
+
+
+
+/**
+* The constructor for our class...
+*/
+CTwnDsmActor::CTwnDsmActor()
+{
+  char szEnv[32];
+
+  m_ptwndsmactorimpl = new CTwnDsmActorImpl;
+  MUTEXINIT(m_ptwndsmactorimpl->pod.m_mutex);
+  CONDINIT(m_ptwndsmactorimpl->pod.m_condDone);
+
+  SGETENV(szEnv,NCHARS(szEnv),kACTORENV);
+  if ((0 != szEnv[0]) && ('0' != szEnv[0]))
+  {
+    m_ptwndsmactorimpl->pod.m_bEnabled = true;
+    kLOG((kLOGINFO,"each driver runs on a thread of its own"));
+  }
+}
+
+
+
+/**
+* The destructor for our class.  The threads stopped with their
+* sessions, but the ones that were stopped from themselves are still
+* waiting to be joined...
+*/
+CTwnDsmActor::~CTwnDsmActor()
+{
+  ACTOR      *pactor;
+  ACTOR_ITEM *pitem;
+
+  if (m_ptwndsmactorimpl)
+  {
+    while (0 != (pactor = m_ptwndsmactorimpl->pod.m_pactorStopped))
+    {
+      m_ptwndsmactorimpl->pod.m_pactorStopped = pactor->pactorNext;
+      m_ptwndsmactorimpl->Halt(pactor);
+    }
+    while (0 != (pitem = m_ptwndsmactorimpl->pod.m_pitemTickets))
+    {
+      m_ptwndsmactorimpl->pod.m_pitemTickets = pitem->pitemNext;
+      free(pitem);
+    }
+    CONDDESTROY(m_ptwndsmactorimpl->pod.m_condDone);
+    MUTEXDESTROY(m_ptwndsmactorimpl->pod.m_mutex);
+    delete m_ptwndsmactorimpl;
+    m_ptwndsmactorimpl = 0;
+  }
+}
+
+
+
+/**
+* TWAINDSM_ACTORS is set to something other than 0...
+*/
+bool CTwnDsmActor::IsEnabled()
+{
+  return m_ptwndsmactorimpl->pod.m_bEnabled;
+}
+
+
+
+/**
+* Is the driver one of ours?
+*/
+bool CTwnDsmActor::IsRunning(const TWID_T _AppId,
+                             const TWID_T _DsId)
+{
+  ACTOR *pactor;
+
+  if (!m_ptwndsmactorimpl->pod.m_bEnabled)
+  {
+    return false;
+  }
+  pactor = m_ptwndsmactorimpl->Find(_AppId,_DsId);
+  if (0 == pactor)
+  {
+    return false;
+  }
+  m_ptwndsmactorimpl->Release(pactor);
+  return true;
+}
+
+
+
+/**
+* Start the driver's thread.  We do this before MSG_OPENDS, so that
+* DAT_ENTRYPOINT and MSG_OPENDS are made from it too...
+*/
+bool CTwnDsmActor::Start(TW_IDENTITY *_pAppId,
+                         TW_IDENTITY *_pDsId)
+{
+  DS_SESSION  *pdssession;
+  ACTOR       *pactor;
+  ACTOR_START *pstart;
+  bool         bStarted = false;
+
+  if (!m_ptwndsmactorimpl->pod.m_bEnabled)
+  {
+    return false;
+  }
+  pdssession = g_ptwndsm->DsSession((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id);
+  if (0 == pdssession)
+  {
+    return false;
+  }
+
+  // Tidy up first...
+  m_ptwndsmactorimpl->Reap();
+
+  pactor = (ACTOR*)calloc(1,sizeof(ACTOR));
+  pstart = (ACTOR_START*)calloc(1,sizeof(ACTOR_START));
+  if ((0 == pactor) || (0 == pstart))
+  {
+    kLOG((kLOGERR,"calloc failed for a driver thread, it'll be called directly..."));
+    free(pactor);
+    free(pstart);
+    return false;
+  }
+  pactor->AppId = (TWID_T)_pAppId->Id;
+  pactor->DsId = (TWID_T)_pDsId->Id;
+  pactor->nRefs = 1;
+  pactor->appidentity = *_pAppId;
+  pactor->dsidentity = *_pDsId;
+  MUTEXINIT(pactor->mutex);
+  CONDINIT(pactor->condReady);
+  CONDINIT(pactor->condSpace);
+  pstart->pimpl = m_ptwndsmactorimpl;
+  pstart->pactor = pactor;
+
+  // There shouldn't already be one for this driver...
+  MUTEXLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+  if (0 == pdssession->pactor)
+  {
+    pactor->bThread = THREADCREATE(pactor->thread,ActorThread,pstart);
+    if (pactor->bThread)
+    {
+      pdssession->pactor = pactor;
+      bStarted = true;
+    }
+  }
+  MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+
+  if (!bStarted)
+  {
+    kLOG((kLOGERR,"unable to start a thread for %.32s, it'll be called directly...",(char*)_pDsId->ProductName));
+    CONDDESTROY(pactor->condSpace);
+    CONDDESTROY(pactor->condReady);
+    MUTEXDESTROY(pactor->mutex);
+    free(pactor);
+    free(pstart);
+    return false;
+  }
+
+  return true;
+}
+
+
+
+/**
+* Take the driver off its DS_SESSION and stop its thread...
+*/
+void CTwnDsmActor::Stop(const TWID_T _AppId,
+                        const TWID_T _DsId)
+{
+  DS_SESSION *pdssession;
+  ACTOR      *pactor = 0;
+  ACTOR      *pactorSelf = 0;
+
+  if (!m_ptwndsmactorimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return;
+  }
+
+  MUTEXLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+  pactor = pdssession->pactor;
+  pdssession->pactor = 0;
+
+  // Closed from its own thread, from inside a callback, so it can't
+  // be joined here.  It waits on m_pactorStopped, and the next Start
+  // or Stop reaps it once it's out of its loop...
+  if (pactor && CTwnDsmActorImpl::OnActor(pactor))
+  {
+    MUTEXLOCK(pactor->mutex);
+    pactor->bStop = true;
+    CONDSIGNAL(pactor->condReady);
+    CONDBROADCAST(pactor->condSpace);
+    MUTEXUNLOCK(pactor->mutex);
+    pactor->pactorNext = m_ptwndsmactorimpl->pod.m_pactorStopped;
+    m_ptwndsmactorimpl->pod.m_pactorStopped = pactor;
+    pactorSelf = pactor;
+    pactor = 0;
+  }
+  MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+
+  if (pactor)
+  {
+    m_ptwndsmactorimpl->Halt(pactor);
+  }
+  else if (pactorSelf)
+  {
+    m_ptwndsmactorimpl->Drain(pactorSelf);
+  }
+
+  m_ptwndsmactorimpl->Reap();
+}
+
+
+
+/**
+* Throw away the application's finished tickets, nobody is left to
+* collect them.  Stopping the threads failed the rest, so these are
+* all of them...
+*/
+void CTwnDsmActor::DropTickets(const TWID_T _AppId)
+{
+  ACTOR_ITEM **ppitem;
+  ACTOR_ITEM  *pitem;
+  UINT         nDropped = 0;
+
+  if (!m_ptwndsmactorimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+
+  MUTEXLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+  ppitem = &m_ptwndsmactorimpl->pod.m_pitemTickets;
+  while (0 != (pitem = *ppitem))
+  {
+    if ((pitem->AppId == _AppId) && pitem->bDone)
+    {
+      *ppitem = pitem->pitemNext;
+      free(pitem);
+      nDropped++;
+    }
+    else
+    {
+      ppitem = &pitem->pitemNext;
+    }
+  }
+  MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+
+  if (nDropped)
+  {
+    kLOG((kLOGINFO,"%u DAT_TWDSM_SUBMIT tickets were never collected",nDropped));
+  }
+}
+
+
+
+/**
+* Queue the call and wait for it.  The driver's own thread, and
+* anything that isn't one of our drivers, makes the call directly...
+*/
+bool CTwnDsmActor::Call(TW_IDENTITY *_pAppId,
+                        TWID_T       _DsId,
+                        TW_UINT32    _DG,
+                        TW_UINT16    _DAT,
+                        TW_UINT16    _MSG,
+                        TW_MEMREF    _pData,
+                        TW_UINT16   *_prc)
+{
+  ACTOR      *pactor;
+  ACTOR_ITEM  item;
+
+  if (!m_ptwndsmactorimpl->pod.m_bEnabled)
+  {
+    return false;
+  }
+
+  pactor = m_ptwndsmactorimpl->Find((TWID_T)_pAppId->Id,_DsId);
+  if (0 == pactor)
+  {
+    return false;
+  }
+  if (CTwnDsmActorImpl::OnActor(pactor))
+  {
+    m_ptwndsmactorimpl->Release(pactor);
+    return false;
+  }
+
+  memset(&item,0,sizeof(item));
+  item.pAppId = _pAppId;
+  item.AppId = (TWID_T)_pAppId->Id;
+  item.submit.DsId = (TW_UINT32)_DsId;
+  item.submit.DG = _DG;
+  item.submit.DAT = _DAT;
+  item.submit.MSG = _MSG;
+  item.submit.pData = _pData;
+
+  // Once it's queued we don't need the actor, a Halt fails the call
+  // for us if it gets there first...
+  MUTEXLOCK(pactor->mutex);
+  if (!CTwnDsmActorImpl::Push(pactor,&item))
+  {
+    MUTEXUNLOCK(pactor->mutex);
+    m_ptwndsmactorimpl->Release(pactor);
+    return false;
+  }
+  MUTEXUNLOCK(pactor->mutex);
+  m_ptwndsmactorimpl->Release(pactor);
+
+  MUTEXLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+  while (!item.bDone)
+  {
+    CONDWAIT(m_ptwndsmactorimpl->pod.m_condDone,m_ptwndsmactorimpl->pod.m_mutex);
+  }
+  MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+
+  *_prc = item.submit.ReturnCode;
+  return true;
+}
+
+
+
+/**
+* Queue a triplet and hand back a ticket for it.  A callback gets the
+* ticket too, so the application can tell its calls apart...
+*/
+TW_INT16 CTwnDsmActor::Submit(TW_IDENTITY     *_pAppId,
+                              TW_TWDSM_SUBMIT *_psubmit,
+                              DSMASYNCPROC     _pfnDone,
+                              TW_MEMREF        _pRefCon,
+                              TW_UINT16       *_pcc)
+{
+  ACTOR      *pactor;
+  ACTOR_ITEM *pitem;
+
+  pactor = m_ptwndsmactorimpl->Find((TWID_T)_pAppId->Id,(TWID_T)_psubmit->DsId);
+  if (0 == pactor)
+  {
+    kLOG((kLOGERR,"DsId isn't an open driver...%d",(int)_psubmit->DsId));
+    *_pcc = TWCC_BADDEST;
+    return TWRC_FAILURE;
+  }
+
+  pitem = (ACTOR_ITEM*)calloc(1,sizeof(ACTOR_ITEM));
+  if (0 == pitem)
+  {
+    m_ptwndsmactorimpl->Release(pactor);
+    *_pcc = TWCC_LOWMEMORY;
+    return TWRC_FAILURE;
+  }
+  pitem->pAppId = &pactor->appidentity;
+  pitem->AppId = (TWID_T)_pAppId->Id;
+  pitem->bSubmit = true;
+  pitem->pfnDone = _pfnDone;
+  pitem->pRefCon = _pRefCon;
+  pitem->submit = *_psubmit;
+  pitem->submit.ReturnCode = TWRC_SUCCESS;
+  pitem->submit.ConditionCode = TWCC_SUCCESS;
+
+  // It goes on the ticket list first, in case it's done before we
+  // get back from Push.  The ticket is read now for the same reason,
+  // a callback frees the item...
+  MUTEXLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+  m_ptwndsmactorimpl->pod.m_uTicket++;
+  if (0 == m_ptwndsmactorimpl->pod.m_uTicket)
+  {
+    m_ptwndsmactorimpl->pod.m_uTicket++;
+  }
+  pitem->submit.Ticket = m_ptwndsmactorimpl->pod.m_uTicket;
+  _psubmit->Ticket = pitem->submit.Ticket;
+  if (0 == _pfnDone)
+  {
+    pitem->pitemNext = m_ptwndsmactorimpl->pod.m_pitemTickets;
+    m_ptwndsmactorimpl->pod.m_pitemTickets = pitem;
+  }
+  MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+
+  // The item points at the actor's copy of the identity, which is
+  // safe once it's queued, Halt fails it before the DS_SESSION lets go...
+  MUTEXLOCK(pactor->mutex);
+  if (CTwnDsmActorImpl::Push(pactor,pitem))
+  {
+    MUTEXUNLOCK(pactor->mutex);
+    m_ptwndsmactorimpl->Release(pactor);
+    return TWRC_SUCCESS;
+  }
+  MUTEXUNLOCK(pactor->mutex);
+  m_ptwndsmactorimpl->Release(pactor);
+
+  // The driver is closing, or we're on its thread and its ring is
+  // full, so take the ticket back...
+  if (0 == _pfnDone)
+  {
+    MUTEXLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+    ACTOR_ITEM **ppitem = &m_ptwndsmactorimpl->pod.m_pitemTickets;
+    while (*ppitem != pitem)
+    {
+      ppitem = &(*ppitem)->pitemNext;
+    }
+    *ppitem = pitem->pitemNext;
+    MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+  }
+  free(pitem);
+  _psubmit->Ticket = 0;
+
+  kLOG((kLOGERR,"DAT_TWDSM_SUBMIT couldn't queue for ds=%u",(unsigned int)_psubmit->DsId));
+  *_pcc = TWCC_SEQERROR;
+  return TWRC_FAILURE;
+}
+
+
+
+/**
+* Wait for a ticket, then hand it over and forget it.  The driver's
+* own thread can't wait for something that's behind it...
+*/
+TW_INT16 CTwnDsmActor::Wait(TW_IDENTITY     *_pAppId,
+                            TW_TWDSM_SUBMIT *_psubmit,
+                            TW_UINT16       *_pcc)
+{
+  ACTOR_ITEM **ppitem;
+  ACTOR_ITEM  *pitem;
+  ACTOR       *pactor;
+  bool         bOnActor;
+
+  MUTEXLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+  for (;;)
+  {
+    for (ppitem = &m_ptwndsmactorimpl->pod.m_pitemTickets; 0 != (pitem = *ppitem); ppitem = &pitem->pitemNext)
+    {
+      if ((pitem->AppId == (TWID_T)_pAppId->Id) && (pitem->submit.Ticket == _psubmit->Ticket))
+      {
+        break;
+      }
+    }
+    if (0 == pitem)
+    {
+      MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+      *_pcc = TWCC_BADVALUE;
+      return TWRC_FAILURE;
+    }
+    if (pitem->bDone)
+    {
+      break;
+    }
+    MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+    pactor = m_ptwndsmactorimpl->Find((TWID_T)_pAppId->Id,(TWID_T)pitem->submit.DsId);
+    if (pactor)
+    {
+      bOnActor = CTwnDsmActorImpl::OnActor(pactor);
+      m_ptwndsmactorimpl->Release(pactor);
+      if (bOnActor)
+      {
+        *_pcc = TWCC_SEQERROR;
+        return TWRC_FAILURE;
+      }
+    }
+    MUTEXLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+    if (!pitem->bDone)
+    {
+      CONDWAIT(m_ptwndsmactorimpl->pod.m_condDone,m_ptwndsmactorimpl->pod.m_mutex);
+    }
+  }
+  *ppitem = pitem->pitemNext;
+  MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+
+  *_psubmit = pitem->submit;
+  free(pitem);
+  return TWRC_SUCCESS;
+}
+
+
+
+/**
+* Hand over the oldest finished ticket, without waiting...
+*/
+TW_INT16 CTwnDsmActor::GetNext(TW_IDENTITY     *_pAppId,
+                               TW_TWDSM_SUBMIT *_psubmit)
+{
+  ACTOR_ITEM **ppitem;
+  ACTOR_ITEM **ppitemOldest = 0;
+  ACTOR_ITEM  *pitem;
+
+  // New tickets go on the front, so the last match is the oldest...
+  MUTEXLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+  for (ppitem = &m_ptwndsmactorimpl->pod.m_pitemTickets; 0 != (pitem = *ppitem); ppitem = &pitem->pitemNext)
+  {
+    if ((pitem->AppId == (TWID_T)_pAppId->Id) && pitem->bDone)
+    {
+      ppitemOldest = ppitem;
+    }
+  }
+  if (0 == ppitemOldest)
+  {
+    MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+    return TWRC_ENDOFLIST;
+  }
+  pitem = *ppitemOldest;
+  *ppitemOldest = pitem->pitemNext;
+  MUTEXUNLOCK(m_ptwndsmactorimpl->pod.m_mutex);
+
+  *_psubmit = pitem->submit;
+  free(pitem);
+  return TWRC_SUCCESS;
+}
+
+
+
+/**
+* Every call to the driver comes through here, so it's one look at
+* the DS_SESSION...
+*/
+ACTOR *CTwnDsmActorImpl::Find(const TWID_T _AppId,
+                              const TWID_T _DsId)
+{
+  DS_SESSION *pdssession;
+  ACTOR      *pactor;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return 0;
+  }
+
+  MUTEXLOCK(pod.m_mutex);
+  pactor = pdssession->pactor;
+  if (pactor)
+  {
+    pactor->nRefs++;
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+
+  return pactor;
+}
+
+
+
+/**
+* Nobody can Find it once it's off the DS_SESSION, so when the count
+* gets to zero it stays there...
+*/
+void CTwnDsmActorImpl::Release(ACTOR *_pactor)
+{
+  bool bLast;
+
+  MUTEXLOCK(pod.m_mutex);
+  _pactor->nRefs--;
+  bLast = (0 == _pactor->nRefs);
+  MUTEXUNLOCK(pod.m_mutex);
+
+  if (bLast)
+  {
+    CONDDESTROY(_pactor->condSpace);
+    CONDDESTROY(_pactor->condReady);
+    MUTEXDESTROY(_pactor->mutex);
+    free(_pactor);
+  }
+}
+
+
+
+/**
+* The thread writes its id before it looks at the ring...
+*/
+bool CTwnDsmActorImpl::OnActor(ACTOR *_pactor)
+{
+  return _pactor->bThread && (_pactor->nThreadId == (UINT64)GETTHREADID());
+}
+
+
+
+/**
+* Wait for room unless we're the one who makes it...
+*/
+bool CTwnDsmActorImpl::Push(ACTOR      *_pactor,
+                            ACTOR_ITEM *_pitem)
+{
+  while (_pactor->nCount == ACTOR_MAXITEMS)
+  {
+    if (OnActor(_pactor) || _pactor->bStop)
+    {
+      return false;
+    }
+    CONDWAIT(_pactor->condSpace,_pactor->mutex);
+  }
+  if (_pactor->bStop)
+  {
+    return false;
+  }
+  _pactor->apitem[(_pactor->nHead + _pactor->nCount) % ACTOR_MAXITEMS] = _pitem;
+  _pactor->nCount++;
+  CONDSIGNAL(_pactor->condReady);
+  return true;
+}
+
+
+
+/**
+* Wake the waiters.  A ticket also wakes the application, if it gave
+* us a way to.  A callback is made here, on the driver's thread, and
+* nobody else knows about the item, so it's ours to free...
+*/
+void CTwnDsmActorImpl::Done(ACTOR_ITEM *_pitem)
+{
+  TW_IDENTITY appidentity;
+  bool        bSubmit = _pitem->bSubmit;
+
+  if (_pitem->pfnDone)
+  {
+    appidentity = *_pitem->pAppId;
+    try
+    {
+      _pitem->pfnDone(&appidentity,&_pitem->submit,_pitem->pRefCon);
+    }
+    catch(...)
+    {
+      kLOG((kLOGERR,"DSM_EntryAsync callback threw for ticket %u",(unsigned int)_pitem->submit.Ticket));
+    }
+    free(_pitem);
+    return;
+  }
+
+  // Once bDone is set a DSM_Entry call can go out of scope, and a
+  // ticket can be collected, so take what we need first...
+  if (bSubmit)
+  {
+    appidentity = *_pitem->pAppId;
+  }
+
+  MUTEXLOCK(pod.m_mutex);
+  _pitem->bDone = true;
+  CONDBROADCAST(pod.m_condDone);
+  MUTEXUNLOCK(pod.m_mutex);
+
+  if (bSubmit)
+  {
+    g_ptwndsm->ActorWakeup(&appidentity);
+  }
+}
+
+
+
+/**
+* Take everything off the ring, then fail it without the ring's mutex,
+* Done takes the pod's...
+*/
+void CTwnDsmActorImpl::Drain(ACTOR *_pactor)
+{
+  ACTOR_ITEM *apitem[ACTOR_MAXITEMS];
+  UINT        nFailed = 0;
+  UINT        ii;
+
+  MUTEXLOCK(_pactor->mutex);
+  while (_pactor->nCount)
+  {
+    apitem[nFailed++] = _pactor->apitem[_pactor->nHead];
+    _pactor->nHead = (_pactor->nHead + 1) % ACTOR_MAXITEMS;
+    _pactor->nCount--;
+  }
+  MUTEXUNLOCK(_pactor->mutex);
+
+  for (ii = 0; ii < nFailed; ii++)
+  {
+    apitem[ii]->submit.ReturnCode = TWRC_FAILURE;
+    apitem[ii]->submit.ConditionCode = TWCC_SEQERROR;
+    Done(apitem[ii]);
+  }
+  if (nFailed)
+  {
+    kLOG((kLOGINFO,"%u calls were still queued for ds=%u",nFailed,(unsigned int)_pactor->DsId));
+  }
+}
+
+
+
+/**
+* Stop the thread, and fail whatever it didn't get to...
+*/
+void CTwnDsmActorImpl::Halt(ACTOR *_pactor)
+{
+  MUTEXLOCK(_pactor->mutex);
+  _pactor->bStop = true;
+  CONDSIGNAL(_pactor->condReady);
+  CONDBROADCAST(_pactor->condSpace);
+  MUTEXUNLOCK(_pactor->mutex);
+
+  if (_pactor->bThread)
+  {
+    THREADJOIN(_pactor->thread);
+  }
+  Drain(_pactor);
+
+  Release(_pactor);
+}
+
+
+
+/**
+* Only the ones that are out of their loop come off m_pactorStopped,
+* bExited means the join won't wait on a callback...
+*/
+void CTwnDsmActorImpl::Reap()
+{
+  ACTOR **ppactor;
+  ACTOR  *pactor;
+  ACTOR  *pactorReaped = 0;
+  bool    bExited;
+
+  MUTEXLOCK(pod.m_mutex);
+  ppactor = &pod.m_pactorStopped;
+  while (0 != (pactor = *ppactor))
+  {
+    MUTEXLOCK(pactor->mutex);
+    bExited = pactor->bExited;
+    MUTEXUNLOCK(pactor->mutex);
+    if (bExited)
+    {
+      *ppactor = pactor->pactorNext;
+      pactor->pactorNext = pactorReaped;
+      pactorReaped = pactor;
+    }
+    else
+    {
+      ppactor = &pactor->pactorNext;
+    }
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+
+  while (0 != (pactor = pactorReaped))
+  {
+    pactorReaped = pactor->pactorNext;
+    Halt(pactor);
+  }
+}
+
+
+
+/**
+* Make calls in order until we're told to stop.  DSM_Entry calls have
+* already been checked, so they go to ActorEntry.  Tickets go through
+* DSM_Entry, like any other triplet, and we ask the driver for its
+* DAT_STATUS when they fail, since nobody else can do it in time...
+*/
+void CTwnDsmActorImpl::Worker(ACTOR *_pactor)
+{
+  ACTOR_ITEM *pitem;
+  TW_STATUS   twstatus;
+  TW_UINT16   rc;
+
+  // Run where the session was placed, if it was...
+  g_ptwndsmaffinity->Pin(_pactor->AppId,_pactor->DsId);
+
+  MUTEXLOCK(_pactor->mutex);
+  _pactor->nThreadId = (UINT64)GETTHREADID();
+  while (!_pactor->bStop)
+  {
+    // Wait for something to do...
+    if (0 == _pactor->nCount)
+    {
+      CONDWAIT(_pactor->condReady,_pactor->mutex);
+      continue;
+    }
+    pitem = _pactor->apitem[_pactor->nHead];
+    _pactor->nHead = (_pactor->nHead + 1) % ACTOR_MAXITEMS;
+    _pactor->nCount--;
+    CONDSIGNAL(_pactor->condSpace);
+    MUTEXUNLOCK(_pactor->mutex);
+
+    try
+    {
+      if (!pitem->bSubmit)
+      {
+        rc = g_ptwndsm->ActorEntry(pitem->pAppId,
+                                   (TWID_T)pitem->submit.DsId,
+                                   pitem->submit.DG,
+                                   pitem->submit.DAT,
+                                   pitem->submit.MSG,
+                                   pitem->submit.pData);
+      }
+      else
+      {
+        rc = ::DSM_Entry(pitem->pAppId,
+                         &_pactor->dsidentity,
+                         pitem->submit.DG,
+                         pitem->submit.DAT,
+                         pitem->submit.MSG,
+                         pitem->submit.pData);
+        if (TWRC_FAILURE == rc)
+        {
+          memset(&twstatus,0,sizeof(twstatus));
+          if (TWRC_SUCCESS == ::DSM_Entry(pitem->pAppId,&_pactor->dsidentity,DG_CONTROL,DAT_STATUS,MSG_GET,(TW_MEMREF)&twstatus))
+          {
+            pitem->submit.ConditionCode = twstatus.ConditionCode;
+          }
+        }
+      }
+    }
+    catch(...)
+    {
+      kLOG((kLOGERR,"exception on the thread for ds=%u",(unsigned int)_pactor->DsId));
+      rc = TWRC_FAILURE;
+      pitem->submit.ConditionCode = TWCC_BUMMER;
+    }
+    pitem->submit.ReturnCode = rc;
+    Done(pitem);
+
+    MUTEXLOCK(_pactor->mutex);
+  }
+  _pactor->bExited = true;
+  MUTEXUNLOCK(_pactor->mutex);
+}
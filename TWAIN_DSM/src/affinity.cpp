@@ -0,0 +1,840 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+/**
+* @file affinity.cpp
+* Session placement.
+* Keep a driver's threads, and the memory they fault in, on the NUMA
+* node its device hangs off, so the pixels don't cross between sockets.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* Enviroment varible with the placement rules.  It's a list separated
+* by semicolons of ProductName=where, with * matching any driver, and
+* where is node:N, cpus:LIST (like 0-3,8), or the device's directory
+* in /sys, where we look for the closest numa_node...
+* @see CTwnDsmAffinity
+*/
+#define kAFFINITYENV "TWAINDSM_AFFINITY"
+
+/**
+* The most rules we take...
+* @see CTwnDsmAffinity
+*/
+#define AFFINITY_MAXRULES    16
+
+/**
+* The memory policies we use, from linux/mempolicy.h, which we don't
+* want to depend on...
+* @see CTwnDsmAffinity
+*/
+#define AFFINITY_MPOL_DEFAULT   0
+#define AFFINITY_MPOL_PREFERRED 1
+#define AFFINITY_MPOL_MF_MOVE   2
+
+
+
+/**
+* One rule from TWAINDSM_AFFINITY...
+*/
+typedef struct
+{
+  TW_STR32     szDsName;    /**< the driver's ProductName, or * */
+  char         szWhere[256];/**< node:N, cpus:LIST or a path in /sys */
+} AFFINITY_RULE;
+
+/**
+* Where one application/driver session runs, hung on its DS_SESSION.
+* It goes when the driver is unloaded, so a later session with the
+* same ids doesn't inherit a stale placement...
+*/
+typedef struct AFFINITY_SESSION_
+{
+  TW_STR32     szDsName;    /**< the driver's ProductName */
+  int          nNode;       /**< the NUMA node, or -1 if we only have CPUs */
+  UINT         nCpus;       /**< how many CPUs it can run on */
+  char         szCpus[128]; /**< the same, as a list */
+  char         szWhere[256];/**< the rule that put it there */
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    cpu_set_t  cpuset;      /**< the CPUs */
+  #endif
+} AFFINITY_SESSION;
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmAffinityImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmAffinityImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Find a session, the caller holds the mutex...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @return the session, or NULL
+    */
+    AFFINITY_SESSION *Find(const TWID_T _AppId,
+                           const TWID_T _DsId);
+
+    #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+
+      /**
+      * Work out the CPUs and node for a rule...
+      * @param[in] _szWhere node:N, cpus:LIST or a path in /sys
+      * @param[out] _pcpuset the CPUs, limited to the ones we're allowed
+      * @param[out] _pnNode the node, or -1
+      * @return false if it doesn't give us anywhere to run
+      */
+      bool Resolve(const char *_szWhere,
+                   cpu_set_t  *_pcpuset,
+                   int        *_pnNode);
+
+      /**
+      * Read a list like 0-3,8 into a cpu_set_t...
+      * @param[in] _szList the list
+      * @param[out] _pcpuset the CPUs
+      * @return false if it's garbage
+      */
+      static bool ParseCpus(const char *_szList,
+                            cpu_set_t  *_pcpuset);
+
+      /**
+      * Write a cpu_set_t as a list like 0-3,8...
+      * @param[in] _pcpuset the CPUs
+      * @param[out] _szList the list
+      * @param[in] _nList its size
+      */
+      static void FormatCpus(const cpu_set_t *_pcpuset,
+                             char            *_szList,
+                             const size_t     _nList);
+
+      /**
+      * Read the first line of a file in /sys...
+      * @param[in] _szPath the file
+      * @param[out] _szLine the line, without the newline
+      * @param[in] _nLine its size
+      * @return false if we can't
+      */
+      static bool ReadLine(const char  *_szPath,
+                           char        *_szLine,
+                           const size_t _nLine);
+
+      /**
+      * Set the memory policy of this thread...
+      * @param[in] _nNode the node to prefer, or -1 for the default
+      */
+      static void SetMemPolicy(const int _nNode);
+
+    #endif
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      bool             m_bEnabled;       /**< TWAINDSM_AFFINITY is set */
+      MUTEX            m_mutex;          /**< guards DS_SESSION.paffinity */
+      int              m_nRules;         /**< how many rules */
+      AFFINITY_RULE    m_arule[AFFINITY_MAXRULES]; /**< the rules, in the order we got them */
+      #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+        cpu_set_t      m_cpusetProcess;  /**< the CPUs we were given at the start */
+        TLSKEY         m_key;            /**< each thread's node plus two, 0 if it isn't pinned */
+        bool           m_bKey;           /**< m_key needs to be deleted */
+      #endif
+    } pod;    /**< Pieces of data for CTwnDsmAffinityImpl*/
+};
+
+
+
+/**
+* The constructor for our class, reads the rules...
+*/
+CTwnDsmAffinity::CTwnDsmAffinity()
+{
+  char  szEnv[1024];
+  char *szRule;
+  char *szNext;
+  char *szEquals;
+
+  m_ptwndsmaffinityimpl = new CTwnDsmAffinityImpl;
+  MUTEXINIT(m_ptwndsmaffinityimpl->pod.m_mutex);
+
+  SGETENV(szEnv,NCHARS(szEnv),kAFFINITYENV);
+  if (0 == szEnv[0])
+  {
+    return;
+  }
+
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    if (0 != sched_getaffinity(0,sizeof(cpu_set_t),&m_ptwndsmaffinityimpl->pod.m_cpusetProcess))
+    {
+      kLOG((kLOGERR,"sched_getaffinity failed, errno %d, sessions won't be placed",errno));
+      return;
+    }
+    m_ptwndsmaffinityimpl->pod.m_bKey = TLSCREATE(m_ptwndsmaffinityimpl->pod.m_key,0);
+    if (!m_ptwndsmaffinityimpl->pod.m_bKey)
+    {
+      kLOG((kLOGERR,"unable to get a TLS key, sessions won't be placed"));
+      return;
+    }
+
+    for (szRule = szEnv; szRule && *szRule; szRule = szNext)
+    {
+      szNext = strchr(szRule,';');
+      if (szNext)
+      {
+        *szNext++ = 0;
+      }
+      szEquals = strchr(szRule,'=');
+      if ((0 == szEquals) || (szEquals == szRule) || (0 == szEquals[1]))
+      {
+        kLOG((kLOGERR,"%s: ignoring \"%s\"",kAFFINITYENV,szRule));
+        continue;
+      }
+      if (m_ptwndsmaffinityimpl->pod.m_nRules >= AFFINITY_MAXRULES)
+      {
+        kLOG((kLOGERR,"%s: too many rules, ignoring \"%s\"",kAFFINITYENV,szRule));
+        break;
+      }
+      *szEquals = 0;
+      AFFINITY_RULE *prule = &m_ptwndsmaffinityimpl->pod.m_arule[m_ptwndsmaffinityimpl->pod.m_nRules++];
+      SNPRINTF((char*)prule->szDsName,sizeof(prule->szDsName),"%s",szRule);
+      SNPRINTF(prule->szWhere,sizeof(prule->szWhere),"%s",szEquals+1);
+      kLOG((kLOGINFO,"placing %s on %s",(char*)prule->szDsName,prule->szWhere));
+    }
+    m_ptwndsmaffinityimpl->pod.m_bEnabled = (0 != m_ptwndsmaffinityimpl->pod.m_nRules);
+  #else
+    (void)szRule;
+    (void)szNext;
+    (void)szEquals;
+    kLOG((kLOGINFO,"%s only works on Linux",kAFFINITYENV));
+  #endif
+}
+
+
+
+/**
+* The destructor for our class...
+*/
+CTwnDsmAffinity::~CTwnDsmAffinity()
+{
+  if (m_ptwndsmaffinityimpl)
+  {
+    #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+      if (m_ptwndsmaffinityimpl->pod.m_bKey)
+      {
+        TLSDELETE(m_ptwndsmaffinityimpl->pod.m_key);
+      }
+    #endif
+    MUTEXDESTROY(m_ptwndsmaffinityimpl->pod.m_mutex);
+    delete m_ptwndsmaffinityimpl;
+    m_ptwndsmaffinityimpl = 0;
+  }
+}
+
+
+
+/**
+* TWAINDSM_AFFINITY gave us at least one rule we can use...
+*/
+bool CTwnDsmAffinity::IsEnabled()
+{
+  return m_ptwndsmaffinityimpl->pod.m_bEnabled;
+}
+
+
+
+/**
+* Find the first rule for the driver and work out where it goes.  We
+* do this at every MSG_OPENDS, since the device may have moved...
+*/
+void CTwnDsmAffinity::Place(TW_IDENTITY *_pAppId,
+                            TW_IDENTITY *_pDsId)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    AFFINITY_RULE    *prule = 0;
+    DS_SESSION       *pdssession;
+    AFFINITY_SESSION *psession;
+    cpu_set_t         cpuset;
+    int               nNode;
+    int               ii;
+
+    if (!m_ptwndsmaffinityimpl->pod.m_bEnabled)
+    {
+      return;
+    }
+
+    for (ii = 0; ii < m_ptwndsmaffinityimpl->pod.m_nRules; ii++)
+    {
+      if (   (0 == strcmp((char*)m_ptwndsmaffinityimpl->pod.m_arule[ii].szDsName,"*"))
+          || (0 == strncmp((char*)m_ptwndsmaffinityimpl->pod.m_arule[ii].szDsName,(char*)_pDsId->ProductName,sizeof(TW_STR32))))
+      {
+        prule = &m_ptwndsmaffinityimpl->pod.m_arule[ii];
+        break;
+      }
+    }
+
+    // Either no rule, or one that doesn't work, leaves it wherever
+    // the scheduler puts it...
+    if (   (0 == prule)
+        || !m_ptwndsmaffinityimpl->Resolve(prule->szWhere,&cpuset,&nNode))
+    {
+      Forget((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id);
+      return;
+    }
+
+    pdssession = g_ptwndsm->DsSession((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id);
+    if (0 == pdssession)
+    {
+      return;
+    }
+
+    MUTEXLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+    psession = pdssession->paffinity;
+    if (0 == psession)
+    {
+      psession = (AFFINITY_SESSION*)calloc(1,sizeof(AFFINITY_SESSION));
+      if (0 == psession)
+      {
+        MUTEXUNLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+        kLOG((kLOGERR,"calloc failed placing %.32s, leaving it alone",(char*)_pDsId->ProductName));
+        return;
+      }
+      pdssession->paffinity = psession;
+    }
+    memset(psession,0,sizeof(AFFINITY_SESSION));
+    memcpy(psession->szDsName,_pDsId->ProductName,sizeof(psession->szDsName));
+    psession->nNode = nNode;
+    psession->cpuset = cpuset;
+    psession->nCpus = (UINT)CPU_COUNT(&cpuset);
+    CTwnDsmAffinityImpl::FormatCpus(&cpuset,psession->szCpus,sizeof(psession->szCpus));
+    SSTRCPY(psession->szWhere,NCHARS(psession->szWhere),prule->szWhere);
+    kLOG((kLOGINFO,"%.32s for %.32s runs on node %d, cpus %s (%s)",(char*)_pDsId->ProductName,(char*)_pAppId->ProductName,nNode,psession->szCpus,prule->szWhere));
+    MUTEXUNLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+  #else
+    (void)_pAppId;
+    (void)_pDsId;
+  #endif
+}
+
+
+
+/**
+* Let go of one session...
+*/
+void CTwnDsmAffinity::Forget(const TWID_T _AppId,
+                             const TWID_T _DsId)
+{
+  DS_SESSION       *pdssession;
+  AFFINITY_SESSION *psession;
+
+  if (!m_ptwndsmaffinityimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return;
+  }
+
+  MUTEXLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+  psession = pdssession->paffinity;
+  pdssession->paffinity = 0;
+  MUTEXUNLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+
+  free(psession);
+}
+
+
+
+/**
+* Move the calling thread to the session's CPUs, and prefer its node
+* for the pages it faults in.  A session that wasn't placed puts a
+* thread we moved before back where it started...
+*/
+void CTwnDsmAffinity::Pin(const TWID_T _AppId,
+                          const TWID_T _DsId)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    AFFINITY_SESSION *psession;
+    cpu_set_t         cpuset;
+    int               nNode = -1;
+    bool              bPlaced = false;
+    int               rc;
+
+    if (!m_ptwndsmaffinityimpl->pod.m_bEnabled)
+    {
+      return;
+    }
+
+    MUTEXLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+    psession = m_ptwndsmaffinityimpl->Find(_AppId,_DsId);
+    if (psession)
+    {
+      cpuset = psession->cpuset;
+      nNode = psession->nNode;
+      bPlaced = true;
+    }
+    MUTEXUNLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+
+    if (!bPlaced)
+    {
+      if (0 == TLSGET(m_ptwndsmaffinityimpl->pod.m_key))
+      {
+        return;
+      }
+      cpuset = m_ptwndsmaffinityimpl->pod.m_cpusetProcess;
+    }
+
+    rc = pthread_setaffinity_np(pthread_self(),sizeof(cpu_set_t),&cpuset);
+    if (0 != rc)
+    {
+      kLOG((kLOGERR,"pthread_setaffinity_np failed, error %d",rc));
+    }
+    CTwnDsmAffinityImpl::SetMemPolicy(nNode);
+    TLSSET(m_ptwndsmaffinityimpl->pod.m_key,bPlaced ? (void*)(size_t)(nNode + 2) : (void*)0);
+  #else
+    (void)_AppId;
+    (void)_DsId;
+  #endif
+}
+
+
+
+/**
+* Bind a mapping to the node the calling thread is pinned to, so it
+* stays there no matter who touches it first.  A recycled one may
+* already have pages on another node, MPOL_MF_MOVE brings them over...
+*/
+void CTwnDsmAffinity::BindMemory(void        *_pv,
+                                 const UINT64 _nBytes,
+                                 const bool   _bMove)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX) && defined(SYS_mbind)
+    unsigned long nodemask[16];
+    int           nNode;
+
+    if (!m_ptwndsmaffinityimpl->pod.m_bEnabled)
+    {
+      return;
+    }
+    nNode = (int)(size_t)TLSGET(m_ptwndsmaffinityimpl->pod.m_key) - 2;
+    if ((nNode < 0) || (nNode >= (int)(sizeof(nodemask) * 8)))
+    {
+      return;
+    }
+    memset(nodemask,0,sizeof(nodemask));
+    nodemask[nNode / (sizeof(unsigned long) * 8)] |= 1UL << (nNode % (sizeof(unsigned long) * 8));
+    if (0 != syscall(SYS_mbind,_pv,(unsigned long)_nBytes,AFFINITY_MPOL_PREFERRED,nodemask,(unsigned long)(sizeof(nodemask) * 8),_bMove ? AFFINITY_MPOL_MF_MOVE : 0))
+    {
+      kLOG((kLOGERR,"mbind to node %d failed, errno %d",nNode,errno));
+    }
+  #else
+    (void)_pv;
+    (void)_nBytes;
+    (void)_bMove;
+  #endif
+}
+
+
+
+/**
+* Tell the shared memory where a session is...
+*/
+bool CTwnDsmAffinity::Get(const TWID_T _AppId,
+                          const TWID_T _DsId,
+                          int         *_pnNode,
+                          UINT        *_pnCpus)
+{
+  AFFINITY_SESSION *psession;
+  bool              bPlaced = false;
+
+  *_pnNode = -1;
+  *_pnCpus = 0;
+  if (!m_ptwndsmaffinityimpl->pod.m_bEnabled)
+  {
+    return false;
+  }
+
+  MUTEXLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+  psession = m_ptwndsmaffinityimpl->Find(_AppId,_DsId);
+  if (psession)
+  {
+    *_pnNode = psession->nNode;
+    *_pnCpus = psession->nCpus;
+    bPlaced = true;
+  }
+  MUTEXUNLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+  return bPlaced;
+}
+
+
+
+/**
+* Add the placements to the metrics file, in the same style...
+*/
+void CTwnDsmAffinity::Report(FILE        *_pfile,
+                             const TWID_T _AppId)
+{
+  AFFINITY_SESSION *psession;
+  TWID_T            DsId;
+  bool              bHeader = false;
+
+  if (!m_ptwndsmaffinityimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+
+  MUTEXLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+  for (DsId = 1; DsId < MAX_NUM_DS; DsId++)
+  {
+    psession = m_ptwndsmaffinityimpl->Find(_AppId,DsId);
+    if (0 == psession)
+    {
+      continue;
+    }
+    if (!bHeader)
+    {
+      fprintf(_pfile,"# %-32s %5s %5s %-24s %s\n","source","node","ncpu","cpus","rule");
+      bHeader = true;
+    }
+    fprintf(_pfile,"  %-32.32s %5d %5u %-24s %s\n",
+            (char*)psession->szDsName,
+            psession->nNode,
+            psession->nCpus,
+            psession->szCpus,
+            psession->szWhere);
+  }
+  MUTEXUNLOCK(m_ptwndsmaffinityimpl->pod.m_mutex);
+}
+
+
+
+/**
+* It's on the DS_SESSION, if the driver was placed...
+*/
+AFFINITY_SESSION *CTwnDsmAffinityImpl::Find(const TWID_T _AppId,
+                                            const TWID_T _DsId)
+{
+  DS_SESSION *pdssession;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return 0;
+  }
+  return pdssession->paffinity;
+}
+
+
+
+#if (TWNDSM_OS == TWNDSM_OS_LINUX)
+
+/**
+* node:N takes the node's CPUs, cpus:LIST takes the node of the first
+* CPU, and a path climbs up from the device until it finds a numa_node
+* that isn't -1, which is usually the PCI function of the controller...
+*/
+bool CTwnDsmAffinityImpl::Resolve(const char *_szWhere,
+                                  cpu_set_t  *_pcpuset,
+                                  int        *_pnNode)
+{
+  char           szPath[FILENAME_MAX];
+  char           szLine[1024];
+  char          *szSlash;
+  DIR           *pdir;
+  struct dirent *pdirent;
+  int            ii;
+
+  *_pnNode = -1;
+  CPU_ZERO(_pcpuset);
+
+  if (0 == strncmp(_szWhere,"node:",5))
+  {
+    *_pnNode = atoi(_szWhere + 5);
+  }
+
+  else if (0 == strncmp(_szWhere,"cpus:",5))
+  {
+    if (!ParseCpus(_szWhere + 5,_pcpuset))
+    {
+      kLOG((kLOGERR,"%s: bad cpu list \"%s\"",kAFFINITYENV,_szWhere));
+      return false;
+    }
+    for (ii = 0; (ii < CPU_SETSIZE) && (-1 == *_pnNode); ii++)
+    {
+      if (CPU_ISSET(ii,_pcpuset))
+      {
+        SNPRINTF(szPath,sizeof(szPath),"/sys/devices/system/cpu/cpu%d",ii);
+        pdir = opendir(szPath);
+        if (pdir)
+        {
+          while (0 != (pdirent = readdir(pdir)))
+          {
+            if (   (0 == strncmp(pdirent->d_name,"node",4))
+                && (pdirent->d_name[4] >= '0')
+                && (pdirent->d_name[4] <= '9'))
+            {
+              *_pnNode = atoi(pdirent->d_name + 4);
+              break;
+            }
+          }
+          closedir(pdir);
+        }
+        break;
+      }
+    }
+  }
+
+  else if ('/' == _szWhere[0])
+  {
+    if (0 == realpath(_szWhere,szPath))
+    {
+      kLOG((kLOGERR,"%s: can't find %s, errno %d",kAFFINITYENV,_szWhere,errno));
+      return false;
+    }
+    while ((-1 == *_pnNode) && (0 != (szSlash = strrchr(szPath,'/'))) && (szSlash != szPath))
+    {
+      size_t nLength = strlen(szPath);
+      SSTRCAT(szPath,NCHARS(szPath),"/numa_node");
+      if (ReadLine(szPath,szLine,sizeof(szLine)))
+      {
+        *_pnNode = atoi(szLine);
+      }
+      szPath[nLength] = 0;
+      *strrchr(szPath,'/') = 0;
+    }
+    if (-1 == *_pnNode)
+    {
+      kLOG((kLOGINFO,"%s has no NUMA locality, leaving it alone",_szWhere));
+      return false;
+    }
+  }
+
+  else
+  {
+    kLOG((kLOGERR,"%s: don't know where \"%s\" is",kAFFINITYENV,_szWhere));
+    return false;
+  }
+
+  // If we have a node but no CPUs, use the node's...
+  if ((*_pnNode >= 0) && (0 == CPU_COUNT(_pcpuset)))
+  {
+    SNPRINTF(szPath,sizeof(szPath),"/sys/devices/system/node/node%d/cpulist",*_pnNode);
+    if (!ReadLine(szPath,szLine,sizeof(szLine)) || !ParseCpus(szLine,_pcpuset))
+    {
+      kLOG((kLOGERR,"%s: no such node for \"%s\"",kAFFINITYENV,_szWhere));
+      return false;
+    }
+  }
+
+  // We can only go where we're allowed...
+  CPU_AND(_pcpuset,_pcpuset,&pod.m_cpusetProcess);
+  if (0 == CPU_COUNT(_pcpuset))
+  {
+    kLOG((kLOGERR,"%s: none of the cpus for \"%s\" are available to us",kAFFINITYENV,_szWhere));
+    return false;
+  }
+  return true;
+}
+
+
+
+/**
+* The same format as cpulist in /sys...
+*/
+bool CTwnDsmAffinityImpl::ParseCpus(const char *_szList,
+                                    cpu_set_t  *_pcpuset)
+{
+  const char *sz = _szList;
+  char       *szEnd;
+  long        nFirst;
+  long        nLast;
+
+  CPU_ZERO(_pcpuset);
+  while (*sz)
+  {
+    nFirst = strtol(sz,&szEnd,10);
+    if ((szEnd == sz) || (nFirst < 0) || (nFirst >= CPU_SETSIZE))
+    {
+      return false;
+    }
+    nLast = nFirst;
+    sz = szEnd;
+    if ('-' == *sz)
+    {
+      nLast = strtol(sz + 1,&szEnd,10);
+      if ((szEnd == sz + 1) || (nLast < nFirst) || (nLast >= CPU_SETSIZE))
+      {
+        return false;
+      }
+      sz = szEnd;
+    }
+    for (; nFirst <= nLast; nFirst++)
+    {
+      CPU_SET((int)nFirst,_pcpuset);
+    }
+    if (',' == *sz)
+    {
+      sz++;
+    }
+    else if (*sz)
+    {
+      return false;
+    }
+  }
+  return (0 != CPU_COUNT(_pcpuset));
+}
+
+
+
+/**
+* Runs of CPUs get a dash...
+*/
+void CTwnDsmAffinityImpl::FormatCpus(const cpu_set_t *_pcpuset,
+                                     char            *_szList,
+                                     const size_t     _nList)
+{
+  size_t nUsed = 0;
+  int    ii;
+  int    nFirst;
+  int    nWrote;
+
+  _szList[0] = 0;
+  for (ii = 0; ii < CPU_SETSIZE; ii++)
+  {
+    if (!CPU_ISSET(ii,_pcpuset))
+    {
+      continue;
+    }
+    nFirst = ii;
+    while (((ii + 1) < CPU_SETSIZE) && CPU_ISSET(ii + 1,_pcpuset))
+    {
+      ii++;
+    }
+    if (nFirst == ii)
+    {
+      nWrote = SNPRINTF(_szList + nUsed,_nList - nUsed,"%s%d",nUsed ? "," : "",nFirst);
+    }
+    else
+    {
+      nWrote = SNPRINTF(_szList + nUsed,_nList - nUsed,"%s%d-%d",nUsed ? "," : "",nFirst,ii);
+    }
+    if ((nWrote < 0) || ((size_t)nWrote >= (_nList - nUsed)))
+    {
+      _szList[nUsed] = 0;
+      return;
+    }
+    nUsed += (size_t)nWrote;
+  }
+}
+
+
+
+/**
+* Files in /sys are one line...
+*/
+bool CTwnDsmAffinityImpl::ReadLine(const char  *_szPath,
+                                   char        *_szLine,
+                                   const size_t _nLine)
+{
+  FILE  *pfile;
+  size_t nLength;
+
+  FOPEN(pfile,_szPath,"r");
+  if (0 == pfile)
+  {
+    return false;
+  }
+  if (0 == fgets(_szLine,(int)_nLine,pfile))
+  {
+    fclose(pfile);
+    return false;
+  }
+  fclose(pfile);
+  nLength = strlen(_szLine);
+  while (nLength && (('\n' == _szLine[nLength-1]) || ('\r' == _szLine[nLength-1])))
+  {
+    _szLine[--nLength] = 0;
+  }
+  return true;
+}
+
+
+
+/**
+* MPOL_PREFERRED falls back to other nodes when this one is full,
+* which is what we want, a slow page is better than no page...
+*/
+void CTwnDsmAffinityImpl::SetMemPolicy(const int _nNode)
+{
+  #if defined(SYS_set_mempolicy)
+    unsigned long nodemask[16];
+    long          rc;
+
+    if ((_nNode < 0) || (_nNode >= (int)(sizeof(nodemask) * 8)))
+    {
+      rc = syscall(SYS_set_mempolicy,AFFINITY_MPOL_DEFAULT,(unsigned long*)0,0UL);
+    }
+    else
+    {
+      memset(nodemask,0,sizeof(nodemask));
+      nodemask[_nNode / (sizeof(unsigned long) * 8)] |= 1UL << (_nNode % (sizeof(unsigned long) * 8));
+      rc = syscall(SYS_set_mempolicy,AFFINITY_MPOL_PREFERRED,nodemask,(unsigned long)(sizeof(nodemask) * 8));
+    }
+    if (0 != rc)
+    {
+      kLOG((kLOGERR,"set_mempolicy for node %d failed, errno %d",_nNode,errno));
+    }
+  #else
+    (void)_nNode;
+  #endif
+}
+
+#endif
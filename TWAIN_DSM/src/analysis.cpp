@@ -0,0 +1,967 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+/**
+* @file analysis.cpp
+* Content analysis.
+* Add up a luminance histogram, ink coverage and edge density for each
+* page, as the strips from DAT_IMAGEMEMXFER go by, so an application
+* can ask with DAT_TWDSM_ANALYSIS if a page is blank.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+/**
+* Which SIMD kernel we can build.  SSE2 is always there on x64, and
+* NEON on ARM64, so there's nothing to decide when we start...
+*/
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+  #define ANALYSIS_SSE2
+  #define ANALYSIS_KERNEL "sse2"
+  #include <emmintrin.h>
+#elif (defined(__aarch64__) || defined(_M_ARM64)) && defined(TWNDSM_CONVERT_NEON)
+  // NEON stays out unless it's asked for, the same as convert.cpp,
+  // until it's been built on aarch64 and passes twaindsm-analysischeck...
+  #define ANALYSIS_NEON
+  #define ANALYSIS_KERNEL "neon"
+  #include <arm_neon.h>
+#endif
+
+
+
+/**
+* How many rows of 8 bit counters we can add up before they overflow...
+* @see CTwnDsmAnalysis
+*/
+#define ANALYSIS_MAXBLOCKS 255
+
+/**
+* CheckKernels tries every row length up to this many pixels, which is
+* a few vectors, plus the odd ends...
+* @see CTwnDsmAnalysis
+*/
+#define ANALYSIS_CHECKCOUNT 100
+
+/**
+* ...and one row long enough to go through ANALYSIS_MAXBLOCKS twice,
+* with every pixel ink and every pair an edge, so the counters would
+* overflow if we didn't add them up in time...
+* @see CTwnDsmAnalysis
+*/
+#define ANALYSIS_CHECKLONG ((ANALYSIS_MAXBLOCKS * 16 * 2) + 33)
+
+
+
+/**
+* What an application asked for, what we know about the image, and
+* what we've seen of the page so far, hung on the DS_SESSION...
+*/
+typedef struct ANALYSIS_SESSION_
+{
+  TW_UINT16          Flags;          /**< TWDSM_ANALYSIS_xxx */
+  TW_UINT8           uInkMax;        /**< luminance at or below this is ink */
+  TW_UINT16          BlankCoverage;  /**< in 1/10000ths */
+  bool               bActive;        /**< DAT_IMAGEINFO said we can do it */
+  UINT               nChannels;      /**< 1, 3 or 4 */
+  UINT               nBits;          /**< bits per sample, 1, 8 or 16 */
+  UINT64             nPixels;        /**< pixels on this page so far */
+  UINT64             nInk;           /**< ...and how many of them are ink */
+  UINT64             nPairs;         /**< neighbours on a row so far */
+  UINT64             nEdges;         /**< ...and how many of them are edges */
+  TW_UINT32          auHistogram[256]; /**< luminance so far */
+  bool               bHaveLast;      /**< true once a page is done */
+  TW_TWDSM_ANALYSIS  last;           /**< the last page that was done */
+} ANALYSIS_SESSION;
+
+/**
+* What we need to know to look at a strip, copied out of the session
+* so we can do it without the mutex...
+*/
+typedef struct
+{
+  TW_UINT16  Flags;      /**< TWDSM_ANALYSIS_xxx */
+  TW_UINT8   uInkMax;    /**< luminance at or below this is ink */
+  UINT       nChannels;  /**< 1, 3 or 4 */
+  UINT       nBits;      /**< bits per sample, 1, 8 or 16 */
+} ANALYSIS_FORMAT;
+
+/**
+* What we found in one strip...
+*/
+typedef struct
+{
+  UINT64     nPixels;           /**< pixels in the strip */
+  UINT64     nInk;              /**< ...and how many of them are ink */
+  UINT64     nPairs;            /**< neighbours on a row */
+  UINT64     nEdges;            /**< ...and how many of them are edges */
+  TW_UINT32  auHistogram[256];  /**< luminance */
+} ANALYSIS_STRIP;
+
+
+
+/**
+* Count the bits in a byte...
+*/
+static UINT Pop8(TW_UINT8 _uByte)
+{
+  _uByte = (TW_UINT8)(_uByte - ((_uByte >> 1) & 0x55));
+  _uByte = (TW_UINT8)((_uByte & 0x33) + ((_uByte >> 2) & 0x33));
+  return (UINT)((_uByte + (_uByte >> 4)) & 0x0F);
+}
+
+/**
+* Turn a byte around, for TWBO_LSBFIRST...
+*/
+static TW_UINT8 Reverse8(TW_UINT8 _uByte)
+{
+  _uByte = (TW_UINT8)((_uByte >> 4) | (_uByte << 4));
+  _uByte = (TW_UINT8)(((_uByte & 0xCC) >> 2) | ((_uByte & 0x33) << 2));
+  _uByte = (TW_UINT8)(((_uByte & 0xAA) >> 1) | ((_uByte & 0x55) << 1));
+  return _uByte;
+}
+
+/**
+* A bilevel row, a byte at a time.  The ones are counted, and the
+* edges are the places where a bit isn't the same as the one before
+* it, which is the byte xor'ed with itself shifted by one...
+*/
+static void BitStats(const TW_UINT8 *_pRow,
+                     UINT            _nPixels,
+                     bool            _bLsbFirst,
+                     TW_UINT32      *_pOnes,
+                     TW_UINT32      *_pEdges)
+{
+  UINT     nBytes = (_nPixels + 7) / 8;
+  UINT     uRem = _nPixels & 7;
+  UINT     nOnes = 0;
+  UINT     nEdges = 0;
+  UINT     ii;
+  TW_UINT8 uByte;
+  TW_UINT8 uMask;
+  TW_UINT8 uEdge;
+  TW_UINT8 uPrev = 0;
+
+  for (ii = 0; ii < nBytes; ii++)
+  {
+    uByte = _bLsbFirst ? Reverse8(_pRow[ii]) : _pRow[ii];
+    uMask = ((ii + 1 == nBytes) && uRem) ? (TW_UINT8)(0xFF << (8 - uRem)) : (TW_UINT8)0xFF;
+    uByte &= uMask;
+    uEdge = (TW_UINT8)((uByte ^ ((uByte >> 1) | (uPrev << 7))) & uMask);
+    if (0 == ii)
+    {
+      uEdge &= 0x7F;
+    }
+    nOnes += Pop8(uByte);
+    nEdges += Pop8(uEdge);
+    uPrev = (TW_UINT8)(uByte & 1);
+  }
+  *_pOnes += nOnes;
+  *_pEdges += nEdges;
+}
+
+/**
+* The plain C kernel, which the others finish with.  It counts the ink
+* in [_uFirst,_nPixels), and the edges between the pairs starting in
+* there...
+*/
+static void ScalarStats(const TW_UINT8 *_pLuma,
+                        UINT            _uFirst,
+                        UINT            _nPixels,
+                        TW_UINT8        _uInkMax,
+                        TW_UINT32      *_pInk,
+                        TW_UINT32      *_pEdges)
+{
+  UINT ii;
+  UINT nInk = 0;
+  UINT nEdges = 0;
+  int  iDiff;
+
+  for (ii = _uFirst; ii < _nPixels; ii++)
+  {
+    nInk += (_pLuma[ii] <= _uInkMax) ? 1 : 0;
+    if ((ii + 1) < _nPixels)
+    {
+      iDiff = (int)_pLuma[ii] - (int)_pLuma[ii + 1];
+      nEdges += ((iDiff >= TWDSM_ANALYSIS_EDGESTEP) || (-iDiff >= TWDSM_ANALYSIS_EDGESTEP)) ? 1 : 0;
+    }
+  }
+  *_pInk += nInk;
+  *_pEdges += nEdges;
+}
+
+#if defined(ANALYSIS_SSE2)
+/**
+* 16 pixels at a time.  The compares give us 0xFF, so subtracting them
+* counts in 8 bits, and psadbw adds the counters up before they can
+* overflow...
+*/
+static void Stats(const TW_UINT8 *_pLuma,
+                  UINT            _nPixels,
+                  TW_UINT8        _uInkMax,
+                  TW_UINT32      *_pInk,
+                  TW_UINT32      *_pEdges)
+{
+  const __m128i vZero = _mm_setzero_si128();
+  const __m128i vInkMax = _mm_set1_epi8((char)_uInkMax);
+  const __m128i vStep = _mm_set1_epi8((char)TWDSM_ANALYSIS_EDGESTEP);
+  __m128i       vInkSum = vZero;
+  __m128i       vEdgeSum = vZero;
+  __m128i       vInk;
+  __m128i       vEdges;
+  __m128i       vA;
+  __m128i       vB;
+  __m128i       vDiff;
+  UINT          ii = 0;
+  UINT          nBlock;
+
+  while ((ii + 17) <= _nPixels)
+  {
+    vInk = vZero;
+    vEdges = vZero;
+    for (nBlock = 0; (nBlock < ANALYSIS_MAXBLOCKS) && ((ii + 17) <= _nPixels); nBlock++, ii += 16)
+    {
+      vA = _mm_loadu_si128((const __m128i*)(_pLuma + ii));
+      vB = _mm_loadu_si128((const __m128i*)(_pLuma + ii + 1));
+      vDiff = _mm_or_si128(_mm_subs_epu8(vA,vB),_mm_subs_epu8(vB,vA));
+      vInk = _mm_sub_epi8(vInk,_mm_cmpeq_epi8(_mm_min_epu8(vA,vInkMax),vA));
+      vEdges = _mm_sub_epi8(vEdges,_mm_cmpeq_epi8(_mm_max_epu8(vDiff,vStep),vDiff));
+    }
+    vInkSum = _mm_add_epi64(vInkSum,_mm_sad_epu8(vInk,vZero));
+    vEdgeSum = _mm_add_epi64(vEdgeSum,_mm_sad_epu8(vEdges,vZero));
+  }
+  *_pInk += (TW_UINT32)(_mm_cvtsi128_si32(vInkSum) + _mm_cvtsi128_si32(_mm_srli_si128(vInkSum,8)));
+  *_pEdges += (TW_UINT32)(_mm_cvtsi128_si32(vEdgeSum) + _mm_cvtsi128_si32(_mm_srli_si128(vEdgeSum,8)));
+  ScalarStats(_pLuma,ii,_nPixels,_uInkMax,_pInk,_pEdges);
+}
+
+#elif defined(ANALYSIS_NEON)
+/**
+* 16 pixels at a time, the same way as the SSE2 kernel, with vaddlvq
+* adding up the counters...
+*/
+static void Stats(const TW_UINT8 *_pLuma,
+                  UINT            _nPixels,
+                  TW_UINT8        _uInkMax,
+                  TW_UINT32      *_pInk,
+                  TW_UINT32      *_pEdges)
+{
+  const uint8x16_t vInkMax = vdupq_n_u8(_uInkMax);
+  const uint8x16_t vStep = vdupq_n_u8(TWDSM_ANALYSIS_EDGESTEP);
+  uint8x16_t       vInk;
+  uint8x16_t       vEdges;
+  uint8x16_t       vA;
+  uint8x16_t       vB;
+  UINT             ii = 0;
+  UINT             nBlock;
+
+  while ((ii + 17) <= _nPixels)
+  {
+    vInk = vdupq_n_u8(0);
+    vEdges = vdupq_n_u8(0);
+    for (nBlock = 0; (nBlock < ANALYSIS_MAXBLOCKS) && ((ii + 17) <= _nPixels); nBlock++, ii += 16)
+    {
+      vA = vld1q_u8(_pLuma + ii);
+      vB = vld1q_u8(_pLuma + ii + 1);
+      vInk = vsubq_u8(vInk,vcleq_u8(vA,vInkMax));
+      vEdges = vsubq_u8(vEdges,vcgeq_u8(vabdq_u8(vA,vB),vStep));
+    }
+    *_pInk += vaddlvq_u8(vInk);
+    *_pEdges += vaddlvq_u8(vEdges);
+  }
+  ScalarStats(_pLuma,ii,_nPixels,_uInkMax,_pInk,_pEdges);
+}
+
+#else
+/**
+* No SIMD, so it's all the plain C kernel...
+*/
+static void Stats(const TW_UINT8 *_pLuma,
+                  UINT            _nPixels,
+                  TW_UINT8        _uInkMax,
+                  TW_UINT32      *_pInk,
+                  TW_UINT32      *_pEdges)
+{
+  ScalarStats(_pLuma,0,_nPixels,_uInkMax,_pInk,_pEdges);
+}
+#endif
+
+/**
+* The histogram doesn't vectorize, but four of them, added together at
+* the end of the strip, keep neighbouring pixels with the same value
+* from waiting on each other...
+*/
+static void Histogram(const TW_UINT8 *_pLuma,
+                      UINT            _nPixels,
+                      TW_UINT32       _aauHistogram[4][256])
+{
+  UINT ii;
+  for (ii = 0; (ii + 4) <= _nPixels; ii += 4)
+  {
+    _aauHistogram[0][_pLuma[ii]]++;
+    _aauHistogram[1][_pLuma[ii + 1]]++;
+    _aauHistogram[2][_pLuma[ii + 2]]++;
+    _aauHistogram[3][_pLuma[ii + 3]]++;
+  }
+  for (; ii < _nPixels; ii++)
+  {
+    _aauHistogram[0][_pLuma[ii]]++;
+  }
+}
+
+/**
+* A row of anything but bilevel to 8 bit luminance, using the BT.601
+* weights for RGB...
+*/
+static void ToLuma(const TW_UINT8        *_pSrc,
+                   TW_UINT8              *_pLuma,
+                   UINT                   _nPixels,
+                   const ANALYSIS_FORMAT *_pformat)
+{
+  TW_UINT8  uXor = (_pformat->Flags & TWDSM_ANALYSIS_INVERT) ? 0xFF : 0x00;
+  TW_UINT16 uSample;
+  UINT      ii;
+
+  if (_pformat->nChannels > 1)
+  {
+    for (ii = 0; ii < _nPixels; ii++, _pSrc += _pformat->nChannels)
+    {
+      _pLuma[ii] = (TW_UINT8)((((77 * (UINT)_pSrc[0]) + (150 * (UINT)_pSrc[1]) + (29 * (UINT)_pSrc[2]) + 128) >> 8) ^ uXor);
+    }
+  }
+  else if (16 == _pformat->nBits)
+  {
+    for (ii = 0; ii < _nPixels; ii++)
+    {
+      memcpy(&uSample,_pSrc + (ii * 2),sizeof(uSample));
+      _pLuma[ii] = (TW_UINT8)((uSample >> 8) ^ uXor);
+    }
+  }
+  else
+  {
+    for (ii = 0; ii < _nPixels; ii++)
+    {
+      _pLuma[ii] = (TW_UINT8)(_pSrc[ii] ^ uXor);
+    }
+  }
+}
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmAnalysisImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmAnalysisImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Find a session, call with the mutex held...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @return the session, or NULL
+    */
+    ANALYSIS_SESSION *Find(const TWID_T _AppId,
+                           const TWID_T _DsId);
+
+    /**
+    * Get what we need to look at a strip, if the session is active...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[out] _pformat the copy
+    * @return true if there's an active session
+    */
+    bool GetFormat(const TWID_T     _AppId,
+                   const TWID_T     _DsId,
+                   ANALYSIS_FORMAT *_pformat);
+
+    /**
+    * Look at a strip...
+    * @param[in] _pMemXfer the strip
+    * @param[in] _pformat what's in it
+    * @param[out] _pstrip what we found
+    * @return false if the strip isn't what DAT_IMAGEINFO said
+    */
+    static bool Strip(const TW_IMAGEMEMXFER *_pMemXfer,
+                      const ANALYSIS_FORMAT *_pformat,
+                      ANALYSIS_STRIP        *_pstrip);
+
+    /**
+    * Forget the page we're on, call with the mutex held...
+    * @param[in] _psession the session
+    */
+    static void ClearPage(ANALYSIS_SESSION *_psession);
+
+    /**
+    * Finish the page we're on, call with the mutex held...
+    * @param[in] _psession the session
+    */
+    static void FinishPage(ANALYSIS_SESSION *_psession);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      MUTEX             m_mutex;     /**< guards DS_SESSION.panalysis */
+    } pod;    /**< Pieces of data for CTwnDsmAnalysisImpl*/
+};
+
+
+
+/**
+* The constructor for our class...
+*/
+CTwnDsmAnalysis::CTwnDsmAnalysis()
+{
+  m_ptwndsmanalysisimpl = new CTwnDsmAnalysisImpl;
+  MUTEXINIT(m_ptwndsmanalysisimpl->pod.m_mutex);
+}
+
+
+
+/**
+* Run the SIMD kernel against the plain C one, on noise, on rows that
+* step by one less, exactly, and one more than TWDSM_ANALYSIS_EDGESTEP
+* across the whole range, and on solid black and white, for every row
+* length up to ANALYSIS_CHECKCOUNT, at every misalignment up to 3
+* bytes, with ink thresholds at both ends and either side of the middle.
+* Then a row long enough to overflow the 8 bit counters...
+*/
+int CTwnDsmAnalysis::CheckKernels(FILE *_pfile)
+{
+#if defined(ANALYSIS_SSE2) || defined(ANALYSIS_NEON)
+  static const char     *aszRows[4] = { "noise", "steps", "black", "white" };
+  static const TW_UINT8  auInkMax[6] = { 0, 31, 127, 128, 254, 255 };
+  static TW_UINT8        abLong[ANALYSIS_CHECKLONG];
+  TW_UINT8               aabRows[4][ANALYSIS_CHECKCOUNT + 4];
+  TW_UINT32              nInkRef;
+  TW_UINT32              nEdgesRef;
+  TW_UINT32              nInkTest;
+  TW_UINT32              nEdgesTest;
+  UINT                   uSeed = 1;
+  int                    iValue = 0;
+  int                    iDir = 1;
+  UINT                   nn;
+  UINT                   oo;
+  UINT                   kk;
+  UINT                   tt;
+
+  // The same rows every time, so a failure can be chased.  The steps
+  // turn around at the ends, so they cover everything from 0 to 255...
+  for (nn = 0; nn < sizeof(aabRows[0]); nn++)
+  {
+    uSeed = (uSeed * 1103515245) + 12345;
+    aabRows[0][nn] = (TW_UINT8)(uSeed >> 16);
+    aabRows[1][nn] = (TW_UINT8)iValue;
+    aabRows[2][nn] = 0;
+    aabRows[3][nn] = 255;
+    if (((iValue + (iDir * (TWDSM_ANALYSIS_EDGESTEP + 1))) > 255) || ((iValue + (iDir * (TWDSM_ANALYSIS_EDGESTEP + 1))) < 0))
+    {
+      iDir = -iDir;
+    }
+    iValue += iDir * (TWDSM_ANALYSIS_EDGESTEP - 1 + (int)(nn % 3));
+  }
+
+  for (kk = 0; kk < 4; kk++)
+  {
+    for (tt = 0; tt < 6; tt++)
+    {
+      for (nn = 0; nn <= ANALYSIS_CHECKCOUNT; nn++)
+      {
+        for (oo = 0; oo < 4; oo++)
+        {
+          nInkRef = nEdgesRef = nInkTest = nEdgesTest = 0;
+          ScalarStats(aabRows[kk] + oo,0,nn,auInkMax[tt],&nInkRef,&nEdgesRef);
+          Stats(aabRows[kk] + oo,nn,auInkMax[tt],&nInkTest,&nEdgesTest);
+          if ((nInkRef != nInkTest) || (nEdgesRef != nEdgesTest))
+          {
+            fprintf(_pfile,"%s doesn't match scalar for %u pixels of %s at offset %u, ink at or below %u\n",
+                    ANALYSIS_KERNEL,nn,aszRows[kk],oo,(UINT)auInkMax[tt]);
+            return 1;
+          }
+        }
+      }
+    }
+  }
+
+  for (nn = 0; nn < ANALYSIS_CHECKLONG; nn++)
+  {
+    abLong[nn] = (nn & 1) ? 255 : 0;
+  }
+  nInkRef = nEdgesRef = nInkTest = nEdgesTest = 0;
+  ScalarStats(abLong,0,ANALYSIS_CHECKLONG,255,&nInkRef,&nEdgesRef);
+  Stats(abLong,ANALYSIS_CHECKLONG,255,&nInkTest,&nEdgesTest);
+  if ((nInkRef != nInkTest) || (nEdgesRef != nEdgesTest))
+  {
+    fprintf(_pfile,"%s doesn't match scalar for a %u pixel row, %u/%u ink, %u/%u edges\n",
+            ANALYSIS_KERNEL,(UINT)ANALYSIS_CHECKLONG,nInkTest,nInkRef,nEdgesTest,nEdgesRef);
+    return 1;
+  }
+
+  fprintf(_pfile,"%s matches scalar\n",ANALYSIS_KERNEL);
+  return 0;
+#else
+  fprintf(_pfile,"no SIMD kernel in this build\n");
+  return 0;
+#endif
+}
+
+
+
+/**
+* The destructor for our class...
+*/
+CTwnDsmAnalysis::~CTwnDsmAnalysis()
+{
+  if (m_ptwndsmanalysisimpl)
+  {
+    MUTEXDESTROY(m_ptwndsmanalysisimpl->pod.m_mutex);
+    delete m_ptwndsmanalysisimpl;
+    m_ptwndsmanalysisimpl = 0;
+  }
+}
+
+
+
+/**
+* Set, get or reset analysis for a driver.  A new setting waits for the
+* next DAT_IMAGEINFO...
+*/
+TW_UINT16 CTwnDsmAnalysis::Analysis(const TWID_T       _AppId,
+                                    const TW_UINT16    _MSG,
+                                    TW_TWDSM_ANALYSIS *_pAnalysis)
+{
+  DS_SESSION       *pdssession;
+  ANALYSIS_SESSION *psession = 0;
+  TW_UINT32         DsId = _pAnalysis->DsId;
+  TW_UINT16         ccResult = TWCC_SUCCESS;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,(TWID_T)DsId);
+  if (0 == pdssession)
+  {
+    return TWCC_BADDEST;
+  }
+
+  MUTEXLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+  psession = pdssession->panalysis;
+  switch (_MSG)
+  {
+    case MSG_SET:
+      if (   (_pAnalysis->Flags & ~(TWDSM_ANALYSIS_INVERT | TWDSM_ANALYSIS_LSBFIRST))
+          || (_pAnalysis->InkThreshold > 256)
+          || (_pAnalysis->BlankCoverage > 10000))
+      {
+        ccResult = TWCC_BADVALUE;
+        break;
+      }
+      if (0 == psession)
+      {
+        psession = (ANALYSIS_SESSION*)calloc(1,sizeof(ANALYSIS_SESSION));
+        if (0 == psession)
+        {
+          kLOG((kLOGERR,"calloc failed for an analysis session..."));
+          ccResult = TWCC_LOWMEMORY;
+          break;
+        }
+        pdssession->panalysis = psession;
+      }
+      if (0 == _pAnalysis->InkThreshold)
+      {
+        _pAnalysis->InkThreshold = TWDSM_ANALYSIS_INK;
+      }
+      if (0 == _pAnalysis->BlankCoverage)
+      {
+        _pAnalysis->BlankCoverage = TWDSM_ANALYSIS_BLANK;
+      }
+      memset(psession,0,sizeof(*psession));
+      psession->Flags         = _pAnalysis->Flags;
+      psession->uInkMax       = (TW_UINT8)(_pAnalysis->InkThreshold - 1);
+      psession->BlankCoverage = _pAnalysis->BlankCoverage;
+      break;
+
+    case MSG_GET:
+      if ((0 == psession) || !psession->bHaveLast)
+      {
+        ccResult = TWCC_SEQERROR;
+        break;
+      }
+      *_pAnalysis = psession->last;
+      _pAnalysis->DsId = DsId;
+      break;
+
+    case MSG_RESET:
+      pdssession->panalysis = 0;
+      free(psession);
+      break;
+
+    default:
+      ccResult = TWCC_BADPROTOCOL;
+      break;
+  }
+  MUTEXUNLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+
+  return ccResult;
+}
+
+
+
+/**
+* Find out if we can look at what's coming, and start a new page...
+*/
+void CTwnDsmAnalysis::ImageInfo(const TWID_T        _AppId,
+                                const TWID_T        _DsId,
+                                const TW_IMAGEINFO *_pImageInfo)
+{
+  ANALYSIS_SESSION *psession;
+  UINT              nChannels;
+  UINT              nBits;
+
+  MUTEXLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+  psession = m_ptwndsmanalysisimpl->Find(_AppId,_DsId);
+  if (0 == psession)
+  {
+    MUTEXUNLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+    return;
+  }
+
+  nChannels = (UINT)_pImageInfo->SamplesPerPixel;
+  nBits = (UINT)_pImageInfo->BitsPerSample[0];
+  psession->bActive =    (TWCP_NONE == _pImageInfo->Compression)
+                      && !_pImageInfo->Planar
+                      && (_pImageInfo->ImageWidth > 0)
+                      && (   ((1 == nChannels) && ((1 == nBits) || (8 == nBits) || (16 == nBits)))
+                          || (((3 == nChannels) || (4 == nChannels)) && (8 == nBits)))
+                      && ((UINT)_pImageInfo->BitsPerPixel == (nChannels * nBits));
+  psession->nChannels = nChannels;
+  psession->nBits     = nBits;
+  CTwnDsmAnalysisImpl::ClearPage(psession);
+  if (!psession->bActive)
+  {
+    kLOG((kLOGERR,"can't analyze %d samples of %d bits, compression %d...",
+          (int)nChannels,(int)nBits,(int)_pImageInfo->Compression));
+  }
+  MUTEXUNLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+}
+
+
+
+/**
+* Look at the strip without the mutex, and add it in with it...
+*/
+void CTwnDsmAnalysis::MemXfer(const TWID_T           _AppId,
+                              const TWID_T           _DsId,
+                              const TW_IMAGEMEMXFER *_pMemXfer,
+                              const TW_INT16         _rc)
+{
+  ANALYSIS_SESSION *psession;
+  ANALYSIS_FORMAT   format;
+  ANALYSIS_STRIP    strip;
+  bool              bStrip;
+  int               ii;
+
+  // The page is gone, so are our numbers for it...
+  if ((TWRC_SUCCESS != _rc) && (TWRC_XFERDONE != _rc))
+  {
+    MUTEXLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+    psession = m_ptwndsmanalysisimpl->Find(_AppId,_DsId);
+    if (psession)
+    {
+      CTwnDsmAnalysisImpl::ClearPage(psession);
+    }
+    MUTEXUNLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+    return;
+  }
+
+  if (!m_ptwndsmanalysisimpl->GetFormat(_AppId,_DsId,&format))
+  {
+    return;
+  }
+  bStrip = CTwnDsmAnalysisImpl::Strip(_pMemXfer,&format,&strip);
+
+  MUTEXLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+  psession = m_ptwndsmanalysisimpl->Find(_AppId,_DsId);
+  if (psession && psession->bActive)
+  {
+    if (!bStrip)
+    {
+      kLOG((kLOGERR,"can't analyze a strip of %ux%u, %u bytes per row, compression %d...",
+            (unsigned int)_pMemXfer->Columns,(unsigned int)_pMemXfer->Rows,
+            (unsigned int)_pMemXfer->BytesPerRow,(int)_pMemXfer->Compression));
+      psession->bActive = false;
+      CTwnDsmAnalysisImpl::ClearPage(psession);
+    }
+    else
+    {
+      psession->nPixels += strip.nPixels;
+      psession->nInk    += strip.nInk;
+      psession->nPairs  += strip.nPairs;
+      psession->nEdges  += strip.nEdges;
+      for (ii = 0; ii < 256; ii++)
+      {
+        psession->auHistogram[ii] += strip.auHistogram[ii];
+      }
+      if (TWRC_XFERDONE == _rc)
+      {
+        CTwnDsmAnalysisImpl::FinishPage(psession);
+      }
+    }
+  }
+  MUTEXUNLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+}
+
+
+
+/**
+* Forget the session...
+*/
+void CTwnDsmAnalysis::Stop(const TWID_T _AppId,
+                           const TWID_T _DsId)
+{
+  DS_SESSION       *pdssession;
+  ANALYSIS_SESSION *psession;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return;
+  }
+
+  MUTEXLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+  psession = pdssession->panalysis;
+  pdssession->panalysis = 0;
+  MUTEXUNLOCK(m_ptwndsmanalysisimpl->pod.m_mutex);
+
+  free(psession);
+}
+
+
+
+/**
+* It's on the DS_SESSION, if analysis was asked for...
+*/
+ANALYSIS_SESSION *CTwnDsmAnalysisImpl::Find(const TWID_T _AppId,
+                                            const TWID_T _DsId)
+{
+  DS_SESSION *pdssession;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return 0;
+  }
+  return pdssession->panalysis;
+}
+
+
+
+/**
+* Copy out the little we need, not the whole session...
+*/
+bool CTwnDsmAnalysisImpl::GetFormat(const TWID_T     _AppId,
+                                    const TWID_T     _DsId,
+                                    ANALYSIS_FORMAT *_pformat)
+{
+  ANALYSIS_SESSION *psession;
+  bool              bActive = false;
+
+  MUTEXLOCK(pod.m_mutex);
+  psession = Find(_AppId,_DsId);
+  if (psession && psession->bActive)
+  {
+    _pformat->Flags     = psession->Flags;
+    _pformat->uInkMax   = psession->uInkMax;
+    _pformat->nChannels = psession->nChannels;
+    _pformat->nBits     = psession->nBits;
+    bActive = true;
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+  return bActive;
+}
+
+
+
+/**
+* Check the layout, and go through the strip a row at a time...
+*/
+bool CTwnDsmAnalysisImpl::Strip(const TW_IMAGEMEMXFER *_pMemXfer,
+                                const ANALYSIS_FORMAT *_pformat,
+                                ANALYSIS_STRIP        *_pstrip)
+{
+  TW_UINT32  aauHistogram[4][256];
+  TW_UINT8  *pStrip;
+  TW_UINT8  *pRow;
+  TW_UINT8  *pLuma = 0;
+  TW_UINT32  nInk = 0;
+  TW_UINT32  nEdges = 0;
+  TW_UINT32  nOnes;
+  UINT64     nRowBytes;
+  UINT       nPixels;
+  UINT       ii;
+  UINT       jj;
+
+  memset(_pstrip,0,sizeof(*_pstrip));
+  if (0 == _pMemXfer->Rows)
+  {
+    return true;
+  }
+
+  // Check the layout...
+  nPixels = (UINT)_pMemXfer->Columns;
+  nRowBytes = (((UINT64)nPixels * _pformat->nChannels * _pformat->nBits) + 7) / 8;
+  if (   (TWCP_NONE != _pMemXfer->Compression)
+      || (0 == nPixels)
+      || (_pMemXfer->BytesPerRow < nRowBytes)
+      || (((UINT64)(_pMemXfer->Rows - 1) * _pMemXfer->BytesPerRow) + nRowBytes > _pMemXfer->BytesWritten))
+  {
+    return false;
+  }
+
+  // Only 8 bit gray can be looked at where it is...
+  if (   (1 != _pformat->nBits)
+      && ((8 != _pformat->nBits) || (1 != _pformat->nChannels) || (_pformat->Flags & TWDSM_ANALYSIS_INVERT)))
+  {
+    pLuma = (TW_UINT8*)malloc(nPixels);
+    if (0 == pLuma)
+    {
+      kLOG((kLOGERR,"unable to allocate an analysis row..."));
+      return false;
+    }
+  }
+  if (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+  {
+    pStrip = (TW_UINT8*)DSM_MemLock((TW_HANDLE)_pMemXfer->Memory.TheMem);
+  }
+  else
+  {
+    pStrip = (TW_UINT8*)_pMemXfer->Memory.TheMem;
+  }
+
+  memset(aauHistogram,0,sizeof(aauHistogram));
+  for (ii = 0; ii < _pMemXfer->Rows; ii++)
+  {
+    pRow = pStrip + ((UINT64)ii * _pMemXfer->BytesPerRow);
+
+    // Bilevel is black and white, and we only need the counts...
+    if (1 == _pformat->nBits)
+    {
+      nOnes = 0;
+      BitStats(pRow,nPixels,(_pformat->Flags & TWDSM_ANALYSIS_LSBFIRST) ? true : false,&nOnes,&nEdges);
+      if (_pformat->Flags & TWDSM_ANALYSIS_INVERT)
+      {
+        nOnes = nPixels - nOnes;
+      }
+      aauHistogram[0][0] += nPixels - nOnes;
+      aauHistogram[0][255] += nOnes;
+      nInk += (255 == _pformat->uInkMax) ? nPixels : (nPixels - nOnes);
+      continue;
+    }
+
+    if (pLuma)
+    {
+      ToLuma(pRow,pLuma,nPixels,_pformat);
+      pRow = pLuma;
+    }
+    Stats(pRow,nPixels,_pformat->uInkMax,&nInk,&nEdges);
+    Histogram(pRow,nPixels,aauHistogram);
+  }
+
+  if (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+  {
+    DSM_MemUnlock((TW_HANDLE)_pMemXfer->Memory.TheMem);
+  }
+  if (pLuma)
+  {
+    free(pLuma);
+  }
+
+  _pstrip->nPixels = (UINT64)nPixels * _pMemXfer->Rows;
+  _pstrip->nPairs  = (UINT64)(nPixels - 1) * _pMemXfer->Rows;
+  _pstrip->nInk    = nInk;
+  _pstrip->nEdges  = nEdges;
+  for (jj = 0; jj < 256; jj++)
+  {
+    _pstrip->auHistogram[jj] = aauHistogram[0][jj] + aauHistogram[1][jj] + aauHistogram[2][jj] + aauHistogram[3][jj];
+  }
+  return true;
+}
+
+
+
+/**
+* Start over...
+*/
+void CTwnDsmAnalysisImpl::ClearPage(ANALYSIS_SESSION *_psession)
+{
+  _psession->nPixels = 0;
+  _psession->nInk    = 0;
+  _psession->nPairs  = 0;
+  _psession->nEdges  = 0;
+  memset(_psession->auHistogram,0,sizeof(_psession->auHistogram));
+}
+
+
+
+/**
+* Work out the page's numbers, and keep them for MSG_GET...
+*/
+void CTwnDsmAnalysisImpl::FinishPage(ANALYSIS_SESSION *_psession)
+{
+  TW_TWDSM_ANALYSIS *plast = &_psession->last;
+
+  plast->Flags         = _psession->Flags;
+  plast->InkThreshold  = (TW_UINT16)(_psession->uInkMax + 1);
+  plast->BlankCoverage = _psession->BlankCoverage;
+  plast->Page         += 1;
+  plast->Pixels        = (_psession->nPixels > 0xFFFFFFFF) ? 0xFFFFFFFF : (TW_UINT32)_psession->nPixels;
+  plast->InkPixels     = (_psession->nInk > 0xFFFFFFFF) ? 0xFFFFFFFF : (TW_UINT32)_psession->nInk;
+  plast->Edges         = (_psession->nEdges > 0xFFFFFFFF) ? 0xFFFFFFFF : (TW_UINT32)_psession->nEdges;
+  plast->InkCoverage   = _psession->nPixels ? (TW_UINT16)((_psession->nInk * 10000) / _psession->nPixels) : 0;
+  plast->EdgeDensity   = _psession->nPairs ? (TW_UINT16)((_psession->nEdges * 10000) / _psession->nPairs) : 0;
+  plast->Blank         = ((_psession->nInk * 10000) < ((UINT64)_psession->BlankCoverage * _psession->nPixels)) ? TRUE : FALSE;
+  memcpy(plast->Histogram,_psession->auHistogram,sizeof(plast->Histogram));
+  _psession->bHaveLast = true;
+
+  kLOG((kLOGINFO,"page %u, ink %u/10000, edges %u/10000, %s",
+        (unsigned int)plast->Page,(unsigned int)plast->InkCoverage,(unsigned int)plast->EdgeDensity,
+        plast->Blank ? "blank" : "not blank"));
+  ClearPage(_psession);
+}
@@ -37,6 +37,29 @@
 
 
 
+/**
+* Number of DAT_NULL messages we can hold for an application that
+* didn't register a callback.  Must be a power of two...
+*/
+#define DSM_EVENTQUEUE 16
+
+/**
+* Messages going from a Data Source to an Application that has no
+* callback, waiting for the Application's next DAT_EVENT.  This is a
+* bounded multi-producer ring (a driver can send DAT_NULL from any of
+* its threads), drained in order by MSG_PROCESSEVENT.  Each cell's
+* sequence number says whose turn it is.  We store it less the cell's
+* index so that the calloc'd DS_LIST is already a valid empty ring...
+*/
+typedef struct
+{
+  volatile TW_UINT32 aSeq[DSM_EVENTQUEUE];  /**< turn for each cell, less the cell index */
+  volatile TW_UINT16 aMsg[DSM_EVENTQUEUE];  /**< the MSG_* for each cell */
+  volatile TW_UINT32 uHead;                 /**< next position DAT_EVENT reads */
+  volatile TW_UINT32 uTail;                 /**< next position DAT_NULL writes */
+  volatile TW_UINT32 aPending[4];           /**< 1 while a message of this kind is queued */
+} DS_EVENTQUEUE;
+
 /**
 * Describes everything we need to know about the Data Source over
 * the course of the session...
@@ -44,13 +67,15 @@
 typedef struct
 {
   TW_IDENTITY   Identity;               /**< Identity info for data source */
-  TW_HANDLE     pHandle;                /**< returned by LOADLIBRARY(...) */
+  TW_HANDLE     pHandle;                /**< returned by CLibList::Load(...) */
   DSENTRYPROC   DS_Entry;               /**< function pointer to the DS_Entry function -- set by dlsym(...) */
   char          szPath[FILENAME_MAX];   /**< location of the DS */
   TW_CALLBACK2  twcallback2;            /**< callback structure (we're using callback2 because it's 32-bit and 64-bit safe) */
-  TW_BOOL       bCallbackPending;       /**< True if an application is old style and a callback was supposed to be made to it */
+  DS_EVENTQUEUE eventqueue;             /**< Messages for an application that is old style and didn't register a callback */
   TW_BOOL       bDSProcessingMessage;   /**< True if the application is still waiting for the DS to return from processing a message */
   TW_BOOL       bAppProcessingCallback; /**< True if the application is still waiting for the DS to return from processing a message */
+  TW_BOOL       bEnabled;               /**< True from MSG_ENABLEDS to MSG_DISABLEDS, so the DS is in state 5 or higher */
+  DS_SESSION    session;                /**< What the modules keep while the DS is open */
 } DS_INFO;
 
 
@@ -92,6 +117,31 @@ typedef struct
 
 
 
+/**
+* A copy of the drivers in an application's DS_LIST, for
+* MSG_GETFIRST/MSG_GETNEXT.  LoadDS rewrites the identities in the
+* DS_LIST, so instead of walking it we walk one of these, which never
+* changes once it's published.  A new one replaces it when the list
+* changes, and the old one goes away when the last cursor lets go...
+*/
+typedef struct
+{
+  volatile TW_INT32 nRefs;          /**< one for the APP_INFO, plus one for each cursor */
+  TW_UINT16         NumFiles;       /**< Number of items in list */
+  TW_IDENTITY       Identity[1];    /**< 1 to NumFiles, the same ids as the DS_LIST */
+} DS_SNAPSHOT;
+
+/**
+* Where an application is in its MSG_GETFIRST/MSG_GETNEXT walk...
+*/
+typedef struct
+{
+  DS_SNAPSHOT      *pSnapshot;      /**< the list we're walking */
+  TWID_T            DsId;           /**< the last one we returned */
+} DS_CURSOR;
+
+
+
 /**
 * Structure to hold data about a connected application, we use
 * DS_LIST so we don't have to allocate memory that we don't
@@ -105,6 +155,11 @@ typedef struct
   DSM_State    CurrentState;     /**< the current state of the DSM for this app. */
   DS_LIST     *pDSList;          /**< Each Application has a list of DS that it discovers each time the app opens the DSM. */
   HWND         hwnd;             /**< the window that will monitor for events on Windows */
+  int          nEventFd;         /**< the eventfd that AppWakeup pokes on Linux plus one, so 0 is none */
+  DS_SNAPSHOT * volatile pSnapshot;   /**< the current list of drivers for MSG_GETFIRST */
+  volatile TW_INT32      nReaders;    /**< threads between reading pSnapshot and taking a reference */
+  DS_CURSOR   * volatile pCursor;     /**< the app's MSG_GETNEXT cursor, 0 while it's in use or done */
+  struct DISPATCH_SESSION_ *pDispatch; /**< the app's callback dispatcher, see CTwnDsmDispatch */
 } APP_INFO;
 
 /**
@@ -228,6 +283,400 @@ public:
   }
 };
 
+/**
+* What a driver's file looked like on disk when we loaded it.  If any
+* of this changes then somebody installed a new version of the driver...
+*/
+typedef struct
+{
+  UINT64        uDev;                   /**< st_dev */
+  UINT64        uIno;                   /**< st_ino, always 0 on Windows */
+  UINT64        uSize;                  /**< st_size */
+  UINT64        uMtime;                 /**< st_mtime */
+} DS_FILEGEN;
+
+/**
+* A library we've loaded, and how many times we've loaded it.  Every
+* DS_INFO with the same pHandle shares one of these...
+*/
+typedef struct
+{
+  TW_HANDLE     pHandle;                /**< returned by LOADLIBRARY(...), 0 if the slot is free */
+  int           nRefs;                  /**< LOADLIBRARY calls less UNLOADLIBRARY calls */
+  int           nFd;                    /**< the file we loaded it through on Linux plus one, so 0 is none */
+  DS_FILEGEN    filegen;                /**< the file when we loaded it */
+  char          szPath[FILENAME_MAX];   /**< location of the DS */
+} DS_LIBRARY;
+
+/**
+* Class CLibList keeps track of the driver libraries we have loaded,
+* so that a driver that's upgraded while the process is running gets
+* picked up by the next MSG_OPENDS.
+*
+* The trouble is that the loaders hand back the library they already
+* have when asked for the same path again, no matter what is on disk
+* now.  On Linux we get around that by loading the new file through
+* /proc/self/fd, which dlopen sees as a different library.  Sessions
+* that are already open keep the old one, and it goes away when the
+* last of them closes.  On Windows and Mac we can only log it, and the
+* new version is used once nothing has the old one loaded.
+*
+* dlclose doesn't always unload a library, and while it's loaded
+* dlopen hands it back for the name we loaded it by.  So a library
+* stays on the list, with its descriptor open, until it's really gone,
+* or a new file could get the same descriptor number, and with it the
+* old library.  One left loaded by an earlier DSM isn't on the list, so
+* if dlopen already has something by the path we don't know, we come
+* in through a descriptor, and dlopen matches it by inode instead...
+*/
+class CLibList
+{
+private:
+  DS_LIBRARY *m_pList;          /**< pointer to dynamicaly allocated array */
+  int         m_count;          /**< number of elements of the array */
+  MUTEX       m_mutex;          /**< UnloadDS can come from the warm pool's thread */
+
+/**
+* Get the file's generation.
+* @param[in] _pPath the file
+* @param[out] _pfilegen its generation, zeroed if we can't stat it
+* @return true if we could stat it
+*/
+  static bool FileGen(const char *_pPath, DS_FILEGEN *_pfilegen)
+  {
+    struct stat st;
+    memset(_pfilegen,0,sizeof(DS_FILEGEN));
+    if (0 != stat(_pPath,&st))
+    {
+      return false;
+    }
+    _pfilegen->uDev   = (UINT64)st.st_dev;
+    _pfilegen->uIno   = (UINT64)st.st_ino;
+    _pfilegen->uSize  = (UINT64)st.st_size;
+    _pfilegen->uMtime = (UINT64)st.st_mtime;
+    return true;
+  }
+
+/**
+* Find a library by its handle.
+* @param[in] _pHandle the handle
+* @return the slot, or 0
+*/
+  DS_LIBRARY *Find(TW_HANDLE _pHandle)
+  {
+    for (int ii = 0; ii < m_count; ii++)
+    {
+      if (m_pList[ii].pHandle == _pHandle)
+      {
+        return &m_pList[ii];
+      }
+    }
+    return 0;
+  }
+
+/**
+* Find a library by its file.
+* @param[in] _pPath the file
+* @param[in] _pfilegen the generation we want, or 0 for any
+* @param[in] _boolByPath only ones loaded by their path
+* @return the slot, or 0
+*/
+  DS_LIBRARY *Find(const char *_pPath, const DS_FILEGEN *_pfilegen, bool _boolByPath)
+  {
+    for (int ii = 0; ii < m_count; ii++)
+    {
+      if (   m_pList[ii].pHandle
+          && (0 == strcmp(m_pList[ii].szPath,_pPath))
+          && (!_pfilegen || (0 == memcmp(&m_pList[ii].filegen,_pfilegen,sizeof(DS_FILEGEN))))
+          && (!_boolByPath || (0 == m_pList[ii].nFd)))
+      {
+        return &m_pList[ii];
+      }
+    }
+    return 0;
+  }
+
+/**
+* Check if dlopen has a library by this name, or through this
+* descriptor.  Something else may have it open, or it may be linked
+* with -z nodelete, so it can still be there after our last
+* UNLOADLIBRARY...
+* @param[in] _pPath the file
+* @param[in] _nFd the descriptor plus one, or 0 for the path
+* @return true if it's loaded
+*/
+  bool IsLoaded(const char *_pPath, int _nFd)
+  {
+    #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+      char        szName[32];
+      const char *pName = _pPath;
+      void       *pHandle;
+      if (_nFd)
+      {
+        SNPRINTF(szName,sizeof(szName),"/proc/self/fd/%d",_nFd-1);
+        pName = szName;
+      }
+      pHandle = dlopen(pName,RTLD_LAZY|RTLD_NOLOAD);
+      if (pHandle)
+      {
+        dlclose(pHandle);
+        return true;
+      }
+    #else
+      (void)_pPath;
+      (void)_nFd;
+    #endif
+    return false;
+  }
+
+/**
+* Forget the libraries that were still loaded after their last
+* UNLOADLIBRARY, once they're gone...
+*/
+  void Sweep()
+  {
+    for (int ii = 0; ii < m_count; ii++)
+    {
+      if (   m_pList[ii].pHandle
+          && (m_pList[ii].nRefs <= 0)
+          && !IsLoaded(m_pList[ii].szPath,m_pList[ii].nFd))
+      {
+        if (m_pList[ii].nFd)
+        {
+          (void)CLOSE(m_pList[ii].nFd-1);
+        }
+        memset(&m_pList[ii],0,sizeof(DS_LIBRARY));
+      }
+    }
+  }
+
+/**
+* Remember a library we've just loaded.
+* @param[in] _pHandle the handle
+* @param[in] _pPath the file
+* @param[in] _pfilegen its generation
+* @param[in] _nFd what we loaded it through plus one, or 0
+* @return false if we're out of memory
+*/
+  bool Add(TW_HANDLE _pHandle, const char *_pPath, const DS_FILEGEN *_pfilegen, int _nFd)
+  {
+    int ii;
+    for (ii = 0; ii < m_count; ii++)
+    {
+      if (0 == m_pList[ii].pHandle)
+      {
+        break;
+      }
+    }
+    if (ii >= m_count)
+    {
+      DS_LIBRARY *pNewList = (DS_LIBRARY*)realloc(m_pList,sizeof(DS_LIBRARY)*(m_count+8));
+      if (pNewList == NULL)
+      {
+        kLOG((kLOGERR,"realloc of m_pList failed"));
+        return false;
+      }
+      m_pList = pNewList;
+      memset(&m_pList[m_count],0,sizeof(DS_LIBRARY)*8);
+      m_count += 8;
+    }
+    m_pList[ii].pHandle = _pHandle;
+    m_pList[ii].nRefs = 1;
+    m_pList[ii].nFd = _nFd;
+    m_pList[ii].filegen = *_pfilegen;
+    SSTRCPY(m_pList[ii].szPath,NCHARS(m_pList[ii].szPath),_pPath);
+    return true;
+  }
+
+public:
+
+/**
+* Default constructor 
+*/
+  CLibList()
+  {
+    m_count=0;
+    m_pList=NULL;
+    MUTEXINIT(m_mutex);
+  }
+
+/**
+* Default destructor
+* frees allocated resources
+*/
+  ~CLibList()
+  {
+    if(m_pList)
+    {
+      free(m_pList);
+    }
+    MUTEXDESTROY(m_mutex);
+  }
+
+/**
+* Load a driver's library.  This stands in for LOADLIBRARY, and does
+* the same thing unless the file has changed since we loaded it...
+* @param[in] _pPath the file
+* @param[in] _hook passed to LOADLIBRARY
+* @param[in] _DsId passed to LOADLIBRARY
+* @return the handle, or 0 with the error left for the caller
+*/
+  TW_HANDLE Load(char *_pPath, bool _hook, TWID_T _DsId)
+  {
+    DS_FILEGEN  filegen;
+    DS_LIBRARY *plibrary;
+    TW_HANDLE   pHandle;
+    int         nFd = 0;
+    bool        boolStat;
+
+    // Only the 32-bit Windows hooks care about these...
+    (void)_hook;
+    (void)_DsId;
+
+    boolStat = FileGen(_pPath,&filegen);
+
+    MUTEXLOCK(m_mutex);
+    Sweep();
+
+    #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+      // If we have this generation then ask for it by the name we
+      // gave it, and if we don't, but something else is loaded by
+      // this path, then dlopen would give us that, so we come in
+      // through a descriptor instead.  That includes something we
+      // don't know about, which might be the file we want, or not...
+      char szName[32];
+      char *pName = _pPath;
+      plibrary = boolStat ? Find(_pPath,&filegen,false) : 0;
+      if (plibrary && plibrary->nFd)
+      {
+        SNPRINTF(szName,sizeof(szName),"/proc/self/fd/%d",plibrary->nFd-1);
+        pName = szName;
+      }
+      else if (boolStat && !plibrary && (Find(_pPath,0,true) || IsLoaded(_pPath,0)))
+      {
+        nFd = open(_pPath,O_RDONLY|O_CLOEXEC) + 1;
+        if (nFd > 0)
+        {
+          kLOG((kLOGINFO,"%s has changed, loading the new version for new sessions",_pPath));
+          SNPRINTF(szName,sizeof(szName),"/proc/self/fd/%d",nFd-1);
+          pName = szName;
+        }
+        else
+        {
+          nFd = 0;
+        }
+      }
+      pHandle = (TW_HANDLE)LOADLIBRARY(pName,_hook,_DsId);
+    #else
+      pHandle = (TW_HANDLE)LOADLIBRARY(_pPath,_hook,_DsId);
+    #endif
+
+    // The caller reports the error...
+    if (0 == pHandle)
+    {
+      if (nFd)
+      {
+        (void)CLOSE(nFd-1);
+      }
+      MUTEXUNLOCK(m_mutex);
+      return pHandle;
+    }
+
+    // We already had it, usually because another session has the
+    // same driver open...
+    plibrary = Find(pHandle);
+    if (plibrary)
+    {
+      plibrary->nRefs++;
+      if (nFd)
+      {
+        (void)CLOSE(nFd-1);
+      }
+      if (boolStat && (0 != memcmp(&plibrary->filegen,&filegen,sizeof(DS_FILEGEN))))
+      {
+        kLOG((kLOGINFO,"%s has changed, but the old version is still in use, so we got that",_pPath));
+      }
+    }
+
+    // It's new to us, if we can't track it we can still use it, and
+    // the worst that happens is we miss an upgrade...
+    else if (!Add(pHandle,_pPath,&filegen,nFd) && nFd)
+    {
+      (void)CLOSE(nFd-1);
+    }
+
+    MUTEXUNLOCK(m_mutex);
+    return pHandle;
+  }
+
+/**
+* Unload a driver's library.  This stands in for UNLOADLIBRARY, and
+* returns what it does...
+* @param[in] _pHandle the handle from Load
+* @param[in] _unhook passed to UNLOADLIBRARY
+* @param[in] _DsId passed to UNLOADLIBRARY
+* @return what UNLOADLIBRARY returns
+*/
+  int Unload(TW_HANDLE _pHandle, bool _unhook, TWID_T _DsId)
+  {
+    DS_LIBRARY *plibrary;
+    DS_FILEGEN  filegen;
+
+    (void)_unhook;
+    (void)_DsId;
+
+    MUTEXLOCK(m_mutex);
+    int retval = UNLOADLIBRARY(_pHandle,_unhook,_DsId);
+    plibrary = Find(_pHandle);
+    if (plibrary && (--plibrary->nRefs <= 0))
+    {
+      if (   FileGen(plibrary->szPath,&filegen)
+          && (0 != memcmp(&plibrary->filegen,&filegen,sizeof(DS_FILEGEN))))
+      {
+        kLOG((kLOGINFO,"the last session on the old version of %s has closed",plibrary->szPath));
+      }
+      if (IsLoaded(plibrary->szPath,plibrary->nFd))
+      {
+        kLOG((kLOGINFO,"%s is still loaded, keeping track of it until it's gone",plibrary->szPath));
+        plibrary->nRefs = 0;
+      }
+      else
+      {
+        if (plibrary->nFd)
+        {
+          (void)CLOSE(plibrary->nFd-1);
+        }
+        memset(plibrary,0,sizeof(DS_LIBRARY));
+      }
+    }
+    MUTEXUNLOCK(m_mutex);
+    return retval;
+  }
+
+/**
+* Check if a library's file has changed since we loaded it.
+* @param[in] _pHandle the handle from Load
+* @return true if it has
+*/
+  bool IsStale(TW_HANDLE _pHandle)
+  {
+    DS_LIBRARY *plibrary;
+    DS_FILEGEN  filegen;
+    bool        boolStale = false;
+
+    MUTEXLOCK(m_mutex);
+    plibrary = Find(_pHandle);
+    if (   plibrary
+        && FileGen(plibrary->szPath,&filegen)
+        && (0 != memcmp(&plibrary->filegen,&filegen,sizeof(DS_FILEGEN))))
+    {
+      boolStale = true;
+    }
+    MUTEXUNLOCK(m_mutex);
+    return boolStale;
+  }
+};
+
 /**
 * Impl Class to hold list of connected applications.
 * In 32bit enviroments each application will connect to a seperate
@@ -247,6 +696,15 @@ class CTwnDsmAppsImpl
     CTwnDsmAppsImpl()
     {
       memset(&pod,0,sizeof(_pod));
+      MUTEXINIT(pod.m_mutexEventFd);
+    }
+
+    /**
+    * Our CTwnDsmAppsImpl destructor.
+    */
+    ~CTwnDsmAppsImpl()
+    {
+      MUTEXDESTROY(pod.m_mutexEventFd);
     }
 
     /**
@@ -281,6 +739,19 @@ class CTwnDsmAppsImpl
                     TWID_T       _DsId,
                     bool         _boolKeepOpen);
 
+    /**
+    * The part of LoadDS that does the work.
+    * @param[in] _pAppId Origin of message
+    * @param[in] _pPath The path to the library to open
+    * @param[in] _DsId the source array index
+    * @param[in] _boolKeepOpen if set to true keeps DS open after successful load
+    * @return a valid TWRC_xxxx return code
+    */
+    TW_INT16 LoadDSLibrary(TW_IDENTITY *_pAppId,
+                           char        *_pPath,
+                           TWID_T       _DsId,
+                           bool         _boolKeepOpen);
+
     /**
     * Set the condition code.
     * @param[in] _pAppId Origin of message
@@ -289,6 +760,50 @@ class CTwnDsmAppsImpl
     void AppSetConditionCode(TW_IDENTITY *_pAppId,
                              TW_UINT16    _ConditionCode);
 
+    /**
+    * Copy the application's DS_LIST into a new snapshot and publish
+    * it.  Cursors that are already walking the old one keep it...
+    * @param[in] _pAppId the application whose list changed
+    */
+    void DsListPublish(TW_IDENTITY *_pAppId);
+
+    /**
+    * Get a reference to the application's current snapshot.  This
+    * doesn't lock, DsListPublish waits for us instead...
+    * @param[in] _pAppId the application
+    * @return the snapshot, or 0, release it with DsListRelease
+    */
+    DS_SNAPSHOT *DsListAcquire(TW_IDENTITY *_pAppId);
+
+    /**
+    * Let go of a snapshot, the last one out frees it...
+    * @param[in] _psnapshot the snapshot, may be 0
+    */
+    static void DsListRelease(DS_SNAPSHOT *_psnapshot);
+
+    /**
+    * Take the application's cursor, so no other thread can change it
+    * or free it while we use it...
+    * @param[in] _pAppId the application
+    * @return the cursor, or 0 if there isn't one
+    */
+    DS_CURSOR *DsCursorTake(TW_IDENTITY *_pAppId);
+
+    /**
+    * Give a cursor back to the application.  If another MSG_GETFIRST
+    * put a new one there while we had it, ours is thrown away...
+    * @param[in] _pAppId the application
+    * @param[in] _pcursor the cursor
+    */
+    void DsCursorPut(TW_IDENTITY *_pAppId,
+                     DS_CURSOR   *_pcursor);
+
+    /**
+    * Free a cursor and its reference to the snapshot...
+    * @param[in] _pcursor the cursor, may be 0
+    */
+    static void DsCursorFree(DS_CURSOR *_pcursor);
+
   public:
     // If you add a class in future, declare it here and not in
     // the pod, or the memset in the constructor will ruin your
@@ -301,9 +816,11 @@ class CTwnDsmAppsImpl
     struct _pod
     {
       TW_UINT16   m_conditioncode;          /**< we use this if we have no apps. */
+      MUTEX       m_mutexEventFd;           /**< AppWakeup mustn't write to an eventfd while it's being closed */
     } pod; /**< Pieces of data for CTwnDsmAppsImpl*/
 
     CAppList      m_AppInfo;  /**< list of applications. */
+    CLibList      m_LibList;  /**< the driver libraries we have loaded. */
 };
 
 
@@ -440,6 +957,7 @@ TW_UINT16 CTwnDsmApps::AddApp(TW_IDENTITY *_pAppId,
   // Recursively navigate the TWAIN datasource dir looking for data sources.
   // Ignor error continue with what we found even if it is nothing
   m_ptwndsmappsimpl->scanDSDir(szDsm,_pAppId);
+  m_ptwndsmappsimpl->DsListPublish(_pAppId);
 
   // Maybe one of many DS failed but we still found some.
   AppSetConditionCode(_pAppId, TWCC_SUCCESS);
@@ -524,7 +1042,14 @@ TW_UINT16 CTwnDsmApps::RemoveApp(TW_IDENTITY *_pAppId)
     free(m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList);
     m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList = NULL;
   }
+  // Let go of the enumeration, the list is gone.  There's no other
+  // thread that should be enumerating for an app that's closing, but
+  // publishing an empty list waits for one that got here anyway...
+  m_ptwndsmappsimpl->DsCursorFree(m_ptwndsmappsimpl->DsCursorTake(_pAppId));
+  m_ptwndsmappsimpl->DsListPublish(_pAppId);
+
   //Free AppInfo for this App
+  AppCloseEventFd(_pAppId);
   m_ptwndsmappsimpl->m_AppInfo.Erase((TWID_T)_pAppId->Id);
 
 
@@ -639,6 +1164,26 @@ TW_UINT16 CTwnDsmApps::AppGetConditionCode(TW_IDENTITY *_pAppId)
 
 
 
+/**
+* Return the condition code without clearing it.
+* This looks where AppSetConditionCode put the code, so it sees
+* the global value when the identity isn't registered, and it
+* doesn't log, so it's safe for bookkeeping on the failure path...
+*/
+TW_UINT16 CTwnDsmApps::AppPeekConditionCode(TW_IDENTITY *_pAppId)
+{
+  if (   (0 == _pAppId)
+      || (0 == (TWID_T)_pAppId->Id)
+      || ((TWID_T)_pAppId->Id >= m_ptwndsmappsimpl->m_AppInfo.size())
+      || (0 == m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].identity.Id))
+  {
+    return m_ptwndsmappsimpl->pod.m_conditioncode;
+  }
+  return m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].ConditionCode;
+}
+
+
+
 /*
 * Set the condition code.
 * The same rules apply here as they do for AppGetConditionCode.
@@ -692,85 +1237,303 @@ DSM_State CTwnDsmApps::AppGetState()
 
   for (TWID_T AppID = 1; AppID<m_ptwndsmappsimpl->m_AppInfo.size(); AppID++)
   {
-    if(m_ptwndsmappsimpl->m_AppInfo[AppID].CurrentState > CurrentState)
-    {
-      CurrentState = m_ptwndsmappsimpl->m_AppInfo[AppID].CurrentState;
-    }
+    if(m_ptwndsmappsimpl->m_AppInfo[AppID].CurrentState > CurrentState)
+    {
+      CurrentState = m_ptwndsmappsimpl->m_AppInfo[AppID].CurrentState;
+    }
+  }
+  return CurrentState;
+}
+
+/**
+* Get our current state.
+* There are really only two states that the DSM can occupy, state
+* 2 where it's loaded, but hasn't had a MSG_OPENDSM done for the
+* specified application identity.  And state 3, where a MSG_OPENDSM
+* has been successfully performed...
+*/
+DSM_State CTwnDsmApps::AppGetState(TW_IDENTITY *_pAppId)
+{
+  // Return the application specific state...
+  if (AppValidateId(_pAppId))
+  {
+    return m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].CurrentState;
+  }
+  // Otherwise we must be in state 2.  Good luck ever getting state 1
+  // out of the DSM...  :)
+  else
+  {
+    return dsmState_Loaded;
+  }
+}
+
+/**
+* Get number of allocated App slots (Last valid App ID +1)
+* @return number of allocated App slots (Last valid App ID +1)
+*/
+TWID_T CTwnDsmApps::AppGetNumApp()
+{
+  return m_ptwndsmappsimpl->m_AppInfo.size();
+}
+
+
+
+/**
+* Get our hwnd.
+* Windows needs this to help center the user select window...
+*/
+void *CTwnDsmApps::AppHwnd(TW_IDENTITY *_pAppId)
+{
+  // Return the hwnd...
+  if (AppValidateId(_pAppId))
+  {
+    return m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].hwnd;
+  }
+  // Otherwise return a null...
+  else
+  {
+    return 0;
+  }
+}
+
+
+
+/**
+* Get the number of drivers found.
+* When LoadDS() is called during AddApp() we browse for drivers and
+* keep the identity for each one we find.  This just tells us how
+* many we found...
+*/
+TWID_T CTwnDsmApps::AppGetNumDs(TW_IDENTITY *_pAppId)
+{
+  // Return the number of drivers we found...
+  if (    AppValidateId(_pAppId)
+      &&  m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList)
+  {
+    return m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->NumFiles;
+  }
+  // Not a lot of choice, the value has to be zero...
+  else
+  {
+    return 0;
+  }
+}
+
+
+
+/**
+* Start a walk of the drivers.  We take a reference to the current
+* snapshot and hang a new cursor on the application, replacing any
+* walk it already had going.  If there are no drivers we still leave
+* a cursor, so that MSG_GETNEXT reports TWRC_ENDOFLIST...
+*/
+TW_INT16 CTwnDsmApps::DsGetFirst(TW_IDENTITY *_pAppId,
+                                 TW_IDENTITY *_pDsId)
+{
+  DS_CURSOR *pcursor;
+
+  // Validate...
+  if (!AppValidateId(_pAppId) || (0 == _pDsId))
+  {
+    return TWRC_FAILURE;
+  }
+
+  pcursor = (DS_CURSOR*)calloc(1,sizeof(DS_CURSOR));
+  if (0 == pcursor)
+  {
+    kLOG((kLOGERR,"calloc failed for the MSG_GETFIRST cursor..."));
+    AppSetConditionCode(_pAppId,TWCC_LOWMEMORY);
+    return TWRC_FAILURE;
+  }
+  pcursor->pSnapshot = m_ptwndsmappsimpl->DsListAcquire(_pAppId);
+
+  // Throw away the old walk, and start the new one...
+  m_ptwndsmappsimpl->DsCursorFree(m_ptwndsmappsimpl->DsCursorTake(_pAppId));
+  if ((0 == pcursor->pSnapshot) || (pcursor->pSnapshot->NumFiles < 1))
+  {
+    m_ptwndsmappsimpl->DsCursorPut(_pAppId,pcursor);
+    return TWRC_ENDOFLIST;
+  }
+  pcursor->DsId = 1;
+  *_pDsId = pcursor->pSnapshot->Identity[pcursor->DsId];
+  m_ptwndsmappsimpl->DsCursorPut(_pAppId,pcursor);
+  return TWRC_SUCCESS;
+}
+
+
+
+/**
+* Continue a walk.  We own the cursor while we're in here, so a
+* second thread in the same application gets TWCC_SEQERROR instead
+* of sharing it.  The cursor goes away at the end of the list...
+*/
+TW_INT16 CTwnDsmApps::DsGetNext(TW_IDENTITY *_pAppId,
+                                TW_IDENTITY *_pDsId)
+{
+  DS_CURSOR *pcursor;
+
+  // Validate...
+  if (!AppValidateId(_pAppId) || (0 == _pDsId))
+  {
+    return TWRC_FAILURE;
+  }
+
+  // Applications must call MSG_GETFIRST before making this call...
+  pcursor = m_ptwndsmappsimpl->DsCursorTake(_pAppId);
+  if (0 == pcursor)
+  {
+    AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    return TWRC_FAILURE;
+  }
+
+  // We're out of items...
+  pcursor->DsId += 1;
+  if ((0 == pcursor->pSnapshot) || (pcursor->DsId > pcursor->pSnapshot->NumFiles))
+  {
+    m_ptwndsmappsimpl->DsCursorFree(pcursor);
+    return TWRC_ENDOFLIST;
+  }
+
+  // Return info on this driver...
+  *_pDsId = pcursor->pSnapshot->Identity[pcursor->DsId];
+  m_ptwndsmappsimpl->DsCursorPut(_pAppId,pcursor);
+  return TWRC_SUCCESS;
+}
+
+
+
+/**
+* Publish a new snapshot of the application's drivers.  Readers take
+* their reference without a lock, so once the new pointer is in we
+* wait until nobody is between reading the old one and counting
+* themselves in it.  After that only the references can keep it
+* alive, and we drop the one the APP_INFO had...
+*/
+void CTwnDsmAppsImpl::DsListPublish(TW_IDENTITY *_pAppId)
+{
+  TWID_T       ii;
+  DS_LIST     *pdslist;
+  DS_SNAPSHOT *psnapshot;
+  DS_SNAPSHOT *psnapshotOld;
+  APP_INFO    *pappinfo;
+
+  pappinfo = &m_AppInfo[(TWID_T)_pAppId->Id];
+
+  // Copy the list, ids and all...
+  psnapshot = 0;
+  pdslist = pappinfo->pDSList;
+  if (0 != pdslist)
+  {
+    psnapshot = (DS_SNAPSHOT*)calloc(1,sizeof(DS_SNAPSHOT) + (pdslist->NumFiles * sizeof(TW_IDENTITY)));
+    if (0 == psnapshot)
+    {
+      kLOG((kLOGERR,"calloc failed for the driver snapshot, MSG_GETFIRST keeps the old one..."));
+      return;
+    }
+    psnapshot->nRefs = 1;
+    psnapshot->NumFiles = pdslist->NumFiles;
+    for (ii = 1; ii <= pdslist->NumFiles; ii++)
+    {
+      psnapshot->Identity[ii] = pdslist->DSInfo[ii].Identity;
+    }
+  }
+
+  // Swap it in...
+  do
+  {
+    psnapshotOld = pappinfo->pSnapshot;
+  } while (!ATOMICCASPTR(&pappinfo->pSnapshot,psnapshotOld,psnapshot));
+
+  // Wait out anyone who might have read the old pointer, it's a
+  // handful of instructions, so this is rarely more than one look...
+  while (0 != ATOMICADD32(&pappinfo->nReaders,0))
+  {
+    THREADYIELD();
+  }
+  DsListRelease(psnapshotOld);
+}
+
+
+
+/**
+* Get a reference to the current snapshot...
+*/
+DS_SNAPSHOT *CTwnDsmAppsImpl::DsListAcquire(TW_IDENTITY *_pAppId)
+{
+  DS_SNAPSHOT *psnapshot;
+  APP_INFO    *pappinfo;
+
+  pappinfo = &m_AppInfo[(TWID_T)_pAppId->Id];
+
+  (void)ATOMICADD32(&pappinfo->nReaders,1);
+  psnapshot = pappinfo->pSnapshot;
+  if (0 != psnapshot)
+  {
+    (void)ATOMICADD32(&psnapshot->nRefs,1);
   }
-  return CurrentState;
+  (void)ATOMICADD32(&pappinfo->nReaders,-1);
+
+  return psnapshot;
 }
 
+
+
 /**
-* Get our current state.
-* There are really only two states that the DSM can occupy, state
-* 2 where it's loaded, but hasn't had a MSG_OPENDSM done for the
-* specified application identity.  And state 3, where a MSG_OPENDSM
-* has been successfully performed...
+* Drop a reference to a snapshot...
 */
-DSM_State CTwnDsmApps::AppGetState(TW_IDENTITY *_pAppId)
+void CTwnDsmAppsImpl::DsListRelease(DS_SNAPSHOT *_psnapshot)
 {
-  // Return the application specific state...
-  if (AppValidateId(_pAppId))
+  if ((0 != _psnapshot) && (1 == ATOMICADD32(&_psnapshot->nRefs,-1)))
   {
-    return m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].CurrentState;
-  }
-  // Otherwise we must be in state 2.  Good luck ever getting state 1
-  // out of the DSM...  :)
-  else
-  {
-    return dsmState_Loaded;
+    free(_psnapshot);
   }
 }
 
+
+
 /**
-* Get number of allocated App slots (Last valid App ID +1)
-* @return number of allocated App slots (Last valid App ID +1)
+* Take the cursor off the application...
 */
-TWID_T CTwnDsmApps::AppGetNumApp()
+DS_CURSOR *CTwnDsmAppsImpl::DsCursorTake(TW_IDENTITY *_pAppId)
 {
-  return m_ptwndsmappsimpl->m_AppInfo.size();
+  DS_CURSOR *pcursor;
+  APP_INFO  *pappinfo;
+
+  pappinfo = &m_AppInfo[(TWID_T)_pAppId->Id];
+
+  do
+  {
+    pcursor = pappinfo->pCursor;
+  } while ((0 != pcursor) && !ATOMICCASPTR(&pappinfo->pCursor,pcursor,(DS_CURSOR*)0));
+
+  return pcursor;
 }
 
 
 
 /**
-* Get our hwnd.
-* Windows needs this to help center the user select window...
+* Put the cursor back on the application...
 */
-void *CTwnDsmApps::AppHwnd(TW_IDENTITY *_pAppId)
+void CTwnDsmAppsImpl::DsCursorPut(TW_IDENTITY *_pAppId,
+                                  DS_CURSOR   *_pcursor)
 {
-  // Return the hwnd...
-  if (AppValidateId(_pAppId))
-  {
-    return m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].hwnd;
-  }
-  // Otherwise return a null...
-  else
+  if (!ATOMICCASPTR(&m_AppInfo[(TWID_T)_pAppId->Id].pCursor,(DS_CURSOR*)0,_pcursor))
   {
-    return 0;
+    DsCursorFree(_pcursor);
   }
 }
 
 
 
 /**
-* Get the number of drivers found.
-* When LoadDS() is called during AddApp() we browse for drivers and
-* keep the identity for each one we find.  This just tells us how
-* many we found...
+* Free a cursor...
 */
-TWID_T CTwnDsmApps::AppGetNumDs(TW_IDENTITY *_pAppId)
+void CTwnDsmAppsImpl::DsCursorFree(DS_CURSOR *_pcursor)
 {
-  // Return the number of drivers we found...
-  if (    AppValidateId(_pAppId)
-      &&  m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList)
-  {
-    return m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->NumFiles;
-  }
-  // Not a lot of choice, the value has to be zero...
-  else
+  if (0 != _pcursor)
   {
-    return 0;
+    DsListRelease(_pcursor->pSnapshot);
+    free(_pcursor);
   }
 }
 
@@ -851,6 +1614,25 @@ char *CTwnDsmApps::DsGetPath(TW_IDENTITY *_pAppId,
 
 
 
+/**
+* Check if the driver's file has changed since we loaded it.  The warm
+* pool uses this so that it doesn't hand out an old version...
+*/
+bool CTwnDsmApps::DsIsStale(TW_IDENTITY *_pAppId,
+                            TWID_T       _DsId)
+{
+  if (    AppValidateId(_pAppId)
+      &&  m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList
+      &&  (_DsId < MAX_NUM_DS)
+      &&  m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].pHandle)
+  {
+    return m_ptwndsmappsimpl->m_LibList.IsStale(m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].pHandle);
+  }
+  return false;
+}
+
+
+
 /**
 * Get a point to the TW_CALLBACK2 for the specified driver.
 * This is optional for drivers on Windows.  On Linux it's the only
@@ -890,7 +1672,8 @@ TW_BOOL CTwnDsmApps::DsCallbackIsWaiting(TW_IDENTITY *_pAppId,
       &&  m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList
       &&  (_DsId < MAX_NUM_DS))
   {
-    return m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].bCallbackPending;
+    DS_EVENTQUEUE *pq = &m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].eventqueue;
+    return (pq->uHead != pq->uTail) ? TRUE : FALSE;
   }
   // Something is toasted, so return FALSE...
   else
@@ -903,24 +1686,158 @@ TW_BOOL CTwnDsmApps::DsCallbackIsWaiting(TW_IDENTITY *_pAppId,
 
 
 /**
-* Set the callback flag.
-* This is how we know when we have something for the Application...
+* Which coalescing slot a DAT_NULL message uses.  The DSM only lets
+* these four through DSM_Null...
+*/
+static int EventKind(TW_UINT16 _MSG)
+{
+  switch (_MSG)
+  {
+    default:
+    case MSG_XFERREADY:   return 0;
+    case MSG_CLOSEDSREQ:  return 1;
+    case MSG_CLOSEDSOK:   return 2;
+    case MSG_DEVICEEVENT: return 3;
+  }
+}
+
+
+
+/**
+* Queue a message for the Application.
+* This is how we know when we have something for the Application.  Any
+* driver thread may call this.  A message that is already waiting is
+* coalesced rather than queued twice: a second MSG_XFERREADY or
+* MSG_CLOSEDSREQ says nothing new, and an Application that gets
+* MSG_DEVICEEVENT drains DAT_DEVICEEVENT until the driver has no more...
 */
-void CTwnDsmApps::DsCallbackSetWaiting(TW_IDENTITY *_pAppId,
+DSM_EventPush CTwnDsmApps::DsEventPush(TW_IDENTITY *_pAppId,
                                        TWID_T       _DsId,
-                                       TW_BOOL      _Waiting)
+                                       TW_UINT16    _MSG)
 {
-  // Set the waiting flag...
-  if (    AppValidateId(_pAppId)
-      &&  m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList
-      &&  (_DsId < MAX_NUM_DS))
+  DS_EVENTQUEUE *pq;
+  TW_UINT32      uPos;
+  TW_UINT32      uIdx;
+  TW_INT32       nDif;
+  int            nKind;
+
+  // Validate...
+  if (   !AppValidateId(_pAppId)
+      || !m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList
+      || (_DsId >= MAX_NUM_DS))
   {
-    m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].bCallbackPending = _Waiting;
+    kLOG((kLOGERR,"Unable to properly handle DsEventPush..."));
+    return dsmEvent_Full;
   }
-  // Something is toasted, so whine about it...
-  else
+  pq = &m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].eventqueue;
+
+  // Only one of each kind waits at a time...
+  nKind = EventKind(_MSG);
+  if (!ATOMICCAS32(&pq->aPending[nKind],0,1))
+  {
+    return dsmEvent_Coalesced;
+  }
+
+  // Claim a cell, a cell is ours when its turn matches our position...
+  uPos = pq->uTail;
+  for (;;)
+  {
+    uIdx = uPos & (DSM_EVENTQUEUE - 1);
+    nDif = (TW_INT32)(pq->aSeq[uIdx] + uIdx - uPos);
+    if (0 == nDif)
+    {
+      if (ATOMICCAS32(&pq->uTail,uPos,uPos + 1))
+      {
+        break;
+      }
+    }
+    else if (nDif < 0)
+    {
+      pq->aPending[nKind] = 0;
+      return dsmEvent_Full;
+    }
+    uPos = pq->uTail;
+  }
+
+  // Fill it, then hand it to the reader...
+  pq->aMsg[uIdx] = _MSG;
+  MEMORYBARRIER;
+  pq->aSeq[uIdx] = uPos + 1 - uIdx;
+  return dsmEvent_Queued;
+}
+
+
+
+/**
+* Take the oldest message for the Application.
+* The coalescing slot is released before the message goes back to the
+* Application, so anything the driver sends while the Application is
+* handling it is queued, not lost...
+*/
+TW_UINT16 CTwnDsmApps::DsEventPop(TW_IDENTITY *_pAppId,
+                                  TWID_T       _DsId)
+{
+  DS_EVENTQUEUE *pq;
+  TW_UINT32      uPos;
+  TW_UINT32      uIdx;
+  TW_INT32       nDif;
+  TW_UINT16      msg;
+
+  // Validate...
+  if (   !AppValidateId(_pAppId)
+      || !m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList
+      || (_DsId >= MAX_NUM_DS))
+  {
+    kLOG((kLOGERR,"Returning 0 from DsEventPop..."));
+    return 0;
+  }
+  pq = &m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].eventqueue;
+
+  // Claim the oldest filled cell...
+  uPos = pq->uHead;
+  for (;;)
+  {
+    uIdx = uPos & (DSM_EVENTQUEUE - 1);
+    nDif = (TW_INT32)(pq->aSeq[uIdx] + uIdx - (uPos + 1));
+    if (0 == nDif)
+    {
+      if (ATOMICCAS32(&pq->uHead,uPos,uPos + 1))
+      {
+        break;
+      }
+    }
+    else if (nDif < 0)
+    {
+      return 0;
+    }
+    uPos = pq->uHead;
+  }
+
+  // Read it, then give the cell back to the writers a lap from now...
+  MEMORYBARRIER;
+  msg = pq->aMsg[uIdx];
+  MEMORYBARRIER;
+  pq->aSeq[uIdx] = uPos + DSM_EVENTQUEUE - uIdx;
+  pq->aPending[EventKind(msg)] = 0;
+  MEMORYBARRIER;
+  return msg;
+}
+
+
+
+/**
+* Throw away any waiting messages.
+* We do this when the Application registers a callback, and when the
+* driver goes away...
+*/
+void CTwnDsmApps::DsEventClear(TW_IDENTITY *_pAppId,
+                               TWID_T       _DsId)
+{
+  TW_UINT16 msg;
+
+  while (0 != (msg = DsEventPop(_pAppId,_DsId)))
   {
-    kLOG((kLOGERR,"Unable to properly handle DsCallbackSetWaiting..."));
+    kLOG((kLOGINFO,"%.32s never retrieved DAT_EVENT / 0x%04x",(char*)_pAppId->ProductName,(unsigned)msg));
   }
 }
 
@@ -1021,6 +1938,52 @@ void CTwnDsmApps::DsSetAppProcessingCallback(TW_IDENTITY *_pAppId,
 }
 
 
+/**
+* Check if the DS has been enabled.
+* The warm pool can only keep a DS that's back in state 4...
+*/
+TW_BOOL CTwnDsmApps::DsIsEnabled(TW_IDENTITY *_pAppId,
+                                 TWID_T       _DsId)
+{
+  // Check the enabled flag...
+  if (    AppValidateId(_pAppId)
+      &&  m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList
+      &&  (_DsId < MAX_NUM_DS))
+  {
+    return m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].bEnabled;
+  }
+  // Something is toasted, so say it's enabled, that's the safe answer...
+  else
+  {
+    kLOG((kLOGERR,"Returning TRUE from DsIsEnabled..."));
+    return TRUE;
+  }
+}
+
+
+/**
+* Set the Enabled flag.
+* DsEntry calls this when MSG_ENABLEDS or MSG_DISABLEDS succeeds
+*/
+void CTwnDsmApps::DsSetEnabled(TW_IDENTITY *_pAppId,
+                               TWID_T       _DsId,
+                               TW_BOOL      _Enabled)
+{
+  // Set the enabled flag...
+  if (    AppValidateId(_pAppId)
+      &&  m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList
+      &&  (_DsId < MAX_NUM_DS))
+  {
+    m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].bEnabled = _Enabled;
+  }
+  // Something is toasted, so whine about it...
+  else
+  {
+    kLOG((kLOGERR,"Unable to properly handle DsSetEnabled..."));
+  }
+}
+
+
 /**
 * Turn a TWCC_ condition code into a string...
 */
@@ -1144,6 +2107,10 @@ int CTwnDsmAppsImpl::scanDSDir(char        *_szAbsPath,
     return EXIT_FAILURE;
   }
 
+  // Each directory we visit gets its own span...
+  CTwnDsmTraceScope tracescope("dsm","scanDSDir",_szAbsPath);
+  kPROBE1(scandsdir,_szAbsPath);
+
   //
   // Take care of VC++...
   //
@@ -1424,6 +2391,12 @@ TW_INT16 CTwnDsmApps::LoadDS(TW_IDENTITY  *_pAppId,
         (void)_chdir( szPrevWorkDir );
       }
     #endif
+
+    // The driver gave us its identity again, and it may have changed...
+    if (TWRC_SUCCESS == result)
+    {
+      m_ptwndsmappsimpl->DsListPublish(_pAppId);
+    }
     return result;
   }
   // Something is toasted, so return LoadDS...
@@ -1441,12 +2414,36 @@ TW_INT16 CTwnDsmApps::LoadDS(TW_IDENTITY  *_pAppId,
 * This is the implementation function.  We use this both to browse
 * for drivers during MSG_GETFIRST/MSG_GETNEXT and to load a specific
 * driver during MSG_OPENDS.  Which is why we need the path and the
-* keep open flag...
+* keep open flag.  The real work is in LoadDSLibrary, this is where
+* we watch it...
 */
 TW_INT16 CTwnDsmAppsImpl::LoadDS(TW_IDENTITY *_pAppId,
                                  char        *_pPath,
                                  TWID_T       _DsId,
                                  bool         _boolKeepOpen)
+{
+  TW_INT16 result;
+
+  // Probing a driver can be slow, so give it a span...
+  CTwnDsmTraceScope tracescope("dsm",_boolKeepOpen?"LoadDS":"LoadDS (probe)",_pPath);
+  kPROBE3(loadds__entry,_pPath,_DsId,(int)_boolKeepOpen);
+
+  result = LoadDSLibrary(_pAppId,_pPath,_DsId,_boolKeepOpen);
+
+  kPROBE3(loadds__return,_pPath,_DsId,result);
+  tracescope.SetResult(result);
+  return result;
+}
+
+
+
+/**
+* Load a driver, and get its identity.  See LoadDS...
+*/
+TW_INT16 CTwnDsmAppsImpl::LoadDSLibrary(TW_IDENTITY *_pAppId,
+                                        char        *_pPath,
+                                        TWID_T       _DsId,
+                                        bool         _boolKeepOpen)
 {
   TW_INT16  result = TWRC_SUCCESS;
   DS_INFO  *pDSInfo;
@@ -1550,7 +2547,7 @@ TW_INT16 CTwnDsmAppsImpl::LoadDS(TW_IDENTITY *_pAppId,
 
   // Try to load the driver...  We load the driver again if we are keeping
   // it open.  This LoadLibrary is always closed so we dont hook this time.
-  pDSInfo->pHandle = (TW_HANDLE)LOADLIBRARY(_pPath,false,0);
+  pDSInfo->pHandle = m_LibList.Load(_pPath,false,0);
   #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
     if (0 == pDSInfo->pHandle)
     {
@@ -1604,7 +2601,7 @@ TW_INT16 CTwnDsmAppsImpl::LoadDS(TW_IDENTITY *_pAppId,
     #endif
 	  if (pDSInfo->DS_Entry == 0)
 	  {
-		  (void)UNLOADLIBRARY(pDSInfo->pHandle, false, 0);
+		  (void)m_LibList.Unload(pDSInfo->pHandle, false, 0);
 		  pDSInfo->pHandle = NULL;
 		  AppSetConditionCode(_pAppId, TWCC_OPERATIONERROR);
 		  return TWRC_FAILURE;
@@ -1672,7 +2669,7 @@ TW_INT16 CTwnDsmAppsImpl::LoadDS(TW_IDENTITY *_pAppId,
   }
   if (result != TWRC_SUCCESS)
   {
-    (void)UNLOADLIBRARY(pDSInfo->pHandle,false,0);
+    (void)m_LibList.Unload(pDSInfo->pHandle,false,0);
     pDSInfo->pHandle = NULL;
     pDSInfo->DS_Entry = NULL;
 	kLOG((kLOGINFO, "DG_CONTROL,DAT_IDENTITY,MSG_GET failed"));
@@ -1714,7 +2711,7 @@ TW_INT16 CTwnDsmAppsImpl::LoadDS(TW_IDENTITY *_pAppId,
 	  }
 	  else
 	  {
-		(void)UNLOADLIBRARY(pDSInfo->pHandle,false,0);
+		(void)m_LibList.Unload(pDSInfo->pHandle,false,0);
 		pDSInfo->pHandle = NULL;
 		pDSInfo->DS_Entry = NULL;
 		kLOG((kLOGINFO,"DG_CONTROL,DAT_IDENTITY,MSG_GET failed (rejected as old 64-bit TW_INT32/TW_UINT32)"));
@@ -1733,7 +2730,7 @@ TW_INT16 CTwnDsmAppsImpl::LoadDS(TW_IDENTITY *_pAppId,
   if ( !(  (_pAppId->SupportedGroups & DG_MASK & ~DG_CONTROL)              // app supports
          & (pDSInfo->Identity.SupportedGroups & DG_MASK & ~DG_CONTROL) ) ) // source supports
   {
-    (void)UNLOADLIBRARY(pDSInfo->pHandle,false,0);
+    (void)m_LibList.Unload(pDSInfo->pHandle,false,0);
     pDSInfo->pHandle = NULL;
     pDSInfo->DS_Entry = NULL;
     kLOG((kLOGINFO,"The SupportedGroups do not match."));
@@ -1753,7 +2750,7 @@ TW_INT16 CTwnDsmAppsImpl::LoadDS(TW_IDENTITY *_pAppId,
   // We clear the library to avoid cluttering up the virtual address space, and
   // to prevent scary weirdness that can result from multiple drivers being
   // loaded (if the application wants to load multiple drivers, that's its risk).
-  (void)UNLOADLIBRARY(pDSInfo->pHandle,false,0);
+  (void)m_LibList.Unload(pDSInfo->pHandle,false,0);
   pDSInfo->pHandle = NULL;
   pDSInfo->DS_Entry = NULL;
 
@@ -1778,7 +2775,7 @@ TW_INT16 CTwnDsmAppsImpl::LoadDS(TW_IDENTITY *_pAppId,
   // driver a consistent look.
   if (_boolKeepOpen == true)
   {
-    pDSInfo->pHandle = (TW_HANDLE)LOADLIBRARY(_pPath,hook,_DsId);
+    pDSInfo->pHandle = m_LibList.Load(_pPath,hook,_DsId);
     #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
     if (0 == pDSInfo->pHandle)
     {
@@ -1831,7 +2828,7 @@ TW_INT16 CTwnDsmAppsImpl::LoadDS(TW_IDENTITY *_pAppId,
       #endif
       if (pDSInfo->DS_Entry == 0)
       {
-        (void)UNLOADLIBRARY(pDSInfo->pHandle,false,0);
+        (void)m_LibList.Unload(pDSInfo->pHandle,false,0);
         pDSInfo->pHandle = NULL;
         AppSetConditionCode(_pAppId,TWCC_OPERATIONERROR);
         return TWRC_FAILURE;
@@ -1863,7 +2860,7 @@ void CTwnDsmApps::UnloadDS(TW_IDENTITY  *_pAppId,
       &&  m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].pHandle)
   {
     // Unload the library...
-    retval = UNLOADLIBRARY(m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].pHandle,true,_DsId);
+    retval = m_ptwndsmappsimpl->m_LibList.Unload(m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].pHandle,true,_DsId);
 
 	// Log if something bad happens...
     #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
@@ -1880,7 +2877,64 @@ void CTwnDsmApps::UnloadDS(TW_IDENTITY  *_pAppId,
 
     m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].DS_Entry = 0;
     m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].pHandle = 0;
+    m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].pDSList->DSInfo[_DsId].bEnabled = FALSE;
+
+    // Nobody is left to ask for these...
+    DsEventClear(_pAppId,_DsId);
+  }
+}
+
+
+
+/**
+* Get what the modules keep for a driver.  The DS_LIST is only freed
+* by RemoveApp, after MSG_CLOSEDSM has had every module let go, so the
+* record stays put for as long as anyone can be using it...
+*/
+DS_SESSION *CTwnDsmApps::DsGetSession(const TWID_T _AppId,
+                                      const TWID_T _DsId)
+{
+  if (    (_AppId > 0)
+      &&  (_AppId < m_ptwndsmappsimpl->m_AppInfo.size())
+      &&  m_ptwndsmappsimpl->m_AppInfo[_AppId].pDSList
+      &&  (_DsId > 0)
+      &&  (_DsId < MAX_NUM_DS))
+  {
+    return &m_ptwndsmappsimpl->m_AppInfo[_AppId].pDSList->DSInfo[_DsId].session;
+  }
+  return NULL;
+}
+
+
+
+/**
+* Get the application's callback dispatcher.  The APP_INFO moves when
+* the list grows, so the dispatcher gets the pointer, not where it's
+* kept...
+*/
+struct DISPATCH_SESSION_ *CTwnDsmApps::AppGetDispatcher(const TWID_T _AppId)
+{
+  if ((_AppId > 0) && (_AppId < m_ptwndsmappsimpl->m_AppInfo.size()))
+  {
+    return m_ptwndsmappsimpl->m_AppInfo[_AppId].pDispatch;
+  }
+  return NULL;
+}
+
+
+
+/**
+* Set the application's callback dispatcher...
+*/
+bool CTwnDsmApps::AppSetDispatcher(const TWID_T              _AppId,
+                                   struct DISPATCH_SESSION_ *_pdispatch)
+{
+  if ((_AppId > 0) && (_AppId < m_ptwndsmappsimpl->m_AppInfo.size()))
+  {
+    m_ptwndsmappsimpl->m_AppInfo[_AppId].pDispatch = _pdispatch;
+    return true;
   }
+  return false;
 }
 
 
@@ -1906,6 +2960,29 @@ void CTwnDsmApps::AppWakeup(TW_IDENTITY *_pAppId)
         kLOG((kLOGERR,"PostMessage failed..."));
       }
     }
+  #elif (TWNDSM_OS == TWNDSM_OS_LINUX)
+    int    nEventFd;
+    UINT64 one = 1;
+    if (AppValidateId(_pAppId))
+    {
+      // If the application asked for an eventfd, bump it so their
+      // poll wakes up, otherwise they have to use callbacks.  We
+      // hold the lock across the write, so a MSG_RESET or RemoveApp
+      // on another thread can't close the fd (and let someone else
+      // reuse the number) under us...
+      MUTEXLOCK(m_ptwndsmappsimpl->pod.m_mutexEventFd);
+      nEventFd = m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].nEventFd;
+      if (0 == nEventFd)
+      {
+        kLOG((kLOGERR,"We shouldn't be here in AppWakeup..."));
+      }
+      else if (   (write(nEventFd - 1,&one,sizeof(one)) != (ssize_t)sizeof(one))
+               && (EAGAIN != errno))
+      {
+        kLOG((kLOGERR,"eventfd write failed, errno %d...",errno));
+      }
+      MUTEXUNLOCK(m_ptwndsmappsimpl->pod.m_mutexEventFd);
+    }
   #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
     kLOG((kLOGERR,"We shouldn't be here in AppWakeup..."));
     // We don't support this path on this platform, use
@@ -1918,3 +2995,85 @@ void CTwnDsmApps::AppWakeup(TW_IDENTITY *_pAppId)
     #error Sorry, we do not recognize this system...
   #endif
 }
+
+
+
+/**
+* Check if AppWakeup can reach the application...
+*/
+TW_BOOL CTwnDsmApps::AppHasWakeup(TW_IDENTITY *_pAppId)
+{
+  if (!AppValidateId(_pAppId))
+  {
+    return FALSE;
+  }
+  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+    return (0 != m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].hwnd);
+  #elif (TWNDSM_OS == TWNDSM_OS_LINUX)
+    return (0 != m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].nEventFd);
+  #else
+    return FALSE;
+  #endif
+}
+
+
+
+/**
+* Get the application's eventfd.
+* We make it the first time we're asked, under the same lock that
+* AppWakeup and AppCloseEventFd use...
+*/
+TW_INT32 CTwnDsmApps::AppGetEventFd(TW_IDENTITY *_pAppId)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    int fd;
+    if (!AppValidateId(_pAppId))
+    {
+      return -1;
+    }
+    MUTEXLOCK(m_ptwndsmappsimpl->pod.m_mutexEventFd);
+    if (0 == m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].nEventFd)
+    {
+      fd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+      if (fd < 0)
+      {
+        MUTEXUNLOCK(m_ptwndsmappsimpl->pod.m_mutexEventFd);
+        kLOG((kLOGERR,"eventfd failed, errno %d...",errno));
+        return -1;
+      }
+      m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].nEventFd = fd + 1;
+    }
+    fd = m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].nEventFd - 1;
+    MUTEXUNLOCK(m_ptwndsmappsimpl->pod.m_mutexEventFd);
+    return (TW_INT32)fd;
+  #else
+    (void)_pAppId;
+    return -1;
+  #endif
+}
+
+
+
+/**
+* Close the application's eventfd.
+* After this AppWakeup goes back to whining...
+*/
+void CTwnDsmApps::AppCloseEventFd(TW_IDENTITY *_pAppId)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    int nEventFd;
+    if (AppValidateId(_pAppId))
+    {
+      MUTEXLOCK(m_ptwndsmappsimpl->pod.m_mutexEventFd);
+      nEventFd = m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].nEventFd;
+      m_ptwndsmappsimpl->m_AppInfo[(TWID_T)_pAppId->Id].nEventFd = 0;
+      if (0 != nEventFd)
+      {
+        close(nEventFd - 1);
+      }
+      MUTEXUNLOCK(m_ptwndsmappsimpl->pod.m_mutexEventFd);
+    }
+  #else
+    (void)_pAppId;
+  #endif
+}
@@ -0,0 +1,1028 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+/**
+* @file checksum.cpp
+* Image checksums.
+* Work out the CRC32C of each image as it comes back from a driver, and
+* catch drivers that write past the end of a DAT_IMAGEMEMXFER buffer.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+/**
+* Which CRC32C instructions we can build.  We build them for the CPU
+* family, and decide if we can use them when we start...
+*/
+#if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP) && (defined(_M_X64) || defined(_M_IX86))
+  #define CHECKSUM_X86
+  #define CHECKSUM_TARGET(t)
+  #include <intrin.h>
+  #include <nmmintrin.h>
+#elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP) && (defined(__x86_64__) || defined(__i386__))
+  #define CHECKSUM_X86
+  #define CHECKSUM_TARGET(t) __attribute__((target(t)))
+  #include <nmmintrin.h>
+#elif (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP) && defined(_M_ARM64) && defined(TWNDSM_CONVERT_NEON)
+  // The ARMv8 kernel stays out unless it's asked for, the same as the
+  // NEON pixel kernels, until it's been built on aarch64 and passes
+  // twaindsm-checksumcheck...
+  #define CHECKSUM_ARM
+  #define CHECKSUM_TARGET(t)
+  #include <intrin.h>
+#elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP) && defined(__aarch64__) && defined(TWNDSM_CONVERT_NEON)
+  #define CHECKSUM_ARM
+  #define CHECKSUM_TARGET(t) __attribute__((target(t)))
+  #include <arm_acle.h>
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    #include <sys/auxv.h>
+    #include <asm/hwcap.h>
+  #endif
+#endif
+
+
+
+/**
+* Enviroment varible to turn us on.  Anything but 0 does it, and it can
+* also say strict (fail the strip that overran), and scalar (don't use
+* the CRC32C instructions)...
+* @see CTwnDsmChecksum
+*/
+#define kCHECKSUMENV "TWAINDSM_CHECKSUM"
+
+/**
+* How much of a file we read at a time...
+* @see CTwnDsmChecksum
+*/
+#define CHECKSUM_FILECHUNK 65536
+
+/**
+* The CRC32C polynomial, reflected...
+*/
+#define CHECKSUM_POLY 0x82F63B78
+
+/**
+* The CRC32C of "123456789", which every kernel has to get...
+*/
+#define CHECKSUM_CHECK 0xE3069283
+
+/**
+* CheckKernels also holds each kernel to the plain C one for every
+* length up to this many bytes, at every misalignment up to 7...
+* @see CTwnDsmChecksum
+*/
+#define CHECKSUM_CHECKCOUNT 64
+
+
+
+/**
+* Add bytes to a CRC32C, the CRC is kept inverted between calls...
+*/
+typedef TW_UINT32 (*CHECKSUM_CRC)(TW_UINT32       _uCrc,
+                                  const TW_UINT8 *_pData,
+                                  UINT64          _nBytes);
+
+/**
+* What we know about a driver, and the image it's sending, hung on
+* the DS_SESSION...
+*/
+typedef struct CHECKSUM_SESSION_
+{
+  TW_UINT32  MinBufSize;     /**< from DAT_SETUPMEMXFER */
+  TW_STR255  FileName;       /**< from DAT_SETUPFILEXFER */
+  TW_UINT32  uCrc;           /**< this image so far, inverted */
+  UINT64     nBytes;         /**< ...how many bytes */
+  TW_UINT32  nStrips;        /**< ...and how many strips */
+  TW_UINT32  nTransfers;     /**< since MSG_OPENDS */
+  TW_UINT32  nOverruns;      /**< since MSG_OPENDS */
+  bool       bHaveLast;      /**< true once an image is done */
+  TW_TWDSM_CHECKSUM last;    /**< the last image that was done */
+} CHECKSUM_SESSION;
+
+
+
+/**
+* The plain C table, built when we start...
+*/
+static TW_UINT32 s_auCrc32c[256];
+
+/**
+* Build the plain C table...
+*/
+static void BuildTable()
+{
+  TW_UINT32 uCrc;
+  int       ii;
+  int       jj;
+
+  for (ii = 0; ii < 256; ii++)
+  {
+    uCrc = (TW_UINT32)ii;
+    for (jj = 0; jj < 8; jj++)
+    {
+      uCrc = (uCrc & 1) ? ((uCrc >> 1) ^ CHECKSUM_POLY) : (uCrc >> 1);
+    }
+    s_auCrc32c[ii] = uCrc;
+  }
+}
+
+/**
+* The plain C kernel, a byte at a time...
+*/
+static TW_UINT32 ScalarCrc(TW_UINT32       _uCrc,
+                           const TW_UINT8 *_pData,
+                           UINT64          _nBytes)
+{
+  while (_nBytes--)
+  {
+    _uCrc = s_auCrc32c[(_uCrc ^ *_pData++) & 0xFF] ^ (_uCrc >> 8);
+  }
+  return _uCrc;
+}
+
+#if defined(CHECKSUM_X86)
+/**
+* SSE4.2, eight bytes at a time on x64, four on x86, once we're
+* aligned...
+*/
+CHECKSUM_TARGET("sse4.2")
+static TW_UINT32 Sse42Crc(TW_UINT32       _uCrc,
+                          const TW_UINT8 *_pData,
+                          UINT64          _nBytes)
+{
+  while (_nBytes && ((size_t)_pData & 7))
+  {
+    _uCrc = _mm_crc32_u8(_uCrc,*_pData++);
+    _nBytes--;
+  }
+  #if defined(_M_X64) || defined(__x86_64__)
+    UINT64 uQuad;
+    for (; _nBytes >= 8; _nBytes -= 8, _pData += 8)
+    {
+      memcpy(&uQuad,_pData,sizeof(uQuad));
+      _uCrc = (TW_UINT32)_mm_crc32_u64(_uCrc,uQuad);
+    }
+  #else
+    TW_UINT32 uWord;
+    for (; _nBytes >= 4; _nBytes -= 4, _pData += 4)
+    {
+      memcpy(&uWord,_pData,sizeof(uWord));
+      _uCrc = _mm_crc32_u32(_uCrc,uWord);
+    }
+  #endif
+  while (_nBytes--)
+  {
+    _uCrc = _mm_crc32_u8(_uCrc,*_pData++);
+  }
+  return _uCrc;
+}
+#endif
+
+#if defined(CHECKSUM_ARM)
+/**
+* The ARMv8 CRC32 extension, eight bytes at a time once we're
+* aligned...
+*/
+CHECKSUM_TARGET("+crc")
+static TW_UINT32 ArmCrc(TW_UINT32       _uCrc,
+                        const TW_UINT8 *_pData,
+                        UINT64          _nBytes)
+{
+  UINT64 uQuad;
+  while (_nBytes && ((size_t)_pData & 7))
+  {
+    _uCrc = __crc32cb(_uCrc,*_pData++);
+    _nBytes--;
+  }
+  for (; _nBytes >= 8; _nBytes -= 8, _pData += 8)
+  {
+    memcpy(&uQuad,_pData,sizeof(uQuad));
+    _uCrc = __crc32cd(_uCrc,uQuad);
+  }
+  while (_nBytes--)
+  {
+    _uCrc = __crc32cb(_uCrc,*_pData++);
+  }
+  return _uCrc;
+}
+#endif
+
+/**
+* The guard pattern, it only has to be unlikely...
+*/
+static TW_UINT8 GuardByte(UINT _uIndex)
+{
+  return (TW_UINT8)(0xA5 ^ (_uIndex * 0x3B));
+}
+
+/**
+* How big is a native handle?  On Linux we only know for the ones with
+* a memfd of their own...
+*/
+static TW_UINT32 HandleSize(TW_HANDLE _handle)
+{
+  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+    return (TW_UINT32)::GlobalSize(_handle);
+  #elif (TWNDSM_OS == TWNDSM_OS_MACOSX)
+    return (TW_UINT32)GetHandleSize((Handle)_handle);
+  #else
+    TW_UINT32 uLength;
+    if (g_ptwndsmpool && g_ptwndsmpool->GetSize((void*)_handle,&uLength))
+    {
+      return uLength;
+    }
+    return 0;
+  #endif
+}
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmChecksumImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmChecksumImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Find a session, or make one, call with the mutex held...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in] _bCreate make one if it's not there
+    * @return the session, or NULL
+    */
+    CHECKSUM_SESSION *Find(const TWID_T _AppId,
+                           const TWID_T _DsId,
+                           const bool   _bCreate);
+
+    /**
+    * Get the CRC of the image so far...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @return the inverted CRC
+    */
+    TW_UINT32 GetCrc(const TWID_T _AppId,
+                     const TWID_T _DsId);
+
+    /**
+    * Add to the image, and maybe finish it...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in] _DAT the transfer
+    * @param[in] _uCrc the inverted CRC with the new bytes in it
+    * @param[in] _nBytes how many new bytes
+    * @param[in] _nStrips how many new strips
+    * @param[in] _bOverrun a strip ran into the guard
+    * @param[in] _bDone the image is done
+    */
+    void Update(const TWID_T    _AppId,
+                const TWID_T    _DsId,
+                const TW_UINT16 _DAT,
+                const TW_UINT32 _uCrc,
+                const UINT64    _nBytes,
+                const TW_UINT32 _nStrips,
+                const bool      _bOverrun,
+                const bool      _bDone);
+
+    /**
+    * Forget the image we're on...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    */
+    void Drop(const TWID_T _AppId,
+              const TWID_T _DsId);
+
+    /**
+    * Check what the CPU can do...
+    * @param[in] _szEnv TWAINDSM_CHECKSUM
+    * @param[out] _pKernels TWDSM_CHECKSUM_xxx
+    * @return the best kernel we have for it
+    */
+    static CHECKSUM_CRC PickKernel(const char *_szEnv,
+                                   TW_UINT16  *_pKernels);
+
+    /**
+    * Get the CRC32C instructions kernel, if the CPU has one...
+    * @param[out] _pszName what it's called
+    * @param[out] _pKernels TWDSM_CHECKSUM_xxx
+    * @return the kernel, or NULL
+    */
+    static CHECKSUM_CRC FastKernel(const char **_pszName,
+                                   TW_UINT16   *_pKernels);
+
+    /**
+    * Hold a kernel to CHECKSUM_CHECK, and to the plain C one...
+    * @param[in] _crc the kernel
+    * @param[in] _szName what it's called
+    * @param[in] _pfile where to say how it did
+    * @return true if it matches
+    */
+    static bool CheckKernel(CHECKSUM_CRC  _crc,
+                            const char   *_szName,
+                            FILE         *_pfile);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      bool              m_bEnabled;   /**< TWAINDSM_CHECKSUM is set */
+      bool              m_bStrict;    /**< fail strips that overran */
+      CHECKSUM_CRC      m_crc;        /**< the kernel we're using */
+      TW_UINT16         m_kernels;    /**< ...and what it is */
+      MUTEX             m_mutex;      /**< guards DS_SESSION.pchecksum */
+    } pod;    /**< Pieces of data for CTwnDsmChecksumImpl*/
+};
+
+
+
+/**
+* The constructor for our class...
+*/
+CTwnDsmChecksum::CTwnDsmChecksum()
+{
+  char      szEnv[32];
+
+  m_ptwndsmchecksumimpl = new CTwnDsmChecksumImpl;
+  MUTEXINIT(m_ptwndsmchecksumimpl->pod.m_mutex);
+
+  SGETENV(szEnv,NCHARS(szEnv),kCHECKSUMENV);
+  if ((0 == szEnv[0]) || (0 == strcmp(szEnv,"0")))
+  {
+    return;
+  }
+
+  BuildTable();
+  m_ptwndsmchecksumimpl->pod.m_crc = CTwnDsmChecksumImpl::PickKernel(szEnv,&m_ptwndsmchecksumimpl->pod.m_kernels);
+  m_ptwndsmchecksumimpl->pod.m_bStrict = (0 != strstr(szEnv,"strict"));
+  m_ptwndsmchecksumimpl->pod.m_bEnabled = true;
+  kLOG((kLOGINFO,"checksums are on%s",m_ptwndsmchecksumimpl->pod.m_bStrict ? ", and strict" : ""));
+}
+
+
+
+/**
+* Hold the plain C kernel, and the CRC32C instructions if the CPU has
+* them, to the check value...
+*/
+int CTwnDsmChecksum::CheckKernels(FILE *_pfile)
+{
+  CHECKSUM_CRC crc;
+  const char  *szName;
+  TW_UINT16    kernels;
+  int          nFailed = 0;
+
+  BuildTable();
+  nFailed += CTwnDsmChecksumImpl::CheckKernel(ScalarCrc,"scalar",_pfile) ? 0 : 1;
+  crc = CTwnDsmChecksumImpl::FastKernel(&szName,&kernels);
+  if (crc)
+  {
+    nFailed += CTwnDsmChecksumImpl::CheckKernel(crc,szName,_pfile) ? 0 : 1;
+  }
+  else
+  {
+    #if defined(CHECKSUM_X86) || defined(CHECKSUM_ARM)
+      fprintf(_pfile,"crc32c instructions skipped, the CPU doesn't have them\n");
+    #else
+      fprintf(_pfile,"no crc32c instructions in this build\n");
+    #endif
+  }
+
+  return nFailed;
+}
+
+
+
+/**
+* The destructor for our class...
+*/
+CTwnDsmChecksum::~CTwnDsmChecksum()
+{
+  if (m_ptwndsmchecksumimpl)
+  {
+    MUTEXDESTROY(m_ptwndsmchecksumimpl->pod.m_mutex);
+    delete m_ptwndsmchecksumimpl;
+    m_ptwndsmchecksumimpl = 0;
+  }
+}
+
+
+
+/**
+* TWAINDSM_CHECKSUM is set...
+*/
+bool CTwnDsmChecksum::IsEnabled()
+{
+  return m_ptwndsmchecksumimpl->pod.m_bEnabled;
+}
+
+
+
+/**
+* Hand out what we have for the last image...
+*/
+TW_UINT16 CTwnDsmChecksum::Checksum(const TWID_T       _AppId,
+                                    const TW_UINT16    _MSG,
+                                    TW_TWDSM_CHECKSUM *_pChecksum)
+{
+  CHECKSUM_SESSION *psession;
+  TW_UINT32         DsId = _pChecksum->DsId;
+  TW_UINT16         ccResult = TWCC_SUCCESS;
+
+  if (!m_ptwndsmchecksumimpl->pod.m_bEnabled)
+  {
+    kLOG((kLOGERR,"%s isn't set...",kCHECKSUMENV));
+    return TWCC_BADPROTOCOL;
+  }
+  if (MSG_GET != _MSG)
+  {
+    return TWCC_BADPROTOCOL;
+  }
+
+  MUTEXLOCK(m_ptwndsmchecksumimpl->pod.m_mutex);
+  psession = m_ptwndsmchecksumimpl->Find(_AppId,(TWID_T)DsId,false);
+  if ((0 == psession) || !psession->bHaveLast)
+  {
+    ccResult = TWCC_SEQERROR;
+  }
+  else
+  {
+    *_pChecksum = psession->last;
+    _pChecksum->DsId      = DsId;
+    _pChecksum->Transfers = psession->nTransfers;
+    _pChecksum->Overruns  = psession->nOverruns;
+  }
+  MUTEXUNLOCK(m_ptwndsmchecksumimpl->pod.m_mutex);
+
+  return ccResult;
+}
+
+
+
+/**
+* Take the guard bytes off the end of the buffer, as long as what's
+* left is still as big as the driver said it had to be...
+*/
+TW_UINT32 CTwnDsmChecksum::Before(const TWID_T     _AppId,
+                                  const TWID_T     _DsId,
+                                  TW_IMAGEMEMXFER *_pMemXfer)
+{
+  CHECKSUM_SESSION *psession;
+  TW_UINT32         nLength = _pMemXfer->Memory.Length;
+  TW_UINT32         nMinBufSize = 0;
+  TW_UINT8         *pMem;
+  UINT              ii;
+
+  MUTEXLOCK(m_ptwndsmchecksumimpl->pod.m_mutex);
+  psession = m_ptwndsmchecksumimpl->Find(_AppId,_DsId,false);
+  if (psession)
+  {
+    nMinBufSize = psession->MinBufSize;
+  }
+  MUTEXUNLOCK(m_ptwndsmchecksumimpl->pod.m_mutex);
+
+  if (   (0 == _pMemXfer->Memory.TheMem)
+      || (_pMemXfer->Memory.Flags & TWMF_DSOWNS)
+      || (nLength <= TWDSM_CHECKSUM_GUARD)
+      || ((nLength - TWDSM_CHECKSUM_GUARD) < nMinBufSize))
+  {
+    return nLength;
+  }
+
+  if (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+  {
+    pMem = (TW_UINT8*)DSM_MemLock((TW_HANDLE)_pMemXfer->Memory.TheMem);
+  }
+  else
+  {
+    pMem = (TW_UINT8*)_pMemXfer->Memory.TheMem;
+  }
+  if (0 == pMem)
+  {
+    return nLength;
+  }
+  pMem += nLength - TWDSM_CHECKSUM_GUARD;
+  for (ii = 0; ii < TWDSM_CHECKSUM_GUARD; ii++)
+  {
+    pMem[ii] = GuardByte(ii);
+  }
+  if (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+  {
+    DSM_MemUnlock((TW_HANDLE)_pMemXfer->Memory.TheMem);
+  }
+
+  _pMemXfer->Memory.Length = nLength - TWDSM_CHECKSUM_GUARD;
+  return nLength;
+}
+
+
+
+/**
+* Put the guard bytes back, see if the driver wrote on them, and add
+* the strip to the CRC...
+*/
+TW_UINT16 CTwnDsmChecksum::After(const TWID_T     _AppId,
+                                 const TWID_T     _DsId,
+                                 const TW_UINT16  _DAT,
+                                 TW_IMAGEMEMXFER *_pMemXfer,
+                                 const TW_UINT32  _Length,
+                                 const TW_INT16   _rc)
+{
+  TW_UINT8  *pMem;
+  TW_UINT32  nGiven = _pMemXfer->Memory.Length;
+  TW_UINT32  uCrc = 0;
+  TW_UINT32  nBytes = 0;
+  bool       bData = (TWRC_SUCCESS == _rc) || (TWRC_XFERDONE == _rc);
+  bool       bOverrun = false;
+  UINT       ii;
+
+  _pMemXfer->Memory.Length = _Length;
+  if (0 == _pMemXfer->Memory.TheMem)
+  {
+    if (!bData)
+    {
+      m_ptwndsmchecksumimpl->Drop(_AppId,_DsId);
+    }
+    return TWCC_SUCCESS;
+  }
+
+  if (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+  {
+    pMem = (TW_UINT8*)DSM_MemLock((TW_HANDLE)_pMemXfer->Memory.TheMem);
+  }
+  else
+  {
+    pMem = (TW_UINT8*)_pMemXfer->Memory.TheMem;
+  }
+  if (0 == pMem)
+  {
+    return TWCC_SUCCESS;
+  }
+
+  // The guard goes first, a driver can overrun and then fail...
+  if (nGiven != _Length)
+  {
+    for (ii = 0; ii < TWDSM_CHECKSUM_GUARD; ii++)
+    {
+      if (pMem[nGiven + ii] != GuardByte(ii))
+      {
+        bOverrun = true;
+        break;
+      }
+    }
+  }
+  if (bData)
+  {
+    nBytes = _pMemXfer->BytesWritten;
+    if (nBytes > nGiven)
+    {
+      bOverrun = true;
+      nBytes = (nBytes > _Length) ? _Length : nBytes;
+    }
+    uCrc = m_ptwndsmchecksumimpl->GetCrc(_AppId,_DsId);
+    uCrc = m_ptwndsmchecksumimpl->pod.m_crc(uCrc,pMem,nBytes);
+  }
+
+  if (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+  {
+    DSM_MemUnlock((TW_HANDLE)_pMemXfer->Memory.TheMem);
+  }
+
+  if (bOverrun)
+  {
+    kLOG((kLOGERR,"driver %d wrote past the %u bytes it was given (%u written, %ux%u at %u,%u)...",
+          (int)_DsId,(unsigned int)nGiven,(unsigned int)_pMemXfer->BytesWritten,
+          (unsigned int)_pMemXfer->Columns,(unsigned int)_pMemXfer->Rows,
+          (unsigned int)_pMemXfer->XOffset,(unsigned int)_pMemXfer->YOffset));
+  }
+  if (bData)
+  {
+    m_ptwndsmchecksumimpl->Update(_AppId,_DsId,_DAT,uCrc,nBytes,1,bOverrun,(TWRC_XFERDONE == _rc));
+  }
+  else
+  {
+    m_ptwndsmchecksumimpl->Update(_AppId,_DsId,_DAT,0,0,0,bOverrun,false);
+    m_ptwndsmchecksumimpl->Drop(_AppId,_DsId);
+  }
+
+  return (bOverrun && m_ptwndsmchecksumimpl->pod.m_bStrict) ? (TW_UINT16)TWCC_OPERATIONERROR : (TW_UINT16)TWCC_SUCCESS;
+}
+
+
+
+/**
+* Remember the buffer size and file name, and do the native and file
+* transfers...
+*/
+void CTwnDsmChecksum::Returned(const TWID_T    _AppId,
+                               const TWID_T    _DsId,
+                               const TW_UINT32 _DG,
+                               const TW_UINT16 _DAT,
+                               TW_MEMREF       _pData,
+                               const TW_INT16  _rc)
+{
+  CHECKSUM_SESSION *psession;
+  TW_HANDLE         hImage;
+  TW_UINT8         *pMem;
+  TW_UINT8         *pChunk;
+  FILE             *pfile = 0;
+  TW_STR255         szFile;
+  TW_UINT32         uCrc;
+  UINT64            nBytes = 0;
+  size_t            nRead;
+
+  // Things we need to know later...
+  if ((DG_CONTROL == _DG) && (TWRC_SUCCESS == _rc))
+  {
+    if (((DAT_SETUPMEMXFER != _DAT) && (DAT_SETUPFILEXFER != _DAT)) || (0 == _pData))
+    {
+      return;
+    }
+    MUTEXLOCK(m_ptwndsmchecksumimpl->pod.m_mutex);
+    psession = m_ptwndsmchecksumimpl->Find(_AppId,_DsId,true);
+    if (psession && (DAT_SETUPMEMXFER == _DAT))
+    {
+      psession->MinBufSize = ((TW_SETUPMEMXFER*)_pData)->MinBufSize;
+    }
+    else if (psession)
+    {
+      SSTRCPY(psession->FileName,sizeof(psession->FileName),((TW_SETUPFILEXFER*)_pData)->FileName);
+    }
+    MUTEXUNLOCK(m_ptwndsmchecksumimpl->pod.m_mutex);
+    return;
+  }
+
+  // Only whole images from here on...
+  if (   (DG_IMAGE != _DG)
+      || ((DAT_IMAGENATIVEXFER != _DAT) && (DAT_IMAGEFILEXFER != _DAT)))
+  {
+    return;
+  }
+  if (TWRC_XFERDONE != _rc)
+  {
+    m_ptwndsmchecksumimpl->Drop(_AppId,_DsId);
+    return;
+  }
+
+  uCrc = 0xFFFFFFFF;
+  if (DAT_IMAGENATIVEXFER == _DAT)
+  {
+    hImage = _pData ? *(TW_HANDLE*)_pData : 0;
+    nBytes = hImage ? HandleSize(hImage) : 0;
+    if (0 == nBytes)
+    {
+      kLOG((kLOGINFO,"can't get the size of the native image from driver %d...",(int)_DsId));
+      return;
+    }
+    pMem = (TW_UINT8*)DSM_MemLock(hImage);
+    if (0 == pMem)
+    {
+      return;
+    }
+    uCrc = m_ptwndsmchecksumimpl->pod.m_crc(uCrc,pMem,nBytes);
+    DSM_MemUnlock(hImage);
+  }
+  else
+  {
+    MUTEXLOCK(m_ptwndsmchecksumimpl->pod.m_mutex);
+    psession = m_ptwndsmchecksumimpl->Find(_AppId,_DsId,false);
+    szFile[0] = 0;
+    if (psession)
+    {
+      SSTRCPY(szFile,sizeof(szFile),psession->FileName);
+    }
+    MUTEXUNLOCK(m_ptwndsmchecksumimpl->pod.m_mutex);
+    if (0 != szFile[0])
+    {
+      FOPEN(pfile,szFile,"rb");
+    }
+    if (0 == pfile)
+    {
+      kLOG((kLOGINFO,"can't read the file from driver %d...%s",(int)_DsId,szFile));
+      return;
+    }
+    pChunk = (TW_UINT8*)malloc(CHECKSUM_FILECHUNK);
+    if (0 == pChunk)
+    {
+      kLOG((kLOGERR,"unable to allocate a file buffer..."));
+      fclose(pfile);
+      return;
+    }
+    while ((nRead = fread(pChunk,1,CHECKSUM_FILECHUNK,pfile)) > 0)
+    {
+      uCrc = m_ptwndsmchecksumimpl->pod.m_crc(uCrc,pChunk,nRead);
+      nBytes += nRead;
+    }
+    free(pChunk);
+    fclose(pfile);
+  }
+
+  m_ptwndsmchecksumimpl->Drop(_AppId,_DsId);
+  m_ptwndsmchecksumimpl->Update(_AppId,_DsId,_DAT,uCrc,nBytes,0,false,true);
+}
+
+
+
+/**
+* Forget the driver...
+*/
+void CTwnDsmChecksum::Stop(const TWID_T _AppId,
+                           const TWID_T _DsId)
+{
+  DS_SESSION       *pdssession;
+  CHECKSUM_SESSION *psession;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return;
+  }
+
+  MUTEXLOCK(m_ptwndsmchecksumimpl->pod.m_mutex);
+  psession = pdssession->pchecksum;
+  pdssession->pchecksum = 0;
+  MUTEXUNLOCK(m_ptwndsmchecksumimpl->pod.m_mutex);
+
+  free(psession);
+}
+
+
+
+/**
+* It's on the DS_SESSION, once the driver has told us something...
+*/
+CHECKSUM_SESSION *CTwnDsmChecksumImpl::Find(const TWID_T _AppId,
+                                            const TWID_T _DsId,
+                                            const bool   _bCreate)
+{
+  DS_SESSION       *pdssession;
+  CHECKSUM_SESSION *psession;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return 0;
+  }
+  psession = pdssession->pchecksum;
+  if (psession || !_bCreate)
+  {
+    return psession;
+  }
+  psession = (CHECKSUM_SESSION*)calloc(1,sizeof(CHECKSUM_SESSION));
+  if (0 == psession)
+  {
+    kLOG((kLOGERR,"calloc failed for a checksum session..."));
+    return 0;
+  }
+  psession->uCrc = 0xFFFFFFFF;
+  pdssession->pchecksum = psession;
+  return psession;
+}
+
+
+
+/**
+* A new image starts with all the bits set...
+*/
+TW_UINT32 CTwnDsmChecksumImpl::GetCrc(const TWID_T _AppId,
+                                      const TWID_T _DsId)
+{
+  CHECKSUM_SESSION *psession;
+  TW_UINT32         uCrc = 0xFFFFFFFF;
+
+  MUTEXLOCK(pod.m_mutex);
+  psession = Find(_AppId,_DsId,false);
+  if (psession)
+  {
+    uCrc = psession->uCrc;
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+  return uCrc;
+}
+
+
+
+/**
+* Keep the CRC, and when the image is done, keep it for MSG_GET and
+* start the next one...
+*/
+void CTwnDsmChecksumImpl::Update(const TWID_T    _AppId,
+                                 const TWID_T    _DsId,
+                                 const TW_UINT16 _DAT,
+                                 const TW_UINT32 _uCrc,
+                                 const UINT64    _nBytes,
+                                 const TW_UINT32 _nStrips,
+                                 const bool      _bOverrun,
+                                 const bool      _bDone)
+{
+  CHECKSUM_SESSION *psession;
+
+  MUTEXLOCK(pod.m_mutex);
+  psession = Find(_AppId,_DsId,true);
+  if (0 == psession)
+  {
+    MUTEXUNLOCK(pod.m_mutex);
+    return;
+  }
+  if (_bOverrun)
+  {
+    psession->nOverruns += 1;
+  }
+  if (_nBytes || _nStrips || _bDone)
+  {
+    psession->uCrc     = _uCrc;
+    psession->nBytes  += _nBytes;
+    psession->nStrips += _nStrips;
+  }
+  if (_bDone)
+  {
+    psession->nTransfers += 1;
+    psession->last.Crc32c  = ~psession->uCrc;
+    psession->last.Bytes   = (psession->nBytes > 0xFFFFFFFF) ? 0xFFFFFFFF : (TW_UINT32)psession->nBytes;
+    psession->last.Strips  = psession->nStrips;
+    psession->last.Dat     = _DAT;
+    psession->last.Kernels = pod.m_kernels;
+    psession->bHaveLast    = true;
+    psession->uCrc    = 0xFFFFFFFF;
+    psession->nBytes  = 0;
+    psession->nStrips = 0;
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+}
+
+
+
+/**
+* The image is gone...
+*/
+void CTwnDsmChecksumImpl::Drop(const TWID_T _AppId,
+                               const TWID_T _DsId)
+{
+  CHECKSUM_SESSION *psession;
+
+  MUTEXLOCK(pod.m_mutex);
+  psession = Find(_AppId,_DsId,false);
+  if (psession)
+  {
+    psession->uCrc    = 0xFFFFFFFF;
+    psession->nBytes  = 0;
+    psession->nStrips = 0;
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+}
+
+
+
+/**
+* SSE4.2 has been around since 2008, and the CRC32 extension is there
+* on every ARMv8.1, but we still ask...
+*/
+CHECKSUM_CRC CTwnDsmChecksumImpl::PickKernel(const char *_szEnv,
+                                             TW_UINT16  *_pKernels)
+{
+  CHECKSUM_CRC crc = 0;
+  const char  *szName = "scalar";
+
+  if (0 == strstr(_szEnv,"scalar"))
+  {
+    crc = FastKernel(&szName,_pKernels);
+  }
+  if (0 == crc)
+  {
+    crc = ScalarCrc;
+    szName = "scalar";
+    *_pKernels = TWDSM_CHECKSUM_SCALAR;
+  }
+
+  kLOG((kLOGINFO,"checksums are using the %s kernel",szName));
+  return crc;
+}
+
+
+
+/**
+* Ask the CPU...
+*/
+CHECKSUM_CRC CTwnDsmChecksumImpl::FastKernel(const char **_pszName,
+                                             TW_UINT16   *_pKernels)
+{
+  #if defined(CHECKSUM_X86)
+    bool bSse42;
+    #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+      int aiInfo[4];
+      __cpuid(aiInfo,1);
+      bSse42 = (0 != (aiInfo[2] & (1 << 20)));
+    #else
+      __builtin_cpu_init();
+      bSse42 = (0 != __builtin_cpu_supports("sse4.2"));
+    #endif
+    if (bSse42)
+    {
+      *_pszName = "sse4.2";
+      *_pKernels = TWDSM_CHECKSUM_SSE42;
+      return Sse42Crc;
+    }
+  #elif defined(CHECKSUM_ARM)
+    #if (TWNDSM_CMP == TWNDSM_CMP_GNUGPP) && (TWNDSM_OS == TWNDSM_OS_LINUX)
+      if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    #endif
+    {
+      *_pszName = "armv8 crc";
+      *_pKernels = TWDSM_CHECKSUM_ARMV8;
+      return ArmCrc;
+    }
+  #else
+    (void)_pszName;
+    (void)_pKernels;
+  #endif
+  return 0;
+}
+
+
+
+/**
+* The check value first, then every length up to CHECKSUM_CHECKCOUNT
+* at every misalignment up to 7, so the kernels that go a word at a
+* time get their odd ends on both sides tried...
+*/
+bool CTwnDsmChecksumImpl::CheckKernel(CHECKSUM_CRC  _crc,
+                                      const char   *_szName,
+                                      FILE         *_pfile)
+{
+  static const char szCheck[] = "123456789";
+  TW_UINT8          abData[CHECKSUM_CHECKCOUNT + 8];
+  TW_UINT32         uCrc;
+  TW_UINT32         uRef;
+  UINT              uSeed = 1;
+  UINT              nn;
+  UINT              oo;
+
+  uCrc = _crc(0xFFFFFFFF,(const TW_UINT8*)szCheck,sizeof(szCheck) - 1) ^ 0xFFFFFFFF;
+  if (CHECKSUM_CHECK != uCrc)
+  {
+    fprintf(_pfile,"%s gets 0x%08X for \"%s\", not 0x%08X\n",_szName,uCrc,szCheck,CHECKSUM_CHECK);
+    return false;
+  }
+
+  // The same noise every time, so a failure can be chased...
+  for (nn = 0; nn < sizeof(abData); nn++)
+  {
+    uSeed = (uSeed * 1103515245) + 12345;
+    abData[nn] = (TW_UINT8)(uSeed >> 16);
+  }
+  for (nn = 0; nn <= CHECKSUM_CHECKCOUNT; nn++)
+  {
+    for (oo = 0; oo < 8; oo++)
+    {
+      uRef = ScalarCrc(0xFFFFFFFF,abData + oo,nn);
+      uCrc = _crc(0xFFFFFFFF,abData + oo,nn);
+      if (uRef != uCrc)
+      {
+        fprintf(_pfile,"%s doesn't match scalar for %u bytes at offset %u\n",_szName,nn,oo);
+        return false;
+      }
+    }
+  }
+
+  fprintf(_pfile,"%s gets 0x%08X\n",_szName,CHECKSUM_CHECK);
+  return true;
+}
@@ -0,0 +1,1389 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+
+/**
+* @file convert.cpp
+* Pixel conversion.
+* Turn the strips from DAT_IMAGEMEMXFER into the pixel format the
+* application asked for with DAT_TWDSM_CONVERT.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+/**
+* Which SIMD kernels we can build.  We build all of them for the CPU
+* family, and decide which to use when we start, since the machine
+* running us may not be the one that built us...
+*/
+#if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP) && (defined(_M_X64) || defined(_M_IX86))
+  #define CONVERT_X86
+  #define CONVERT_TARGET(t)
+  #include <intrin.h>
+  #include <immintrin.h>
+#elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP) && (defined(__x86_64__) || defined(__i386__))
+  #define CONVERT_X86
+  #define CONVERT_TARGET(t) __attribute__((target(t)))
+  #include <immintrin.h>
+#elif (defined(__aarch64__) || defined(_M_ARM64)) && defined(TWNDSM_CONVERT_NEON)
+  // NEON stays out unless it's asked for (cmake -DTWAINDSM_NEON=ON),
+  // until the kernels have been built on aarch64 and pass
+  // twaindsm-convertcheck...
+  #define CONVERT_NEON
+  #include <arm_neon.h>
+#endif
+
+
+
+/**
+* Enviroment varible to hold us to the plain C kernels (scalar), or
+* to no better than SSSE3 (ssse3)...
+* @see CTwnDsmConvert
+*/
+#define kCONVERTENV "TWAINDSM_CONVERT"
+
+/**
+* CheckKernels tries every count up to this many samples or pixels,
+* which is a few vectors for every kernel, plus the odd ends...
+* @see CTwnDsmConvert
+*/
+#define CONVERT_CHECKCOUNT 200
+
+
+
+/**
+* 8 or 16 bit samples to 8 bit samples, inverting with uXor...
+*/
+typedef void (*CONVERT_SAMPLES)(const TW_UINT8 *_pSrc,
+                                TW_UINT8       *_pDst,
+                                UINT            _nSamples,
+                                TW_UINT8        _uXor);
+
+/**
+* 8 bit samples from one layout to another...
+*/
+typedef void (*CONVERT_PIXELS)(const TW_UINT8 *_pSrc,
+                               TW_UINT8       *_pDst,
+                               UINT            _nPixels);
+
+/**
+* One set of kernels.  The SIMD sets borrow from each other, and from
+* the plain C set, for what they don't do better...
+*/
+typedef struct
+{
+  TW_UINT16        Kernels;     /**< TWDSM_KERNELS_xxx */
+  const char      *szName;      /**< for the log */
+  CONVERT_SAMPLES  Copy8;       /**< 8 bit samples, maybe inverted */
+  CONVERT_SAMPLES  Narrow16;    /**< 16 bit samples to 8 */
+  CONVERT_SAMPLES  UnpackMsb;   /**< bilevel, first pixel in bit 7, to 0/255 */
+  CONVERT_SAMPLES  UnpackLsb;   /**< bilevel, first pixel in bit 0, to 0/255 */
+  CONVERT_PIXELS   GrayToRgb;   /**< Y to YYY */
+  CONVERT_PIXELS   GrayToRgba;  /**< Y to YYY255 */
+  CONVERT_PIXELS   SwapRgb;     /**< BGR to RGB */
+  CONVERT_PIXELS   RgbToRgba;   /**< RGB to RGB255 */
+  CONVERT_PIXELS   BgrToRgba;   /**< BGR to RGB255 */
+} CONVERT_KERNELS;
+
+/**
+* What an application asked for, and what we know about the image,
+* hung on the DS_SESSION...
+*/
+typedef struct CONVERT_SESSION_
+{
+  TW_UINT16  Format;         /**< TWDSM_FORMAT_xxx */
+  TW_UINT16  Flags;          /**< TWDSM_CONVERT_xxx */
+  bool       bActive;        /**< DAT_IMAGEINFO said we can do it */
+  TW_INT32   ImageWidth;     /**< from DAT_IMAGEINFO */
+  UINT       nSrcChannels;   /**< 1 or 3 */
+  UINT       nSrcBits;       /**< bits per sample, 1, 8 or 16 */
+  UINT       nDstChannels;   /**< 1, 3 or 4 */
+} CONVERT_SESSION;
+
+
+
+/**
+* The plain C kernels, these are the reference for the others...
+*/
+static void ScalarCopy8(const TW_UINT8 *_pSrc,
+                        TW_UINT8       *_pDst,
+                        UINT            _nSamples,
+                        TW_UINT8        _uXor)
+{
+  UINT ii;
+  if (0 == _uXor)
+  {
+    memcpy(_pDst,_pSrc,_nSamples);
+    return;
+  }
+  for (ii = 0; ii < _nSamples; ii++)
+  {
+    _pDst[ii] = (TW_UINT8)(_pSrc[ii] ^ _uXor);
+  }
+}
+
+static void ScalarNarrow16(const TW_UINT8 *_pSrc,
+                           TW_UINT8       *_pDst,
+                           UINT            _nSamples,
+                           TW_UINT8        _uXor)
+{
+  UINT      ii;
+  TW_UINT16 uSample;
+  for (ii = 0; ii < _nSamples; ii++)
+  {
+    memcpy(&uSample,_pSrc + (ii * 2),sizeof(uSample));
+    _pDst[ii] = (TW_UINT8)((uSample >> 8) ^ _uXor);
+  }
+}
+
+static void ScalarUnpackMsb(const TW_UINT8 *_pSrc,
+                            TW_UINT8       *_pDst,
+                            UINT            _nSamples,
+                            TW_UINT8        _uXor)
+{
+  UINT ii;
+  for (ii = 0; ii < _nSamples; ii++)
+  {
+    _pDst[ii] = (TW_UINT8)((((_pSrc[ii >> 3] >> (7 - (ii & 7))) & 1) ? 0xFF : 0x00) ^ _uXor);
+  }
+}
+
+static void ScalarUnpackLsb(const TW_UINT8 *_pSrc,
+                            TW_UINT8       *_pDst,
+                            UINT            _nSamples,
+                            TW_UINT8        _uXor)
+{
+  UINT ii;
+  for (ii = 0; ii < _nSamples; ii++)
+  {
+    _pDst[ii] = (TW_UINT8)((((_pSrc[ii >> 3] >> (ii & 7)) & 1) ? 0xFF : 0x00) ^ _uXor);
+  }
+}
+
+static void ScalarGrayToRgb(const TW_UINT8 *_pSrc,
+                            TW_UINT8       *_pDst,
+                            UINT            _nPixels)
+{
+  UINT ii;
+  for (ii = 0; ii < _nPixels; ii++)
+  {
+    _pDst[(ii * 3) + 0] = _pSrc[ii];
+    _pDst[(ii * 3) + 1] = _pSrc[ii];
+    _pDst[(ii * 3) + 2] = _pSrc[ii];
+  }
+}
+
+static void ScalarGrayToRgba(const TW_UINT8 *_pSrc,
+                             TW_UINT8       *_pDst,
+                             UINT            _nPixels)
+{
+  UINT ii;
+  for (ii = 0; ii < _nPixels; ii++)
+  {
+    _pDst[(ii * 4) + 0] = _pSrc[ii];
+    _pDst[(ii * 4) + 1] = _pSrc[ii];
+    _pDst[(ii * 4) + 2] = _pSrc[ii];
+    _pDst[(ii * 4) + 3] = 0xFF;
+  }
+}
+
+static void ScalarSwapRgb(const TW_UINT8 *_pSrc,
+                          TW_UINT8       *_pDst,
+                          UINT            _nPixels)
+{
+  UINT ii;
+  for (ii = 0; ii < _nPixels; ii++)
+  {
+    _pDst[(ii * 3) + 0] = _pSrc[(ii * 3) + 2];
+    _pDst[(ii * 3) + 1] = _pSrc[(ii * 3) + 1];
+    _pDst[(ii * 3) + 2] = _pSrc[(ii * 3) + 0];
+  }
+}
+
+static void ScalarRgbToRgba(const TW_UINT8 *_pSrc,
+                            TW_UINT8       *_pDst,
+                            UINT            _nPixels)
+{
+  UINT ii;
+  for (ii = 0; ii < _nPixels; ii++)
+  {
+    _pDst[(ii * 4) + 0] = _pSrc[(ii * 3) + 0];
+    _pDst[(ii * 4) + 1] = _pSrc[(ii * 3) + 1];
+    _pDst[(ii * 4) + 2] = _pSrc[(ii * 3) + 2];
+    _pDst[(ii * 4) + 3] = 0xFF;
+  }
+}
+
+static void ScalarBgrToRgba(const TW_UINT8 *_pSrc,
+                            TW_UINT8       *_pDst,
+                            UINT            _nPixels)
+{
+  UINT ii;
+  for (ii = 0; ii < _nPixels; ii++)
+  {
+    _pDst[(ii * 4) + 0] = _pSrc[(ii * 3) + 2];
+    _pDst[(ii * 4) + 1] = _pSrc[(ii * 3) + 1];
+    _pDst[(ii * 4) + 2] = _pSrc[(ii * 3) + 0];
+    _pDst[(ii * 4) + 3] = 0xFF;
+  }
+}
+
+static const CONVERT_KERNELS s_kernelsScalar =
+{
+  TWDSM_KERNELS_SCALAR, "scalar",
+  ScalarCopy8, ScalarNarrow16, ScalarUnpackMsb, ScalarUnpackLsb,
+  ScalarGrayToRgb, ScalarGrayToRgba, ScalarSwapRgb, ScalarRgbToRgba, ScalarBgrToRgba
+};
+
+
+
+#if defined(CONVERT_X86)
+/**
+* SSSE3, we need it for pshufb, which does all of the byte shuffling.
+* Each kernel does what it can 16 bytes at a time, and leaves the rest
+* to the plain C one...
+*/
+CONVERT_TARGET("ssse3")
+static void Ssse3Copy8(const TW_UINT8 *_pSrc,
+                       TW_UINT8       *_pDst,
+                       UINT            _nSamples,
+                       TW_UINT8        _uXor)
+{
+  UINT    ii;
+  __m128i xXor = _mm_set1_epi8((char)_uXor);
+  for (ii = 0; (ii + 16) <= _nSamples; ii += 16)
+  {
+    _mm_storeu_si128((__m128i*)(_pDst + ii),_mm_xor_si128(_mm_loadu_si128((const __m128i*)(_pSrc + ii)),xXor));
+  }
+  ScalarCopy8(_pSrc + ii,_pDst + ii,_nSamples - ii,_uXor);
+}
+
+CONVERT_TARGET("ssse3")
+static void Ssse3Narrow16(const TW_UINT8 *_pSrc,
+                          TW_UINT8       *_pDst,
+                          UINT            _nSamples,
+                          TW_UINT8        _uXor)
+{
+  UINT    ii;
+  __m128i xXor = _mm_set1_epi8((char)_uXor);
+  __m128i xLo;
+  __m128i xHi;
+  for (ii = 0; (ii + 16) <= _nSamples; ii += 16)
+  {
+    xLo = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(_pSrc + (ii * 2))),8);
+    xHi = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(_pSrc + (ii * 2) + 16)),8);
+    _mm_storeu_si128((__m128i*)(_pDst + ii),_mm_xor_si128(_mm_packus_epi16(xLo,xHi),xXor));
+  }
+  ScalarNarrow16(_pSrc + (ii * 2),_pDst + ii,_nSamples - ii,_uXor);
+}
+
+CONVERT_TARGET("ssse3")
+static void Ssse3Unpack(const TW_UINT8 *_pSrc,
+                        TW_UINT8       *_pDst,
+                        UINT            _nSamples,
+                        TW_UINT8        _uXor,
+                        bool            _bLsb)
+{
+  UINT      ii;
+  TW_UINT16 uBits;
+  __m128i   xXor = _mm_set1_epi8((char)_uXor);
+  __m128i   xSpread = _mm_setr_epi8(0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1);
+  __m128i   xMask = _bLsb ? _mm_set1_epi64x((long long)0x8040201008040201LL)
+                          : _mm_set1_epi64x((long long)0x0102040810204080LL);
+  __m128i   xBits;
+  for (ii = 0; (ii + 16) <= _nSamples; ii += 16)
+  {
+    memcpy(&uBits,_pSrc + (ii / 8),sizeof(uBits));
+    xBits = _mm_shuffle_epi8(_mm_set1_epi16((short)uBits),xSpread);
+    xBits = _mm_cmpeq_epi8(_mm_and_si128(xBits,xMask),xMask);
+    _mm_storeu_si128((__m128i*)(_pDst + ii),_mm_xor_si128(xBits,xXor));
+  }
+  if (_bLsb)
+  {
+    ScalarUnpackLsb(_pSrc + (ii / 8),_pDst + ii,_nSamples - ii,_uXor);
+  }
+  else
+  {
+    ScalarUnpackMsb(_pSrc + (ii / 8),_pDst + ii,_nSamples - ii,_uXor);
+  }
+}
+
+CONVERT_TARGET("ssse3")
+static void Ssse3UnpackMsb(const TW_UINT8 *_pSrc,
+                           TW_UINT8       *_pDst,
+                           UINT            _nSamples,
+                           TW_UINT8        _uXor)
+{
+  Ssse3Unpack(_pSrc,_pDst,_nSamples,_uXor,false);
+}
+
+CONVERT_TARGET("ssse3")
+static void Ssse3UnpackLsb(const TW_UINT8 *_pSrc,
+                           TW_UINT8       *_pDst,
+                           UINT            _nSamples,
+                           TW_UINT8        _uXor)
+{
+  Ssse3Unpack(_pSrc,_pDst,_nSamples,_uXor,true);
+}
+
+CONVERT_TARGET("ssse3")
+static void Ssse3GrayToRgb(const TW_UINT8 *_pSrc,
+                           TW_UINT8       *_pDst,
+                           UINT            _nPixels)
+{
+  UINT    ii;
+  __m128i xGray;
+  __m128i xShuffle0 = _mm_setr_epi8(0,0,0,1,1,1,2,2,2,3,3,3,4,4,4,5);
+  __m128i xShuffle1 = _mm_setr_epi8(5,5,6,6,6,7,7,7,8,8,8,9,9,9,10,10);
+  __m128i xShuffle2 = _mm_setr_epi8(10,11,11,11,12,12,12,13,13,13,14,14,14,15,15,15);
+  for (ii = 0; (ii + 16) <= _nPixels; ii += 16)
+  {
+    xGray = _mm_loadu_si128((const __m128i*)(_pSrc + ii));
+    _mm_storeu_si128((__m128i*)(_pDst + (ii * 3)),_mm_shuffle_epi8(xGray,xShuffle0));
+    _mm_storeu_si128((__m128i*)(_pDst + (ii * 3) + 16),_mm_shuffle_epi8(xGray,xShuffle1));
+    _mm_storeu_si128((__m128i*)(_pDst + (ii * 3) + 32),_mm_shuffle_epi8(xGray,xShuffle2));
+  }
+  ScalarGrayToRgb(_pSrc + ii,_pDst + (ii * 3),_nPixels - ii);
+}
+
+CONVERT_TARGET("ssse3")
+static void Ssse3GrayToRgba(const TW_UINT8 *_pSrc,
+                            TW_UINT8       *_pDst,
+                            UINT            _nPixels)
+{
+  UINT    ii;
+  __m128i xGray;
+  __m128i xAlpha = _mm_set1_epi32((int)0xFF000000);
+  __m128i xShuffle0 = _mm_setr_epi8(0,0,0,-1,1,1,1,-1,2,2,2,-1,3,3,3,-1);
+  __m128i xShuffle1 = _mm_setr_epi8(4,4,4,-1,5,5,5,-1,6,6,6,-1,7,7,7,-1);
+  __m128i xShuffle2 = _mm_setr_epi8(8,8,8,-1,9,9,9,-1,10,10,10,-1,11,11,11,-1);
+  __m128i xShuffle3 = _mm_setr_epi8(12,12,12,-1,13,13,13,-1,14,14,14,-1,15,15,15,-1);
+  for (ii = 0; (ii + 16) <= _nPixels; ii += 16)
+  {
+    xGray = _mm_loadu_si128((const __m128i*)(_pSrc + ii));
+    _mm_storeu_si128((__m128i*)(_pDst + (ii * 4)),_mm_or_si128(_mm_shuffle_epi8(xGray,xShuffle0),xAlpha));
+    _mm_storeu_si128((__m128i*)(_pDst + (ii * 4) + 16),_mm_or_si128(_mm_shuffle_epi8(xGray,xShuffle1),xAlpha));
+    _mm_storeu_si128((__m128i*)(_pDst + (ii * 4) + 32),_mm_or_si128(_mm_shuffle_epi8(xGray,xShuffle2),xAlpha));
+    _mm_storeu_si128((__m128i*)(_pDst + (ii * 4) + 48),_mm_or_si128(_mm_shuffle_epi8(xGray,xShuffle3),xAlpha));
+  }
+  ScalarGrayToRgba(_pSrc + ii,_pDst + (ii * 4),_nPixels - ii);
+}
+
+/*
+* Five pixels at a time, since three doesn't go into sixteen.  The
+* sixteenth byte we store is junk, but it's the first byte of the next
+* five, so it gets fixed on the next pass...
+*/
+CONVERT_TARGET("ssse3")
+static void Ssse3SwapRgb(const TW_UINT8 *_pSrc,
+                         TW_UINT8       *_pDst,
+                         UINT            _nPixels)
+{
+  UINT    ii;
+  __m128i xShuffle = _mm_setr_epi8(2,1,0,5,4,3,8,7,6,11,10,9,14,13,12,15);
+  for (ii = 0; (ii + 6) <= _nPixels; ii += 5)
+  {
+    _mm_storeu_si128((__m128i*)(_pDst + (ii * 3)),_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(_pSrc + (ii * 3))),xShuffle));
+  }
+  ScalarSwapRgb(_pSrc + (ii * 3),_pDst + (ii * 3),_nPixels - ii);
+}
+
+CONVERT_TARGET("ssse3")
+static void Ssse3ToRgba(const TW_UINT8 *_pSrc,
+                        TW_UINT8       *_pDst,
+                        UINT            _nPixels,
+                        bool            _bSwap)
+{
+  UINT    ii;
+  __m128i xAlpha = _mm_set1_epi32((int)0xFF000000);
+  __m128i xShuffle = _bSwap ? _mm_setr_epi8(2,1,0,-1,5,4,3,-1,8,7,6,-1,11,10,9,-1)
+                            : _mm_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+  // Twelve bytes in, but we load sixteen, so stop short of the end...
+  for (ii = 0; (ii + 6) <= _nPixels; ii += 4)
+  {
+    _mm_storeu_si128((__m128i*)(_pDst + (ii * 4)),
+                     _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(_pSrc + (ii * 3))),xShuffle),xAlpha));
+  }
+  if (_bSwap)
+  {
+    ScalarBgrToRgba(_pSrc + (ii * 3),_pDst + (ii * 4),_nPixels - ii);
+  }
+  else
+  {
+    ScalarRgbToRgba(_pSrc + (ii * 3),_pDst + (ii * 4),_nPixels - ii);
+  }
+}
+
+CONVERT_TARGET("ssse3")
+static void Ssse3RgbToRgba(const TW_UINT8 *_pSrc,
+                           TW_UINT8       *_pDst,
+                           UINT            _nPixels)
+{
+  Ssse3ToRgba(_pSrc,_pDst,_nPixels,false);
+}
+
+CONVERT_TARGET("ssse3")
+static void Ssse3BgrToRgba(const TW_UINT8 *_pSrc,
+                           TW_UINT8       *_pDst,
+                           UINT            _nPixels)
+{
+  Ssse3ToRgba(_pSrc,_pDst,_nPixels,true);
+}
+
+static const CONVERT_KERNELS s_kernelsSsse3 =
+{
+  TWDSM_KERNELS_SSSE3, "ssse3",
+  Ssse3Copy8, Ssse3Narrow16, Ssse3UnpackMsb, Ssse3UnpackLsb,
+  Ssse3GrayToRgb, Ssse3GrayToRgba, Ssse3SwapRgb, Ssse3RgbToRgba, Ssse3BgrToRgba
+};
+
+
+
+/**
+* AVX2, for the kernels that are a straight run of samples.  The
+* shuffles work within 128 bit lanes, so the pixel kernels stay with
+* SSSE3...
+*/
+CONVERT_TARGET("avx2")
+static void Avx2Copy8(const TW_UINT8 *_pSrc,
+                      TW_UINT8       *_pDst,
+                      UINT            _nSamples,
+                      TW_UINT8        _uXor)
+{
+  UINT    ii;
+  __m256i yXor = _mm256_set1_epi8((char)_uXor);
+  for (ii = 0; (ii + 32) <= _nSamples; ii += 32)
+  {
+    _mm256_storeu_si256((__m256i*)(_pDst + ii),_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(_pSrc + ii)),yXor));
+  }
+  ScalarCopy8(_pSrc + ii,_pDst + ii,_nSamples - ii,_uXor);
+}
+
+CONVERT_TARGET("avx2")
+static void Avx2Narrow16(const TW_UINT8 *_pSrc,
+                         TW_UINT8       *_pDst,
+                         UINT            _nSamples,
+                         TW_UINT8        _uXor)
+{
+  UINT    ii;
+  __m256i yXor = _mm256_set1_epi8((char)_uXor);
+  __m256i yLo;
+  __m256i yHi;
+  __m256i yPacked;
+  for (ii = 0; (ii + 32) <= _nSamples; ii += 32)
+  {
+    yLo = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(_pSrc + (ii * 2))),8);
+    yHi = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(_pSrc + (ii * 2) + 32)),8);
+    // packus works lane by lane, so put the quarters back in order...
+    yPacked = _mm256_permute4x64_epi64(_mm256_packus_epi16(yLo,yHi),0xD8);
+    _mm256_storeu_si256((__m256i*)(_pDst + ii),_mm256_xor_si256(yPacked,yXor));
+  }
+  ScalarNarrow16(_pSrc + (ii * 2),_pDst + ii,_nSamples - ii,_uXor);
+}
+
+CONVERT_TARGET("avx2")
+static void Avx2UnpackMsb(const TW_UINT8 *_pSrc,
+                          TW_UINT8       *_pDst,
+                          UINT            _nSamples,
+                          TW_UINT8        _uXor)
+{
+  UINT      ii;
+  TW_UINT32 uBits;
+  __m256i   yXor = _mm256_set1_epi8((char)_uXor);
+  __m256i   ySpread = _mm256_setr_epi8(0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,2,2,2,2,2,2,2,2,3,3,3,3,3,3,3,3);
+  __m256i   yMask = _mm256_set1_epi64x((long long)0x0102040810204080LL);
+  __m256i   yBits;
+  for (ii = 0; (ii + 32) <= _nSamples; ii += 32)
+  {
+    memcpy(&uBits,_pSrc + (ii / 8),sizeof(uBits));
+    yBits = _mm256_shuffle_epi8(_mm256_set1_epi32((int)uBits),ySpread);
+    yBits = _mm256_cmpeq_epi8(_mm256_and_si256(yBits,yMask),yMask);
+    _mm256_storeu_si256((__m256i*)(_pDst + ii),_mm256_xor_si256(yBits,yXor));
+  }
+  ScalarUnpackMsb(_pSrc + (ii / 8),_pDst + ii,_nSamples - ii,_uXor);
+}
+
+CONVERT_TARGET("avx2")
+static void Avx2UnpackLsb(const TW_UINT8 *_pSrc,
+                          TW_UINT8       *_pDst,
+                          UINT            _nSamples,
+                          TW_UINT8        _uXor)
+{
+  UINT      ii;
+  TW_UINT32 uBits;
+  __m256i   yXor = _mm256_set1_epi8((char)_uXor);
+  __m256i   ySpread = _mm256_setr_epi8(0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,2,2,2,2,2,2,2,2,3,3,3,3,3,3,3,3);
+  __m256i   yMask = _mm256_set1_epi64x((long long)0x8040201008040201LL);
+  __m256i   yBits;
+  for (ii = 0; (ii + 32) <= _nSamples; ii += 32)
+  {
+    memcpy(&uBits,_pSrc + (ii / 8),sizeof(uBits));
+    yBits = _mm256_shuffle_epi8(_mm256_set1_epi32((int)uBits),ySpread);
+    yBits = _mm256_cmpeq_epi8(_mm256_and_si256(yBits,yMask),yMask);
+    _mm256_storeu_si256((__m256i*)(_pDst + ii),_mm256_xor_si256(yBits,yXor));
+  }
+  ScalarUnpackLsb(_pSrc + (ii / 8),_pDst + ii,_nSamples - ii,_uXor);
+}
+
+static const CONVERT_KERNELS s_kernelsAvx2 =
+{
+  TWDSM_KERNELS_AVX2, "avx2",
+  Avx2Copy8, Avx2Narrow16, Avx2UnpackMsb, Avx2UnpackLsb,
+  Ssse3GrayToRgb, Ssse3GrayToRgba, Ssse3SwapRgb, Ssse3RgbToRgba, Ssse3BgrToRgba
+};
+#endif // CONVERT_X86
+
+
+
+#if defined(CONVERT_NEON)
+/**
+* NEON is always there on aarch64, and its interleaved loads and
+* stores do the channel shuffling for us...
+*/
+static void NeonCopy8(const TW_UINT8 *_pSrc,
+                      TW_UINT8       *_pDst,
+                      UINT            _nSamples,
+                      TW_UINT8        _uXor)
+{
+  UINT       ii;
+  uint8x16_t vXor = vdupq_n_u8(_uXor);
+  for (ii = 0; (ii + 16) <= _nSamples; ii += 16)
+  {
+    vst1q_u8(_pDst + ii,veorq_u8(vld1q_u8(_pSrc + ii),vXor));
+  }
+  ScalarCopy8(_pSrc + ii,_pDst + ii,_nSamples - ii,_uXor);
+}
+
+static void NeonNarrow16(const TW_UINT8 *_pSrc,
+                         TW_UINT8       *_pDst,
+                         UINT            _nSamples,
+                         TW_UINT8        _uXor)
+{
+  UINT         ii;
+  uint8x16_t   vXor = vdupq_n_u8(_uXor);
+  uint8x16x2_t vSamples;
+  for (ii = 0; (ii + 16) <= _nSamples; ii += 16)
+  {
+    // Little-endian, so the high bytes are the odd ones...
+    vSamples = vld2q_u8(_pSrc + (ii * 2));
+    vst1q_u8(_pDst + ii,veorq_u8(vSamples.val[1],vXor));
+  }
+  ScalarNarrow16(_pSrc + (ii * 2),_pDst + ii,_nSamples - ii,_uXor);
+}
+
+static void NeonUnpackMsb(const TW_UINT8 *_pSrc,
+                          TW_UINT8       *_pDst,
+                          UINT            _nSamples,
+                          TW_UINT8        _uXor)
+{
+  static const TW_UINT8 s_auMask[16] = {0x80,0x40,0x20,0x10,0x08,0x04,0x02,0x01,0x80,0x40,0x20,0x10,0x08,0x04,0x02,0x01};
+  UINT       ii;
+  uint8x16_t vXor = vdupq_n_u8(_uXor);
+  uint8x16_t vMask = vld1q_u8(s_auMask);
+  uint8x16_t vBits;
+  for (ii = 0; (ii + 16) <= _nSamples; ii += 16)
+  {
+    vBits = vcombine_u8(vdup_n_u8(_pSrc[ii / 8]),vdup_n_u8(_pSrc[(ii / 8) + 1]));
+    vst1q_u8(_pDst + ii,veorq_u8(vtstq_u8(vBits,vMask),vXor));
+  }
+  ScalarUnpackMsb(_pSrc + (ii / 8),_pDst + ii,_nSamples - ii,_uXor);
+}
+
+static void NeonUnpackLsb(const TW_UINT8 *_pSrc,
+                          TW_UINT8       *_pDst,
+                          UINT            _nSamples,
+                          TW_UINT8        _uXor)
+{
+  static const TW_UINT8 s_auMask[16] = {0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80,0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80};
+  UINT       ii;
+  uint8x16_t vXor = vdupq_n_u8(_uXor);
+  uint8x16_t vMask = vld1q_u8(s_auMask);
+  uint8x16_t vBits;
+  for (ii = 0; (ii + 16) <= _nSamples; ii += 16)
+  {
+    vBits = vcombine_u8(vdup_n_u8(_pSrc[ii / 8]),vdup_n_u8(_pSrc[(ii / 8) + 1]));
+    vst1q_u8(_pDst + ii,veorq_u8(vtstq_u8(vBits,vMask),vXor));
+  }
+  ScalarUnpackLsb(_pSrc + (ii / 8),_pDst + ii,_nSamples - ii,_uXor);
+}
+
+static void NeonGrayToRgb(const TW_UINT8 *_pSrc,
+                          TW_UINT8       *_pDst,
+                          UINT            _nPixels)
+{
+  UINT         ii;
+  uint8x16x3_t vRgb;
+  for (ii = 0; (ii + 16) <= _nPixels; ii += 16)
+  {
+    vRgb.val[0] = vld1q_u8(_pSrc + ii);
+    vRgb.val[1] = vRgb.val[0];
+    vRgb.val[2] = vRgb.val[0];
+    vst3q_u8(_pDst + (ii * 3),vRgb);
+  }
+  ScalarGrayToRgb(_pSrc + ii,_pDst + (ii * 3),_nPixels - ii);
+}
+
+static void NeonGrayToRgba(const TW_UINT8 *_pSrc,
+                           TW_UINT8       *_pDst,
+                           UINT            _nPixels)
+{
+  UINT         ii;
+  uint8x16x4_t vRgba;
+  vRgba.val[3] = vdupq_n_u8(0xFF);
+  for (ii = 0; (ii + 16) <= _nPixels; ii += 16)
+  {
+    vRgba.val[0] = vld1q_u8(_pSrc + ii);
+    vRgba.val[1] = vRgba.val[0];
+    vRgba.val[2] = vRgba.val[0];
+    vst4q_u8(_pDst + (ii * 4),vRgba);
+  }
+  ScalarGrayToRgba(_pSrc + ii,_pDst + (ii * 4),_nPixels - ii);
+}
+
+static void NeonSwapRgb(const TW_UINT8 *_pSrc,
+                        TW_UINT8       *_pDst,
+                        UINT            _nPixels)
+{
+  UINT         ii;
+  uint8x16x3_t vRgb;
+  uint8x16_t   vRed;
+  for (ii = 0; (ii + 16) <= _nPixels; ii += 16)
+  {
+    vRgb = vld3q_u8(_pSrc + (ii * 3));
+    vRed = vRgb.val[2];
+    vRgb.val[2] = vRgb.val[0];
+    vRgb.val[0] = vRed;
+    vst3q_u8(_pDst + (ii * 3),vRgb);
+  }
+  ScalarSwapRgb(_pSrc + (ii * 3),_pDst + (ii * 3),_nPixels - ii);
+}
+
+static void NeonRgbToRgba(const TW_UINT8 *_pSrc,
+                          TW_UINT8       *_pDst,
+                          UINT            _nPixels)
+{
+  UINT         ii;
+  uint8x16x3_t vRgb;
+  uint8x16x4_t vRgba;
+  vRgba.val[3] = vdupq_n_u8(0xFF);
+  for (ii = 0; (ii + 16) <= _nPixels; ii += 16)
+  {
+    vRgb = vld3q_u8(_pSrc + (ii * 3));
+    vRgba.val[0] = vRgb.val[0];
+    vRgba.val[1] = vRgb.val[1];
+    vRgba.val[2] = vRgb.val[2];
+    vst4q_u8(_pDst + (ii * 4),vRgba);
+  }
+  ScalarRgbToRgba(_pSrc + (ii * 3),_pDst + (ii * 4),_nPixels - ii);
+}
+
+static void NeonBgrToRgba(const TW_UINT8 *_pSrc,
+                          TW_UINT8       *_pDst,
+                          UINT            _nPixels)
+{
+  UINT         ii;
+  uint8x16x3_t vBgr;
+  uint8x16x4_t vRgba;
+  vRgba.val[3] = vdupq_n_u8(0xFF);
+  for (ii = 0; (ii + 16) <= _nPixels; ii += 16)
+  {
+    vBgr = vld3q_u8(_pSrc + (ii * 3));
+    vRgba.val[0] = vBgr.val[2];
+    vRgba.val[1] = vBgr.val[1];
+    vRgba.val[2] = vBgr.val[0];
+    vst4q_u8(_pDst + (ii * 4),vRgba);
+  }
+  ScalarBgrToRgba(_pSrc + (ii * 3),_pDst + (ii * 4),_nPixels - ii);
+}
+
+static const CONVERT_KERNELS s_kernelsNeon =
+{
+  TWDSM_KERNELS_NEON, "neon",
+  NeonCopy8, NeonNarrow16, NeonUnpackMsb, NeonUnpackLsb,
+  NeonGrayToRgb, NeonGrayToRgba, NeonSwapRgb, NeonRgbToRgba, NeonBgrToRgba
+};
+#endif // CONVERT_NEON
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmConvertImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmConvertImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Find a session, call with the mutex held...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @return the session, or NULL
+    */
+    CONVERT_SESSION *Find(const TWID_T _AppId,
+                          const TWID_T _DsId);
+
+    /**
+    * Get a copy of a session we can use outside of the mutex...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[out] _psession the copy
+    * @return true if there's an active conversion
+    */
+    bool GetActive(const TWID_T     _AppId,
+                   const TWID_T     _DsId,
+                   CONVERT_SESSION *_psession);
+
+    /**
+    * Check what the CPU can do...
+    * @return the best kernels we have for it
+    */
+    static const CONVERT_KERNELS *PickKernels();
+
+    /**
+    * Which of our x86 kernels the CPU can run...
+    * @param[out] _pbSsse3 SSSE3 is there
+    * @param[out] _pbAvx2 AVX2 is there, and the OS saves its registers
+    */
+    static void GetCpu(bool *_pbSsse3,
+                       bool *_pbAvx2);
+
+    /**
+    * Compare one set of kernels with the plain C ones...
+    * @param[in] _pkernels the set to check
+    * @param[in] _pfile where to say how it went
+    * @return true if every kernel matches
+    */
+    static bool CheckKernels(const CONVERT_KERNELS *_pkernels,
+                             FILE                  *_pfile);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      const CONVERT_KERNELS *m_pkernels;  /**< the kernels we're using */
+      MUTEX                  m_mutex;     /**< guards DS_SESSION.pconvert */
+    } pod;    /**< Pieces of data for CTwnDsmConvertImpl*/
+};
+
+
+
+/**
+* The constructor for our class...
+*/
+CTwnDsmConvert::CTwnDsmConvert()
+{
+  m_ptwndsmconvertimpl = new CTwnDsmConvertImpl;
+  MUTEXINIT(m_ptwndsmconvertimpl->pod.m_mutex);
+  m_ptwndsmconvertimpl->pod.m_pkernels = CTwnDsmConvertImpl::PickKernels();
+}
+
+
+
+/**
+* Run each set of SIMD kernels the CPU can run against the plain C
+* ones...
+*/
+int CTwnDsmConvert::CheckKernels(FILE *_pfile)
+{
+  int nFailed = 0;
+
+  #if defined(CONVERT_X86)
+    bool bSsse3;
+    bool bAvx2;
+    CTwnDsmConvertImpl::GetCpu(&bSsse3,&bAvx2);
+    if (bSsse3)
+    {
+      nFailed += CTwnDsmConvertImpl::CheckKernels(&s_kernelsSsse3,_pfile) ? 0 : 1;
+      if (bAvx2)
+      {
+        nFailed += CTwnDsmConvertImpl::CheckKernels(&s_kernelsAvx2,_pfile) ? 0 : 1;
+      }
+      else
+      {
+        fprintf(_pfile,"avx2 skipped, the CPU doesn't have it\n");
+      }
+    }
+    else
+    {
+      fprintf(_pfile,"ssse3 and avx2 skipped, the CPU doesn't have them\n");
+    }
+  #elif defined(CONVERT_NEON)
+    nFailed += CTwnDsmConvertImpl::CheckKernels(&s_kernelsNeon,_pfile) ? 0 : 1;
+  #else
+    fprintf(_pfile,"no SIMD kernels in this build\n");
+  #endif
+
+  return nFailed;
+}
+
+
+
+/**
+* The destructor for our class...
+*/
+CTwnDsmConvert::~CTwnDsmConvert()
+{
+  if (m_ptwndsmconvertimpl)
+  {
+    MUTEXDESTROY(m_ptwndsmconvertimpl->pod.m_mutex);
+    delete m_ptwndsmconvertimpl;
+    m_ptwndsmconvertimpl = 0;
+  }
+}
+
+
+
+/**
+* Set, get or reset what an application wants from a driver.  A new
+* setting waits for the next DAT_IMAGEINFO...
+*/
+TW_UINT16 CTwnDsmConvert::Convert(const TWID_T      _AppId,
+                                  const TW_UINT16   _MSG,
+                                  TW_TWDSM_CONVERT *_pConvert)
+{
+  DS_SESSION      *pdssession;
+  CONVERT_SESSION *psession;
+  TW_UINT16        ccResult = TWCC_SUCCESS;
+
+  _pConvert->Kernels = m_ptwndsmconvertimpl->pod.m_pkernels->Kernels;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,(TWID_T)_pConvert->DsId);
+  if (0 == pdssession)
+  {
+    return TWCC_BADDEST;
+  }
+
+  MUTEXLOCK(m_ptwndsmconvertimpl->pod.m_mutex);
+  psession = pdssession->pconvert;
+  switch (_MSG)
+  {
+    case MSG_SET:
+      if (   (_pConvert->Format > TWDSM_FORMAT_RGBA8)
+          || (_pConvert->Flags & ~(TWDSM_CONVERT_SWAPRB | TWDSM_CONVERT_INVERT | TWDSM_CONVERT_LSBFIRST)))
+      {
+        ccResult = TWCC_BADVALUE;
+        break;
+      }
+      if (TWDSM_FORMAT_NONE == _pConvert->Format)
+      {
+        pdssession->pconvert = 0;
+        free(psession);
+        break;
+      }
+      if (0 == psession)
+      {
+        psession = (CONVERT_SESSION*)calloc(1,sizeof(CONVERT_SESSION));
+        if (0 == psession)
+        {
+          kLOG((kLOGERR,"calloc failed for a conversion..."));
+          ccResult = TWCC_LOWMEMORY;
+          break;
+        }
+        pdssession->pconvert = psession;
+      }
+      memset(psession,0,sizeof(*psession));
+      psession->Format = _pConvert->Format;
+      psession->Flags  = _pConvert->Flags;
+      break;
+
+    case MSG_GET:
+      _pConvert->Format = psession ? psession->Format : (TW_UINT16)TWDSM_FORMAT_NONE;
+      _pConvert->Flags  = psession ? psession->Flags : (TW_UINT16)0;
+      break;
+
+    case MSG_RESET:
+      pdssession->pconvert = 0;
+      free(psession);
+      _pConvert->Format = TWDSM_FORMAT_NONE;
+      _pConvert->Flags  = 0;
+      break;
+
+    default:
+      ccResult = TWCC_BADPROTOCOL;
+      break;
+  }
+  MUTEXUNLOCK(m_ptwndsmconvertimpl->pod.m_mutex);
+
+  return ccResult;
+}
+
+
+
+/**
+* Find out if we can do it, and if we can, tell the application what
+* it's going to get...
+*/
+void CTwnDsmConvert::ImageInfo(const TWID_T  _AppId,
+                               const TWID_T  _DsId,
+                               TW_IMAGEINFO *_pImageInfo)
+{
+  CONVERT_SESSION *psession;
+  UINT             nChannels;
+  UINT             nBits;
+  int              ii;
+
+  MUTEXLOCK(m_ptwndsmconvertimpl->pod.m_mutex);
+  psession = m_ptwndsmconvertimpl->Find(_AppId,_DsId);
+  if (0 == psession)
+  {
+    MUTEXUNLOCK(m_ptwndsmconvertimpl->pod.m_mutex);
+    return;
+  }
+
+  nChannels = (UINT)_pImageInfo->SamplesPerPixel;
+  nBits = (UINT)_pImageInfo->BitsPerSample[0];
+  psession->bActive =    (TWCP_NONE == _pImageInfo->Compression)
+                      && !_pImageInfo->Planar
+                      && (_pImageInfo->ImageWidth > 0)
+                      && (   ((1 == nChannels) && ((1 == nBits) || (8 == nBits) || (16 == nBits)))
+                          || ((3 == nChannels) && ((8 == nBits) || (16 == nBits))))
+                      && ((UINT)_pImageInfo->BitsPerPixel == (nChannels * nBits))
+                      && !((3 == nChannels) && (TWDSM_FORMAT_GRAY8 == psession->Format));
+  if (!psession->bActive)
+  {
+    kLOG((kLOGERR,"can't convert %d samples of %d bits, compression %d, to format %d...",
+          (int)nChannels,(int)nBits,(int)_pImageInfo->Compression,(int)psession->Format));
+    MUTEXUNLOCK(m_ptwndsmconvertimpl->pod.m_mutex);
+    return;
+  }
+
+  psession->ImageWidth   = _pImageInfo->ImageWidth;
+  psession->nSrcChannels = nChannels;
+  psession->nSrcBits     = nBits;
+  switch (psession->Format)
+  {
+    default:
+    case TWDSM_FORMAT_GRAY8: psession->nDstChannels = 1; break;
+    case TWDSM_FORMAT_RGB8:  psession->nDstChannels = 3; break;
+    case TWDSM_FORMAT_RGBA8: psession->nDstChannels = 4; break;
+  }
+  MUTEXUNLOCK(m_ptwndsmconvertimpl->pod.m_mutex);
+
+  // Describe what we're going to deliver...
+  _pImageInfo->PixelType       = (1 == psession->nDstChannels) ? TWPT_GRAY : TWPT_RGB;
+  _pImageInfo->SamplesPerPixel = (TW_INT16)psession->nDstChannels;
+  _pImageInfo->BitsPerPixel    = (TW_INT16)(psession->nDstChannels * 8);
+  for (ii = 0; ii < 8; ii++)
+  {
+    _pImageInfo->BitsPerSample[ii] = ((UINT)ii < psession->nDstChannels) ? 8 : 0;
+  }
+}
+
+
+
+/**
+* If the rows get bigger, ask the driver for fewer of them...
+*/
+bool CTwnDsmConvert::Before(const TWID_T     _AppId,
+                            const TWID_T     _DsId,
+                            TW_IMAGEMEMXFER *_pMemXfer,
+                            TW_UINT32       *_pLength,
+                            TW_UINT16       *_pConditionCode)
+{
+  CONVERT_SESSION session;
+  UINT64          nSrcRow;
+  UINT64          nDstRow;
+
+  *_pConditionCode = TWCC_SUCCESS;
+  if (!m_ptwndsmconvertimpl->GetActive(_AppId,_DsId,&session))
+  {
+    return false;
+  }
+
+  *_pLength = _pMemXfer->Memory.Length;
+  nSrcRow = (((UINT64)session.ImageWidth * session.nSrcChannels * session.nSrcBits) + 7) / 8;
+  nDstRow = (UINT64)session.ImageWidth * session.nDstChannels;
+  if (nDstRow > nSrcRow)
+  {
+    if (_pMemXfer->Memory.Length < nDstRow)
+    {
+      kLOG((kLOGERR,"a converted row is %u bytes, the buffer is only %u...",
+            (unsigned int)nDstRow,(unsigned int)_pMemXfer->Memory.Length));
+      *_pConditionCode = TWCC_BADVALUE;
+      return false;
+    }
+    _pMemXfer->Memory.Length = (TW_UINT32)((_pMemXfer->Memory.Length / nDstRow) * nSrcRow);
+  }
+  return true;
+}
+
+
+
+/**
+* Convert the strip a row at a time, each row going through a scratch
+* row and back into the buffer.  If the rows get bigger we start at the
+* bottom, and if they get smaller we start at the top, so we never write
+* over a row we haven't read yet...
+*/
+TW_UINT16 CTwnDsmConvert::After(const TWID_T     _AppId,
+                                const TWID_T     _DsId,
+                                TW_IMAGEMEMXFER *_pMemXfer,
+                                const TW_UINT32  _Length)
+{
+  CONVERT_SESSION        session;
+  const CONVERT_KERNELS *pkernels = m_ptwndsmconvertimpl->pod.m_pkernels;
+  TW_UINT8              *pStrip;
+  TW_UINT8              *pRow;
+  TW_UINT8              *pSrc;
+  TW_UINT8              *pDst;
+  TW_UINT8               uXor;
+  UINT64                 nSrcRow;
+  UINT64                 nDstBytesPerRow;
+  UINT                   nPixels;
+  UINT                   nSamples;
+  UINT                   ii;
+  UINT                   uRow;
+
+  _pMemXfer->Memory.Length = _Length;
+  if (!m_ptwndsmconvertimpl->GetActive(_AppId,_DsId,&session))
+  {
+    return TWCC_SUCCESS;
+  }
+  if (0 == _pMemXfer->Rows)
+  {
+    return TWCC_SUCCESS;
+  }
+
+  // Check the layout...
+  nPixels = (UINT)_pMemXfer->Columns;
+  nSamples = nPixels * session.nSrcChannels;
+  nSrcRow = (((UINT64)nSamples * session.nSrcBits) + 7) / 8;
+  nDstBytesPerRow = (UINT64)nPixels * session.nDstChannels;
+  if (   (TWCP_NONE != _pMemXfer->Compression)
+      || (_pMemXfer->BytesPerRow < nSrcRow)
+      || (((UINT64)(_pMemXfer->Rows - 1) * _pMemXfer->BytesPerRow) + nSrcRow > _pMemXfer->BytesWritten)
+      || ((UINT64)_pMemXfer->Rows * nDstBytesPerRow > _Length))
+  {
+    kLOG((kLOGERR,"can't convert a strip of %ux%u, %u bytes per row, compression %d...",
+          (unsigned int)_pMemXfer->Columns,(unsigned int)_pMemXfer->Rows,
+          (unsigned int)_pMemXfer->BytesPerRow,(int)_pMemXfer->Compression));
+    return TWCC_BADVALUE;
+  }
+
+  pRow = (TW_UINT8*)malloc(nSamples);
+  if (0 == pRow)
+  {
+    kLOG((kLOGERR,"unable to allocate a conversion row..."));
+    return TWCC_LOWMEMORY;
+  }
+  if (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+  {
+    pStrip = (TW_UINT8*)DSM_MemLock((TW_HANDLE)_pMemXfer->Memory.TheMem);
+  }
+  else
+  {
+    pStrip = (TW_UINT8*)_pMemXfer->Memory.TheMem;
+  }
+
+  uXor = (session.Flags & TWDSM_CONVERT_INVERT) ? 0xFF : 0x00;
+  for (ii = 0; ii < _pMemXfer->Rows; ii++)
+  {
+    uRow = (nDstBytesPerRow > _pMemXfer->BytesPerRow) ? (_pMemXfer->Rows - 1 - ii) : ii;
+    pSrc = pStrip + ((UINT64)uRow * _pMemXfer->BytesPerRow);
+    pDst = pStrip + ((UINT64)uRow * nDstBytesPerRow);
+
+    // Samples to 8 bits...
+    switch (session.nSrcBits)
+    {
+      case 1:
+        if (session.Flags & TWDSM_CONVERT_LSBFIRST)
+        {
+          pkernels->UnpackLsb(pSrc,pRow,nSamples,uXor);
+        }
+        else
+        {
+          pkernels->UnpackMsb(pSrc,pRow,nSamples,uXor);
+        }
+        break;
+      case 16:
+        pkernels->Narrow16(pSrc,pRow,nSamples,uXor);
+        break;
+      default:
+        pkernels->Copy8(pSrc,pRow,nSamples,uXor);
+        break;
+    }
+
+    // ...and channels to the new layout...
+    if (1 == session.nSrcChannels)
+    {
+      switch (session.nDstChannels)
+      {
+        case 1:  memcpy(pDst,pRow,nPixels); break;
+        case 3:  pkernels->GrayToRgb(pRow,pDst,nPixels); break;
+        default: pkernels->GrayToRgba(pRow,pDst,nPixels); break;
+      }
+    }
+    else if (3 == session.nDstChannels)
+    {
+      if (session.Flags & TWDSM_CONVERT_SWAPRB)
+      {
+        pkernels->SwapRgb(pRow,pDst,nPixels);
+      }
+      else
+      {
+        memcpy(pDst,pRow,nSamples);
+      }
+    }
+    else if (session.Flags & TWDSM_CONVERT_SWAPRB)
+    {
+      pkernels->BgrToRgba(pRow,pDst,nPixels);
+    }
+    else
+    {
+      pkernels->RgbToRgba(pRow,pDst,nPixels);
+    }
+  }
+
+  if (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+  {
+    DSM_MemUnlock((TW_HANDLE)_pMemXfer->Memory.TheMem);
+  }
+  free(pRow);
+
+  _pMemXfer->BytesPerRow  = (TW_UINT32)nDstBytesPerRow;
+  _pMemXfer->BytesWritten = (TW_UINT32)(nDstBytesPerRow * _pMemXfer->Rows);
+  return TWCC_SUCCESS;
+}
+
+
+
+/**
+* Forget the session...
+*/
+void CTwnDsmConvert::Stop(const TWID_T _AppId,
+                          const TWID_T _DsId)
+{
+  DS_SESSION      *pdssession;
+  CONVERT_SESSION *psession;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return;
+  }
+
+  MUTEXLOCK(m_ptwndsmconvertimpl->pod.m_mutex);
+  psession = pdssession->pconvert;
+  pdssession->pconvert = 0;
+  MUTEXUNLOCK(m_ptwndsmconvertimpl->pod.m_mutex);
+
+  free(psession);
+}
+
+
+
+/**
+* It's on the DS_SESSION, if a conversion was asked for...
+*/
+CONVERT_SESSION *CTwnDsmConvertImpl::Find(const TWID_T _AppId,
+                                          const TWID_T _DsId)
+{
+  DS_SESSION *pdssession;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return 0;
+  }
+  return pdssession->pconvert;
+}
+
+
+
+/**
+* Copy it out, so the strip can be converted without the mutex...
+*/
+bool CTwnDsmConvertImpl::GetActive(const TWID_T     _AppId,
+                                   const TWID_T     _DsId,
+                                   CONVERT_SESSION *_psession)
+{
+  CONVERT_SESSION *psession;
+  bool             bActive = false;
+
+  MUTEXLOCK(pod.m_mutex);
+  psession = Find(_AppId,_DsId);
+  if (psession && psession->bActive)
+  {
+    *_psession = *psession;
+    bActive = true;
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+  return bActive;
+}
+
+
+
+/**
+* The best kernels the CPU can run, unless TWAINDSM_CONVERT holds us
+* back...
+*/
+const CONVERT_KERNELS *CTwnDsmConvertImpl::PickKernels()
+{
+  const CONVERT_KERNELS *pkernels = &s_kernelsScalar;
+  char                   szEnv[32];
+
+  SGETENV(szEnv,NCHARS(szEnv),kCONVERTENV);
+  if (0 == strcmp(szEnv,"scalar"))
+  {
+    return pkernels;
+  }
+
+  #if defined(CONVERT_X86)
+    bool bSsse3;
+    bool bAvx2;
+    GetCpu(&bSsse3,&bAvx2);
+    if (bSsse3)
+    {
+      pkernels = &s_kernelsSsse3;
+      if (bAvx2 && strcmp(szEnv,"ssse3"))
+      {
+        pkernels = &s_kernelsAvx2;
+      }
+    }
+  #elif defined(CONVERT_NEON)
+    pkernels = &s_kernelsNeon;
+  #endif
+
+  kLOG((kLOGINFO,"pixel conversion is using the %s kernels",pkernels->szName));
+  return pkernels;
+}
+
+
+
+/**
+* AVX2 needs the OS to save the upper halves of the registers, which
+* the compiler builtins check for us, but __cpuid doesn't...
+*/
+void CTwnDsmConvertImpl::GetCpu(bool *_pbSsse3,
+                                bool *_pbAvx2)
+{
+  #if defined(CONVERT_X86)
+    #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+      int aiInfo[4];
+      __cpuid(aiInfo,1);
+      *_pbSsse3 = (0 != (aiInfo[2] & (1 << 9)));
+      *_pbAvx2 = (0 != (aiInfo[2] & (1 << 27))) && ((_xgetbv(0) & 6) == 6);
+      __cpuidex(aiInfo,7,0);
+      *_pbAvx2 = *_pbAvx2 && (0 != (aiInfo[1] & (1 << 5)));
+    #else
+      __builtin_cpu_init();
+      *_pbSsse3 = (0 != __builtin_cpu_supports("ssse3"));
+      *_pbAvx2 = (0 != __builtin_cpu_supports("avx2"));
+    #endif
+  #else
+    *_pbSsse3 = false;
+    *_pbAvx2 = false;
+  #endif
+}
+
+
+
+/**
+* Every count up to CONVERT_CHECKCOUNT, at every misalignment up to
+* 3 bytes, inverted and not.  The destinations start out the same, and
+* we compare all of them, so writing past the end shows up too...
+*/
+bool CTwnDsmConvertImpl::CheckKernels(const CONVERT_KERNELS *_pkernels,
+                                      FILE                  *_pfile)
+{
+  static const char *aszSamples[4] = { "Copy8", "Narrow16", "UnpackMsb", "UnpackLsb" };
+  static const char *aszPixels[5]  = { "GrayToRgb", "GrayToRgba", "SwapRgb", "RgbToRgba", "BgrToRgba" };
+  const CONVERT_SAMPLES asamplesRef[4]  = { s_kernelsScalar.Copy8, s_kernelsScalar.Narrow16, s_kernelsScalar.UnpackMsb, s_kernelsScalar.UnpackLsb };
+  const CONVERT_SAMPLES asamplesTest[4] = { _pkernels->Copy8, _pkernels->Narrow16, _pkernels->UnpackMsb, _pkernels->UnpackLsb };
+  const CONVERT_PIXELS  apixelsRef[5]   = { s_kernelsScalar.GrayToRgb, s_kernelsScalar.GrayToRgba, s_kernelsScalar.SwapRgb, s_kernelsScalar.RgbToRgba, s_kernelsScalar.BgrToRgba };
+  const CONVERT_PIXELS  apixelsTest[5]  = { _pkernels->GrayToRgb, _pkernels->GrayToRgba, _pkernels->SwapRgb, _pkernels->RgbToRgba, _pkernels->BgrToRgba };
+  TW_UINT8 abSrc[(CONVERT_CHECKCOUNT * 3) + 4];
+  TW_UINT8 abRef[(CONVERT_CHECKCOUNT * 4) + 4];
+  TW_UINT8 abTest[(CONVERT_CHECKCOUNT * 4) + 4];
+  UINT     uSeed = 1;
+  UINT     nn;
+  UINT     oo;
+  UINT     kk;
+  UINT     xx;
+
+  // The same noise every time, so a failure can be chased...
+  for (nn = 0; nn < sizeof(abSrc); nn++)
+  {
+    uSeed = (uSeed * 1103515245) + 12345;
+    abSrc[nn] = (TW_UINT8)(uSeed >> 16);
+  }
+
+  for (nn = 0; nn <= CONVERT_CHECKCOUNT; nn++)
+  {
+    for (oo = 0; oo < 4; oo++)
+    {
+      for (kk = 0; kk < 4; kk++)
+      {
+        for (xx = 0; xx < 2; xx++)
+        {
+          memset(abRef,0xA5,sizeof(abRef));
+          memset(abTest,0xA5,sizeof(abTest));
+          asamplesRef[kk](abSrc + oo,abRef + oo,nn,xx ? 0xFF : 0x00);
+          asamplesTest[kk](abSrc + oo,abTest + oo,nn,xx ? 0xFF : 0x00);
+          if (0 != memcmp(abRef,abTest,sizeof(abRef)))
+          {
+            fprintf(_pfile,"%s %s doesn't match scalar for %u samples at offset %u%s\n",
+                    _pkernels->szName,aszSamples[kk],nn,oo,xx ? ", inverted" : "");
+            return false;
+          }
+        }
+      }
+      for (kk = 0; kk < 5; kk++)
+      {
+        memset(abRef,0xA5,sizeof(abRef));
+        memset(abTest,0xA5,sizeof(abTest));
+        apixelsRef[kk](abSrc + oo,abRef + oo,nn);
+        apixelsTest[kk](abSrc + oo,abTest + oo,nn);
+        if (0 != memcmp(abRef,abTest,sizeof(abRef)))
+        {
+          fprintf(_pfile,"%s %s doesn't match scalar for %u pixels at offset %u\n",
+                  _pkernels->szName,aszPixels[kk],nn,oo);
+          return false;
+        }
+      }
+    }
+  }
+
+  fprintf(_pfile,"%s matches scalar\n",_pkernels->szName);
+  return true;
+}
@@ -0,0 +1,505 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+/**
+* @file dispatch.cpp
+* Callback dispatch.
+* Deliver DAT_NULL messages to an application's callback on a thread of
+* our own, so a driver's acquisition thread never waits on the
+* application.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* Enviroment varible to turn the dispatcher on.  Set it to async to
+* have callbacks made from a dispatcher thread...
+* @see CTwnDsmDispatch
+*/
+#define kDISPATCHENV "TWAINDSM_CALLBACKS"
+
+/**
+* The most messages we'll hold for an application...
+* @see CTwnDsmDispatch
+*/
+#define DISPATCH_MAXITEMS    64
+
+
+
+/**
+* One message on its way to the application...
+*/
+typedef struct
+{
+  TWID_T     DsId;       /**< the driver that sent it */
+  TW_UINT16  MSG;        /**< the MSG_* */
+} DISPATCH_ITEM;
+
+/**
+* One application, hung on its APP_INFO.  Drivers add to the tail of
+* the ring, the dispatcher takes from the head, so every driver's
+* messages reach the application in the order they were sent...
+*/
+typedef struct DISPATCH_SESSION_
+{
+  struct DISPATCH_SESSION_ *psessionNext; /**< the next one waiting for the destructor to join it */
+  TWID_T          AppId;       /**< the application */
+  TW_IDENTITY     identity;    /**< our copy of the application's identity */
+  MUTEX           mutex;       /**< guards the rest */
+  COND            condReady;   /**< a message is waiting, or the dispatcher should stop */
+  COND            condSpace;   /**< a slot is free */
+  COND            condIdle;    /**< the dispatcher finished a callback */
+  THREAD          thread;      /**< the dispatcher */
+  bool            bThread;     /**< the dispatcher needs to be joined */
+  bool            bStop;       /**< the dispatcher should stop once the ring is empty */
+  UINT64          nThreadId;   /**< the dispatcher's thread id */
+  TWID_T          DsIdBusy;    /**< the driver whose message is in the callback, 0 if none */
+  UINT            nHead;       /**< the next item to deliver */
+  UINT            nCount;      /**< how many items are waiting */
+  DISPATCH_ITEM   aitem[DISPATCH_MAXITEMS]; /**< the ring */
+} DISPATCH_SESSION;
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmDispatchImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmDispatchImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Get the application's session...
+    * @param[in] _AppId the application
+    * @param[in] _bCreate add it if it isn't there
+    * @return the session, or NULL
+    */
+    DISPATCH_SESSION *Find(const TWID_T _AppId,
+                           const bool   _bCreate);
+
+    /**
+    * Join the dispatcher, if it needs it, and free the session...
+    * @param[in] _psession the session, nobody else can get to it
+    */
+    static void Destroy(DISPATCH_SESSION *_psession);
+
+    /**
+    * Check if we're running on the session's dispatcher, which is
+    * the one thread that must never wait on it...
+    * @param[in] _psession the session
+    * @return true if we are
+    */
+    static bool OnDispatcher(DISPATCH_SESSION *_psession);
+
+    /**
+    * The dispatcher...
+    * @param[in] _psession its session
+    */
+    static void Worker(DISPATCH_SESSION *_psession);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      bool              m_bEnabled;       /**< TWAINDSM_CALLBACKS=async */
+      MUTEX             m_mutex;          /**< guards APP_INFO.pDispatch and m_psessionStopped */
+      DISPATCH_SESSION *m_psessionStopped; /**< the ones stopped from their own dispatcher */
+    } pod;    /**< Pieces of data for CTwnDsmDispatchImpl*/
+};
+
+
+
+/**
+* The dispatcher thread just runs the loop...
+*/
+static THREADPROC(DispatchThread)
+{
+  CTwnDsmDispatchImpl::Worker((DISPATCH_SESSION*)_pv);
+  return 0;
+}
+
+
+
+/**
+* The constructor for our class...
+*/
+CTwnDsmDispatch::CTwnDsmDispatch()
+{
+  char szEnv[32];
+
+  m_ptwndsmdispatchimpl = new CTwnDsmDispatchImpl;
+  MUTEXINIT(m_ptwndsmdispatchimpl->pod.m_mutex);
+
+  SGETENV(szEnv,NCHARS(szEnv),kDISPATCHENV);
+  if (0 == STRNICMP(szEnv,"async",5))
+  {
+    m_ptwndsmdispatchimpl->pod.m_bEnabled = true;
+    kLOG((kLOGINFO,"callbacks are made from a dispatcher thread"));
+  }
+}
+
+
+
+/**
+* The destructor for our class.  MSG_CLOSEDSM stopped every dispatcher,
+* but the ones it stopped from their own threads still need joining...
+*/
+CTwnDsmDispatch::~CTwnDsmDispatch()
+{
+  DISPATCH_SESSION *psession;
+
+  if (m_ptwndsmdispatchimpl)
+  {
+    while (0 != (psession = m_ptwndsmdispatchimpl->pod.m_psessionStopped))
+    {
+      m_ptwndsmdispatchimpl->pod.m_psessionStopped = psession->psessionNext;
+      CTwnDsmDispatchImpl::Destroy(psession);
+    }
+    MUTEXDESTROY(m_ptwndsmdispatchimpl->pod.m_mutex);
+    delete m_ptwndsmdispatchimpl;
+    m_ptwndsmdispatchimpl = 0;
+  }
+}
+
+
+
+/**
+* TWAINDSM_CALLBACKS=async...
+*/
+bool CTwnDsmDispatch::IsEnabled()
+{
+  return m_ptwndsmdispatchimpl->pod.m_bEnabled;
+}
+
+
+
+/**
+* Add a message to the tail of the ring, starting the dispatcher if
+* it isn't running.  A full ring holds up the driver until there's
+* room, which is the same wait it would have had without us...
+*/
+bool CTwnDsmDispatch::Post(TW_IDENTITY     *_pAppId,
+                           const TWID_T     _DsId,
+                           const TW_UINT16  _MSG)
+{
+  DISPATCH_SESSION *psession;
+  UINT              nTail;
+
+  if (!m_ptwndsmdispatchimpl->pod.m_bEnabled)
+  {
+    return false;
+  }
+
+  psession = m_ptwndsmdispatchimpl->Find((TWID_T)_pAppId->Id,true);
+  if (0 == psession)
+  {
+    return false;
+  }
+
+  MUTEXLOCK(psession->mutex);
+
+  // A message sent from inside one of our own callbacks can't wait
+  // for us, so if there's no room the caller makes the call...
+  while (psession->nCount == DISPATCH_MAXITEMS)
+  {
+    if (CTwnDsmDispatchImpl::OnDispatcher(psession) || psession->bStop)
+    {
+      MUTEXUNLOCK(psession->mutex);
+      return false;
+    }
+    CONDWAIT(psession->condSpace,psession->mutex);
+  }
+  if (psession->bStop)
+  {
+    MUTEXUNLOCK(psession->mutex);
+    return false;
+  }
+
+  // Start the dispatcher the first time through...
+  if (!psession->bThread)
+  {
+    psession->identity = *_pAppId;
+    psession->bThread = THREADCREATE(psession->thread,DispatchThread,psession);
+    if (!psession->bThread)
+    {
+      kLOG((kLOGERR,"unable to start a callback dispatcher..."));
+      MUTEXUNLOCK(psession->mutex);
+      return false;
+    }
+  }
+
+  nTail = (psession->nHead + psession->nCount) % DISPATCH_MAXITEMS;
+  psession->aitem[nTail].DsId = _DsId;
+  psession->aitem[nTail].MSG  = _MSG;
+  psession->nCount++;
+  CONDSIGNAL(psession->condReady);
+  MUTEXUNLOCK(psession->mutex);
+
+  return true;
+}
+
+
+
+/**
+* Drop anything the driver sent that hasn't gone out yet, and wait
+* for the callback it's in, unless that's who's asking...
+*/
+void CTwnDsmDispatch::Stop(const TWID_T _AppId,
+                           const TWID_T _DsId)
+{
+  DISPATCH_SESSION *psession;
+  UINT              ii;
+  UINT              nKept;
+  UINT              nFrom;
+  UINT              nTo;
+
+  if (!m_ptwndsmdispatchimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+  psession = m_ptwndsmdispatchimpl->Find(_AppId,false);
+  if (0 == psession)
+  {
+    return;
+  }
+
+  MUTEXLOCK(psession->mutex);
+
+  // Squeeze the driver's messages out of the ring, keeping the order
+  // of everyone else's...
+  nKept = 0;
+  for (ii = 0; ii < psession->nCount; ii++)
+  {
+    nFrom = (psession->nHead + ii) % DISPATCH_MAXITEMS;
+    if (psession->aitem[nFrom].DsId != _DsId)
+    {
+      nTo = (psession->nHead + nKept) % DISPATCH_MAXITEMS;
+      psession->aitem[nTo] = psession->aitem[nFrom];
+      nKept++;
+    }
+  }
+  if (nKept != psession->nCount)
+  {
+    kLOG((kLOGINFO,"dispatcher dropping %u messages",psession->nCount - nKept));
+    psession->nCount = nKept;
+    CONDSIGNAL(psession->condSpace);
+  }
+
+  while ((psession->DsIdBusy == _DsId) && !CTwnDsmDispatchImpl::OnDispatcher(psession))
+  {
+    CONDWAIT(psession->condIdle,psession->mutex);
+  }
+
+  MUTEXUNLOCK(psession->mutex);
+}
+
+
+
+/**
+* Stop the dispatcher and give back the session.  Anything still in
+* the ring is dropped, the application is going away...
+*/
+void CTwnDsmDispatch::StopApp(const TWID_T _AppId)
+{
+  DISPATCH_SESSION *psession;
+  bool              bSelf;
+
+  if (!m_ptwndsmdispatchimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+  psession = m_ptwndsmdispatchimpl->Find(_AppId,false);
+  if (0 == psession)
+  {
+    return;
+  }
+
+  MUTEXLOCK(psession->mutex);
+  if (psession->nCount)
+  {
+    kLOG((kLOGINFO,"dispatcher dropping %u messages",psession->nCount));
+  }
+  psession->nCount = 0;
+  psession->bStop = true;
+  CONDSIGNAL(psession->condReady);
+  CONDSIGNAL(psession->condSpace);
+
+  // The application closed the DSM from inside a callback, so the
+  // dispatcher stops when it returns, and we can't wait for it.  It
+  // comes off the application either way, and the destructor joins
+  // that one...
+  bSelf = CTwnDsmDispatchImpl::OnDispatcher(psession);
+  MUTEXUNLOCK(psession->mutex);
+
+  MUTEXLOCK(m_ptwndsmdispatchimpl->pod.m_mutex);
+  g_ptwndsm->AppSetDispatcher(_AppId,0);
+  if (bSelf)
+  {
+    psession->psessionNext = m_ptwndsmdispatchimpl->pod.m_psessionStopped;
+    m_ptwndsmdispatchimpl->pod.m_psessionStopped = psession;
+  }
+  MUTEXUNLOCK(m_ptwndsmdispatchimpl->pod.m_mutex);
+
+  if (!bSelf)
+  {
+    CTwnDsmDispatchImpl::Destroy(psession);
+  }
+}
+
+
+
+/**
+* The session is made by the first message for the application, and
+* StopApp takes it off the APP_INFO...
+*/
+DISPATCH_SESSION *CTwnDsmDispatchImpl::Find(const TWID_T _AppId,
+                                            const bool   _bCreate)
+{
+  DISPATCH_SESSION *psession;
+
+  MUTEXLOCK(pod.m_mutex);
+  psession = g_ptwndsm->AppDispatcher(_AppId);
+  if ((0 == psession) && _bCreate)
+  {
+    psession = (DISPATCH_SESSION*)calloc(1,sizeof(DISPATCH_SESSION));
+    if (psession)
+    {
+      psession->AppId = _AppId;
+      MUTEXINIT(psession->mutex);
+      CONDINIT(psession->condReady);
+      CONDINIT(psession->condSpace);
+      CONDINIT(psession->condIdle);
+      if (!g_ptwndsm->AppSetDispatcher(_AppId,psession))
+      {
+        Destroy(psession);
+        psession = 0;
+      }
+    }
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+
+  return psession;
+}
+
+
+
+/**
+* Once it's off the APP_INFO only the dispatcher itself can be
+* looking at it, so the join is all the locking we need...
+*/
+void CTwnDsmDispatchImpl::Destroy(DISPATCH_SESSION *_psession)
+{
+  if (_psession->bThread)
+  {
+    THREADJOIN(_psession->thread);
+  }
+  CONDDESTROY(_psession->condIdle);
+  CONDDESTROY(_psession->condSpace);
+  CONDDESTROY(_psession->condReady);
+  MUTEXDESTROY(_psession->mutex);
+  free(_psession);
+}
+
+
+
+/**
+* The dispatcher writes its id before it looks at the ring, and
+* everyone reads it under the session's mutex...
+*/
+bool CTwnDsmDispatchImpl::OnDispatcher(DISPATCH_SESSION *_psession)
+{
+  return _psession->bThread && (_psession->nThreadId == (UINT64)GETTHREADID());
+}
+
+
+
+/**
+* Deliver messages in order until we're told to stop.  The callback
+* is made without the mutex, so drivers can keep adding to the ring
+* while the application works...
+*/
+void CTwnDsmDispatchImpl::Worker(DISPATCH_SESSION *_psession)
+{
+  DISPATCH_ITEM item;
+  TW_INT16      rc;
+  TWID_T        DsIdPinned = 0;
+
+  MUTEXLOCK(_psession->mutex);
+  _psession->nThreadId = (UINT64)GETTHREADID();
+  while (!_psession->bStop)
+  {
+    // Wait for something to do...
+    if (0 == _psession->nCount)
+    {
+      CONDWAIT(_psession->condReady,_psession->mutex);
+      continue;
+    }
+    item = _psession->aitem[_psession->nHead];
+    _psession->nHead = (_psession->nHead + 1) % DISPATCH_MAXITEMS;
+    _psession->nCount--;
+    _psession->DsIdBusy = item.DsId;
+    CONDSIGNAL(_psession->condSpace);
+    MUTEXUNLOCK(_psession->mutex);
+
+    // We serve all of the application's drivers, so we follow the
+    // placement of whichever one sent this...
+    if (item.DsId != DsIdPinned)
+    {
+      g_ptwndsmaffinity->Pin(_psession->AppId,item.DsId);
+      DsIdPinned = item.DsId;
+    }
+
+    rc = g_ptwndsm->DispatchCallback(&_psession->identity,item.DsId,item.MSG);
+    if (TWRC_SUCCESS != rc)
+    {
+      kLOG((kLOGINFO,"callback for %.32s returned %d",(char*)_psession->identity.ProductName,(int)rc));
+    }
+
+    MUTEXLOCK(_psession->mutex);
+    _psession->DsIdBusy = 0;
+    CONDSIGNAL(_psession->condIdle);
+  }
+  MUTEXUNLOCK(_psession->mutex);
+}
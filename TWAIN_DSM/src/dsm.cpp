@@ -68,6 +68,19 @@
 HINSTANCE   g_hinstance     = 0; /**< Windows Instance handle for the DSM DLL... */
 CTwnDsm    *g_ptwndsm       = 0; /**< The main DSM object */
 CTwnDsmLog *g_ptwndsmlog    = 0; /**< The logging object, only access through macros */
+CTwnDsmTrace *g_ptwndsmtrace = 0; /**< The tracing object, only access through macros */
+CTwnDsmMetrics *g_ptwndsmmetrics = 0; /**< The metrics object */
+CTwnDsmShm *g_ptwndsmshm = 0; /**< The shared memory object */
+CTwnDsmPool *g_ptwndsmpool = 0; /**< The memory pool, outlives CTwnDsm */
+CTwnDsmMemTrack *g_ptwndsmmemtrack = 0; /**< The memory tracker */
+CTwnDsmReadAhead *g_ptwndsmreadahead = 0; /**< The read-ahead workers */
+CTwnDsmConvert *g_ptwndsmconvert = 0; /**< The pixel converter */
+CTwnDsmAnalysis *g_ptwndsmanalysis = 0; /**< The content analyzer */
+CTwnDsmChecksum *g_ptwndsmchecksum = 0; /**< The image checksums */
+CTwnDsmDispatch *g_ptwndsmdispatch = 0; /**< The callback dispatchers */
+CTwnDsmActor *g_ptwndsmactor = 0; /**< The driver threads */
+CTwnDsmWarmPool *g_ptwndsmwarmpool = 0; /**< The drivers we're keeping open */
+CTwnDsmAffinity *g_ptwndsmaffinity = 0; /**< Where each session runs */
 
 
 
@@ -387,6 +400,53 @@ DSMENTRY DSM_Entry(TW_IDENTITY  *_pOrigin,
 
 
 
+/**
+* Asynchronous Data Source Manager Entry Point.
+*
+* DSM_Entry for applications that can't wait.  The triplet is queued
+* for the driver's thread, and we return as soon as it is.  This needs
+* TWAINDSM_ACTORS, and a driver that's open.  Unlike DSM_Entry, this
+* never opens or closes the DSM, so there's nothing to manage here...
+*
+* Defined in twaindsm.h
+*
+* @param[in] _pOrigin Identifies the application.
+* @param[in] _pDest Identifies the data source.
+* @param[in] _DG The Data Group.
+* @param[in] _DAT The Data Attribute Type.
+* @param[in] _MSG The message.
+* @param[in,out] _pData A pointer to the data structure or variable identified
+*            by the Data Attribute Type.  It belongs to the driver until
+*            the triplet is done.
+* @param[in] _pfnDone Called on the driver's thread when the triplet is
+*            done.  If this is NULL the ticket is collected with
+*            DAT_TWDSM_SUBMIT.
+* @param[in] _pRefCon Passed to _pfnDone.
+* @param[out] _pTicket The triplet's ticket.
+*
+* @return TWRC_SUCCESS if the triplet was queued, otherwise TWRC_FAILURE.
+*/
+DSMENTRY DSM_EntryAsync(TW_IDENTITY  *_pOrigin,
+                        TW_IDENTITY  *_pDest,
+                        TW_UINT32     _DG,
+                        TW_UINT16     _DAT,
+                        TW_UINT16     _MSG,
+                        TW_MEMREF     _pData,
+                        DSMASYNCPROC  _pfnDone,
+                        TW_MEMREF     _pRefCon,
+                        TW_UINT32    *_pTicket)
+{
+  // Validate...
+  if ((0 == _pOrigin) || (0 == g_ptwndsm))
+  {
+    return TWRC_FAILURE;
+  }
+
+  return g_ptwndsm->DSM_EntryAsync(_pOrigin,_pDest,_DG,_DAT,_MSG,_pData,_pfnDone,_pRefCon,_pTicket);
+}
+
+
+
 /*
 * Our constructor...
 * Clean out the pod and set stuff.  Get logging set up so we
@@ -411,6 +471,101 @@ CTwnDsm::CTwnDsm()
   kLOG((kLOGINFO,"%s",TWNDSM_DESCRIPTION));
   kLOG((kLOGINFO,"version: %s",TWNDSM_VERSION_STR));
 
+  // Get our tracing object...
+  g_ptwndsmtrace = new CTwnDsmTrace;
+  if (!g_ptwndsmtrace)
+  {
+      kPANIC("Failed to new CTwnDsmTrace!!!");
+  }
+
+  // Get our metrics object...
+  g_ptwndsmmetrics = new CTwnDsmMetrics;
+  if (!g_ptwndsmmetrics)
+  {
+      kPANIC("Failed to new CTwnDsmMetrics!!!");
+  }
+
+  // Get our shared memory object...
+  g_ptwndsmshm = new CTwnDsmShm;
+  if (!g_ptwndsmshm)
+  {
+      kPANIC("Failed to new CTwnDsmShm!!!");
+  }
+
+  // Get our memory pool, the first time through...
+  if (!g_ptwndsmpool)
+  {
+    g_ptwndsmpool = new CTwnDsmPool;
+    if (!g_ptwndsmpool)
+    {
+        kPANIC("Failed to new CTwnDsmPool!!!");
+    }
+  }
+  g_ptwndsmpool->StartTrim();
+
+  // Get our memory tracker...
+  g_ptwndsmmemtrack = new CTwnDsmMemTrack;
+  if (!g_ptwndsmmemtrack)
+  {
+      kPANIC("Failed to new CTwnDsmMemTrack!!!");
+  }
+
+  // Get our read-ahead object...
+  g_ptwndsmreadahead = new CTwnDsmReadAhead;
+  if (!g_ptwndsmreadahead)
+  {
+      kPANIC("Failed to new CTwnDsmReadAhead!!!");
+  }
+
+  // Get our pixel converter...
+  g_ptwndsmconvert = new CTwnDsmConvert;
+  if (!g_ptwndsmconvert)
+  {
+      kPANIC("Failed to new CTwnDsmConvert!!!");
+  }
+
+  // Get our content analyzer...
+  g_ptwndsmanalysis = new CTwnDsmAnalysis;
+  if (!g_ptwndsmanalysis)
+  {
+      kPANIC("Failed to new CTwnDsmAnalysis!!!");
+  }
+
+  // Get our checksums...
+  g_ptwndsmchecksum = new CTwnDsmChecksum;
+  if (!g_ptwndsmchecksum)
+  {
+      kPANIC("Failed to new CTwnDsmChecksum!!!");
+  }
+
+  // Get our session placement, before any of the threads it pins...
+  g_ptwndsmaffinity = new CTwnDsmAffinity;
+  if (!g_ptwndsmaffinity)
+  {
+      kPANIC("Failed to new CTwnDsmAffinity!!!");
+  }
+
+  // Get our callback dispatcher...
+  g_ptwndsmdispatch = new CTwnDsmDispatch;
+  if (!g_ptwndsmdispatch)
+  {
+      kPANIC("Failed to new CTwnDsmDispatch!!!");
+  }
+
+  // Get our driver threads...
+  g_ptwndsmactor = new CTwnDsmActor;
+  if (!g_ptwndsmactor)
+  {
+      kPANIC("Failed to new CTwnDsmActor!!!");
+  }
+
+  // Get our warm drivers...
+  g_ptwndsmwarmpool = new CTwnDsmWarmPool;
+  if (!g_ptwndsmwarmpool)
+  {
+      kPANIC("Failed to new CTwnDsmWarmPool!!!");
+  }
+
   // Get our application object...
   pod.m_ptwndsmapps = new CTwnDsmApps();
   if (!pod.m_ptwndsmapps)
@@ -427,13 +582,81 @@ CTwnDsm::CTwnDsm()
 */
 CTwnDsm::~CTwnDsm()
 {
+  // The driver threads and the dispatchers call back into us, so
+  // they go first.  The warm drivers are closed through the driver
+  // threads, so they go before them...
+  if (g_ptwndsmwarmpool)
+  {
+    delete g_ptwndsmwarmpool;
+    g_ptwndsmwarmpool = 0;
+  }
+  if (g_ptwndsmactor)
+  {
+    delete g_ptwndsmactor;
+    g_ptwndsmactor = 0;
+  }
+  if (g_ptwndsmdispatch)
+  {
+    delete g_ptwndsmdispatch;
+    g_ptwndsmdispatch = 0;
+  }
+  if (g_ptwndsmreadahead)
+  {
+    delete g_ptwndsmreadahead;
+    g_ptwndsmreadahead = 0;
+  }
+  if (g_ptwndsmaffinity)
+  {
+    delete g_ptwndsmaffinity;
+    g_ptwndsmaffinity = 0;
+  }
+  if (g_ptwndsmconvert)
+  {
+    delete g_ptwndsmconvert;
+    g_ptwndsmconvert = 0;
+  }
+  if (g_ptwndsmanalysis)
+  {
+    delete g_ptwndsmanalysis;
+    g_ptwndsmanalysis = 0;
+  }
+  if (g_ptwndsmchecksum)
+  {
+    delete g_ptwndsmchecksum;
+    g_ptwndsmchecksum = 0;
+  }
   if (pod.m_ptwndsmapps)
   {
     delete pod.m_ptwndsmapps;
   }
+  if (g_ptwndsmpool)
+  {
+    g_ptwndsmpool->StopTrim();
+  }
+  if (g_ptwndsmmemtrack)
+  {
+    delete g_ptwndsmmemtrack;
+    g_ptwndsmmemtrack = 0;
+  }
+  if (g_ptwndsmshm)
+  {
+    delete g_ptwndsmshm;
+    g_ptwndsmshm = 0;
+  }
+  if (g_ptwndsmmetrics)
+  {
+    delete g_ptwndsmmetrics;
+    g_ptwndsmmetrics = 0;
+  }
+  if (g_ptwndsmtrace)
+  {
+    delete g_ptwndsmtrace;
+    g_ptwndsmtrace = 0;
+  }
   if (g_ptwndsmlog)
   {
     delete g_ptwndsmlog;
+    g_ptwndsmlog = 0;
   }
   memset(&pod,0,sizeof(pod));
 }
@@ -453,9 +676,10 @@ TW_UINT16 CTwnDsm::DSM_Entry(TW_IDENTITY  *_pOrigin,
 {
   TW_UINT16     rcDSM   = TWRC_SUCCESS;
   bool          bPrinted;
-  TW_CALLBACK2 *ptwcallback2;
+  TW_UINT16     msgEvent;
   TW_IDENTITY  *pAppId  = _pOrigin;
   TW_IDENTITY  *pDSId   = _pDest;
+  UINT64        tickStart = DSM_GetTickNs();
 
   // Do a test to see if pOrigin is a DS instead of App, if so then switch pAppId and pDSId
   // MSG_INVOKE_CALLBACK was only used on the Mac and is now deprecated (ver 2.1)
@@ -470,6 +694,33 @@ TW_UINT16 CTwnDsm::DSM_Entry(TW_IDENTITY  *_pOrigin,
   // Print the triplets to stdout for information purposes
   bPrinted = printTripletsInfo(_pOrigin,_pDest,_DG,_DAT,_MSG,_pData);
 
+  // Let anybody attached to our probes know we're here...
+  kPROBE5(dsm__entry,
+          pAppId ? (TWID_T)pAppId->Id : 0,
+          pDSId ? (TWID_T)pDSId->Id : 0,
+          _DG,_DAT,_MSG);
+
+  // Anything allocated from here until we return belongs to this
+  // application and driver...
+  UINT uMemTrack = 0;
+  if (g_ptwndsmmemtrack && (0 != pAppId))
+  {
+    uMemTrack = g_ptwndsmmemtrack->Enter((TWID_T)pAppId->Id,pDSId ? (TWID_T)pDSId->Id : 0);
+  }
+
+  // Start a span covering everything we do for this call...
+  char szTriplet[128];
+  szTriplet[0] = 0;
+  if (g_ptwndsmtrace && g_ptwndsmtrace->IsEnabled())
+  {
+    char szDetail[128];
+    StringFromTriplet(szTriplet,NCHARS(szTriplet),_DG,_DAT,_MSG);
+    SSNPRINTF(szDetail,NCHARS(szDetail),NCHARS(szDetail),"%.32s -> %.32s",
+              _pOrigin->ProductName,
+              _pDest ? _pDest->ProductName : "DSM");
+    g_ptwndsmtrace->Begin("dsm",szTriplet,szDetail);
+  }
+
   // Sniff for the application forwarding an event to the
   // DS. It may be possible that the app has a message waiting for
   // it because it didn't register a callback.
@@ -483,18 +734,26 @@ TW_UINT16 CTwnDsm::DSM_Entry(TW_IDENTITY  *_pOrigin,
       pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADPROTOCOL);
       rcDSM = TWRC_FAILURE;
     }
-    else if (pod.m_ptwndsmapps->DsCallbackIsWaiting(pAppId,(TWID_T)pDSId->Id))
+    // Hand back the oldest queued message, one per DAT_EVENT, the
+    // app keeps forwarding events so the rest follow in order.  A
+    // parked driver is closed as far as the app knows, so it falls
+    // through and fails below...
+    else if (   (0 != _pData)
+             && !g_ptwndsmwarmpool->IsParked((TWID_T)pAppId->Id,(TWID_T)pDSId->Id)
+             && (0 != (msgEvent = pod.m_ptwndsmapps->DsEventPop(pAppId,(TWID_T)pDSId->Id))))
     {
-      ptwcallback2 = pod.m_ptwndsmapps->DsCallback2Get(pAppId,(TWID_T)pDSId->Id);
-      ((TW_EVENT*)(_pData))->TWMessage = ptwcallback2->Message;
+      ((TW_EVENT*)(_pData))->TWMessage = msgEvent;
+      if (g_ptwndsmmetrics)
+      {
+        RecordLatency("deliver",pAppId,(TWID_T)pDSId->Id,msgEvent,g_ptwndsmmetrics->Deliver((TWID_T)pAppId->Id,(TWID_T)pDSId->Id,msgEvent));
+      }
       if( g_ptwndsmlog )
       {
         char szMsg[64];
-        StringFromMsg(szMsg,NCHARS(szMsg),ptwcallback2->Message);
+        StringFromMsg(szMsg,NCHARS(szMsg),msgEvent);
         kLOG((kLOGINFO,"%.32s retrieving DAT_EVENT / %s\n", pAppId->ProductName, szMsg));
       }
-      ptwcallback2->Message = 0;
-      pod.m_ptwndsmapps->DsCallbackSetWaiting(pAppId,(TWID_T)pDSId->Id,FALSE);
+      PublishCallbackDepth(pAppId);
       rcDSM = TWRC_DSEVENT;
     }
     // No callback, so fall on through...
@@ -518,6 +777,13 @@ TW_UINT16 CTwnDsm::DSM_Entry(TW_IDENTITY  *_pOrigin,
         // else we fall thru to send the message onto the DS
 
       default:
+        // Custom triplets sent to us, rather than to a driver, are ours...
+        if ((0 == pDSId) && (_DAT >= DAT_CUSTOMBASE))
+        {
+          rcDSM = DSM_Custom(pAppId,_DAT,_MSG,_pData);
+          break;
+        }
+
         // check if the application is open or not.  If it isn't, we have a bad sequence
         if (dsmState_Open == pod.m_ptwndsmapps->AppGetState(pAppId))
         {
@@ -529,6 +795,23 @@ TW_UINT16 CTwnDsm::DSM_Entry(TW_IDENTITY  *_pOrigin,
               rcDSM = TWRC_FAILURE;
             }
 
+            // The application closed it, even if we didn't...
+            else if (g_ptwndsmwarmpool->IsParked((TWID_T)pAppId->Id,(TWID_T)pDSId->Id))
+            {
+              kLOG((kLOGINFO,"DS is not open"));
+              pod.m_ptwndsmapps->AppSetConditionCode(pAppId,TWCC_SEQERROR);
+              rcDSM = TWRC_FAILURE;
+            }
+
+            // A callback the driver made while reading ahead, the
+            // driver is still busy with the strip...
+            else if (g_ptwndsmreadahead->OnWorker((TWID_T)pAppId->Id,(TWID_T)pDSId->Id))
+            {
+              kLOG((kLOGERR,"Nested call back to the DS from a read-ahead callback.  Returning Failure."));
+              pod.m_ptwndsmapps->AppSetConditionCode(pAppId,TWCC_SEQERROR);
+              rcDSM = TWRC_FAILURE;
+            }
+
             // Issue the command...
             else if (0 != pod.m_ptwndsmapps->DsGetEntryProc(pAppId,(TWID_T)pDSId->Id))
             {
@@ -548,17 +831,41 @@ TW_UINT16 CTwnDsm::DSM_Entry(TW_IDENTITY  *_pOrigin,
                      !pod.m_ptwndsmapps->DsIsAppProcessingCallback(pAppId,(TWID_T)pDSId->Id) )    ) 
               {
                 pod.m_ptwndsmapps->DsSetProcessingMessage(pAppId,(TWID_T)pDSId->Id,TRUE);
+                bool bResume = false;
                 try
                 {
                   // Create a local copy of the AppIdentity
                   TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(pAppId);
-
-                  rcDSM = (pod.m_ptwndsmapps->DsGetEntryProc(&AppId,(TWID_T)pDSId->Id))(
-                                          &AppId,
-                                          _DG,
-                                          _DAT,
-                                          _MSG,
-                                          _pData);
+                  bool        bHandled = false;
+                  TW_UINT16   ccReadAhead = TWCC_SUCCESS;
+
+                  // Strips may already be waiting for us, anything
+                  // else has to wait for the read-ahead worker...
+                  if (g_ptwndsmreadahead->IsEnabled())
+                  {
+                    if ((DG_IMAGE == _DG) && (DAT_IMAGEMEMXFER == _DAT) && (MSG_GET == _MSG))
+                    {
+                      rcDSM = g_ptwndsmreadahead->MemXfer(&AppId,(TWID_T)pDSId->Id,(TW_IMAGEMEMXFER*)_pData,&bHandled,&ccReadAhead);
+                      if (TWCC_SUCCESS != ccReadAhead)
+                      {
+                        pod.m_ptwndsmapps->AppSetConditionCode(pAppId,ccReadAhead);
+                      }
+                    }
+                    else
+                    {
+                      bResume = g_ptwndsmreadahead->Pause((TWID_T)pAppId->Id,(TWID_T)pDSId->Id,_DAT,_MSG);
+                    }
+                  }
+
+                  if (!bHandled)
+                  {
+                    rcDSM = DsEntry(&AppId,
+                                    (TWID_T)pDSId->Id,
+                                    _DG,
+                                    _DAT,
+                                    _MSG,
+                                    _pData);
+                  }
                 }
                 catch(...)
                 {
@@ -566,6 +873,10 @@ TW_UINT16 CTwnDsm::DSM_Entry(TW_IDENTITY  *_pOrigin,
                   pod.m_ptwndsmapps->AppSetConditionCode(pAppId,TWCC_BUMMER);
                   kLOG((kLOGERR,"Exception caught while DS was processing message.  Returning Failure."));
                 }
+                if (bResume)
+                {
+                  g_ptwndsmreadahead->Resume((TWID_T)pAppId->Id,(TWID_T)pDSId->Id);
+                }
                 pod.m_ptwndsmapps->DsSetProcessingMessage(pAppId,(TWID_T)pDSId->Id,FALSE);
               }
               else
@@ -628,17 +939,18 @@ TW_UINT16 CTwnDsm::DSM_Entry(TW_IDENTITY  *_pOrigin,
         if (  0 != pDSId
           &&  (dsmState_Open == pod.m_ptwndsmapps->AppGetState(pAppId))
           &&  pod.m_ptwndsmapps->AppValidateIds(pAppId,pDSId)
-          &&  (0 != pod.m_ptwndsmapps->DsGetEntryProc(pAppId,(TWID_T)pDSId->Id)))
+          &&  (0 != pod.m_ptwndsmapps->DsGetEntryProc(pAppId,(TWID_T)pDSId->Id))
+          &&  !g_ptwndsmwarmpool->IsParked((TWID_T)pAppId->Id,(TWID_T)pDSId->Id))
         {
           // Create a local copy of the AppIdentity
           TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(pAppId);
 
-          rcDSM = (pod.m_ptwndsmapps->DsGetEntryProc(&AppId,(TWID_T)pDSId->Id))(
-                                  &AppId,
-                                  _DG,
-                                  _DAT,
-                                  _MSG,
-                                  _pData);
+          rcDSM = DsEntry(&AppId,
+                          (TWID_T)pDSId->Id,
+                          _DG,
+                          _DAT,
+                          _MSG,
+                          _pData);
         }
         // Otherwise, handle it ourself...
         else
@@ -673,447 +985,483 @@ TW_UINT16 CTwnDsm::DSM_Entry(TW_IDENTITY  *_pOrigin,
   {
     printResults(_DG,_DAT,_MSG,_pData,rcDSM);
   }
+  if (szTriplet[0])
+  {
+    kTRACE(End("dsm",szTriplet,rcDSM));
+  }
 
-  return rcDSM;
-}
-
-/*
-* Return the state of the DSM by checking the state of all applications
-*/
-DSM_State CTwnDsm::DSMGetState()
-{
-  DSM_State CurrentState = pod.m_ptwndsmapps->AppGetState();
-  return CurrentState;
-}
+  // DSM_Null records its own, so it can say how long the callback took...
+  if (g_ptwndsmmetrics && (DAT_NULL != _DAT) && (0 != pAppId))
+  {
+    g_ptwndsmmetrics->Record((TWID_T)pAppId->Id,
+                             pDSId ? (TWID_T)pDSId->Id : 0,
+                             _DG,_DAT,_MSG,
+                             DSM_GetTickNs() - tickStart,
+                             rcDSM);
+  }
 
-/*
-* Handle DAT_STATUS.  Just a few things of note, we handle some
-* DAT_STATUS stuff in DSM_Entry.  And per the spec we have to
-* clear the condition code when we are done.  I've also put in
-* MSG_CHECKSTATUS, because I can't imagine why we have the silly
-* thing if it isn't for this function...
-*/
-TW_INT16 CTwnDsm::DSM_Status(TW_IDENTITY  *_pAppId,
-                             TW_UINT16     _MSG,
-                             TW_STATUS    *_pStatus)
-{
-  TW_INT16 result = TWRC_SUCCESS;
+  kPROBE6(dsm__return,
+          pAppId ? (TWID_T)pAppId->Id : 0,
+          pDSId ? (TWID_T)pDSId->Id : 0,
+          _DG,_DAT,_MSG,rcDSM);
 
-  switch (_MSG)
+  // Let twaindsm-top know...
+  if (g_ptwndsmshm && (0 != pAppId))
   {
-    case MSG_GET:
-    case MSG_CHECKSTATUS:
-       _pStatus->ConditionCode = pod.m_ptwndsmapps->AppGetConditionCode(_pAppId);
-       _pStatus->Reserved = 0;
-      break;
+    g_ptwndsmshm->Triplet((TWID_T)pAppId->Id);
+    if (TWRC_FAILURE == rcDSM)
+    {
+      // Peek at the condition code, the app still needs to get it...
+      TW_UINT16 cc = pod.m_ptwndsmapps->AppPeekConditionCode(pAppId);
+      g_ptwndsmshm->Error((TWID_T)pAppId->Id,
+                          pDSId ? (TWID_T)pDSId->Id : 0,
+                          _DG,_DAT,_MSG,
+                          rcDSM,cc);
+    }
+  }
 
-    default:
-      result = TWRC_FAILURE;
-      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
-      break;
+  if (g_ptwndsmmemtrack && (0 != pAppId))
+  {
+    g_ptwndsmmemtrack->Leave(uMemTrack);
   }
 
-  return result;
+  return rcDSM;
 }
 
 
 
 /*
-* Handle DAT_PARENT.  This is where the DSM is expected to
-* do most of its contribution, which is finding drivers for
-* the application...
+* DSM_EntryAsync lands here.  We only check what's needed to queue the
+* triplet, it goes through DSM_Entry on the driver's thread, where it
+* gets logged and checked like any other...
 */
-TW_INT16 CTwnDsm::DSM_Parent(TW_IDENTITY  *_pAppId,
-                             TW_UINT16     _MSG,
-                             TW_MEMREF     _MemRef)
+TW_UINT16 CTwnDsm::DSM_EntryAsync(TW_IDENTITY  *_pOrigin,
+                                  TW_IDENTITY  *_pDest,
+                                  TW_UINT32    _DG,
+                                  TW_UINT16    _DAT,
+                                  TW_UINT16    _MSG,
+                                  TW_MEMREF    _pData,
+                                  DSMASYNCPROC _pfnDone,
+                                  TW_MEMREF    _pRefCon,
+                                  TW_UINT32   *_pTicket)
 {
-  TW_UINT16 result;
+  TW_TWDSM_SUBMIT twsubmit;
+  TW_INT16        result;
 
   // Validate...
-  if (0 == _pAppId)
+  if (!pod.m_ptwndsmapps->AppValidateId(_pOrigin))
   {
-      kLOG((kLOGERR,"_pAppId is null"));
-      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-      return TWRC_FAILURE;
+    kLOG((kLOGINFO,"Bad TW_IDENTITY"));
+    pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADPROTOCOL);
+    return TWRC_FAILURE;
   }
-
-  // Init stuff...
-  result = TWRC_SUCCESS;
-
-  // Process the message...
-  switch (_MSG)
+  if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pOrigin))
   {
-    case MSG_OPENDSM:
-      // Try to add the proposed item...
-      result = pod.m_ptwndsmapps->AddApp(_pAppId,_MemRef);
-      break;
-
-    case MSG_CLOSEDSM:
-      // Try to remove the proposed item...
-      result = pod.m_ptwndsmapps->RemoveApp(_pAppId);
-      break;
+    kLOG((kLOGERR,"DSM must be open before using DSM_EntryAsync"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pOrigin,TWCC_SEQERROR);
+    return TWRC_FAILURE;
+  }
+  if ((0 == _pDest) || (0 == _pTicket))
+  {
+    kLOG((kLOGERR,"DSM_EntryAsync needs a pDest and a pTicket"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pOrigin,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
 
-    default:
-      result = TWRC_FAILURE;
-      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
-      break;
+  if (g_ptwndsmlog)
+  {
+    char szTriplet[128];
+    StringFromTriplet(szTriplet,NCHARS(szTriplet),_DG,_DAT,_MSG);
+    kLOG((kLOGINFO,"%.32s -> %.32s (async%s)",_pOrigin->ProductName,_pDest->ProductName,_pfnDone ? ", callback" : ""));
+    kLOG((kLOGINFO,"%s",szTriplet));
   }
 
+  memset(&twsubmit,0,sizeof(twsubmit));
+  twsubmit.DsId = (TW_UINT32)_pDest->Id;
+  twsubmit.DG = _DG;
+  twsubmit.DAT = _DAT;
+  twsubmit.MSG = _MSG;
+  twsubmit.pData = _pData;
+  result = DSM_Submit(_pOrigin,MSG_SET,&twsubmit,_pfnDone,_pRefCon);
+  *_pTicket = (TWRC_SUCCESS == result) ? twsubmit.Ticket : 0;
+
   return result;
 }
 
 
 
 /*
-* Handle DAT_IDENTITY.  This is where the DSM is expected to
-* do most of its contribution, which is finding drivers for
-* the application...
+* The read-ahead worker's way to the driver...
 */
-TW_INT16 CTwnDsm::DSM_Identity(TW_IDENTITY  *_pAppId,
-                               TW_UINT16     _MSG,
-                               TW_IDENTITY  *_pDsId)
+TW_UINT16 CTwnDsm::ReadAheadXfer(TW_IDENTITY     *_pAppId,
+                                 TWID_T           _DsId,
+                                 TW_IMAGEMEMXFER *_pMemXfer)
 {
-  TW_INT16  result;
+  TW_UINT16 rcDS;
 
-  // Validate...
-  if (0 == _pAppId || (TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp())
+  try
   {
-      kLOG((kLOGERR,"_pAppId is null"));
-      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-      return TWRC_FAILURE;
+    rcDS = DsEntry(_pAppId,_DsId,DG_IMAGE,DAT_IMAGEMEMXFER,MSG_GET,(TW_MEMREF)_pMemXfer);
   }
-
-  // Init stuff...
-  result = TWRC_SUCCESS;
-
-  // Pick the message...
-  if (dsmState_Open == pod.m_ptwndsmapps->AppGetState(_pAppId))
+  catch(...)
   {
-    switch (_MSG)
-    {
-      case MSG_OPENDS:
-        result = OpenDS(_pAppId,_pDsId);
-        break;
-
-      case MSG_CLOSEDS:
-        result = CloseDS(_pAppId,_pDsId);
-        break;
+    rcDS = TWRC_FAILURE;
+    kLOG((kLOGERR,"Exception caught while DS was reading ahead.  Returning Failure."));
+  }
 
-      case MSG_USERSELECT:
-        result = DSM_SelectDS(_pAppId,_pDsId);
-        break;
+  return rcDS;
+}
 
-      case MSG_GETFIRST:
-        result = DSM_GetFirst(_pAppId,_pDsId);
-        break;
 
-      case MSG_GETNEXT:
-        result = DSM_GetNext(_pAppId,_pDsId);
-        break;
 
-      case MSG_GETDEFAULT:
-        result = GetMatchingDefault(_pAppId,_pDsId);
-        break;
+/*
+* Send a triplet to the driver.  The caller is responsible for the
+* validation, the try/catch and the state flags, we just make the
+* call, count it, and wrap a span around it.  If the driver throws,
+* we put back what we changed on the way in before passing it on...
+*/
+TW_UINT16 CTwnDsm::DsEntry(TW_IDENTITY *_pAppId,
+                           TWID_T       _DsId,
+                           TW_UINT32    _DG,
+                           TW_UINT16    _DAT,
+                           TW_UINT16    _MSG,
+                           TW_MEMREF    _pData)
+{
+  TW_UINT16 rcDS;
+  TW_UINT32 bytes;
+  UINT      uMemTrack = 0;
+  TW_UINT32 nLength = 0;
+  TW_UINT16 ccConvert = TWCC_SUCCESS;
+  bool      bConvert = false;
+  TW_UINT32 nGuardLength = 0;
+  TW_UINT16 ccChecksum;
+  bool      bChecksum = false;
+
+  // The driver has a thread of its own, so the call is made there,
+  // and it comes back through here...
+  if (   g_ptwndsmactor->IsEnabled()
+      && g_ptwndsmactor->Call(_pAppId,_DsId,_DG,_DAT,_MSG,_pData,&rcDS))
+  {
+    return rcDS;
+  }
 
-      case MSG_SET:
-        result = DSM_SetDefaultDS(_pAppId,_pDsId);
-        break;
+  // Whatever the driver allocates is charged to it, even when we're
+  // the ones calling it (DSM triplets, the read-ahead worker)...
+  if (g_ptwndsmmemtrack)
+  {
+    uMemTrack = g_ptwndsmmemtrack->Enter((TWID_T)_pAppId->Id,_DsId);
+  }
+  if (g_ptwndsmshm)
+  {
+    g_ptwndsmshm->DsEnter((TWID_T)_pAppId->Id);
+  }
+  kPROBE5(ds__entry,(TWID_T)_pAppId->Id,_DsId,_DG,_DAT,_MSG);
 
-      default:
-        result = TWRC_FAILURE;
-        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
-        break;
-    }
+  // The first image triplet after MSG_XFERREADY stops the clock...
+  if ((DG_IMAGE == _DG) && g_ptwndsmmetrics)
+  {
+    RecordLatency("respond",_pAppId,_DsId,MSG_XFERREADY,g_ptwndsmmetrics->Transfer((TWID_T)_pAppId->Id,_DsId));
   }
-  else
+
+  // Pixel conversion may need the driver to send fewer rows...
+  if (   g_ptwndsmconvert
+      && (DG_IMAGE == _DG)
+      && (DAT_IMAGEMEMXFER == _DAT)
+      && (MSG_GET == _MSG)
+      && (0 != _pData))
   {
-    result = TWRC_FAILURE;
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    bConvert = g_ptwndsmconvert->Before((TWID_T)_pAppId->Id,_DsId,(TW_IMAGEMEMXFER*)_pData,&nLength,&ccConvert);
   }
 
-  return result;
-}
+  // Hold back the guard bytes, once the conversion has had its say...
+  if (   (TWCC_SUCCESS == ccConvert)
+      && g_ptwndsmchecksum
+      && g_ptwndsmchecksum->IsEnabled()
+      && (DG_IMAGE == _DG)
+      && ((DAT_IMAGEMEMXFER == _DAT) || (DAT_IMAGEMEMFILEXFER == _DAT))
+      && (MSG_GET == _MSG)
+      && (0 != _pData))
+  {
+    nGuardLength = g_ptwndsmchecksum->Before((TWID_T)_pAppId->Id,_DsId,(TW_IMAGEMEMXFER*)_pData);
+    bChecksum = true;
+  }
 
-/*
-* Handle DAT_TWUNKIDENTITY.  This is here for backwards compatibility. 
-* DAT_TWUNKIDENTITY is undocumented.  It was used by the Twunking
-* layer.  Some old applications use it to get the path to the DS.
-* We need to continue to support it.
-*/
-TW_INT16 CTwnDsm::DSM_TwunkIdentity(TW_IDENTITY  *_pAppId,
-                                    TW_UINT16     _MSG,
-                                TW_TWUNKIDENTITY *_pTwunkId)
-{
-  TW_INT16  result = TWRC_SUCCESS;
-
-  // Validate...
-  if (0 == _pAppId || (TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp())
-  {
-    kLOG((kLOGERR,"_pAppId is null"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-    return TWRC_FAILURE;
-  }
-  else if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
+  // A converted row won't fit, so there's no point in asking...
+  if (TWCC_SUCCESS != ccConvert)
   {
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
-    return TWRC_FAILURE;
+    rcDS = TWRC_FAILURE;
   }
-  else if (MSG_GET != _MSG)
+
+  else
   {
-    kLOG((kLOGERR,"protocol error"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
-    return TWRC_FAILURE;
+    try
+    {
+      // Not tracing, so just make the call...
+      if (!g_ptwndsmtrace || !g_ptwndsmtrace->IsEnabled())
+      {
+        rcDS = (pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,_DsId))(_pAppId,_DG,_DAT,_MSG,_pData);
+      }
+      else
+      {
+        rcDS = DsEntryTraced(_pAppId,_DsId,_DG,_DAT,_MSG,_pData);
+      }
+    }
+    catch(...)
+    {
+      if (bChecksum)
+      {
+        ((TW_IMAGEMEMXFER*)_pData)->Memory.Length = nGuardLength;
+      }
+      if (bConvert)
+      {
+        ((TW_IMAGEMEMXFER*)_pData)->Memory.Length = nLength;
+      }
+      if (g_ptwndsmshm)
+      {
+        g_ptwndsmshm->DsLeave((TWID_T)_pAppId->Id,0);
+      }
+      if (g_ptwndsmmemtrack)
+      {
+        g_ptwndsmmemtrack->Leave(uMemTrack);
+      }
+      throw;
+    }
   }
-  else if (0 == _pTwunkId)
+  kPROBE6(ds__return,(TWID_T)_pAppId->Id,_DsId,_DG,_DAT,_MSG,rcDS);
+
+  // Check the data before anything else gets to touch it...
+  if (bChecksum)
   {
-    kLOG((kLOGERR,"_pTwunkId is null"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-    return TWRC_FAILURE;
+    ccChecksum = g_ptwndsmchecksum->After((TWID_T)_pAppId->Id,_DsId,_DAT,(TW_IMAGEMEMXFER*)_pData,nGuardLength,(TW_INT16)rcDS);
+    if (TWCC_SUCCESS != ccChecksum)
+    {
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,ccChecksum);
+      rcDS = TWRC_FAILURE;
+    }
   }
-  // Check that the DSID is valid...
-  else if (!pod.m_ptwndsmapps->AppValidateIds(_pAppId,&_pTwunkId->identity))
+  else if (   g_ptwndsmchecksum
+           && g_ptwndsmchecksum->IsEnabled())
   {
-    pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADVALUE);
-    return TWRC_FAILURE;
+    g_ptwndsmchecksum->Returned((TWID_T)_pAppId->Id,_DsId,_DG,_DAT,_pData,(TW_INT16)rcDS);
   }
 
-  SSTRCPY((char*)_pTwunkId->dsPath, sizeof(_pTwunkId->dsPath),(char*)pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pTwunkId->identity.Id));
-
-  return result;
-}
-
-
-
-/*
-* Handle DAT_ENTRYPOINT.  This handles an application asking
-* for entry point information.  Drivers have this information
-* pushed to them in a different part of the code (just before
-* DG_CONTORL/DAT_IDENTITY/MSG_OPENDS is received)
-*/
-TW_INT16 CTwnDsm::DSM_Entrypoint(TW_IDENTITY    *_pAppId,
-                                 TW_UINT16      _MSG,
-                                 TW_ENTRYPOINT  *_pEntrypoint)
-{
-  // Validate...
-  if (0 == _pAppId)
+  // Convert the strip, or tell the converter what's coming...
+  if (bConvert)
   {
-    kLOG((kLOGERR,"_pAppId is null"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-    return TWRC_FAILURE;
+    if ((TWRC_SUCCESS == rcDS) || (TWRC_XFERDONE == rcDS))
+    {
+      ccConvert = g_ptwndsmconvert->After((TWID_T)_pAppId->Id,_DsId,(TW_IMAGEMEMXFER*)_pData,nLength);
+    }
+    else
+    {
+      ((TW_IMAGEMEMXFER*)_pData)->Memory.Length = nLength;
+    }
   }
-  else if (MSG_GET != _MSG)
+  else if (   g_ptwndsmconvert
+           && (DG_IMAGE == _DG)
+           && (DAT_IMAGEINFO == _DAT)
+           && (TWRC_SUCCESS == rcDS)
+           && (0 != _pData))
   {
-    kLOG((kLOGERR,"protocol error"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
-    return TWRC_FAILURE;
+    g_ptwndsmconvert->ImageInfo((TWID_T)_pAppId->Id,_DsId,(TW_IMAGEINFO*)_pData);
   }
-  else if (0 == _pEntrypoint)
+  if (TWCC_SUCCESS != ccConvert)
   {
-    kLOG((kLOGERR,"_pEntrypoint is null"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-    return TWRC_FAILURE;
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,ccConvert);
+    rcDS = TWRC_FAILURE;
   }
-  else if (0 == _pEntrypoint->Size)
+
+  // Content analysis looks at what the application gets, so it comes
+  // after the conversion...
+  if (   g_ptwndsmanalysis
+      && (DG_IMAGE == _DG)
+      && (0 != _pData))
   {
-    kLOG((kLOGERR,"_pEntrypoint is zero, it needs to be set to the size of TW_ENTRYPOINT..."));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-    return TWRC_FAILURE;
+    if ((DAT_IMAGEMEMXFER == _DAT) && (MSG_GET == _MSG))
+    {
+      g_ptwndsmanalysis->MemXfer((TWID_T)_pAppId->Id,_DsId,(TW_IMAGEMEMXFER*)_pData,(TW_INT16)rcDS);
+    }
+    else if ((DAT_IMAGEINFO == _DAT) && (TWRC_SUCCESS == rcDS))
+    {
+      g_ptwndsmanalysis->ImageInfo((TWID_T)_pAppId->Id,_DsId,(TW_IMAGEINFO*)_pData);
+    }
   }
-  else if (!(_pAppId->SupportedGroups & DF_APP2))
+
+  // Follow the driver in and out of state 5, so CloseDS knows if the
+  // warm pool can have it...
+  if ((DG_CONTROL == _DG) && (DAT_USERINTERFACE == _DAT))
   {
-    kLOG((kLOGERR,"_pAppId->SupportedGroups must include the DF_APP2 flag to make this call..."));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
-    return TWRC_FAILURE;
+    if (   ((MSG_ENABLEDS == _MSG) && ((TWRC_SUCCESS == rcDS) || (TWRC_CHECKSTATUS == rcDS)))
+        || ((MSG_ENABLEDSUIONLY == _MSG) && (TWRC_SUCCESS == rcDS)))
+    {
+      pod.m_ptwndsmapps->DsSetEnabled(_pAppId,_DsId,TRUE);
+    }
+    else if ((MSG_DISABLEDS == _MSG) && (TWRC_SUCCESS == rcDS))
+    {
+      pod.m_ptwndsmapps->DsSetEnabled(_pAppId,_DsId,FALSE);
+    }
   }
 
-  // This is the TWAIN 2.0 minimum size.  If we add more values
-  // in future we should create a new structure (ex: TW_ENTRYPOINT2)
-  // and then add an if-statement for it...
-  if (_pEntrypoint->Size < sizeof(TW_ENTRYPOINT))
+  // Memory transfers tell us how much they moved, the others don't...
+  bytes = 0;
+  if (   (DG_IMAGE == _DG)
+      && ((DAT_IMAGEMEMXFER == _DAT) || (DAT_IMAGEMEMFILEXFER == _DAT))
+      && ((TWRC_SUCCESS == rcDS) || (TWRC_XFERDONE == rcDS))
+      && (0 != _pData))
   {
-    kLOG((kLOGERR,"_pEntrypoint->Size minimum is %ld, we got %ld...",sizeof(TW_ENTRYPOINT),_pEntrypoint->Size));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-    return TWRC_FAILURE;
+    bytes = ((TW_IMAGEMEMXFER*)_pData)->BytesWritten;
   }
-
-  // TWAIN 2.0
-  // Stock the structure with interesting stuff...
-  else if (_pEntrypoint->Size == sizeof(TW_ENTRYPOINT))
+  if (g_ptwndsmshm)
   {
-    _pEntrypoint->DSM_Entry        = ::DSM_Entry;
-    _pEntrypoint->DSM_MemAllocate  = DSM_MemAllocate;
-    _pEntrypoint->DSM_MemFree      = DSM_MemFree;
-    _pEntrypoint->DSM_MemLock      = DSM_MemLock;
-    _pEntrypoint->DSM_MemUnlock    = DSM_MemUnlock;
+    g_ptwndsmshm->DsLeave((TWID_T)_pAppId->Id,bytes);
   }
-
-  // Uh-oh...
-  else
+  if (g_ptwndsmmemtrack)
   {
-    kLOG((kLOGERR,"_pEntrypoint->Size cannot be larger than %ld, we got %ld...",sizeof(TW_ENTRYPOINT),_pEntrypoint->Size));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-    return TWRC_FAILURE;
+    g_ptwndsmmemtrack->Leave(uMemTrack);
   }
 
-  // All done...
-  return TWRC_SUCCESS;
+  return rcDS;
 }
 
 
 
 /*
-* We've received a callback.  MSG_REGISTER_CALLBACK are from
-* the Application and MSG_INVOKE_CALLBACK (Mac OSx only) 
-* are from the DS.
-* If Callbacks have not been registered by the App then when the 
-* DS Invokes a callback, make a note of it so the next time the 
-* application hits us with a Windows message for us to process, 
-* we can send it the callback message...
+* We're on the driver's thread, so DsEntry makes the call...
 */
-TW_INT16 CTwnDsm::DSM_Callback(TW_IDENTITY *_pOrigin,
-                               TW_IDENTITY *_pDest,
-                               TW_UINT16    _MSG,
-                               TW_CALLBACK *_pData)
+TW_UINT16 CTwnDsm::ActorEntry(TW_IDENTITY *_pAppId,
+                              TWID_T       _DsId,
+                              TW_UINT32    _DG,
+                              TW_UINT16    _DAT,
+                              TW_UINT16    _MSG,
+                              TW_MEMREF    _pData)
 {
-  TW_INT16      result;
-  TW_CALLBACK  *ptwcallback;
-  TW_CALLBACK2 *ptwcallback2;
+  return DsEntry(_pAppId,_DsId,_DG,_DAT,_MSG,_pData);
+}
 
-  // Init stuff...
-  result = TWRC_SUCCESS;
 
-  // Take action on the message...
-  switch (_MSG)
+
+/*
+* A DAT_TWDSM_SUBMIT ticket is done.  Applications that poll get
+* poked, the rest collect their tickets when they get around to it...
+*/
+void CTwnDsm::ActorWakeup(TW_IDENTITY *_pAppId)
+{
+  if (pod.m_ptwndsmapps->AppHasWakeup(_pAppId))
   {
-    case MSG_REGISTER_CALLBACK:
-      {
-        // Origin is an App
-        // Check that the ids are valid...
-        if (!pod.m_ptwndsmapps->AppValidateIds(_pOrigin,_pDest))
-        {
-          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADPROTOCOL);
-          return TWRC_FAILURE;
-        }
-        if(0 == _pData)
-        {
-          kLOG((kLOGERR,"Invalid data"));
-          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADVALUE);
-          return TWRC_FAILURE;
-        }
+    pod.m_ptwndsmapps->AppWakeup(_pAppId);
+  }
+}
 
-        ptwcallback2 = pod.m_ptwndsmapps->DsCallback2Get(_pOrigin,(TWID_T)_pDest->Id);
-        ptwcallback2->CallBackProc = ((TW_CALLBACK*)_pData)->CallBackProc;
-        ptwcallback2->RefCon = (TWID_T)((TW_CALLBACK*)_pData)->RefCon;
-        ptwcallback2->Message = ((TW_CALLBACK*)_pData)->Message;
-        pod.m_ptwndsmapps->DsCallbackSetWaiting(_pOrigin,(TWID_T)_pDest->Id,FALSE);
-      }
-      break;
 
-    case MSG_INVOKE_CALLBACK:
-      {
-        // For backwards capability only.  MSG_INVOKE_CALLBACK is deprecated - use DAT_NULL
-        // Origin is a DS
-        // Check that the ids are valid...
-        kLOG((kLOGINFO,"MSG_INVOKE_CALLBACK is deprecated - use DAT_NULL"));
-        if (!pod.m_ptwndsmapps->AppValidateIds(_pDest,_pOrigin))
-        {
-          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADPROTOCOL);
-          return TWRC_FAILURE;
-        }
-        if(0 == _pData)
-        {
-          kLOG((kLOGERR,"Invalid data"));
-          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADVALUE);
-          return TWRC_FAILURE;
-        }
 
-        ptwcallback = (TW_CALLBACK*)_pData;
-        result = DSM_Null(_pDest,_pOrigin,ptwcallback->Message);
-      }
-      break;
+/*
+* The modules' way in to the DS_INFO...
+*/
+DS_SESSION *CTwnDsm::DsSession(const TWID_T _AppId,
+                               const TWID_T _DsId)
+{
+  return pod.m_ptwndsmapps->DsGetSession(_AppId,_DsId);
+}
 
-    default:
-      result = TWRC_FAILURE;
-      pod.m_ptwndsmapps->AppSetConditionCode(_pOrigin,TWCC_BADPROTOCOL);
-      break;
-  }
 
-  return result;
+
+/*
+* And to the APP_INFO, for the dispatcher...
+*/
+struct DISPATCH_SESSION_ *CTwnDsm::AppDispatcher(const TWID_T _AppId)
+{
+  return pod.m_ptwndsmapps->AppGetDispatcher(_AppId);
 }
 
 
 
 /*
-* We've received a callback.  MSG_REGISTER_CALLBACK are from
-* the Application and MSG_INVOKE_CALLBACK (Mac OSx only) 
-* are from the DS.
-* If Callbacks have not been registered by the App then when the 
-* DS Invokes a callback, make a note of it so the next time the 
-* application hits us with a Windows message for us to process, 
-* we can send it the callback message...
+* Hang the dispatcher on the APP_INFO, or take it off...
 */
-TW_INT16 CTwnDsm::DSM_Callback2(TW_IDENTITY *_pOrigin,
-                               TW_IDENTITY *_pDest,
-                               TW_UINT16    _MSG,
-                               TW_CALLBACK2 *_pData)
+bool CTwnDsm::AppSetDispatcher(const TWID_T              _AppId,
+                               struct DISPATCH_SESSION_ *_pdispatch)
 {
-  TW_INT16      result;
-  TW_CALLBACK2 *ptwcallback2;
+  return pod.m_ptwndsmapps->AppSetDispatcher(_AppId,_pdispatch);
+}
 
-  // Init stuff...
-  result = TWRC_SUCCESS;
 
-  // Take action on the message...
-  switch (_MSG)
+
+/*
+* The traced half of DsEntry...
+*/
+TW_UINT16 CTwnDsm::DsEntryTraced(TW_IDENTITY *_pAppId,
+                                 TWID_T       _DsId,
+                                 TW_UINT32    _DG,
+                                 TW_UINT16    _DAT,
+                                 TW_UINT16    _MSG,
+                                 TW_MEMREF    _pData)
+{
+  TW_UINT16 rcDS;
+  char      szTriplet[128];
+
+  StringFromTriplet(szTriplet,NCHARS(szTriplet),_DG,_DAT,_MSG);
+  g_ptwndsmtrace->Begin("ds",szTriplet,pod.m_ptwndsmapps->DsGetIdentity(_pAppId,_DsId)->ProductName);
+
+  // Image transfers hang off of the last MSG_XFERREADY...
+  if (DG_IMAGE == _DG)
   {
-    case MSG_REGISTER_CALLBACK:
-      {
-        // Origin is an App
-        // Check that the ids are valid...
-        if (!pod.m_ptwndsmapps->AppValidateIds(_pOrigin,_pDest))
-        {
-          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADPROTOCOL);
-          return TWRC_FAILURE;
-        }
-        if(0 == _pData)
-        {
-          kLOG((kLOGERR,"Invalid data"));
-          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADVALUE);
-          return TWRC_FAILURE;
-        }
+    g_ptwndsmtrace->Flow('t',(TWID_T)_pAppId->Id,_DsId);
+  }
 
-        ptwcallback2 = pod.m_ptwndsmapps->DsCallback2Get(_pOrigin,(TWID_T)_pDest->Id);
-        memcpy(ptwcallback2,_pData,sizeof(*ptwcallback2));
-        pod.m_ptwndsmapps->DsCallbackSetWaiting(_pOrigin,(TWID_T)_pDest->Id,FALSE);
-      }
-      break;
+  try
+  {
+    rcDS = (pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,_DsId))(_pAppId,_DG,_DAT,_MSG,_pData);
+  }
+  catch(...)
+  {
+    g_ptwndsmtrace->End("ds",szTriplet,TWRC_FAILURE);
+    throw;
+  }
 
-    case MSG_INVOKE_CALLBACK:
-      {
-        // For backwards capability only.  MSG_INVOKE_CALLBACK is deprecated - use DAT_NULL
-        // Origin is a DS
-        // Check that the ids are valid...
-        kLOG((kLOGINFO,"MSG_INVOKE_CALLBACK is deprecated - use DAT_NULL"));
-        if (!pod.m_ptwndsmapps->AppValidateIds(_pDest,_pOrigin))
-        {
-          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADPROTOCOL);
-          return TWRC_FAILURE;
-        }
-        if(0 == _pData)
-        {
-          kLOG((kLOGERR,"Invalid data"));
-          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADVALUE);
-          return TWRC_FAILURE;
-        }
+  // The app is done with this image...
+  if (   (DAT_PENDINGXFERS == _DAT)
+      && ((MSG_ENDXFER == _MSG) || (MSG_RESET == _MSG)))
+  {
+    g_ptwndsmtrace->Flow('f',(TWID_T)_pAppId->Id,_DsId);
+  }
 
-        ptwcallback2 = (TW_CALLBACK2*)_pData;
-        result = DSM_Null(_pDest,_pOrigin,ptwcallback2->Message);
-      }
+  g_ptwndsmtrace->End("ds",szTriplet,rcDS);
+  return rcDS;
+}
+
+/*
+* Return the state of the DSM by checking the state of all applications
+*/
+DSM_State CTwnDsm::DSMGetState()
+{
+  DSM_State CurrentState = pod.m_ptwndsmapps->AppGetState();
+  return CurrentState;
+}
+
+/*
+* Handle DAT_STATUS.  Just a few things of note, we handle some
+* DAT_STATUS stuff in DSM_Entry.  And per the spec we have to
+* clear the condition code when we are done.  I've also put in
+* MSG_CHECKSTATUS, because I can't imagine why we have the silly
+* thing if it isn't for this function...
+*/
+TW_INT16 CTwnDsm::DSM_Status(TW_IDENTITY  *_pAppId,
+                             TW_UINT16     _MSG,
+                             TW_STATUS    *_pStatus)
+{
+  TW_INT16 result = TWRC_SUCCESS;
+
+  switch (_MSG)
+  {
+    case MSG_GET:
+    case MSG_CHECKSTATUS:
+       _pStatus->ConditionCode = pod.m_ptwndsmapps->AppGetConditionCode(_pAppId);
+       _pStatus->Reserved = 0;
       break;
 
     default:
       result = TWRC_FAILURE;
-      pod.m_ptwndsmapps->AppSetConditionCode(_pOrigin,TWCC_BADPROTOCOL);
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
       break;
   }
 
@@ -1123,20 +1471,16 @@ TW_INT16 CTwnDsm::DSM_Callback2(TW_IDENTITY *_pOrigin,
 
 
 /*
-* Open the specified driver.  We're using the application identity
-* and the driver identity we picked up during MSG_OPENDSM.  The
-* application is just telling us which driver to load.  As part of
-* a successful open we'll remember this driver's full path and file
-* name as the new default driver.  On Windows this information goes
-* into the registry.  On Linux we put it under the user's home
-* directory...
+* Handle DAT_PARENT.  This is where the DSM is expected to
+* do most of its contribution, which is finding drivers for
+* the application...
 */
-TW_INT16 CTwnDsm::OpenDS(TW_IDENTITY *_pAppId,
-                         TW_IDENTITY *_pDsId)
+TW_INT16 CTwnDsm::DSM_Parent(TW_IDENTITY  *_pAppId,
+                             TW_UINT16     _MSG,
+                             TW_MEMREF     _MemRef)
 {
-  TW_INT16      result;
-  TW_ENTRYPOINT twentrypoint;
- 
+  TW_UINT16 result;
+
   // Validate...
   if (0 == _pAppId)
   {
@@ -1144,1308 +1488,2719 @@ TW_INT16 CTwnDsm::OpenDS(TW_IDENTITY *_pAppId,
       pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
       return TWRC_FAILURE;
   }
-  else if (   ((TWID_T)_pAppId->Id < 1)
-           || ((TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp()))
-  {
-      kLOG((kLOGERR,"id is out of range...%d",(int)(TWID_T)_pAppId->Id));
-      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_MAXCONNECTIONS);
-      return TWRC_FAILURE;
-  }
 
   // Init stuff...
   result = TWRC_SUCCESS;
 
-  // check that we are in the proper state
-  if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
-  {
-    kLOG((kLOGERR,"DSM must be open before opening DS"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
-    return(TWRC_FAILURE);
-  }
-
-  // check for valid data
-  if(0 == _pDsId)
+  // Process the message...
+  switch (_MSG)
   {
-    kLOG((kLOGERR,"_pDsId is null"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
-    return TWRC_FAILURE;
-  }
+    case MSG_OPENDSM:
+      // The log may be waiting for a name...
+      if (g_ptwndsmlog)
+      {
+        char szName[sizeof(TW_STR32) + 1];
+        SSTRNCPY(szName,NCHARS(szName),(char*)_pAppId->ProductName,sizeof(TW_STR32));
+        szName[sizeof(TW_STR32)] = 0;
+        g_ptwndsmlog->SetAppName(szName);
+      }
 
-  // Do we need to find a source to open
-  if (0 == (TWID_T)_pDsId->Id)
-  {
-    // Does the app know the name of the source it wants to open
-    if (0 != _pDsId->ProductName[0])
-    {
-      // The application is passing me a TW_IDENTITY structure that contains
-      // the name of the source to select.
-      result = GetDSFromProductName(_pAppId,_pDsId);
+      // Try to add the proposed item...
+      result = pod.m_ptwndsmapps->AddApp(_pAppId,_MemRef);
 
-      // was the id found or specified by the app?
-      if (TWRC_SUCCESS != result)
+      // Don't inherit the metrics of the last app to have this id...
+      if ((TWRC_SUCCESS == result) && g_ptwndsmmetrics)
       {
-        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_NODS);
-        return result;
+        g_ptwndsmmetrics->Reset((TWID_T)_pAppId->Id);
       }
-    }
+      if ((TWRC_SUCCESS == result) && g_ptwndsmshm)
+      {
+        g_ptwndsmshm->AddApp(_pAppId);
+      }
+      break;
 
-    // Does the application want me to choose the default?
-    // Or no Source located by name
-    if (0 == _pDsId->ProductName[0]) 
-    {
-      // -if the name of the source is NULL, and the id is 0, the application is
-      //  telling me to select the default source.
-      result = GetMatchingDefault(_pAppId,_pDsId);
+    case MSG_CLOSEDSM:
+      // Get the metrics out while we still know who the drivers are...
+      if (pod.m_ptwndsmapps->AppValidateId(_pAppId))
+      {
+        LogLatency(_pAppId);
+        DumpMetrics(_pAppId);
+      }
 
-      // was the id found or specified by the app?
-      if (TWRC_SUCCESS != result)
+      // Try to remove the proposed item, hang on to the id, since
+      // RemoveApp clears it.  The warm drivers are closed first, on
+      // their own threads.  Then the sessions the application left
+      // open end, as they would in CloseDS, and the dispatcher goes,
+      // since RemoveApp throws away the callbacks, and closes what's
+      // still open from this thread...
       {
-        return result;
+        TWID_T AppId = (TWID_T)_pAppId->Id;
+        TWID_T DsId;
+        if (pod.m_ptwndsmapps->AppValidateId(_pAppId))
+        {
+          g_ptwndsmwarmpool->StopApp(AppId);
+          for (DsId = 1; DsId <= pod.m_ptwndsmapps->AppGetNumDs(_pAppId); DsId++)
+          {
+            if (pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,DsId))
+            {
+              StopSession(AppId,DsId,true);
+            }
+          }
+          g_ptwndsmactor->DropTickets(AppId);
+          g_ptwndsmdispatch->StopApp(AppId);
+        }
+        result = pod.m_ptwndsmapps->RemoveApp(_pAppId);
+        if ((TWRC_SUCCESS == result) && g_ptwndsmshm)
+        {
+          g_ptwndsmshm->RemoveApp(AppId);
+        }
+        if ((TWRC_SUCCESS == result) && g_ptwndsmmemtrack)
+        {
+          g_ptwndsmmemtrack->ReportApp(AppId,(char*)_pAppId->ProductName);
+        }
       }
-    }
-  }
+      break;
 
-  // Load the driver...
-  result = pod.m_ptwndsmapps->LoadDS(_pAppId,(TWID_T)_pDsId->Id);
-  if (result != TWRC_SUCCESS)
-  {
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_NODS);
-    return TWRC_FAILURE;
+    default:
+      result = TWRC_FAILURE;
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+      break;
   }
 
-  // open the ds
-  if (0 != pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,(TWID_T)_pDsId->Id))
-  {
-    // If the DS reports support for DF_DS2, then send it our DAT_ENTRYPOINT
-    // information.  Failure to handle this is treated like a failure to open...
-    result = TWRC_SUCCESS;
+  return result;
+}
 
-    // Create a local copy of the AppIdentity
-    TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(_pAppId);
 
-    if (_pDsId->SupportedGroups & DF_DS2)
-    {
-      memset(&twentrypoint,0,sizeof(twentrypoint));
-      twentrypoint.Size = sizeof(TW_ENTRYPOINT);
-      twentrypoint.DSM_Entry        = ::DSM_Entry;
-      twentrypoint.DSM_MemAllocate  = DSM_MemAllocate;
-      twentrypoint.DSM_MemFree      = DSM_MemFree;
-      twentrypoint.DSM_MemLock      = DSM_MemLock;
-      twentrypoint.DSM_MemUnlock    = DSM_MemUnlock;
-      result = pod.m_ptwndsmapps->DsGetEntryProc(&AppId,(TWID_T)_pDsId->Id)(
-                                &AppId,
-                                DG_CONTROL,
-                                DAT_ENTRYPOINT,
-                                MSG_SET,
-                                (TW_MEMREF)&twentrypoint);
-    }
 
-    // We have a problem...
-    if (TWRC_SUCCESS != result)
-    {
-      kLOG((kLOGERR,"DAT_ENTRYPOINT failed..."));
-      pod.m_ptwndsmapps->AppSetConditionCode(&AppId,TWCC_OPERATIONERROR);
-    }
+/*
+* Handle DAT_IDENTITY.  This is where the DSM is expected to
+* do most of its contribution, which is finding drivers for
+* the application...
+*/
+TW_INT16 CTwnDsm::DSM_Identity(TW_IDENTITY  *_pAppId,
+                               TW_UINT16     _MSG,
+                               TW_IDENTITY  *_pDsId)
+{
+  TW_INT16  result;
 
-    // Okay, we're good.  Either we're a 1.x driver, or we were able to
-    // push down our entrypoint info, so open the ds...
-    else
+  // Validate...
+  if (0 == _pAppId || (TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp())
+  {
+      kLOG((kLOGERR,"_pAppId is null"));
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+      return TWRC_FAILURE;
+  }
+
+  // Init stuff...
+  result = TWRC_SUCCESS;
+
+  // Pick the message...
+  if (dsmState_Open == pod.m_ptwndsmapps->AppGetState(_pAppId))
+  {
+    switch (_MSG)
     {
-      result = pod.m_ptwndsmapps->DsGetEntryProc(&AppId,(TWID_T)_pDsId->Id)(
-                                &AppId,
-                                DG_CONTROL,
-                                DAT_IDENTITY,
-                                MSG_OPENDS,
-                                (TW_MEMREF)_pDsId);
+      case MSG_OPENDS:
+        result = OpenDS(_pAppId,_pDsId);
+        if ((TWRC_SUCCESS == result) && g_ptwndsmshm)
+        {
+          int  nNode;
+          UINT nCpus;
+          g_ptwndsmshm->SetDs((TWID_T)_pAppId->Id,_pDsId);
+          if (g_ptwndsmaffinity->Get((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id,&nNode,&nCpus))
+          {
+            g_ptwndsmshm->SetPlacement((TWID_T)_pAppId->Id,nNode,nCpus);
+          }
+        }
+        break;
 
-      // Oh well...
-      if (TWRC_SUCCESS != result)
-      {
-        kLOG((kLOGINFO,"MSG_OPENDS failed..."));
-        TW_UINT16  rcDSMStatus;
-		TW_STATUS  twstatus = { 0, { 0 } };
-        // If the call to MSG_OPENDS fails, then we need to get the DAT_STATUS and squirrel
-        // it away, because we're going to close this data source soon...
-        rcDSMStatus = (pod.m_ptwndsmapps->DsGetEntryProc(&AppId,(TWID_T)_pDsId->Id))(
-					              &AppId,
-					              DG_CONTROL,
-					              DAT_STATUS,
-					              MSG_GET,
-					              (TW_MEMREF)&twstatus);
-        if (rcDSMStatus == TWRC_SUCCESS)
+      case MSG_CLOSEDS:
+        result = CloseDS(_pAppId,_pDsId);
+        if ((TWRC_SUCCESS == result) && g_ptwndsmshm)
         {
-          pod.m_ptwndsmapps->AppSetConditionCode(&AppId,twstatus.ConditionCode);
+          g_ptwndsmshm->SetDs((TWID_T)_pAppId->Id,0);
+          PublishCallbackDepth(_pAppId);
         }
-        else
+        if ((TWRC_SUCCESS == result) && g_ptwndsmmemtrack && _pDsId)
         {
-          pod.m_ptwndsmapps->AppSetConditionCode(&AppId,TWCC_NODS);
+          g_ptwndsmmemtrack->ReportDs((TWID_T)_pAppId->Id,(char*)_pAppId->ProductName,
+                                      (TWID_T)_pDsId->Id,(char*)_pDsId->ProductName);
         }
-      }
-    }
-  }
+        break;
 
-  // Remember that we opened this DS...
-  if (TWRC_SUCCESS == result)
-  {
-    // Starting with TWAIN 2.1 the application will use DAT_IDENTITY / MSG_SET
-    // to set the default DS
-    if( ( _pAppId->ProtocolMajor == 2
-       && _pAppId->ProtocolMinor == 0 )
-     || _pAppId->ProtocolMajor < 2 ) 
-    {
-      #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
-        // skip...
-      #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
-		int iResult;
-        FILE *pfile;
-        char *szHome;
-        char szFile[FILENAME_MAX];
-        szHome = getenv("HOME");
-        if (szHome)
-        {
-          SSTRCPY(szFile,sizeof(szFile),szHome);
-          SSTRCAT(szFile,sizeof(szFile),"/.twndsmrc");
-          mkdir(szFile,0660);
-          SSTRCAT(szFile,sizeof(szFile),"/defaultds");
-          FOPEN(pfile,szFile,"w");
-          if (pfile)
-          {
-            iResult = fwrite
-			(
-				pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pDsId->Id),
-                1,
-                strlen(pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pDsId->Id)),
-                pfile
-			);
-			if (iResult < (int)strlen(pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pDsId->Id)))
-			{
-				kLOG((kLOGERR,"fwrite defaultds failed..."));
-			}
-            fclose(pfile);
-          }
-        }
-      #else
-        #error Sorry, we do not recognize this system...
-      #endif
+      case MSG_USERSELECT:
+        result = DSM_SelectDS(_pAppId,_pDsId);
+        break;
+
+      case MSG_GETFIRST:
+        result = DSM_GetFirst(_pAppId,_pDsId);
+        break;
+
+      case MSG_GETNEXT:
+        result = DSM_GetNext(_pAppId,_pDsId);
+        break;
+
+      case MSG_GETDEFAULT:
+        result = GetMatchingDefault(_pAppId,_pDsId);
+        break;
+
+      case MSG_SET:
+        result = DSM_SetDefaultDS(_pAppId,_pDsId);
+        break;
+
+      default:
+        result = TWRC_FAILURE;
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+        break;
     }
   }
-
-  // If we had an error, make sure we unload the ds...
   else
   {
-    pod.m_ptwndsmapps->UnloadDS(_pAppId,(TWID_T)_pDsId->Id);
+    result = TWRC_FAILURE;
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
   }
 
-  // All done...
   return result;
 }
 
-
-
 /*
-* Close the specified driver...
+* Handle DAT_TWUNKIDENTITY.  This is here for backwards compatibility. 
+* DAT_TWUNKIDENTITY is undocumented.  It was used by the Twunking
+* layer.  Some old applications use it to get the path to the DS.
+* We need to continue to support it.
 */
-TW_INT16 CTwnDsm::CloseDS(TW_IDENTITY *_pAppId,
-                          TW_IDENTITY *_pDsId)
+TW_INT16 CTwnDsm::DSM_TwunkIdentity(TW_IDENTITY  *_pAppId,
+                                    TW_UINT16     _MSG,
+                                TW_TWUNKIDENTITY *_pTwunkId)
 {
-  TW_INT16  result;
+  TW_INT16  result = TWRC_SUCCESS;
 
   // Validate...
-  if (0 == _pAppId)
+  if (0 == _pAppId || (TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp())
   {
     kLOG((kLOGERR,"_pAppId is null"));
     pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
     return TWRC_FAILURE;
   }
-  else if (   ((TWID_T)_pAppId->Id < 1)
-           || ((TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp()))
+  else if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
   {
-    kLOG((kLOGERR,"id out of range...%d",(int)(TWID_T)_pAppId->Id));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
     return TWRC_FAILURE;
   }
-
-  // Init stuff...
-  result = TWRC_SUCCESS;
-
-  // check that we are in the proper state
-  if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
+  else if (MSG_GET != _MSG)
   {
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    kLOG((kLOGERR,"protocol error"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
     return TWRC_FAILURE;
   }
-
-  // Check for valid DS
-  if(0 == _pDsId)
+  else if (0 == _pTwunkId)
   {
-    kLOG((kLOGERR,"_pDsId is null"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
+    kLOG((kLOGERR,"_pTwunkId is null"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
     return TWRC_FAILURE;
   }
-
-  // close the ds
-  if (0 != pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,(TWID_T)_pDsId->Id))
+  // Check that the DSID is valid...
+  else if (!pod.m_ptwndsmapps->AppValidateIds(_pAppId,&_pTwunkId->identity))
   {
-    // Create a local copy of the AppIdentity
-    TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(_pAppId);
-
-    result = (pod.m_ptwndsmapps->DsGetEntryProc(&AppId,(TWID_T)_pDsId->Id))(
-                             &AppId,
-                             DG_CONTROL,
-                             DAT_IDENTITY,
-                             MSG_CLOSEDS,
-                             (TW_MEMREF)_pDsId);
-
-    if (TWRC_SUCCESS != result)
-    {
-      pod.m_ptwndsmapps->AppSetConditionCode(&AppId,TWCC_OPERATIONERROR);
-      return result;
-    }
-
-    // Cleanup...
-    pod.m_ptwndsmapps->UnloadDS(&AppId,(TWID_T)_pDsId->Id);
+    pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADVALUE);
+    return TWRC_FAILURE;
   }
 
-  // All done...
+  SSTRCPY((char*)_pTwunkId->dsPath, sizeof(_pTwunkId->dsPath),(char*)pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pTwunkId->identity.Id));
+
   return result;
 }
 
 
 
-#if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
-/**
-* DllMain is only needed for Windows, and it's only needed to collect
-* our instance handle, which is also our module handle.  Don't ever
-* put anything else in here, not even logging messages.  It just isn't
-* safe...
-* @param[in] _hmodule handle to the application that loaded the DSM
-* @param[in] _dwReasonCalled why this function is being called
-* @return TRUE
+/*
+* Handle DAT_ENTRYPOINT.  This handles an application asking
+* for entry point information.  Drivers have this information
+* pushed to them in a different part of the code (just before
+* DG_CONTORL/DAT_IDENTITY/MSG_OPENDS is received)
 */
-BOOL WINAPI DllMain(HINSTANCE _hmodule,
-                    DWORD     _dwReasonCalled,
-                    LPVOID)
+TW_INT16 CTwnDsm::DSM_Entrypoint(TW_IDENTITY    *_pAppId,
+                                 TW_UINT16      _MSG,
+                                 TW_ENTRYPOINT  *_pEntrypoint)
 {
-  switch (_dwReasonCalled)
+  // Validate...
+  if (0 == _pAppId)
   {
-    case DLL_THREAD_ATTACH:
-    case DLL_THREAD_DETACH:
-      break;
-    case DLL_PROCESS_ATTACH:
-      g_hinstance = _hmodule;
-      break;
-    case DLL_PROCESS_DETACH:
-      if( g_ptwndsm )
-      {
-        if( g_ptwndsm->DSMGetState() == dsmState_Open )
-        {
-          // This should never happen!
-          // The Application should always close any open DS, then Close the DSM.
-          kLOG((kLOGERR,"The DSM was left in an open state when it was unloaded!"));
-        }
-        delete g_ptwndsm;
-        g_ptwndsm = 0;
-      }
-      break;
+    kLOG((kLOGERR,"_pAppId is null"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+  else if (MSG_GET != _MSG)
+  {
+    kLOG((kLOGERR,"protocol error"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+    return TWRC_FAILURE;
+  }
+  else if (0 == _pEntrypoint)
+  {
+    kLOG((kLOGERR,"_pEntrypoint is null"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+  else if (0 == _pEntrypoint->Size)
+  {
+    kLOG((kLOGERR,"_pEntrypoint is zero, it needs to be set to the size of TW_ENTRYPOINT..."));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+  else if (!(_pAppId->SupportedGroups & DF_APP2))
+  {
+    kLOG((kLOGERR,"_pAppId->SupportedGroups must include the DF_APP2 flag to make this call..."));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+    return TWRC_FAILURE;
   }
-  return(TRUE);
-}
-#elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
-    // Nothing for us to do...
-#else
-    #error Sorry, we do not recognize this system...
-#endif
-
 
+  // This is the TWAIN 2.0 minimum size.  If we add more values
+  // in future we should create a new structure (ex: TW_ENTRYPOINT2)
+  // and then add an if-statement for it...
+  if (_pEntrypoint->Size < sizeof(TW_ENTRYPOINT))
+  {
+    kLOG((kLOGERR,"_pEntrypoint->Size minimum is %ld, we got %ld...",sizeof(TW_ENTRYPOINT),_pEntrypoint->Size));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
 
-#if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
-/**
-* We support a selection dialog on Windows.  I wish we didn't, it's
-* more trouble than it's worth, but it's part of that legacy thing.
-* This function is properly constructed for use with DialogBox...
-* @param[in] _hWnd Window handle of the dialog
-* @param[in] _Message message
-* @param[in] _wParam wparam
-* @param[in] _lParam lparam
-* @return FALSE if we processed the message
-*/
-BOOL CALLBACK SelectDlgProc(HWND   _hWnd,
-                            UINT   _Message,
-                            WPARAM _wParam,
-                            LPARAM _lParam)
-{
-  if (g_ptwndsm)
+  // TWAIN 2.0
+  // Stock the structure with interesting stuff...
+  else if (_pEntrypoint->Size == sizeof(TW_ENTRYPOINT))
   {
-    return g_ptwndsm->SelectDlgProc(_hWnd,_Message,_wParam,_lParam);
+    _pEntrypoint->DSM_Entry        = ::DSM_Entry;
+    _pEntrypoint->DSM_MemAllocate  = DSM_MemAllocate;
+    _pEntrypoint->DSM_MemFree      = DSM_MemFree;
+    _pEntrypoint->DSM_MemLock      = DSM_MemLock;
+    _pEntrypoint->DSM_MemUnlock    = DSM_MemUnlock;
   }
+
+  // Uh-oh...
   else
   {
-    return TRUE;
+    kLOG((kLOGERR,"_pEntrypoint->Size cannot be larger than %ld, we got %ld...",sizeof(TW_ENTRYPOINT),_pEntrypoint->Size));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
   }
+
+  // All done...
+  return TWRC_SUCCESS;
 }
-#elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
-  // We don't have one of these...
-#else
-  #error Sorry, we do not recognize this system...
-#endif
 
 
 
-#if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
-/**
-* We support a selection dialog on Windows.  This function is
-* part of our CTwnDsm class, so we don't have to have a lot
-* of pointers, and we can keep things private, unlike what we
-* would have to do if we put this code into the function we
-* actually pass to DialogBox...
-* @param[in] hwnd Window handle of the dialog
-* @param[in] lParam lparam
-* @return TRUE
-*/
-BOOL CALLBACK EnumChildProc
-(
-  HWND hwnd,
-  LPARAM lParam
-)
-{
-  ::SendMessage(hwnd,WM_SETFONT,(WPARAM)lParam,(LPARAM)TRUE);
-  return TRUE;
-}
-
-
-
-BOOL CTwnDsm::SelectDlgProc(HWND hWnd,
-                            UINT Message,
-                            WPARAM wParam,
-                            LPARAM /*lParam - unused*/)
+/*
+* We've received a callback.  MSG_REGISTER_CALLBACK are from
+* the Application and MSG_INVOKE_CALLBACK (Mac OSx only) 
+* are from the DS.
+* If Callbacks have not been registered by the App then when the 
+* DS Invokes a callback, make a note of it so the next time the 
+* application hits us with a Windows message for us to process, 
+* we can send it the callback message...
+*/
+TW_INT16 CTwnDsm::DSM_Callback(TW_IDENTITY *_pOrigin,
+                               TW_IDENTITY *_pDest,
+                               TW_UINT16    _MSG,
+                               TW_CALLBACK *_pData)
 {
-  TW_IDENTITY  *pAppId;
-  int           nIndex;
-  int           nSelect;
-  TW_UINT32     x;
-  char         *szProductName;
-  HWND          hListBox;
-  RECT          rectParent;
-  RECT          rectSelect;
-  HWND          hParent;
-  LANGID        LangId;
-  wchar_t       uzUnicode[128];
-  HFONT         hfont;
-  LOGFONT       lf;
-  POINT         point;
-  int           nWidth;
-  int           nHeight;
+  TW_INT16      result;
+  TW_CALLBACK  *ptwcallback;
+  TW_CALLBACK2 *ptwcallback2;
 
   // Init stuff...
-  nSelect = 0;
-  pAppId = pod.m_pSelectDlgAppId;
+  result = TWRC_SUCCESS;
 
-  // Process the message...
-  switch (Message)
+  // Take action on the message...
+  switch (_MSG)
   {
-    case WM_INITDIALOG:
-      
-      // If the caller wants us to figure out the language, do this...
-      if (pAppId->Version.Language == (TW_UINT16)TWLG_USERLOCALE)
-      {
-      // Try to find the user's default language...
-      LangId = ::GetUserDefaultLangID();
-      for (nIndex = 0;
-           s_twlocalize[nIndex].Language >= 0;
-           nIndex++)
+    case MSG_REGISTER_CALLBACK:
       {
-        if (    (s_twlocalize[nIndex].LangId == LangId)
-            &&  s_twlocalize[nIndex].LangId
-            &&  s_twlocalize[nIndex].Title
-            &&  s_twlocalize[nIndex].Title[0]
-            &&  s_twlocalize[nIndex].Sources
-            &&  s_twlocalize[nIndex].Sources[0]
-            &&  s_twlocalize[nIndex].Select
-            &&  s_twlocalize[nIndex].Select[0]
-            &&  s_twlocalize[nIndex].Cancel
-            &&  s_twlocalize[nIndex].Cancel[0])
+        // Origin is an App
+        // Check that the ids are valid...
+        if (!pod.m_ptwndsmapps->AppValidateIds(_pOrigin,_pDest))
         {
-            break;
+          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADPROTOCOL);
+          return TWRC_FAILURE;
+        }
+        if(0 == _pData)
+        {
+          kLOG((kLOGERR,"Invalid data"));
+          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADVALUE);
+          return TWRC_FAILURE;
         }
+
+        ptwcallback2 = pod.m_ptwndsmapps->DsCallback2Get(_pOrigin,(TWID_T)_pDest->Id);
+        ptwcallback2->CallBackProc = ((TW_CALLBACK*)_pData)->CallBackProc;
+        ptwcallback2->RefCon = (TWID_T)((TW_CALLBACK*)_pData)->RefCon;
+        ptwcallback2->Message = ((TW_CALLBACK*)_pData)->Message;
+        pod.m_ptwndsmapps->DsEventClear(_pOrigin,(TWID_T)_pDest->Id);
       }
+      break;
 
-      // If that doesn't work, try for the primary language...
-      if (s_twlocalize[nIndex].Language < 0)
+    case MSG_INVOKE_CALLBACK:
       {
-        LangId &= 0xFF;
-        for (nIndex = 0;
-             s_twlocalize[nIndex].Language >= 0;
-             nIndex++)
+        // For backwards capability only.  MSG_INVOKE_CALLBACK is deprecated - use DAT_NULL
+        // Origin is a DS
+        // Check that the ids are valid...
+        kLOG((kLOGINFO,"MSG_INVOKE_CALLBACK is deprecated - use DAT_NULL"));
+        if (!pod.m_ptwndsmapps->AppValidateIds(_pDest,_pOrigin))
         {
-          if (  ((s_twlocalize[nIndex].LangId & 0xFF) == LangId)
-            &&  s_twlocalize[nIndex].LangId
-            &&  s_twlocalize[nIndex].Title
-            &&  s_twlocalize[nIndex].Title[0]
-            &&  s_twlocalize[nIndex].Sources
-            &&  s_twlocalize[nIndex].Sources[0]
-            &&  s_twlocalize[nIndex].Select
-            &&  s_twlocalize[nIndex].Select[0]
-            &&  s_twlocalize[nIndex].Cancel
-            &&  s_twlocalize[nIndex].Cancel[0])
-          {
-            break;
-          }
+          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADPROTOCOL);
+          return TWRC_FAILURE;
+        }
+        if(0 == _pData)
+        {
+          kLOG((kLOGERR,"Invalid data"));
+          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADVALUE);
+          return TWRC_FAILURE;
         }
+
+        ptwcallback = (TW_CALLBACK*)_pData;
+        result = DSM_Null(_pDest,_pOrigin,ptwcallback->Message);
       }
-    }
+      break;
 
-    // Otherwise, use whatever the caller gave us...
-    else
-    {
-      for (nIndex = 0;
-           s_twlocalize[nIndex].Language >= 0;
-           nIndex++)
+    default:
+      result = TWRC_FAILURE;
+      pod.m_ptwndsmapps->AppSetConditionCode(_pOrigin,TWCC_BADPROTOCOL);
+      break;
+  }
+
+  return result;
+}
+
+
+
+/*
+* We've received a callback.  MSG_REGISTER_CALLBACK are from
+* the Application and MSG_INVOKE_CALLBACK (Mac OSx only) 
+* are from the DS.
+* If Callbacks have not been registered by the App then when the 
+* DS Invokes a callback, make a note of it so the next time the 
+* application hits us with a Windows message for us to process, 
+* we can send it the callback message...
+*/
+TW_INT16 CTwnDsm::DSM_Callback2(TW_IDENTITY *_pOrigin,
+                               TW_IDENTITY *_pDest,
+                               TW_UINT16    _MSG,
+                               TW_CALLBACK2 *_pData)
+{
+  TW_INT16      result;
+  TW_CALLBACK2 *ptwcallback2;
+
+  // Init stuff...
+  result = TWRC_SUCCESS;
+
+  // Take action on the message...
+  switch (_MSG)
+  {
+    case MSG_REGISTER_CALLBACK:
       {
-        if (    (s_twlocalize[nIndex].Language == pAppId->Version.Language)
-            &&  s_twlocalize[nIndex].LangId
-            &&  s_twlocalize[nIndex].Title
-            &&  s_twlocalize[nIndex].Title[0]
-            &&  s_twlocalize[nIndex].Sources
-            &&  s_twlocalize[nIndex].Sources[0]
-            &&  s_twlocalize[nIndex].Select
-            &&  s_twlocalize[nIndex].Select[0]
-            &&  s_twlocalize[nIndex].Cancel
-            &&  s_twlocalize[nIndex].Cancel[0])
+        // Origin is an App
+        // Check that the ids are valid...
+        if (!pod.m_ptwndsmapps->AppValidateIds(_pOrigin,_pDest))
         {
-          break;
+          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADPROTOCOL);
+          return TWRC_FAILURE;
+        }
+        if(0 == _pData)
+        {
+          kLOG((kLOGERR,"Invalid data"));
+          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADVALUE);
+          return TWRC_FAILURE;
         }
+
+        ptwcallback2 = pod.m_ptwndsmapps->DsCallback2Get(_pOrigin,(TWID_T)_pDest->Id);
+        memcpy(ptwcallback2,_pData,sizeof(*ptwcallback2));
+        pod.m_ptwndsmapps->DsEventClear(_pOrigin,(TWID_T)_pDest->Id);
       }
-    }
+      break;
 
-    // If we didn't find our language, go for English...
-    if (s_twlocalize[nIndex].Language < 0)
-    {
-      for (nIndex = 0;
-           s_twlocalize[nIndex].Language >= 0;
-           nIndex++)
+    case MSG_INVOKE_CALLBACK:
       {
-        if (    (s_twlocalize[nIndex].Language == TWLG_ENGLISH)
-            &&  s_twlocalize[nIndex].LangId
-            &&  s_twlocalize[nIndex].Title
-            &&  s_twlocalize[nIndex].Title[0]
-            &&  s_twlocalize[nIndex].Sources
-            &&  s_twlocalize[nIndex].Sources[0]
-            &&  s_twlocalize[nIndex].Select
-            &&  s_twlocalize[nIndex].Select[0]
-            &&  s_twlocalize[nIndex].Cancel
-            &&  s_twlocalize[nIndex].Cancel[0])
+        // For backwards capability only.  MSG_INVOKE_CALLBACK is deprecated - use DAT_NULL
+        // Origin is a DS
+        // Check that the ids are valid...
+        kLOG((kLOGINFO,"MSG_INVOKE_CALLBACK is deprecated - use DAT_NULL"));
+        if (!pod.m_ptwndsmapps->AppValidateIds(_pDest,_pOrigin))
         {
-          break;
+          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADPROTOCOL);
+          return TWRC_FAILURE;
+        }
+        if(0 == _pData)
+        {
+          kLOG((kLOGERR,"Invalid data"));
+          pod.m_ptwndsmapps->AppSetConditionCode(0,TWCC_BADVALUE);
+          return TWRC_FAILURE;
         }
+
+        ptwcallback2 = (TW_CALLBACK2*)_pData;
+        result = DSM_Null(_pDest,_pOrigin,ptwcallback2->Message);
       }
-    }
+      break;
 
-    // If we found something, then use it...
-    if (s_twlocalize[nIndex].Language >= 0)
-    {
-      // Set our font...
-      memset(&lf,0,sizeof(lf));
-      lf.lfHeight = 16;
-      lf.lfCharSet = s_twlocalize[nIndex].CharSet;
-      hfont = CreateFontIndirect(&lf);
-      EnumChildWindows(hWnd,EnumChildProc,(LPARAM)hfont);
+    default:
+      result = TWRC_FAILURE;
+      pod.m_ptwndsmapps->AppSetConditionCode(_pOrigin,TWCC_BADPROTOCOL);
+      break;
+  }
 
-      MultiByteToWideChar(CP_UTF8,0,s_twlocalize[nIndex].Title,-1,uzUnicode,sizeof(uzUnicode)/sizeof(*uzUnicode));
-      SetWindowTextW(hWnd,uzUnicode);
+  return result;
+}
 
-      MultiByteToWideChar(CP_UTF8,0,s_twlocalize[nIndex].Sources,-1,uzUnicode,sizeof(uzUnicode)/sizeof(*uzUnicode));
-      SetWindowTextW(::GetDlgItem(hWnd,IDC_STATIC),uzUnicode);
 
-      MultiByteToWideChar(CP_UTF8,0,s_twlocalize[nIndex].Select,-1,uzUnicode,sizeof(uzUnicode)/sizeof(*uzUnicode));
-      SetWindowTextW(::GetDlgItem(hWnd,IDOK),uzUnicode);
 
-      MultiByteToWideChar(CP_UTF8,0,s_twlocalize[nIndex].Cancel,-1,uzUnicode,sizeof(uzUnicode)/sizeof(*uzUnicode));
-      SetWindowTextW(::GetDlgItem(hWnd,IDCANCEL),uzUnicode);
+/*
+* Open the specified driver.  We're using the application identity
+* and the driver identity we picked up during MSG_OPENDSM.  The
+* application is just telling us which driver to load.  As part of
+* a successful open we'll remember this driver's full path and file
+* name as the new default driver.  On Windows this information goes
+* into the registry.  On Linux we put it under the user's home
+* directory...
+*/
+TW_INT16 CTwnDsm::OpenDS(TW_IDENTITY *_pAppId,
+                         TW_IDENTITY *_pDsId)
+{
+  TW_INT16      result;
+  TW_ENTRYPOINT twentrypoint;
+  bool          bWarm;
+ 
+  // Validate...
+  if (0 == _pAppId)
+  {
+      kLOG((kLOGERR,"_pAppId is null"));
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+      return TWRC_FAILURE;
+  }
+  else if (   ((TWID_T)_pAppId->Id < 1)
+           || ((TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp()))
+  {
+      kLOG((kLOGERR,"id is out of range...%d",(int)(TWID_T)_pAppId->Id));
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_MAXCONNECTIONS);
+      return TWRC_FAILURE;
+  }
+
+  // Init stuff...
+  result = TWRC_SUCCESS;
+
+  // check that we are in the proper state
+  if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
+  {
+    kLOG((kLOGERR,"DSM must be open before opening DS"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    return(TWRC_FAILURE);
+  }
+
+  // check for valid data
+  if(0 == _pDsId)
+  {
+    kLOG((kLOGERR,"_pDsId is null"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
+    return TWRC_FAILURE;
+  }
+
+  // Do we need to find a source to open
+  if (0 == (TWID_T)_pDsId->Id)
+  {
+    // Does the app know the name of the source it wants to open
+    if (0 != _pDsId->ProductName[0])
+    {
+      // The application is passing me a TW_IDENTITY structure that contains
+      // the name of the source to select.
+      result = GetDSFromProductName(_pAppId,_pDsId);
+
+      // was the id found or specified by the app?
+      if (TWRC_SUCCESS != result)
+      {
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_NODS);
+        return result;
+      }
     }
 
-      hListBox = ::GetDlgItem(hWnd,ID_LST_SOURCES);
-      if (hListBox) 
+    // Does the application want me to choose the default?
+    // Or no Source located by name
+    if (0 == _pDsId->ProductName[0]) 
+    {
+      // -if the name of the source is NULL, and the id is 0, the application is
+      //  telling me to select the default source.
+      result = GetMatchingDefault(_pAppId,_pDsId);
+
+      // was the id found or specified by the app?
+      if (TWRC_SUCCESS != result)
       {
-        SendMessage(hListBox,LB_RESETCONTENT,(WPARAM)NULL,(LPARAM)NULL);
+        return result;
+      }
+    }
+  }
 
-        for (x = 1; x < MAX_NUM_DS; ++x)
+  // We may have kept it open from the last time...
+  bWarm = g_ptwndsmwarmpool->IsEnabled() && WarmPoolTake(_pAppId,_pDsId);
+
+  // Load the driver...
+  if (!bWarm)
+  {
+    result = pod.m_ptwndsmapps->LoadDS(_pAppId,(TWID_T)_pDsId->Id);
+    if (result != TWRC_SUCCESS)
+    {
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_NODS);
+      return TWRC_FAILURE;
+    }
+
+    // Work out where the session runs before any of its threads start...
+    g_ptwndsmaffinity->Place(pod.m_ptwndsmapps->AppGetIdentity(_pAppId),_pDsId);
+
+    // Give the driver its own thread, if we're doing that, so that
+    // everything from DAT_ENTRYPOINT on is made from it...
+    (void)g_ptwndsmactor->Start(pod.m_ptwndsmapps->AppGetIdentity(_pAppId),_pDsId);
+  }
+
+  // open the ds
+  if (   !bWarm
+      && (0 != pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,(TWID_T)_pDsId->Id)))
+  {
+    // If the DS reports support for DF_DS2, then send it our DAT_ENTRYPOINT
+    // information.  Failure to handle this is treated like a failure to open...
+    result = TWRC_SUCCESS;
+
+    // Create a local copy of the AppIdentity
+    TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(_pAppId);
+
+    if (_pDsId->SupportedGroups & DF_DS2)
+    {
+      memset(&twentrypoint,0,sizeof(twentrypoint));
+      twentrypoint.Size = sizeof(TW_ENTRYPOINT);
+      twentrypoint.DSM_Entry        = ::DSM_Entry;
+      twentrypoint.DSM_MemAllocate  = DSM_MemAllocate;
+      twentrypoint.DSM_MemFree      = DSM_MemFree;
+      twentrypoint.DSM_MemLock      = DSM_MemLock;
+      twentrypoint.DSM_MemUnlock    = DSM_MemUnlock;
+      result = DsEntry(&AppId,
+                       (TWID_T)_pDsId->Id,
+                       DG_CONTROL,
+                       DAT_ENTRYPOINT,
+                       MSG_SET,
+                       (TW_MEMREF)&twentrypoint);
+    }
+
+    // We have a problem...
+    if (TWRC_SUCCESS != result)
+    {
+      kLOG((kLOGERR,"DAT_ENTRYPOINT failed..."));
+      pod.m_ptwndsmapps->AppSetConditionCode(&AppId,TWCC_OPERATIONERROR);
+    }
+
+    // Okay, we're good.  Either we're a 1.x driver, or we were able to
+    // push down our entrypoint info, so open the ds...
+    else
+    {
+      result = DsEntry(&AppId,
+                       (TWID_T)_pDsId->Id,
+                       DG_CONTROL,
+                       DAT_IDENTITY,
+                       MSG_OPENDS,
+                       (TW_MEMREF)_pDsId);
+
+      // Oh well...
+      if (TWRC_SUCCESS != result)
+      {
+        kLOG((kLOGINFO,"MSG_OPENDS failed..."));
+        TW_UINT16  rcDSMStatus;
+		TW_STATUS  twstatus = { 0, { 0 } };
+        // If the call to MSG_OPENDS fails, then we need to get the DAT_STATUS and squirrel
+        // it away, because we're going to close this data source soon...
+        rcDSMStatus = DsEntry(&AppId,
+					              (TWID_T)_pDsId->Id,
+					              DG_CONTROL,
+					              DAT_STATUS,
+					              MSG_GET,
+					              (TW_MEMREF)&twstatus);
+        if (rcDSMStatus == TWRC_SUCCESS)
         {
-          // We expect the list to be contiguous...
-          szProductName = pod.m_ptwndsmapps->DsGetIdentity(pAppId,x)->ProductName;
-          if (!szProductName[0])
-          {
-              break;
-          }
-          // Display the name...
-          nIndex = (int)SendMessage(hListBox,LB_ADDSTRING,(WPARAM)NULL,(LPARAM)szProductName);
-          if (LB_ERR == nIndex)
-          {
-            break;
-          }
-          // Associate the id with the name...
-          nIndex = (int)SendMessage(hListBox,
-                                    LB_SETITEMDATA,
-                                    (WPARAM)nIndex,
-                                    (LPARAM)pod.m_ptwndsmapps->DsGetIdentity(pAppId,x)->Id);
-          if (LB_ERR == nIndex)
-          {
-            break;
-          }
-          // Remember this item if it's the default...
-          if (!strcmp(pod.m_ptwndsmapps->DsGetPath(pAppId,x),pod.m_DefaultDSPath))
-          {
-            nSelect = x;
-          }
+          pod.m_ptwndsmapps->AppSetConditionCode(&AppId,twstatus.ConditionCode);
         }
-        // If we have no drivers, then disable the OK button...
-        if (pod.m_ptwndsmapps->AppGetNumDs(pAppId) < 1)
+        else
         {
-          HWND hOK= ::GetDlgItem(hWnd,IDOK);
-          EnableWindow(hOK, FALSE);
+          pod.m_ptwndsmapps->AppSetConditionCode(&AppId,TWCC_NODS);
         }
-        // Otherwise select the defaulted item...
-        else
+      }
+    }
+  }
+
+  // Remember that we opened this DS...
+  if (TWRC_SUCCESS == result)
+  {
+    // Starting with TWAIN 2.1 the application will use DAT_IDENTITY / MSG_SET
+    // to set the default DS
+    if( ( _pAppId->ProtocolMajor == 2
+       && _pAppId->ProtocolMinor == 0 )
+     || _pAppId->ProtocolMajor < 2 ) 
+    {
+      #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+        // skip...
+      #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+		int iResult;
+        FILE *pfile;
+        char *szHome;
+        char szFile[FILENAME_MAX];
+        szHome = getenv("HOME");
+        if (szHome)
         {
-          nIndex = (int)SendMessage(hListBox,
-                                    LB_FINDSTRINGEXACT,
-                                    (WPARAM)-1,
-                                    (LPARAM)pod.m_ptwndsmapps->DsGetIdentity(pAppId,nSelect)->ProductName);
-          if (LB_ERR == nIndex)
+          SSTRCPY(szFile,sizeof(szFile),szHome);
+          SSTRCAT(szFile,sizeof(szFile),"/.twndsmrc");
+          mkdir(szFile,0660);
+          SSTRCAT(szFile,sizeof(szFile),"/defaultds");
+          FOPEN(pfile,szFile,"w");
+          if (pfile)
           {
-            nIndex = 0;
+            iResult = fwrite
+			(
+				pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pDsId->Id),
+                1,
+                strlen(pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pDsId->Id)),
+                pfile
+			);
+			if (iResult < (int)strlen(pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pDsId->Id)))
+			{
+				kLOG((kLOGERR,"fwrite defaultds failed..."));
+			}
+            fclose(pfile);
           }
-          SendMessage(hListBox,LB_SETCURSEL,(WPARAM)nIndex,(LPARAM)NULL);
         }
-      }
+      #else
+        #error Sorry, we do not recognize this system...
+      #endif
+    }
+  }
 
-    // Center our dialog on the window reported to us in MSG_OPENDS...
-    hParent = (HWND)pod.m_ptwndsmapps->AppHwnd(pAppId);
-    if (hParent)
-    {
-      GetClientRect(hParent,&rectParent);
-      GetWindowRect(hWnd,&rectSelect);
-          nWidth  = (rectSelect.right - rectSelect.left);
-          nHeight = (rectSelect.bottom - rectSelect.top);
-      point.x = (rectParent.right - rectParent.left) / 2;
-      point.y = (rectParent.bottom - rectParent.top) / 2;
-      ClientToScreen(hParent,&point);
-      point.x -= nWidth / 2;
-      point.y -= nHeight / 2;
-      // keep the dialog visible on the screen
-      if(point.x < 0)
-      {
-        point.x = 0;
-      }
-      if(point.y < 0)
+  // If we had an error, make sure we unload the ds...
+  else
+  {
+    StopSession((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id,true);
+    pod.m_ptwndsmapps->UnloadDS(_pAppId,(TWID_T)_pDsId->Id);
+  }
+
+  // All done...
+  return result;
+}
+
+
+
+/*
+* Close the specified driver...
+*/
+TW_INT16 CTwnDsm::CloseDS(TW_IDENTITY *_pAppId,
+                          TW_IDENTITY *_pDsId)
+{
+  TW_INT16  result;
+
+  // Validate...
+  if (0 == _pAppId)
+  {
+    kLOG((kLOGERR,"_pAppId is null"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+  else if (   ((TWID_T)_pAppId->Id < 1)
+           || ((TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp()))
+  {
+    kLOG((kLOGERR,"id out of range...%d",(int)(TWID_T)_pAppId->Id));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+
+  // Init stuff...
+  result = TWRC_SUCCESS;
+
+  // check that we are in the proper state
+  if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
+  {
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    return TWRC_FAILURE;
+  }
+
+  // Check for valid DS
+  if(0 == _pDsId)
+  {
+    kLOG((kLOGERR,"_pDsId is null"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
+    return TWRC_FAILURE;
+  }
+
+  // It's already closed, we're just keeping it warm...
+  if (g_ptwndsmwarmpool->IsParked((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id))
+  {
+    kLOG((kLOGINFO,"DS is not open"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    return TWRC_FAILURE;
+  }
+
+  // We'd be waiting for ourselves to finish the strip...
+  if (g_ptwndsmreadahead->OnWorker((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id))
+  {
+    kLOG((kLOGERR,"MSG_CLOSEDS from a read-ahead callback.  Returning Failure."));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    return TWRC_FAILURE;
+  }
+
+  // close the ds
+  if (0 != pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,(TWID_T)_pDsId->Id))
+  {
+    // Create a local copy of the AppIdentity
+    TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(_pAppId);
+    bool        bParked = false;
+
+    // Keep it open for a while, in case the application wants it
+    // back.  Forget about its callback and its messages, they were
+    // for the session that's ending.  Only a driver in state 4 would
+    // have agreed to MSG_CLOSEDS, so anything else gets the real one
+    // and says no for itself...
+    if (   g_ptwndsmwarmpool->IsEnabled()
+        && !pod.m_ptwndsmapps->DsIsEnabled(&AppId,(TWID_T)_pDsId->Id))
+    {
+      TW_IDENTITY *pDsIdentity = pod.m_ptwndsmapps->DsGetIdentity(&AppId,(TWID_T)_pDsId->Id);
+      if (pDsIdentity && g_ptwndsmwarmpool->Park(&AppId,pDsIdentity))
+      {
+        TW_CALLBACK2 *ptwcallback2 = pod.m_ptwndsmapps->DsCallback2Get(&AppId,(TWID_T)_pDsId->Id);
+        if (ptwcallback2)
+        {
+          memset(ptwcallback2,0,sizeof(*ptwcallback2));
+        }
+        pod.m_ptwndsmapps->DsEventClear(&AppId,(TWID_T)_pDsId->Id);
+        bParked = true;
+      }
+    }
+
+    if (!bParked)
+    {
+      // The read-ahead worker has to be out of the driver first, but
+      // the driver may say no, so its strips stay where they are...
+      g_ptwndsmreadahead->Pause((TWID_T)AppId.Id,(TWID_T)_pDsId->Id,DAT_IDENTITY,MSG_CLOSEDS);
+
+      result = DsEntry(&AppId,
+                       (TWID_T)_pDsId->Id,
+                       DG_CONTROL,
+                       DAT_IDENTITY,
+                       MSG_CLOSEDS,
+                       (TW_MEMREF)_pDsId);
+
+      if (TWRC_SUCCESS != result)
+      {
+        pod.m_ptwndsmapps->AppSetConditionCode(&AppId,TWCC_OPERATIONERROR);
+        return result;
+      }
+    }
+
+    // The session is over, so everything we kept for it goes, and
+    // unless it's parked, so does the driver...
+    StopSession((TWID_T)AppId.Id,(TWID_T)_pDsId->Id,!bParked);
+    if (!bParked)
+    {
+      pod.m_ptwndsmapps->UnloadDS(&AppId,(TWID_T)_pDsId->Id);
+    }
+  }
+
+  // All done...
+  return result;
+}
+
+
+
+/*
+* The application closed this driver a while ago, and didn't come back
+* for it, so do what CloseDS would have done.  This runs on the warm
+* pool's thread, or in MSG_CLOSEDSM.  Nobody is waiting for the answer,
+* so a failure is only logged...
+*/
+void CTwnDsm::WarmPoolClose(TW_IDENTITY *_pAppId,
+                            TW_IDENTITY *_pDsId)
+{
+  TW_UINT16 rcDS;
+
+  try
+  {
+    rcDS = DsEntry(_pAppId,
+                   (TWID_T)_pDsId->Id,
+                   DG_CONTROL,
+                   DAT_IDENTITY,
+                   MSG_CLOSEDS,
+                   (TW_MEMREF)_pDsId);
+  }
+  catch(...)
+  {
+    rcDS = TWRC_FAILURE;
+    kLOG((kLOGERR,"Exception caught while closing a warm driver."));
+  }
+  if (TWRC_SUCCESS != rcDS)
+  {
+    kLOG((kLOGERR,"MSG_CLOSEDS failed for warm driver %.32s...",(char*)_pDsId->ProductName));
+  }
+
+  StopSession((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id,true);
+  pod.m_ptwndsmapps->UnloadDS(_pAppId,(TWID_T)_pDsId->Id);
+}
+
+
+
+/*
+* The driver is still open from the last time, so all it needs is to
+* have its capabilities put back the way a fresh open would find them.
+* A driver that can't do that gets closed, and loaded again...
+*/
+bool CTwnDsm::WarmPoolTake(TW_IDENTITY *_pAppId,
+                           TW_IDENTITY *_pDsId)
+{
+  TW_CAPABILITY twcapability;
+  TW_IDENTITY   dsidentity;
+  TW_IDENTITY  *pDsIdentity;
+  TW_UINT16     rcDS;
+
+  if (!g_ptwndsmwarmpool->Take((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id))
+  {
+    return false;
+  }
+
+  // Anything that got queued while it was parked isn't for this session...
+  pod.m_ptwndsmapps->DsEventClear(_pAppId,(TWID_T)_pDsId->Id);
+
+  // Create a local copy of the AppIdentity, and the driver's...
+  TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(_pAppId);
+  pDsIdentity = pod.m_ptwndsmapps->DsGetIdentity(&AppId,(TWID_T)_pDsId->Id);
+  if (0 == pDsIdentity)
+  {
+    WarmPoolClose(&AppId,_pDsId);
+    return false;
+  }
+  dsidentity = *pDsIdentity;
+
+  // Somebody installed a new version while this one was parked...
+  if (pod.m_ptwndsmapps->DsIsStale(&AppId,(TWID_T)dsidentity.Id))
+  {
+    kLOG((kLOGINFO,"warm driver %.32s has been upgraded, opening it again...",(char*)dsidentity.ProductName));
+    WarmPoolClose(&AppId,&dsidentity);
+    return false;
+  }
+
+  // MSG_RESETALL ignores the Cap...
+  memset(&twcapability,0,sizeof(twcapability));
+  twcapability.Cap     = CAP_SUPPORTEDCAPS;
+  twcapability.ConType = TWON_DONTCARE16;
+  rcDS = DsEntry(&AppId,
+                 (TWID_T)dsidentity.Id,
+                 DG_CONTROL,
+                 DAT_CAPABILITY,
+                 MSG_RESETALL,
+                 (TW_MEMREF)&twcapability);
+  if (TWRC_SUCCESS != rcDS)
+  {
+    kLOG((kLOGINFO,"MSG_RESETALL failed for warm driver %.32s, opening it again...",(char*)dsidentity.ProductName));
+    WarmPoolClose(&AppId,&dsidentity);
+    return false;
+  }
+
+  kLOG((kLOGINFO,"%.32s was still open, MSG_OPENDS skipped",(char*)dsidentity.ProductName));
+  *_pDsId = dsidentity;
+  return true;
+}
+
+
+
+/*
+* Every way a session ends comes through here, so nothing a module
+* kept for it is left behind in the DS_SESSION.  The read-ahead worker
+* goes first, it's the one still calling the driver.  The driver's
+* thread goes last, since anything above may be waiting on it...
+*/
+void CTwnDsm::StopSession(const TWID_T _AppId,
+                          const TWID_T _DsId,
+                          const bool   _bUnloading)
+{
+  g_ptwndsmreadahead->Stop(_AppId,_DsId);
+  g_ptwndsmconvert->Stop(_AppId,_DsId);
+  g_ptwndsmanalysis->Stop(_AppId,_DsId);
+  g_ptwndsmchecksum->Stop(_AppId,_DsId);
+  g_ptwndsmdispatch->Stop(_AppId,_DsId);
+  if (_bUnloading)
+  {
+    g_ptwndsmactor->Stop(_AppId,_DsId);
+    g_ptwndsmaffinity->Forget(_AppId,_DsId);
+  }
+}
+
+
+
+#if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+/**
+* DllMain is only needed for Windows, and it's only needed to collect
+* our instance handle, which is also our module handle.  Don't ever
+* put anything else in here, not even logging messages.  It just isn't
+* safe...
+* @param[in] _hmodule handle to the application that loaded the DSM
+* @param[in] _dwReasonCalled why this function is being called
+* @return TRUE
+*/
+BOOL WINAPI DllMain(HINSTANCE _hmodule,
+                    DWORD     _dwReasonCalled,
+                    LPVOID    _lpReserved)
+{
+  switch (_dwReasonCalled)
+  {
+    case DLL_THREAD_ATTACH:
+    case DLL_THREAD_DETACH:
+      break;
+    case DLL_PROCESS_ATTACH:
+      g_hinstance = _hmodule;
+      break;
+    case DLL_PROCESS_DETACH:
+      if( g_ptwndsm )
+      {
+        if( g_ptwndsm->DSMGetState() == dsmState_Open )
+        {
+          // This should never happen!
+          // The Application should always close any open DS, then Close the DSM.
+          kLOG((kLOGERR,"The DSM was left in an open state when it was unloaded!"));
+        }
+        delete g_ptwndsm;
+        g_ptwndsm = 0;
+      }
+      // The pool outlives CTwnDsm, but not us.  Its FLS callback lives
+      // in this DLL, so on FreeLibrary the index has to go with it (when
+      // the process is exiting the other threads are already gone)...
+      if( g_ptwndsmpool && (0 == _lpReserved) )
+      {
+        delete g_ptwndsmpool;
+        g_ptwndsmpool = 0;
+      }
+      break;
+  }
+  return(TRUE);
+}
+#elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+/**
+* Our counterpart to DLL_PROCESS_DETACH.  The memory pool outlives
+* CTwnDsm, since blocks can be freed after MSG_CLOSEDSM, but its TLS
+* key has a destructor in this library.  If the key is still there
+* after dlclose, the next thread that exits with a cache calls into
+* an unmapped page, so delete the key and the pool on the way out...
+*/
+static void __attribute__((destructor)) DsmUnload(void)
+{
+  if (g_ptwndsmpool)
+  {
+    delete g_ptwndsmpool;
+    g_ptwndsmpool = 0;
+  }
+}
+#else
+    #error Sorry, we do not recognize this system...
+#endif
+
+
+
+#if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+/**
+* We support a selection dialog on Windows.  I wish we didn't, it's
+* more trouble than it's worth, but it's part of that legacy thing.
+* This function is properly constructed for use with DialogBox...
+* @param[in] _hWnd Window handle of the dialog
+* @param[in] _Message message
+* @param[in] _wParam wparam
+* @param[in] _lParam lparam
+* @return FALSE if we processed the message
+*/
+BOOL CALLBACK SelectDlgProc(HWND   _hWnd,
+                            UINT   _Message,
+                            WPARAM _wParam,
+                            LPARAM _lParam)
+{
+  if (g_ptwndsm)
+  {
+    return g_ptwndsm->SelectDlgProc(_hWnd,_Message,_wParam,_lParam);
+  }
+  else
+  {
+    return TRUE;
+  }
+}
+#elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+  // We don't have one of these...
+#else
+  #error Sorry, we do not recognize this system...
+#endif
+
+
+
+#if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+/**
+* We support a selection dialog on Windows.  This function is
+* part of our CTwnDsm class, so we don't have to have a lot
+* of pointers, and we can keep things private, unlike what we
+* would have to do if we put this code into the function we
+* actually pass to DialogBox...
+* @param[in] hwnd Window handle of the dialog
+* @param[in] lParam lparam
+* @return TRUE
+*/
+BOOL CALLBACK EnumChildProc
+(
+  HWND hwnd,
+  LPARAM lParam
+)
+{
+  ::SendMessage(hwnd,WM_SETFONT,(WPARAM)lParam,(LPARAM)TRUE);
+  return TRUE;
+}
+
+
+
+BOOL CTwnDsm::SelectDlgProc(HWND hWnd,
+                            UINT Message,
+                            WPARAM wParam,
+                            LPARAM /*lParam - unused*/)
+{
+  TW_IDENTITY  *pAppId;
+  int           nIndex;
+  int           nSelect;
+  TW_UINT32     x;
+  char         *szProductName;
+  HWND          hListBox;
+  RECT          rectParent;
+  RECT          rectSelect;
+  HWND          hParent;
+  LANGID        LangId;
+  wchar_t       uzUnicode[128];
+  HFONT         hfont;
+  LOGFONT       lf;
+  POINT         point;
+  int           nWidth;
+  int           nHeight;
+
+  // Init stuff...
+  nSelect = 0;
+  pAppId = pod.m_pSelectDlgAppId;
+
+  // Process the message...
+  switch (Message)
+  {
+    case WM_INITDIALOG:
+      
+      // If the caller wants us to figure out the language, do this...
+      if (pAppId->Version.Language == (TW_UINT16)TWLG_USERLOCALE)
+      {
+      // Try to find the user's default language...
+      LangId = ::GetUserDefaultLangID();
+      for (nIndex = 0;
+           s_twlocalize[nIndex].Language >= 0;
+           nIndex++)
+      {
+        if (    (s_twlocalize[nIndex].LangId == LangId)
+            &&  s_twlocalize[nIndex].LangId
+            &&  s_twlocalize[nIndex].Title
+            &&  s_twlocalize[nIndex].Title[0]
+            &&  s_twlocalize[nIndex].Sources
+            &&  s_twlocalize[nIndex].Sources[0]
+            &&  s_twlocalize[nIndex].Select
+            &&  s_twlocalize[nIndex].Select[0]
+            &&  s_twlocalize[nIndex].Cancel
+            &&  s_twlocalize[nIndex].Cancel[0])
+        {
+            break;
+        }
+      }
+
+      // If that doesn't work, try for the primary language...
+      if (s_twlocalize[nIndex].Language < 0)
+      {
+        LangId &= 0xFF;
+        for (nIndex = 0;
+             s_twlocalize[nIndex].Language >= 0;
+             nIndex++)
+        {
+          if (  ((s_twlocalize[nIndex].LangId & 0xFF) == LangId)
+            &&  s_twlocalize[nIndex].LangId
+            &&  s_twlocalize[nIndex].Title
+            &&  s_twlocalize[nIndex].Title[0]
+            &&  s_twlocalize[nIndex].Sources
+            &&  s_twlocalize[nIndex].Sources[0]
+            &&  s_twlocalize[nIndex].Select
+            &&  s_twlocalize[nIndex].Select[0]
+            &&  s_twlocalize[nIndex].Cancel
+            &&  s_twlocalize[nIndex].Cancel[0])
+          {
+            break;
+          }
+        }
+      }
+    }
+
+    // Otherwise, use whatever the caller gave us...
+    else
+    {
+      for (nIndex = 0;
+           s_twlocalize[nIndex].Language >= 0;
+           nIndex++)
+      {
+        if (    (s_twlocalize[nIndex].Language == pAppId->Version.Language)
+            &&  s_twlocalize[nIndex].LangId
+            &&  s_twlocalize[nIndex].Title
+            &&  s_twlocalize[nIndex].Title[0]
+            &&  s_twlocalize[nIndex].Sources
+            &&  s_twlocalize[nIndex].Sources[0]
+            &&  s_twlocalize[nIndex].Select
+            &&  s_twlocalize[nIndex].Select[0]
+            &&  s_twlocalize[nIndex].Cancel
+            &&  s_twlocalize[nIndex].Cancel[0])
+        {
+          break;
+        }
+      }
+    }
+
+    // If we didn't find our language, go for English...
+    if (s_twlocalize[nIndex].Language < 0)
+    {
+      for (nIndex = 0;
+           s_twlocalize[nIndex].Language >= 0;
+           nIndex++)
+      {
+        if (    (s_twlocalize[nIndex].Language == TWLG_ENGLISH)
+            &&  s_twlocalize[nIndex].LangId
+            &&  s_twlocalize[nIndex].Title
+            &&  s_twlocalize[nIndex].Title[0]
+            &&  s_twlocalize[nIndex].Sources
+            &&  s_twlocalize[nIndex].Sources[0]
+            &&  s_twlocalize[nIndex].Select
+            &&  s_twlocalize[nIndex].Select[0]
+            &&  s_twlocalize[nIndex].Cancel
+            &&  s_twlocalize[nIndex].Cancel[0])
+        {
+          break;
+        }
+      }
+    }
+
+    // If we found something, then use it...
+    if (s_twlocalize[nIndex].Language >= 0)
+    {
+      // Set our font...
+      memset(&lf,0,sizeof(lf));
+      lf.lfHeight = 16;
+      lf.lfCharSet = s_twlocalize[nIndex].CharSet;
+      hfont = CreateFontIndirect(&lf);
+      EnumChildWindows(hWnd,EnumChildProc,(LPARAM)hfont);
+
+      MultiByteToWideChar(CP_UTF8,0,s_twlocalize[nIndex].Title,-1,uzUnicode,sizeof(uzUnicode)/sizeof(*uzUnicode));
+      SetWindowTextW(hWnd,uzUnicode);
+
+      MultiByteToWideChar(CP_UTF8,0,s_twlocalize[nIndex].Sources,-1,uzUnicode,sizeof(uzUnicode)/sizeof(*uzUnicode));
+      SetWindowTextW(::GetDlgItem(hWnd,IDC_STATIC),uzUnicode);
+
+      MultiByteToWideChar(CP_UTF8,0,s_twlocalize[nIndex].Select,-1,uzUnicode,sizeof(uzUnicode)/sizeof(*uzUnicode));
+      SetWindowTextW(::GetDlgItem(hWnd,IDOK),uzUnicode);
+
+      MultiByteToWideChar(CP_UTF8,0,s_twlocalize[nIndex].Cancel,-1,uzUnicode,sizeof(uzUnicode)/sizeof(*uzUnicode));
+      SetWindowTextW(::GetDlgItem(hWnd,IDCANCEL),uzUnicode);
+    }
+
+      hListBox = ::GetDlgItem(hWnd,ID_LST_SOURCES);
+      if (hListBox) 
+      {
+        SendMessage(hListBox,LB_RESETCONTENT,(WPARAM)NULL,(LPARAM)NULL);
+
+        for (x = 1; x < MAX_NUM_DS; ++x)
+        {
+          // We expect the list to be contiguous...
+          szProductName = pod.m_ptwndsmapps->DsGetIdentity(pAppId,x)->ProductName;
+          if (!szProductName[0])
+          {
+              break;
+          }
+          // Display the name...
+          nIndex = (int)SendMessage(hListBox,LB_ADDSTRING,(WPARAM)NULL,(LPARAM)szProductName);
+          if (LB_ERR == nIndex)
+          {
+            break;
+          }
+          // Associate the id with the name...
+          nIndex = (int)SendMessage(hListBox,
+                                    LB_SETITEMDATA,
+                                    (WPARAM)nIndex,
+                                    (LPARAM)pod.m_ptwndsmapps->DsGetIdentity(pAppId,x)->Id);
+          if (LB_ERR == nIndex)
+          {
+            break;
+          }
+          // Remember this item if it's the default...
+          if (!strcmp(pod.m_ptwndsmapps->DsGetPath(pAppId,x),pod.m_DefaultDSPath))
+          {
+            nSelect = x;
+          }
+        }
+        // If we have no drivers, then disable the OK button...
+        if (pod.m_ptwndsmapps->AppGetNumDs(pAppId) < 1)
+        {
+          HWND hOK= ::GetDlgItem(hWnd,IDOK);
+          EnableWindow(hOK, FALSE);
+        }
+        // Otherwise select the defaulted item...
+        else
+        {
+          nIndex = (int)SendMessage(hListBox,
+                                    LB_FINDSTRINGEXACT,
+                                    (WPARAM)-1,
+                                    (LPARAM)pod.m_ptwndsmapps->DsGetIdentity(pAppId,nSelect)->ProductName);
+          if (LB_ERR == nIndex)
+          {
+            nIndex = 0;
+          }
+          SendMessage(hListBox,LB_SETCURSEL,(WPARAM)nIndex,(LPARAM)NULL);
+        }
+      }
+
+    // Center our dialog on the window reported to us in MSG_OPENDS...
+    hParent = (HWND)pod.m_ptwndsmapps->AppHwnd(pAppId);
+    if (hParent)
+    {
+      GetClientRect(hParent,&rectParent);
+      GetWindowRect(hWnd,&rectSelect);
+          nWidth  = (rectSelect.right - rectSelect.left);
+          nHeight = (rectSelect.bottom - rectSelect.top);
+      point.x = (rectParent.right - rectParent.left) / 2;
+      point.y = (rectParent.bottom - rectParent.top) / 2;
+      ClientToScreen(hParent,&point);
+      point.x -= nWidth / 2;
+      point.y -= nHeight / 2;
+      // keep the dialog visible on the screen
+      if(point.x < 0)
+      {
+        point.x = 0;
+      }
+      if(point.y < 0)
+      {
+        point.y = 0;
+      }
+      MoveWindow(hWnd,point.x,point.y,nWidth,nHeight,FALSE);
+    }
+
+      return TRUE;
+
+    case WM_COMMAND:
+      switch (LOWORD(wParam))
+      {
+        case ID_LST_SOURCES: 
+          if (HIWORD(wParam) != LBN_DBLCLK) 
+            break; 
+            // drop through...
+
+        case IDOK:
+          {
+            hListBox = ::GetDlgItem(hWnd, ID_LST_SOURCES); 
+            nIndex   = 0;
+            if ( hListBox ) 
+            {
+              nIndex = (int)SendMessage(hListBox,LB_GETCURSEL,(WPARAM)0,(LPARAM)0);
+              if (LB_ERR == nIndex)
+              {
+                // if there is no selection should not have OK available
+                // to press in the first place.
+                return TRUE;
+              }
+              nIndex = (int)SendMessage(hListBox,LB_GETITEMDATA,(WPARAM)nIndex,(LPARAM)0);
+              if (LB_ERR != nIndex)
+              {
+                pod.m_pSelectDlgDsId = pod.m_ptwndsmapps->DsGetIdentity(pAppId,nIndex);
+              }
+            }
+            EndDialog(hWnd, IDOK);
+            return TRUE;
+          }
+        case IDCANCEL:
+          EndDialog(hWnd, IDCANCEL);
+          return TRUE;
+      }
+      break;
+  }
+  return FALSE;
+}
+#elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+  // We don't have anything to do on Linux...
+#else
+  #error Sorry, we do not recognize this system...
+#endif
+
+
+
+/*
+* Invoke the user selection dialog box.  We only support this for
+* Windows, for Linux it's a bad protocol, since there is no way
+* to query the user (nicely) across all consoles and graphical
+* interfaces for all distributions...
+*/
+TW_INT16 CTwnDsm::DSM_SelectDS(TW_IDENTITY *_pAppId,
+                               TW_IDENTITY *_pDsId)
+{
+  // Validate...
+  if (0 == _pAppId)
+  {
+    kLOG((kLOGERR,"_pAppId is null"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+  if (   ((TWID_T)_pAppId->Id < 1)
+      || ((TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp()))
+  {
+    kLOG((kLOGERR,"_pAppId.Id is out of range"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+  else if (0 == _pDsId)
+  {
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
+    return TWRC_FAILURE;
+  }
+  else if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
+  {
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    return TWRC_FAILURE;
+  }
+
+  /** @todo scanDSDir needs to be done with each MSG_USERSELECT  
+    currently we are only scanDSDir when an App opens the DSM **/
+
+  // Make sure the id is 0 before we go into this...
+  _pDsId->Id = 0;
+
+  // Windows...
+  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+
+      HKEY      hKey;
+      long      status;
+      char     *szPath;
+      TW_INT16  result;
+
+      // Set the context...
+      result = TWRC_SUCCESS;
+      pod.m_pSelectDlgAppId = _pAppId;
+        
+      // If passed in a DS name we want to select it
+      if (_pDsId->ProductName[0] != 0)
+      {
+        result = GetDSFromProductName(_pAppId,_pDsId);
+        // If no match continue anyway.
+      }
+
+      // If not passed a DS or the name was not currently found
+      // then selete the default
+      _pDsId->Id = 0;
+      result = GetMatchingDefault(_pAppId,_pDsId);
+      pod.m_pSelectDlgDsId = _pDsId;
+
+      // a.walling - Get the HWND of the parent window, if any, and use it as the dialog's parent
+      HWND hParent = (HWND)pod.m_ptwndsmapps->AppHwnd(_pAppId);
+
+      // create the dialog window
+      int ret = (int)::DialogBoxW(g_hinstance,
+                                  (LPCWSTR)IDD_DLG_SOURCE,
+                                  (HWND)hParent,
+                                  (DLGPROC)::SelectDlgProc);
+
+      // User picked something...
+      if (ret == IDOK)
+      {
+        // Validate the result...
+        if (!pod.m_pSelectDlgDsId)
+        {
+          kLOG((kLOGERR,"We came out of the Select Dialog with a null..."));
+          pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_OPERATIONERROR);
+          return TWRC_FAILURE;
+        }
+
+        // Copy the data over...
+        *_pDsId = *pod.m_pSelectDlgDsId;
+
+        // save default source to Registry  
+        // sanity check...
+        if (   (pod.m_pSelectDlgDsId->Id < 1)
+            || (pod.m_pSelectDlgDsId->Id >= MAX_NUM_DS))
+        {
+          // Failed to save default DS to registry
+          kLOG((kLOGERR,"Id is out of range 0 - 49..."));
+          // Nothing preventing us from using the default right now
+          pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
+        }
+
+        else
+        {
+          // Get the path we're using...
+          status = ERROR_SUCCESS;
+          szPath = pod.m_ptwndsmapps->DsGetPath(pod.m_pSelectDlgAppId,pod.m_pSelectDlgDsId->Id);
+
+          // Open the key, creating it if it doesn't exist.
+          if (RegCreateKeyEx(HKEY_CURRENT_USER, 
+                             TWNDSM_DS_REG_LOC,
+                             NULL,
+                             NULL,
+                             NULL,
+                             KEY_READ | KEY_WRITE, NULL,
+                             &hKey,
+                             NULL) == ERROR_SUCCESS)
+          {
+            status = RegSetValueEx(hKey,"Default Source",0,REG_SZ,(LPBYTE)szPath,(DWORD)strlen((char*)szPath)+1);
+            if (status != ERROR_SUCCESS)
+            {
+              // Failed to save default DS to registry
+              kLOG((kLOGERR,"Failed to save default DS to registry"));
+              // Nothing preventing us from using the default right now
+              pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
+            }
+          }
+          // Close the key.
+          RegCloseKey(hKey);
+        }
+      }
+
+      // We're cancelling...
+      else if (ret == IDCANCEL)
+      {
+        result = TWRC_CANCEL;
+      }
+
+      // Something back happened...
+      else if (ret == -1)
+      {
+        ::MessageBox(NULL,"Dialog failed!","Error",MB_OK|MB_ICONINFORMATION);
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
+        result = TWRC_FAILURE;
+      }
+
+      return result;
+
+  // We don't support the user selection box on linux...
+  #elif  (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+    return TWRC_FAILURE;
+
+  // Ruh-roh, Reorge...
+  #else
+    #error Sorry, we do not recognize this system...
+  #endif
+}
+
+
+/*
+* Set the datasource as the default
+*/
+TW_INT16 CTwnDsm::DSM_SetDefaultDS(TW_IDENTITY *_pAppId,
+                                   TW_IDENTITY *_pDsId)
+{
+  TW_INT16 result = TWRC_SUCCESS;
+
+  // Validate app ...
+  if (0 == _pAppId)
+  {
+    kLOG((kLOGERR,"_pAppId is null"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+  else if ( (TWID_T)_pAppId->Id < 1
+         || (TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp() )
+  {
+    kLOG((kLOGERR,"_pAppId.Id is out of range...%d",(int)(TWID_T)_pAppId->Id));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+  else if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
+  {
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    return TWRC_FAILURE;
+  }
+
+  // Validate DS
+  if(0 == _pDsId)
+  {
+    kLOG((kLOGERR,"_pDsId is null"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
+    return TWRC_FAILURE;
+  }
+  else if ((TWID_T)_pDsId->Id < 1
+        || (TWID_T)_pDsId->Id >= MAX_NUM_DS)
+  {
+    kLOG((kLOGERR,"Id is out of range 0 - 49..."));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+
+  char     *szPath = pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pDsId->Id); // Get the path we're using...
+
+  if(!szPath)
+  {
+    kLOG((kLOGERR,"DS is not valid"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
+
+  // Windows... save default source to Registry  
+  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+    HKEY      hKey;
+    long      status = ERROR_SUCCESS;
+
+    // Open the key, creating it if it doesn't exist.
+    if (RegCreateKeyEx(HKEY_CURRENT_USER, 
+                       TWNDSM_DS_REG_LOC,
+                       NULL,
+                       NULL,
+                       NULL,
+                       KEY_READ | KEY_WRITE, NULL,
+                       &hKey,
+                       NULL) == ERROR_SUCCESS)
+    {
+      status = RegSetValueEx(hKey,"Default Source",0,REG_SZ,(LPBYTE)szPath,(DWORD)strlen((char*)szPath)+1);
+      if (status != ERROR_SUCCESS)
+      {
+        // Failed to save default DS to registry
+        kLOG((kLOGERR,"Failed to save default DS to registry"));
+        // Nothing preventing us from using the default right now
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
+        result = TWRC_FAILURE;
+      }
+
+      // Close the key.
+      RegCloseKey(hKey);
+    }
+
+  // Linux looks in the user's directory...
+  #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+    int iResult;
+    FILE *pfile;
+    char *szHome;
+    char szFile[FILENAME_MAX];
+    szHome = getenv("HOME");
+    if (szHome)
+    {
+      SSTRCPY(szFile,sizeof(szFile),szHome);
+      SSTRCAT(szFile,sizeof(szFile),"/.twndsmrc/defaultds");
+      FOPEN(pfile,szFile,"w");
+      if (pfile)
+      {
+        iResult = fwrite(szPath, 1, strlen(szPath), pfile);
+		if (iResult < (int)strlen(pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pDsId->Id)))
+		{
+			kLOG((kLOGERR,"fwrite defaultds failed..."));
+		}
+        fclose(pfile);
+      }
+    }
+
+  // eek...
+  #else
+    #error Sorry, we do not recognize this system...
+    result = TWRC_FAILURE
+  #endif
+
+  return result;
+}
+
+
+/*
+* Invoke the user selection dialog box.  We only support this for
+* Windows, for Linux it's a bad protocol, since there is no way
+* to query the user (nicely) across all consoles and graphical
+* interfaces for all distributions...
+*/
+TW_INT16 CTwnDsm::GetDSFromProductName(TW_IDENTITY *_pAppId,
+                                       TW_IDENTITY *_pDsId)
+{
+  TWID_T ii;
+
+  // Validate...
+  if (   !pod.m_ptwndsmapps->AppValidateId(_pAppId)
+      || (0 == _pDsId))
+  {
+    kLOG((kLOGERR,"bad _pAppId or _pDsId..."));
+    return TWRC_FAILURE;
+  }
+  else if (0 == _pDsId->ProductName[0])
+  {
+    return TWRC_FAILURE;
+  }
+
+  // Search for a match on the ProductName...
+  for (ii = 1; ii < MAX_NUM_DS; ++ii)
+  {
+    // Note that TW_STR32 type is NUL-filled, not NUL-terminated...
+    if (0 == strncmp((char*)_pDsId->ProductName,
+                     (char*)pod.m_ptwndsmapps->DsGetIdentity(_pAppId,ii)->ProductName,
+                     sizeof(TW_STR32)))
+    {
+      // match found, set the index
+      *_pDsId = *pod.m_ptwndsmapps->DsGetIdentity(_pAppId,ii);
+      return TWRC_SUCCESS;
+    }
+  }
+
+  // Uh-oh...
+  return TWRC_FAILURE;
+}
+
+
+
+/*
+* Get the identity for the first driver we found, or TWRC_ENDOFLIST
+* if we don't have any...
+*/
+TW_INT16 CTwnDsm::DSM_GetFirst(TW_IDENTITY *_pAppId,
+                               TW_IDENTITY *_pDsId)
+{
+  // Validate...
+  if (   !pod.m_ptwndsmapps->AppValidateId(_pAppId)
+      || (0 == _pDsId))
+  {
+    kLOG((kLOGERR,"bad _pAppId or _pDsId..."));
+    return TWRC_FAILURE;
+  }
+
+  /** @todo scanDSDir needs to be done with each MSG_GETFIRST  
+      currently we are only scanDSDir when an App opens the DSM **/
+
+  // Return info on the first driver we found.  Each application has
+  // its own cursor, and walks a copy of the list, so other apps and
+  // MSG_OPENDS can't move it around.  If there are no drivers we
+  // return TWRC_ENDOFLIST, and so will MSG_GETNEXT...
+  return pod.m_ptwndsmapps->DsGetFirst(_pAppId,_pDsId);
+}
+
+
+
+/*
+* Get the identity for the next driver we found, or TWRC_ENDOFLIST
+* if we've run out...
+*/
+TW_INT16 CTwnDsm::DSM_GetNext(TW_IDENTITY *_pAppId,
+                              TW_IDENTITY *_pDsId)
+{
+  // Validate...
+  if (   !pod.m_ptwndsmapps->AppValidateId(_pAppId)
+      || (0 == _pDsId))
+  {
+    kLOG((kLOGERR,"bad _pAppId or _pDsId..."));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
+    return TWRC_FAILURE;
+  }
+
+  // Return info on the next driver, or TWRC_ENDOFLIST if we're out
+  // of them.  Applications must call MSG_GETFIRST before making this
+  // call, and get TWCC_SEQERROR if they didn't...
+  return pod.m_ptwndsmapps->DsGetNext(_pAppId,_pDsId);
+}
+
+
+
+/*
+* Get the identity of the default source...
+*/
+TW_INT16 CTwnDsm::GetMatchingDefault(TW_IDENTITY *_pAppId,
+                                     TW_IDENTITY *_pDsId)
+{
+  bool      bMatchFnd = false;
+  bool      bDefaultFound = false;
+  TW_UINT32 ii;
+
+  // Validate...
+  if (   !pod.m_ptwndsmapps->AppValidateId(_pAppId)
+      || (0 == _pDsId))
+  {
+    kLOG((kLOGERR,"bad _pAppId or _pDsId..."));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
+    return TWRC_FAILURE;
+  }
+
+  // is there something to match to?
+  if (pod.m_ptwndsmapps->AppGetNumDs(_pAppId) < 1)
+  {
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_NODS);
+    return TWRC_FAILURE;
+  }
+
+  // Something very bad may be happening, so don't let the
+  // application get away with this...
+  if (0 != (TWID_T)_pDsId->Id)
+  {
+    kLOG((kLOGINFO,"Please make sure your TW_IDENTITY.Id for your driver (the destination) is zeroed out before making this call..."));
+    //pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_OPERATIONERROR);
+    //return TWRC_FAILURE;
+  }
+
+  // In Windows the default Data Source is stored in the registry
+  // as the path to that DS.  We will need to compare this to the other DS as a match.
+  // read default source from Registry
+  memset(pod.m_DefaultDSPath,0,sizeof(pod.m_DefaultDSPath));
+
+  // Windows uses the registry...
+  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+    HKEY hKey;
+    if (RegOpenKeyEx(HKEY_CURRENT_USER,
+                     TWNDSM_DS_REG_LOC,
+                     0,
+                     KEY_READ,
+                     &hKey) == ERROR_SUCCESS )
+    {
+      // Look for the subkey "Default Source".
+      DWORD DWtype = REG_SZ;
+      DWORD DWsize = sizeof(pod.m_DefaultDSPath);
+      bDefaultFound = ( RegQueryValueEx(hKey,"Default Source",NULL,&DWtype,(LPBYTE)pod.m_DefaultDSPath,&DWsize) == ERROR_SUCCESS);
+
+      // Close the registry key handle.
+      RegCloseKey(hKey);
+    }
+
+  // Linux looks in the user's directory...
+  #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+    int iResult;
+    FILE *pfile;
+    char *szHome;
+    char szFile[FILENAME_MAX];
+    memset(pod.m_DefaultDSPath,0,sizeof(pod.m_DefaultDSPath));
+    szHome = getenv("HOME");
+    if (szHome)
+    {
+      SSTRCPY(szFile,sizeof(szFile),szHome);
+      SSTRCAT(szFile,sizeof(szFile),"/.twndsmrc/defaultds");
+      FOPEN(pfile,szFile,"r");
+      if (pfile)
       {
-        point.y = 0;
+        iResult = fread(pod.m_DefaultDSPath,1,sizeof(pod.m_DefaultDSPath)-1,pfile);
+		if (iResult <= 0)
+		{
+			kLOG((kLOGINFO,"The defaultds file is empty, this is okay..."));
+			pod.m_DefaultDSPath[0] = 0;
+		}
+        bDefaultFound = true;
+        fclose(pfile);
       }
-      MoveWindow(hWnd,point.x,point.y,nWidth,nHeight,FALSE);
     }
 
-      return TRUE;
+  // eek...
+  #else
+    #error Sorry, we do not recognize this system...
+  #endif
 
-    case WM_COMMAND:
-      switch (LOWORD(wParam))
-      {
-        case ID_LST_SOURCES: 
-          if (HIWORD(wParam) != LBN_DBLCLK) 
-            break; 
-            // drop through...
 
-        case IDOK:
-          {
-            hListBox = ::GetDlgItem(hWnd, ID_LST_SOURCES); 
-            nIndex   = 0;
-            if ( hListBox ) 
-            {
-              nIndex = (int)SendMessage(hListBox,LB_GETCURSEL,(WPARAM)0,(LPARAM)0);
-              if (LB_ERR == nIndex)
-              {
-                // if there is no selection should not have OK available
-                // to press in the first place.
-                return TRUE;
-              }
-              nIndex = (int)SendMessage(hListBox,LB_GETITEMDATA,(WPARAM)nIndex,(LPARAM)0);
-              if (LB_ERR != nIndex)
-              {
-                pod.m_pSelectDlgDsId = pod.m_ptwndsmapps->DsGetIdentity(pAppId,nIndex);
-              }
-            }
-            EndDialog(hWnd, IDOK);
-            return TRUE;
-          }
-        case IDCANCEL:
-          EndDialog(hWnd, IDCANCEL);
-          return TRUE;
+  // If current default source is not a match find a new default source
+  // that will match this app
+  for (ii = 1; ii < MAX_NUM_DS; ++ii)
+  {
+    // Mark the first match to use as default, if we don't
+    // find a match, this will be the one we go with...
+    if (!bMatchFnd)
+    {
+      *_pDsId = *pod.m_ptwndsmapps->DsGetIdentity(_pAppId,ii);
+      bMatchFnd = true;
+
+      //If no default was saved no need to go checking for a match
+      if(!bDefaultFound)
+      {
+        break;
       }
+    }
+
+    // If the system default is a match we will use it and stop looking.
+    if (0 == STRNICMP(pod.m_DefaultDSPath,
+                      pod.m_ptwndsmapps->DsGetPath(_pAppId,ii),
+                      sizeof(pod.m_DefaultDSPath)))
+    {
+      *_pDsId = *pod.m_ptwndsmapps->DsGetIdentity(_pAppId,ii);
+      bMatchFnd = true;
       break;
+    }
+  }
+
+  if (!bMatchFnd)
+  {
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_NODS);
+    return TWRC_FAILURE;
   }
-  return FALSE;
-}
-#elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
-  // We don't have anything to do on Linux...
-#else
-  #error Sorry, we do not recognize this system...
-#endif
 
+  return TWRC_SUCCESS;
+}
 
 
 /*
-* Invoke the user selection dialog box.  We only support this for
-* Windows, for Linux it's a bad protocol, since there is no way
-* to query the user (nicely) across all consoles and graphical
-* interfaces for all distributions...
+* Log the triplets that the application sends to us...
 */
-TW_INT16 CTwnDsm::DSM_SelectDS(TW_IDENTITY *_pAppId,
-                               TW_IDENTITY *_pDsId)
+bool CTwnDsm::printTripletsInfo(const TW_IDENTITY *_pOrigin,
+                                const TW_IDENTITY *_pDest,
+                                const TW_UINT32 _DG,
+                                const TW_UINT16 _DAT,
+                                const TW_UINT16 _MSG,
+                                const TW_MEMREF _pData)
 {
-  // Validate...
-  if (0 == _pAppId)
+  char szDg[64];
+  char szDat[64];
+  char szMsg[64];
+  char szData[128];
+  TW_CAPABILITY *_pCap;
+
+  // Don't spend time processing the triplet if we are not logging.
+  if( !g_ptwndsmlog )
   {
-    kLOG((kLOGERR,"_pAppId is null"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-    return TWRC_FAILURE;
+    return false;
   }
-  if (   ((TWID_T)_pAppId->Id < 1)
-      || ((TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp()))
+
+  // too many of these messages to log...
+  if (    (DG_CONTROL == _DG)
+      &&  (DAT_EVENT == _DAT))
   {
-    kLOG((kLOGERR,"_pAppId.Id is out of range"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
-    return TWRC_FAILURE;
+    return false;
   }
-  else if (0 == _pDsId)
+
+  // Convert them...
+  StringFromDg(szDg,NCHARS(szDg),_DG);
+  StringFromDat(szDat,NCHARS(szDat),_DAT);
+  StringFromMsg(szMsg,NCHARS(szMsg),_MSG);
+
+  memset(szData, 0, sizeof(szData));
+
+  // If we have data do some extra work to see what it might be
+  if(NULL != _pData)
   {
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
-    return TWRC_FAILURE;
+    // If we're a capability, try to tell them what cap it is...
+    if (   (DG_CONTROL == _DG)
+        && (DAT_CAPABILITY == _DAT) )
+    {
+      _pCap = (TW_CAPABILITY*)_pData;
+      StringFromCap(szData,NCHARS(szData),_pCap->Cap);
+
+      // If sending a container, try to tell them what...
+      if( MSG_SET == _MSG )
+      {
+        char szType[32];
+        StringFromConType(szType,NCHARS(szType),_pCap->ConType);
+        SSTRCAT(szData,NCHARS(szData),szType);
+      }
+    }
   }
-  else if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
+
+  // Print out the orgin and Destination
+  kLOG((kLOGINFO,"%.32s -> %.32s",_pOrigin? (char*)_pOrigin->ProductName:"DSM", _pDest? (char*)_pDest->ProductName:"DSM"));
+  
+  // Print them
+  if(strlen(szData))
   {
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
-    return TWRC_FAILURE;
+    kLOG((kLOGINFO,"%s/%s/%s/%s",szDg,szDat,szMsg,szData));
   }
+  else
+  {
+    kLOG((kLOGINFO,"%s/%s/%s",szDg,szDat,szMsg));
+  }
+  g_ptwndsmlog->Indent(1);
 
-  /** @todo scanDSDir needs to be done with each MSG_USERSELECT  
-    currently we are only scanDSDir when an App opens the DSM **/
+  // All done...
+  return true;
+}
 
-  // Make sure the id is 0 before we go into this...
-  _pDsId->Id = 0;
+/*
+* Log the results after processing the Triplet
+*/
+void CTwnDsm::printResults(const TW_UINT32 _DG,
+                           const TW_UINT16 _DAT,
+                           const TW_UINT16 _MSG,
+                           const TW_MEMREF _pData,
+                           const TW_UINT16 _RC)
+{
+  char szRc[64];
 
-  // Windows...
-  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+  StringFromRC(szRc,NCHARS(szRc),_RC);
 
-      HKEY      hKey;
-      long      status;
-      char     *szPath;
-      TW_INT16  result;
+  // If we have data do some extra work to see what it might be
+  if( NULL != _pData && TWRC_FAILURE != _RC)
+  {
+    if( DG_CONTROL == _DG
+     && DAT_CAPABILITY == _DAT 
+     && ( MSG_GET == _MSG || MSG_GETCURRENT == _MSG || MSG_GETDEFAULT == _MSG || MSG_RESET == _MSG ) )
+    {
+        TW_CAPABILITY *_pCap = (TW_CAPABILITY*)_pData;
+        char szType[32];
+        StringFromConType(szType, NCHARS(szType), _pCap->ConType);
+        SSTRCAT(szRc, NCHARS(szRc), szType);
+    }
+    else if( DG_CONTROL == _DG
+     && DAT_PENDINGXFERS == _DAT )
+    {
+        TW_PENDINGXFERS *pXfer = (TW_PENDINGXFERS*)_pData;
+        char szValue[32];
+        SSNPRINTF(szValue, NCHARS(szValue), NCHARS(szValue), " Count = %d", pXfer->Count==0xFFFF?-1:pXfer->Count);
+        SSTRCAT(szRc, NCHARS(szRc), szValue);
+    }
+    else if( DG_CONTROL == _DG
+     && DAT_STATUS == _DAT )
+    {
+        TW_STATUS *pStatus = (TW_STATUS*)_pData;
+        char szStatus[32];
+        StringFromConditionCode(szStatus, NCHARS(szStatus), pStatus->ConditionCode);
+        SSTRCAT(szRc, NCHARS(szRc), szStatus);
+    }
+  }
 
-      // Set the context...
-      result = TWRC_SUCCESS;
-      pod.m_pSelectDlgAppId = _pAppId;
-        
-      // If passed in a DS name we want to select it
-      if (_pDsId->ProductName[0] != 0)
-      {
-        result = GetDSFromProductName(_pAppId,_pDsId);
-        // If no match continue anyway.
-      }
+  // ... and add a blank line
+  SSTRCAT(szRc,NCHARS(szRc),"\n");
+
+  g_ptwndsmlog->Indent(-1);
+  kLOG((kLOGINFO,szRc));
+}
+
+/*
+* Our custom triplets.  They're only ours if they're sent to the DSM,
+* which DSM_Entry has already checked...
+*/
+TW_INT16 CTwnDsm::DSM_Custom(TW_IDENTITY *_pAppId,
+                             TW_UINT16    _DAT,
+                             TW_UINT16    _MSG,
+                             TW_MEMREF    _pData)
+{
+  // Validate...
+  if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
+  {
+    kLOG((kLOGERR,"DSM must be open before using custom triplets"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    return TWRC_FAILURE;
+  }
+  if (0 == _pData)
+  {
+    kLOG((kLOGERR,"_pData is null"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    return TWRC_FAILURE;
+  }
 
-      // If not passed a DS or the name was not currently found
-      // then selete the default
-      _pDsId->Id = 0;
-      result = GetMatchingDefault(_pAppId,_pDsId);
-      pod.m_pSelectDlgDsId = _pDsId;
+  switch (_DAT)
+  {
+    case DAT_TWDSM_METRICS:
+      return DSM_Metrics(_pAppId,_MSG,(TW_TWDSM_METRICS*)_pData);
 
-      // a.walling - Get the HWND of the parent window, if any, and use it as the dialog's parent
-      HWND hParent = (HWND)pod.m_ptwndsmapps->AppHwnd(_pAppId);
+    case DAT_TWDSM_MEMFD:
+      return DSM_Memfd(_pAppId,_MSG,(TW_TWDSM_MEMFD*)_pData);
 
-      // create the dialog window
-      int ret = (int)::DialogBoxW(g_hinstance,
-                                  (LPCWSTR)IDD_DLG_SOURCE,
-                                  (HWND)hParent,
-                                  (DLGPROC)::SelectDlgProc);
+    case DAT_TWDSM_MEMXFERBATCH:
+      return DSM_MemXferBatch(_pAppId,_MSG,(TW_TWDSM_MEMXFERBATCH*)_pData);
 
-      // User picked something...
-      if (ret == IDOK)
-      {
-        // Validate the result...
-        if (!pod.m_pSelectDlgDsId)
-        {
-          kLOG((kLOGERR,"We came out of the Select Dialog with a null..."));
-          pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_OPERATIONERROR);
-          return TWRC_FAILURE;
-        }
+    case DAT_TWDSM_IMAGEFRAME:
+      return DSM_ImageFrame(_pAppId,_MSG,(TW_TWDSM_IMAGEFRAME*)_pData);
 
-        // Copy the data over...
-        *_pDsId = *pod.m_pSelectDlgDsId;
+    case DAT_TWDSM_CONVERT:
+      return DSM_Convert(_pAppId,_MSG,(TW_TWDSM_CONVERT*)_pData);
 
-        // save default source to Registry  
-        // sanity check...
-        if (   (pod.m_pSelectDlgDsId->Id < 1)
-            || (pod.m_pSelectDlgDsId->Id >= MAX_NUM_DS))
-        {
-          // Failed to save default DS to registry
-          kLOG((kLOGERR,"Id is out of range 0 - 49..."));
-          // Nothing preventing us from using the default right now
-          pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
-        }
+    case DAT_TWDSM_ANALYSIS:
+      return DSM_Analysis(_pAppId,_MSG,(TW_TWDSM_ANALYSIS*)_pData);
 
-        else
-        {
-          // Get the path we're using...
-          status = ERROR_SUCCESS;
-          szPath = pod.m_ptwndsmapps->DsGetPath(pod.m_pSelectDlgAppId,pod.m_pSelectDlgDsId->Id);
+    case DAT_TWDSM_CHECKSUM:
+      return DSM_Checksum(_pAppId,_MSG,(TW_TWDSM_CHECKSUM*)_pData);
 
-          // Open the key, creating it if it doesn't exist.
-          if (RegCreateKeyEx(HKEY_CURRENT_USER, 
-                             TWNDSM_DS_REG_LOC,
-                             NULL,
-                             NULL,
-                             NULL,
-                             KEY_READ | KEY_WRITE, NULL,
-                             &hKey,
-                             NULL) == ERROR_SUCCESS)
-          {
-            status = RegSetValueEx(hKey,"Default Source",0,REG_SZ,(LPBYTE)szPath,(DWORD)strlen((char*)szPath)+1);
-            if (status != ERROR_SUCCESS)
-            {
-              // Failed to save default DS to registry
-              kLOG((kLOGERR,"Failed to save default DS to registry"));
-              // Nothing preventing us from using the default right now
-              pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
-            }
-          }
-          // Close the key.
-          RegCloseKey(hKey);
-        }
-      }
+    case DAT_TWDSM_EVENTFD:
+      return DSM_EventFd(_pAppId,_MSG,(TW_TWDSM_EVENTFD*)_pData);
 
-      // We're cancelling...
-      else if (ret == IDCANCEL)
-      {
-        result = TWRC_CANCEL;
-      }
+    case DAT_TWDSM_SUBMIT:
+      return DSM_Submit(_pAppId,_MSG,(TW_TWDSM_SUBMIT*)_pData,0,0);
 
-      // Something back happened...
-      else if (ret == -1)
+    default:
+      kLOG((kLOGERR,"unrecognized custom DAT for the DSM...0x%04x",_DAT));
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+      return TWRC_FAILURE;
+  }
+}
+
+
+
+/*
+* Handle DAT_TWDSM_METRICS.  GETFIRST/GETNEXT work like they do for
+* DAT_IDENTITY, except the cursor lives in the structure, so nobody
+* can step on anybody else...
+*/
+TW_INT16 CTwnDsm::DSM_Metrics(TW_IDENTITY      *_pAppId,
+                              TW_UINT16         _MSG,
+                              TW_TWDSM_METRICS *_pMetrics)
+{
+  if (0 == g_ptwndsmmetrics)
+  {
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
+    return TWRC_FAILURE;
+  }
+
+  switch (_MSG)
+  {
+    case MSG_GET:
+      if (!g_ptwndsmmetrics->Get(_pMetrics))
       {
-        ::MessageBox(NULL,"Dialog failed!","Error",MB_OK|MB_ICONINFORMATION);
-        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
-        result = TWRC_FAILURE;
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+        return TWRC_FAILURE;
       }
+      return TWRC_SUCCESS;
 
-      return result;
+    case MSG_GETFIRST:
+      _pMetrics->Index = 0;
+      // fall through...
 
-  // We don't support the user selection box on linux...
-  #elif  (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+    case MSG_GETNEXT:
+      if (!g_ptwndsmmetrics->GetNext(_pMetrics))
+      {
+        return TWRC_ENDOFLIST;
+      }
+      return TWRC_SUCCESS;
 
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
-    return TWRC_FAILURE;
+    case MSG_RESET:
+      g_ptwndsmmetrics->Reset((TWID_T)_pAppId->Id);
+      return TWRC_SUCCESS;
 
-  // Ruh-roh, Reorge...
-  #else
-    #error Sorry, we do not recognize this system...
-  #endif
+    default:
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+      return TWRC_FAILURE;
+  }
 }
 
 
+
 /*
-* Set the datasource as the default
+* Handle DAT_TWDSM_MEMFD.  Only blocks from the memfd arenas have a
+* descriptor, anything else is a bad value...
 */
-TW_INT16 CTwnDsm::DSM_SetDefaultDS(TW_IDENTITY *_pAppId,
-                                   TW_IDENTITY *_pDsId)
+TW_INT16 CTwnDsm::DSM_Memfd(TW_IDENTITY    *_pAppId,
+                            TW_UINT16       _MSG,
+                            TW_TWDSM_MEMFD *_pMemfd)
 {
-  TW_INT16 result = TWRC_SUCCESS;
+  int       fd = -1;
+  TW_UINT32 offset = 0;
+  TW_UINT32 length = 0;
 
-  // Validate app ...
-  if (0 == _pAppId)
+  if (MSG_GET != _MSG)
   {
-    kLOG((kLOGERR,"_pAppId is null"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
     return TWRC_FAILURE;
   }
-  else if ( (TWID_T)_pAppId->Id < 1
-         || (TWID_T)_pAppId->Id >= pod.m_ptwndsmapps->AppGetNumApp() )
+
+  if (   (0 == g_ptwndsmpool)
+      || !g_ptwndsmpool->GetMemfd((void*)_pMemfd->hMem,&fd,&offset,&length))
   {
-    kLOG((kLOGERR,"_pAppId.Id is out of range...%d",(int)(TWID_T)_pAppId->Id));
+    kLOG((kLOGERR,"DAT_TWDSM_MEMFD handle doesn't have a memfd of its own..."));
     pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
     return TWRC_FAILURE;
   }
-  else if (dsmState_Open != pod.m_ptwndsmapps->AppGetState(_pAppId))
-  {
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
-    return TWRC_FAILURE;
-  }
 
-  // Validate DS
-  if(0 == _pDsId)
+  _pMemfd->Fd     = (TW_INT32)fd;
+  _pMemfd->Offset = offset;
+  _pMemfd->Length = length;
+  return TWRC_SUCCESS;
+}
+
+
+
+/*
+* Handle DAT_TWDSM_MEMXFERBATCH.  We check the application and the
+* driver once, and then go straight to DsEntry for each strip, which
+* is the whole point.  The rules about nested calls are the same as
+* they are in DSM_Entry, but since this is new we don't give older
+* applications a pass on them...
+*/
+TW_INT16 CTwnDsm::DSM_MemXferBatch(TW_IDENTITY           *_pAppId,
+                                   TW_UINT16              _MSG,
+                                   TW_TWDSM_MEMXFERBATCH *_pBatch)
+{
+  TWID_T    DsId;
+  TW_UINT16 rcDS = TWRC_FAILURE;
+  TW_UINT32 ii;
+
+  if (MSG_GET != _MSG)
   {
-    kLOG((kLOGERR,"_pDsId is null"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
     return TWRC_FAILURE;
   }
-  else if ((TWID_T)_pDsId->Id < 1
-        || (TWID_T)_pDsId->Id >= MAX_NUM_DS)
+
+  _pBatch->Delivered  = 0;
+  _pBatch->ReturnCode = TWRC_FAILURE;
+  if ((0 == _pBatch->Count) || (0 == _pBatch->pMemXfer))
   {
-    kLOG((kLOGERR,"Id is out of range 0 - 49..."));
+    kLOG((kLOGERR,"DAT_TWDSM_MEMXFERBATCH needs a Count and a pMemXfer..."));
     pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
     return TWRC_FAILURE;
   }
 
-  char     *szPath = pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pDsId->Id); // Get the path we're using...
-
-  if(!szPath)
+  DsId = (TWID_T)_pBatch->DsId;
+  if (!CustomDsIsReady(_pAppId,DsId))
   {
-    kLOG((kLOGERR,"DS is not valid"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
     return TWRC_FAILURE;
   }
 
-  // Windows... save default source to Registry  
-  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
-    HKEY      hKey;
-    long      status = ERROR_SUCCESS;
+  pod.m_ptwndsmapps->DsSetProcessingMessage(_pAppId,DsId,TRUE);
+  try
+  {
+    // Create a local copy of the AppIdentity
+    TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(_pAppId);
 
-    // Open the key, creating it if it doesn't exist.
-    if (RegCreateKeyEx(HKEY_CURRENT_USER, 
-                       TWNDSM_DS_REG_LOC,
-                       NULL,
-                       NULL,
-                       NULL,
-                       KEY_READ | KEY_WRITE, NULL,
-                       &hKey,
-                       NULL) == ERROR_SUCCESS)
+    for (ii = 0; ii < _pBatch->Count; ii++)
     {
-      status = RegSetValueEx(hKey,"Default Source",0,REG_SZ,(LPBYTE)szPath,(DWORD)strlen((char*)szPath)+1);
-      if (status != ERROR_SUCCESS)
+      rcDS = DsMemXfer(&AppId,DsId,&_pBatch->pMemXfer[ii]);
+      if ((TWRC_SUCCESS == rcDS) || (TWRC_XFERDONE == rcDS))
       {
-        // Failed to save default DS to registry
-        kLOG((kLOGERR,"Failed to save default DS to registry"));
-        // Nothing preventing us from using the default right now
-        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
-        result = TWRC_FAILURE;
+        _pBatch->Delivered++;
       }
-
-      // Close the key.
-      RegCloseKey(hKey);
-    }
-
-  // Linux looks in the user's directory...
-  #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
-    int iResult;
-    FILE *pfile;
-    char *szHome;
-    char szFile[FILENAME_MAX];
-    szHome = getenv("HOME");
-    if (szHome)
-    {
-      SSTRCPY(szFile,sizeof(szFile),szHome);
-      SSTRCAT(szFile,sizeof(szFile),"/.twndsmrc/defaultds");
-      FOPEN(pfile,szFile,"w");
-      if (pfile)
+      if (TWRC_SUCCESS != rcDS)
       {
-        iResult = fwrite(szPath, 1, strlen(szPath), pfile);
-		if (iResult < (int)strlen(pod.m_ptwndsmapps->DsGetPath(_pAppId,(TWID_T)_pDsId->Id)))
-		{
-			kLOG((kLOGERR,"fwrite defaultds failed..."));
-		}
-        fclose(pfile);
+        break;
       }
     }
+  }
+  catch(...)
+  {
+    rcDS = TWRC_FAILURE;
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
+    kLOG((kLOGERR,"Exception caught while DS was processing message.  Returning Failure."));
+  }
+  pod.m_ptwndsmapps->DsSetProcessingMessage(_pAppId,DsId,FALSE);
 
-  // eek...
-  #else
-    #error Sorry, we do not recognize this system...
-    result = TWRC_FAILURE
-  #endif
-
-  return result;
+  _pBatch->ReturnCode = rcDS;
+  return rcDS;
 }
 
 
+
 /*
-* Invoke the user selection dialog box.  We only support this for
-* Windows, for Linux it's a bad protocol, since there is no way
-* to query the user (nicely) across all consoles and graphical
-* interfaces for all distributions...
+* Handle DAT_TWDSM_IMAGEFRAME.  This is the application's half of a
+* memory transfer, done for it: DAT_IMAGEINFO, DAT_SETUPMEMXFER, and
+* then DAT_IMAGEMEMXFER until the driver stops saying TWRC_SUCCESS.
+* CTwnDsmFrame does the real work...
 */
-TW_INT16 CTwnDsm::GetDSFromProductName(TW_IDENTITY *_pAppId,
-                                       TW_IDENTITY *_pDsId)
+TW_INT16 CTwnDsm::DSM_ImageFrame(TW_IDENTITY         *_pAppId,
+                                 TW_UINT16            _MSG,
+                                 TW_TWDSM_IMAGEFRAME *_pImageFrame)
 {
-  TWID_T ii;
-
-  // Validate...
-  if (   !pod.m_ptwndsmapps->AppValidateId(_pAppId)
-      || (0 == _pDsId))
+  TWID_T          DsId;
+  TW_UINT16       rcDS = TWRC_FAILURE;
+  TW_UINT32       nPreferred;
+  TW_IMAGEINFO    imageinfo;
+  TW_SETUPMEMXFER setupmemxfer;
+  TW_IMAGEMEMXFER memxfer;
+  bool            bResume = false;
+
+  if (MSG_GET != _MSG)
   {
-    kLOG((kLOGERR,"bad _pAppId or _pDsId..."));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
     return TWRC_FAILURE;
   }
-  else if (0 == _pDsId->ProductName[0])
+
+  _pImageFrame->hFrame = 0;
+  DsId = (TWID_T)_pImageFrame->DsId;
+  if (!CustomDsIsReady(_pAppId,DsId))
   {
     return TWRC_FAILURE;
   }
 
-  // Search for a match on the ProductName...
-  for (ii = 1; ii < MAX_NUM_DS; ++ii)
+  pod.m_ptwndsmapps->DsSetProcessingMessage(_pAppId,DsId,TRUE);
+  try
   {
-    // Note that TW_STR32 type is NUL-filled, not NUL-terminated...
-    if (0 == strncmp((char*)_pDsId->ProductName,
-                     (char*)pod.m_ptwndsmapps->DsGetIdentity(_pAppId,ii)->ProductName,
-                     sizeof(TW_STR32)))
+    // Create a local copy of the AppIdentity
+    TW_IDENTITY  AppId = *pod.m_ptwndsmapps->AppGetIdentity(_pAppId);
+    CTwnDsmFrame twndsmframe;
+
+    // What are we getting, and how does the driver want it.  The
+    // read-ahead worker has to be out of the driver first, and it
+    // won't come back until the first DsMemXfer...
+    memset(&imageinfo,0,sizeof(imageinfo));
+    memset(&setupmemxfer,0,sizeof(setupmemxfer));
+    bResume = g_ptwndsmreadahead->Pause((TWID_T)AppId.Id,DsId,DAT_IMAGEINFO,MSG_GET);
+    rcDS = DsEntry(&AppId,DsId,DG_IMAGE,DAT_IMAGEINFO,MSG_GET,(TW_MEMREF)&imageinfo);
+    if (TWRC_SUCCESS == rcDS)
+    {
+      rcDS = DsEntry(&AppId,DsId,DG_CONTROL,DAT_SETUPMEMXFER,MSG_GET,(TW_MEMREF)&setupmemxfer);
+    }
+    if (bResume)
+    {
+      g_ptwndsmreadahead->Resume((TWID_T)AppId.Id,DsId);
+      bResume = false;
+    }
+    if (TWRC_SUCCESS == rcDS)
+    {
+      nPreferred = setupmemxfer.Preferred;
+      if ((0 == nPreferred) || (TWON_DONTCARE32 == nPreferred))
+      {
+        nPreferred = setupmemxfer.MaxBufSize;
+      }
+      if ((0 == nPreferred) || (TWON_DONTCARE32 == nPreferred))
+      {
+        kLOG((kLOGERR,"DAT_SETUPMEMXFER didn't give us a buffer size..."));
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+        rcDS = TWRC_FAILURE;
+      }
+      else if (!twndsmframe.Begin(&imageinfo,nPreferred))
+      {
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_LOWMEMORY);
+        rcDS = TWRC_FAILURE;
+      }
+    }
+
+    // Strips, right into the frame...
+    while (TWRC_SUCCESS == rcDS)
+    {
+      if (!twndsmframe.Target(&memxfer))
+      {
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_LOWMEMORY);
+        rcDS = TWRC_FAILURE;
+        break;
+      }
+      rcDS = DsMemXfer(&AppId,DsId,&memxfer);
+      if (   ((TWRC_SUCCESS == rcDS) || (TWRC_XFERDONE == rcDS))
+          && !twndsmframe.Place(&memxfer))
+      {
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADVALUE);
+        rcDS = TWRC_FAILURE;
+      }
+    }
+
+    if (TWRC_XFERDONE == rcDS)
     {
-      // match found, set the index
-      *_pDsId = *pod.m_ptwndsmapps->DsGetIdentity(_pAppId,ii);
-      return TWRC_SUCCESS;
+      twndsmframe.Finish(_pImageFrame);
     }
   }
+  catch(...)
+  {
+    rcDS = TWRC_FAILURE;
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
+    kLOG((kLOGERR,"Exception caught while DS was processing message.  Returning Failure."));
+  }
+  if (bResume)
+  {
+    g_ptwndsmreadahead->Resume((TWID_T)_pAppId->Id,DsId);
+  }
+  pod.m_ptwndsmapps->DsSetProcessingMessage(_pAppId,DsId,FALSE);
 
-  // Uh-oh...
-  return TWRC_FAILURE;
+  return rcDS;
 }
 
 
 
 /*
-* Get the identity for the first driver we found, or TWRC_ENDOFLIST
-* if we don't have any...
+* Handle DAT_TWDSM_CONVERT.  The driver has to be open, but we don't
+* call it, so it doesn't matter if it's busy...
 */
-TW_INT16 CTwnDsm::DSM_GetFirst(TW_IDENTITY *_pAppId,
-                               TW_IDENTITY *_pDsId)
+TW_INT16 CTwnDsm::DSM_Convert(TW_IDENTITY      *_pAppId,
+                              TW_UINT16         _MSG,
+                              TW_TWDSM_CONVERT *_pConvert)
 {
-  // Validate...
-  if (   !pod.m_ptwndsmapps->AppValidateId(_pAppId)
-      || (0 == _pDsId))
-  {
-    kLOG((kLOGERR,"bad _pAppId or _pDsId..."));
-    return TWRC_FAILURE;
-  }
-
-  /** @todo scanDSDir needs to be done with each MSG_GETFIRST  
-      currently we are only scanDSDir when an App opens the DSM **/
+  TW_UINT16 ccConvert;
 
-  // There are no supported drivers...
-  if (pod.m_ptwndsmapps->AppGetNumDs(_pAppId) < 1)
+  if (0 == pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,(TWID_T)_pConvert->DsId))
   {
-    // Make sure we fail of GetNext is called...
-    pod.m_nextDsId = pod.m_ptwndsmapps->AppGetNumDs(_pAppId) + 1;
-    return TWRC_ENDOFLIST;
+    kLOG((kLOGERR,"DsId isn't an open driver...%d",(int)_pConvert->DsId));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
+    return TWRC_FAILURE;
   }
 
-  // Check for valid DS
-  if(0 == _pDsId)
+  ccConvert = g_ptwndsmconvert->Convert((TWID_T)_pAppId->Id,_MSG,_pConvert);
+  if (TWCC_SUCCESS != ccConvert)
   {
-    kLOG((kLOGERR,"_pDsId is null"));
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,ccConvert);
     return TWRC_FAILURE;
   }
-
-
-  // Return info on the first driver we found...
-  pod.m_nextDsId = 1;
-  *_pDsId = *pod.m_ptwndsmapps->DsGetIdentity(_pAppId,pod.m_nextDsId);
-
-  // All done...
   return TWRC_SUCCESS;
 }
 
 
 
 /*
-* Get the identity for the next driver we found, or TWRC_ENDOFLIST
-* if we've run out...
+* Handle DAT_TWDSM_ANALYSIS.  Like DAT_TWDSM_CONVERT, the driver has
+* to be open, but we don't call it...
 */
-TW_INT16 CTwnDsm::DSM_GetNext(TW_IDENTITY *_pAppId,
-                              TW_IDENTITY *_pDsId)
+TW_INT16 CTwnDsm::DSM_Analysis(TW_IDENTITY       *_pAppId,
+                               TW_UINT16          _MSG,
+                               TW_TWDSM_ANALYSIS *_pAnalysis)
 {
-  // Validate...
-  if (   !pod.m_ptwndsmapps->AppValidateId(_pAppId)
-      || (0 == _pDsId))
+  TW_UINT16 ccAnalysis;
+
+  if (0 == pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,(TWID_T)_pAnalysis->DsId))
   {
-    kLOG((kLOGERR,"bad _pAppId or _pDsId..."));
+    kLOG((kLOGERR,"DsId isn't an open driver...%d",(int)_pAnalysis->DsId));
     pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
     return TWRC_FAILURE;
   }
 
-  // Applications must call MSG_GETFIRST before making this call...
-  if (pod.m_nextDsId == 0)
+  ccAnalysis = g_ptwndsmanalysis->Analysis((TWID_T)_pAppId->Id,_MSG,_pAnalysis);
+  if (TWCC_SUCCESS != ccAnalysis)
   {
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,ccAnalysis);
     return TWRC_FAILURE;
   }
-
-  // Prep for a call to GetNext...
-  pod.m_nextDsId += 1;
-
-  // We're out of items...
-  if (pod.m_nextDsId > pod.m_ptwndsmapps->AppGetNumDs(_pAppId))
-  {
-    pod.m_nextDsId = 0;
-    return TWRC_ENDOFLIST;
-  }
-
-  // Return info on the this driver...
-  *_pDsId = *pod.m_ptwndsmapps->DsGetIdentity(_pAppId,pod.m_nextDsId);
-
-  // All done...
   return TWRC_SUCCESS;
 }
 
 
 
 /*
-* Get the identity of the default source...
+* Handle DAT_TWDSM_CHECKSUM.  The driver has to be open, but we don't
+* call it...
 */
-TW_INT16 CTwnDsm::GetMatchingDefault(TW_IDENTITY *_pAppId,
-                                     TW_IDENTITY *_pDsId)
+TW_INT16 CTwnDsm::DSM_Checksum(TW_IDENTITY       *_pAppId,
+                               TW_UINT16          _MSG,
+                               TW_TWDSM_CHECKSUM *_pChecksum)
 {
-  bool      bMatchFnd = false;
-  bool      bDefaultFound = false;
-  TW_UINT32 ii;
+  TW_UINT16 ccChecksum;
 
-  // Validate...
-  if (   !pod.m_ptwndsmapps->AppValidateId(_pAppId)
-      || (0 == _pDsId))
+  if (0 == pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,(TWID_T)_pChecksum->DsId))
   {
-    kLOG((kLOGERR,"bad _pAppId or _pDsId..."));
+    kLOG((kLOGERR,"DsId isn't an open driver...%d",(int)_pChecksum->DsId));
     pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
     return TWRC_FAILURE;
   }
 
-  // is there something to match to?
-  if (pod.m_ptwndsmapps->AppGetNumDs(_pAppId) < 1)
+  ccChecksum = g_ptwndsmchecksum->Checksum((TWID_T)_pAppId->Id,_MSG,_pChecksum);
+  if (TWCC_SUCCESS != ccChecksum)
   {
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_NODS);
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,ccChecksum);
     return TWRC_FAILURE;
   }
+  return TWRC_SUCCESS;
+}
 
-  // Something very bad may be happening, so don't let the
-  // application get away with this...
-  if (0 != (TWID_T)_pDsId->Id)
-  {
-    kLOG((kLOGINFO,"Please make sure your TW_IDENTITY.Id for your driver (the destination) is zeroed out before making this call..."));
-    //pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_OPERATIONERROR);
-    //return TWRC_FAILURE;
-  }
 
-  // In Windows the default Data Source is stored in the registry
-  // as the path to that DS.  We will need to compare this to the other DS as a match.
-  // read default source from Registry
-  memset(pod.m_DefaultDSPath,0,sizeof(pod.m_DefaultDSPath));
 
-  // Windows uses the registry...
-  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
-    HKEY hKey;
-    if (RegOpenKeyEx(HKEY_CURRENT_USER,
-                     TWNDSM_DS_REG_LOC,
-                     0,
-                     KEY_READ,
-                     &hKey) == ERROR_SUCCESS )
+/*
+* Handle DAT_TWDSM_EVENTFD.  The descriptor belongs to the application,
+* DSM_Null pokes it through AppWakeup when it queues a message.  If
+* something is already waiting we poke it now, so an application that
+* asks late doesn't sleep through it...
+*/
+TW_INT16 CTwnDsm::DSM_EventFd(TW_IDENTITY      *_pAppId,
+                              TW_UINT16         _MSG,
+                              TW_TWDSM_EVENTFD *_pEventFd)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    TWID_T ii;
+
+    switch (_MSG)
     {
-      // Look for the subkey "Default Source".
-      DWORD DWtype = REG_SZ;
-      DWORD DWsize = sizeof(pod.m_DefaultDSPath);
-      bDefaultFound = ( RegQueryValueEx(hKey,"Default Source",NULL,&DWtype,(LPBYTE)pod.m_DefaultDSPath,&DWsize) == ERROR_SUCCESS);
+      case MSG_GET:
+        _pEventFd->Fd = pod.m_ptwndsmapps->AppGetEventFd(_pAppId);
+        _pEventFd->Pending = 0;
+        if (_pEventFd->Fd < 0)
+        {
+          pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_LOWMEMORY);
+          return TWRC_FAILURE;
+        }
+        for (ii = 1; ii < MAX_NUM_DS; ii++)
+        {
+          if (pod.m_ptwndsmapps->DsCallbackIsWaiting(_pAppId,ii))
+          {
+            _pEventFd->Pending++;
+          }
+        }
+        if (_pEventFd->Pending)
+        {
+          pod.m_ptwndsmapps->AppWakeup(_pAppId);
+        }
+        return TWRC_SUCCESS;
 
-      // Close the registry key handle.
-      RegCloseKey(hKey);
-    }
+      case MSG_RESET:
+        pod.m_ptwndsmapps->AppCloseEventFd(_pAppId);
+        _pEventFd->Fd = -1;
+        _pEventFd->Pending = 0;
+        return TWRC_SUCCESS;
 
-  // Linux looks in the user's directory...
-  #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
-    int iResult;
-    FILE *pfile;
-    char *szHome;
-    char szFile[FILENAME_MAX];
-    memset(pod.m_DefaultDSPath,0,sizeof(pod.m_DefaultDSPath));
-    szHome = getenv("HOME");
-    if (szHome)
-    {
-      SSTRCPY(szFile,sizeof(szFile),szHome);
-      SSTRCAT(szFile,sizeof(szFile),"/.twndsmrc/defaultds");
-      FOPEN(pfile,szFile,"r");
-      if (pfile)
-      {
-        iResult = fread(pod.m_DefaultDSPath,1,sizeof(pod.m_DefaultDSPath)-1,pfile);
-		if (iResult <= 0)
-		{
-			kLOG((kLOGINFO,"The defaultds file is empty, this is okay..."));
-			pod.m_DefaultDSPath[0] = 0;
-		}
-        bDefaultFound = true;
-        fclose(pfile);
-      }
+      default:
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+        return TWRC_FAILURE;
     }
-
-  // eek...
   #else
-    #error Sorry, we do not recognize this system...
+    (void)_MSG;
+    (void)_pEventFd;
+    kLOG((kLOGERR,"DAT_TWDSM_EVENTFD is only on Linux..."));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+    return TWRC_FAILURE;
   #endif
+}
 
 
-  // If current default source is not a match find a new default source
-  // that will match this app
-  for (ii = 1; ii < MAX_NUM_DS; ++ii)
+
+/*
+* Handle DAT_TWDSM_SUBMIT.  The triplet goes through DSM_Entry on the
+* driver's thread, so the checks happen there, in order with everything
+* else the driver is asked to do.  All we can check here is that the
+* driver has a thread, and that the triplet is one for a driver...
+*/
+TW_INT16 CTwnDsm::DSM_Submit(TW_IDENTITY     *_pAppId,
+                             TW_UINT16        _MSG,
+                             TW_TWDSM_SUBMIT *_pSubmit,
+                             DSMASYNCPROC     _pfnDone,
+                             TW_MEMREF        _pRefCon)
+{
+  TW_INT16  result;
+  TW_UINT16 cc = TWCC_SUCCESS;
+
+  if (!g_ptwndsmactor->IsEnabled())
   {
-    // Mark the first match to use as default, if we don't
-    // find a match, this will be the one we go with...
-    if (!bMatchFnd)
-    {
-      *_pDsId = *pod.m_ptwndsmapps->DsGetIdentity(_pAppId,ii);
-      bMatchFnd = true;
+    kLOG((kLOGERR,"DAT_TWDSM_SUBMIT needs TWAINDSM_ACTORS..."));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+    return TWRC_FAILURE;
+  }
 
-      //If no default was saved no need to go checking for a match
-      if(!bDefaultFound)
+  switch (_MSG)
+  {
+    case MSG_SET:
+      if (   (DAT_IDENTITY == _pSubmit->DAT)
+          || (DAT_PARENT == _pSubmit->DAT)
+          || (DAT_NULL == _pSubmit->DAT))
       {
-        break;
+        kLOG((kLOGERR,"DAT_TWDSM_SUBMIT is only for triplets that go to a driver..."));
+        pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+        return TWRC_FAILURE;
       }
-    }
+      result = g_ptwndsmactor->Submit(_pAppId,_pSubmit,_pfnDone,_pRefCon,&cc);
+      break;
 
-    // If the system default is a match we will use it and stop looking.
-    if (0 == STRNICMP(pod.m_DefaultDSPath,
-                      pod.m_ptwndsmapps->DsGetPath(_pAppId,ii),
-                      sizeof(pod.m_DefaultDSPath)))
-    {
-      *_pDsId = *pod.m_ptwndsmapps->DsGetIdentity(_pAppId,ii);
-      bMatchFnd = true;
+    case MSG_GET:
+      result = g_ptwndsmactor->Wait(_pAppId,_pSubmit,&cc);
       break;
-    }
+
+    case MSG_GETNEXT:
+      return g_ptwndsmactor->GetNext(_pAppId,_pSubmit);
+
+    default:
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADPROTOCOL);
+      return TWRC_FAILURE;
   }
 
-  if (!bMatchFnd)
+  if (TWRC_SUCCESS != result)
   {
-    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_NODS);
-    return TWRC_FAILURE;
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,cc);
   }
-
-  return TWRC_SUCCESS;
+  return result;
 }
 
 
+
 /*
-* Log the triplets that the application sends to us...
+* The DSM triplets that talk to a driver name it with a DsId, so this
+* does the checks DSM_Entry would have done on pDest.  The rules about
+* nested calls are the same as they are in DSM_Entry, but since these
+* are new we don't give older applications a pass on them...
 */
-bool CTwnDsm::printTripletsInfo(const TW_IDENTITY *_pOrigin,
-                                const TW_IDENTITY *_pDest,
-                                const TW_UINT32 _DG,
-                                const TW_UINT16 _DAT,
-                                const TW_UINT16 _MSG,
-                                const TW_MEMREF _pData)
+bool CTwnDsm::CustomDsIsReady(TW_IDENTITY *_pAppId,
+                              TWID_T       _DsId)
 {
-  char szDg[64];
-  char szDat[64];
-  char szMsg[64];
-  char szData[128];
-  TW_CAPABILITY *_pCap;
+  TW_IDENTITY *pDsIdentity;
 
-  // Don't spend time processing the triplet if we are not logging.
-  if( !g_ptwndsmlog )
+  // The driver has to be one of ours, and it has to be open...
+  pDsIdentity = pod.m_ptwndsmapps->DsGetIdentity(_pAppId,_DsId);
+  if (   (0 == pDsIdentity)
+      || !pod.m_ptwndsmapps->AppValidateIds(_pAppId,pDsIdentity)
+      || (0 == pod.m_ptwndsmapps->DsGetEntryProc(_pAppId,_DsId)))
   {
+    kLOG((kLOGERR,"DsId isn't an open driver...%d",(int)_DsId));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BADDEST);
     return false;
   }
-
-  // too many of these messages to log...
-  if (    (DG_CONTROL == _DG)
-      &&  (DAT_EVENT == _DAT))
+  if (g_ptwndsmwarmpool->IsParked((TWID_T)_pAppId->Id,_DsId))
+  {
+    kLOG((kLOGINFO,"DS is not open"));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
+    return false;
+  }
+  if (   pod.m_ptwndsmapps->DsIsProcessingMessage(_pAppId,_DsId)
+      || pod.m_ptwndsmapps->DsIsAppProcessingCallback(_pAppId,_DsId)
+      || g_ptwndsmreadahead->OnWorker((TWID_T)_pAppId->Id,_DsId))
   {
+    kLOG((kLOGERR,"Nested calls back to the DS.  Returning Failure."));
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_SEQERROR);
     return false;
   }
+  return true;
+}
 
-  // Convert them...
-  StringFromDg(szDg,NCHARS(szDg),_DG);
-  StringFromDat(szDat,NCHARS(szDat),_DAT);
-  StringFromMsg(szMsg,NCHARS(szMsg),_MSG);
 
-  memset(szData, 0, sizeof(szData));
 
-  // If we have data do some extra work to see what it might be
-  if(NULL != _pData)
+/*
+* One strip for the DSM triplets, from the read-ahead ring if it's on,
+* otherwise from the driver...
+*/
+TW_UINT16 CTwnDsm::DsMemXfer(TW_IDENTITY     *_pAppId,
+                             TWID_T           _DsId,
+                             TW_IMAGEMEMXFER *_pMemXfer)
+{
+  TW_UINT16 rcDS = TWRC_FAILURE;
+  TW_UINT16 ccReadAhead;
+  bool      bHandled = false;
+
+  if (g_ptwndsmreadahead->IsEnabled())
   {
-    // If we're a capability, try to tell them what cap it is...
-    if (   (DG_CONTROL == _DG)
-        && (DAT_CAPABILITY == _DAT) )
+    rcDS = g_ptwndsmreadahead->MemXfer(_pAppId,_DsId,_pMemXfer,&bHandled,&ccReadAhead);
+    if (TWCC_SUCCESS != ccReadAhead)
     {
-      _pCap = (TW_CAPABILITY*)_pData;
-      StringFromCap(szData,NCHARS(szData),_pCap->Cap);
+      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,ccReadAhead);
+    }
+  }
+  if (!bHandled)
+  {
+    rcDS = DsEntry(_pAppId,_DsId,DG_IMAGE,DAT_IMAGEMEMXFER,MSG_GET,(TW_MEMREF)_pMemXfer);
+  }
+  return rcDS;
+}
+
+
+
+/*
+* Dump the metrics for an application that's closing.  We append,
+* because several applications (or several sessions of the same
+* one) are likely to be sharing the file...
+*/
+void CTwnDsm::DumpMetrics(TW_IDENTITY *_pAppId)
+{
+  FILE            *pfile;
+  char             szPath[FILENAME_MAX];
+  char             szTriplet[128];
+  TW_IDENTITY     *pDsIdentity;
+  TW_TWDSM_METRICS twmetrics;
+
+  if (0 == g_ptwndsmmetrics)
+  {
+    return;
+  }
+
+  SGETENV(szPath,NCHARS(szPath),"TWAINDSM_METRICS");
+  if (0 == szPath[0])
+  {
+    return;
+  }
+
+  FOPEN(pfile,szPath,"a");
+  if (0 == pfile)
+  {
+    kLOG((kLOGERR,"Unable to open the metrics file: %s",szPath));
+    return;
+  }
+
+  fprintf(pfile,"# pid=%u app=%.32s\n",(UINT)GETPROCESSID(),_pAppId->ProductName);
+  fprintf(pfile,"# %-32s %-48s %10s %8s %10s %10s %10s %10s %10s %10s\n",
+          "source","triplet","calls","errors","mean_us","p50_us","p90_us","p99_us","p999_us","max_us");
 
-      // If sending a container, try to tell them what...
-      if( MSG_SET == _MSG )
-      {
-        char szType[32];
-        StringFromConType(szType,NCHARS(szType),_pCap->ConType);
-        SSTRCAT(szData,NCHARS(szData),szType);
-      }
+  memset(&twmetrics,0,sizeof(twmetrics));
+  while (g_ptwndsmmetrics->GetNext(&twmetrics))
+  {
+    if (twmetrics.AppId != (TW_UINT32)((TWID_T)_pAppId->Id & 0xFFFF))
+    {
+      continue;
     }
+    pDsIdentity = twmetrics.DsId ? pod.m_ptwndsmapps->DsGetIdentity(_pAppId,(TWID_T)twmetrics.DsId) : 0;
+    StringFromTriplet(szTriplet,NCHARS(szTriplet),twmetrics.DG,twmetrics.DAT,twmetrics.MSG);
+    fprintf(pfile,"  %-32.32s %-48s %10u %8u %10u %10u %10u %10u %10u %10u\n",
+            pDsIdentity ? pDsIdentity->ProductName : "DSM",
+            szTriplet,
+            (unsigned int)twmetrics.Calls,
+            (unsigned int)twmetrics.Errors,
+            (unsigned int)twmetrics.MeanUs,
+            (unsigned int)twmetrics.P50Us,
+            (unsigned int)twmetrics.P90Us,
+            (unsigned int)twmetrics.P99Us,
+            (unsigned int)twmetrics.P999Us,
+            (unsigned int)twmetrics.MaxUs);
   }
 
-  // Print out the orgin and Destination
-  kLOG((kLOGINFO,"%.32s -> %.32s",_pOrigin? (char*)_pOrigin->ProductName:"DSM", _pDest? (char*)_pDest->ProductName:"DSM"));
-  
-  // Print them
-  if(strlen(szData))
+  // And where its drivers ran...
+  g_ptwndsmaffinity->Report(pfile,(TWID_T)_pAppId->Id);
+
+  fclose(pfile);
+}
+
+
+
+/*
+* A message reached the application, or the application answered
+* MSG_XFERREADY.  Send the latency to the trace as a graph, and to the
+* log, the histogram is already in the metrics...
+*/
+void CTwnDsm::RecordLatency(const char* const _szName,
+                            TW_IDENTITY      *_pAppId,
+                            const TWID_T      _DsId,
+                            const TW_UINT16   _MSG,
+                            const UINT64      _ns)
+{
+  char szMsg[64];
+
+  if (0 == _ns)
   {
-    kLOG((kLOGINFO,"%s/%s/%s/%s",szDg,szDat,szMsg,szData));
+    return;
   }
-  else
+  kTRACE(Counter(_szName,(TWID_T)_pAppId->Id,_DsId,_ns));
+  if (g_ptwndsmlog)
   {
-    kLOG((kLOGINFO,"%s/%s/%s",szDg,szDat,szMsg));
+    StringFromMsg(szMsg,NCHARS(szMsg),_MSG);
+    kLOG((kLOGINFO,"%.32s %s %s %lluus",(char*)_pAppId->ProductName,_szName,szMsg,(unsigned long long)(_ns / 1000)));
   }
-  g_ptwndsmlog->Indent(1);
-
-  // All done...
-  return true;
 }
 
+
+
 /*
-* Log the results after processing the Triplet
+* Log the DAT_TWDSM_DELIVER and DAT_TWDSM_RESPOND rows for an
+* application that's closing, so the log has the whole picture even
+* without TWAINDSM_METRICS...
 */
-void CTwnDsm::printResults(const TW_UINT32 _DG,
-                           const TW_UINT16 _DAT,
-                           const TW_UINT16 _MSG,
-                           const TW_MEMREF _pData,
-                           const TW_UINT16 _RC)
+void CTwnDsm::LogLatency(TW_IDENTITY *_pAppId)
 {
-  char szRc[64];
+  char             szTriplet[128];
+  TW_TWDSM_METRICS twmetrics;
 
-  StringFromRC(szRc,NCHARS(szRc),_RC);
+  if ((0 == g_ptwndsmmetrics) || (0 == g_ptwndsmlog))
+  {
+    return;
+  }
 
-  // If we have data do some extra work to see what it might be
-  if( NULL != _pData && TWRC_FAILURE != _RC)
+  memset(&twmetrics,0,sizeof(twmetrics));
+  while (g_ptwndsmmetrics->GetNext(&twmetrics))
   {
-    if( DG_CONTROL == _DG
-     && DAT_CAPABILITY == _DAT 
-     && ( MSG_GET == _MSG || MSG_GETCURRENT == _MSG || MSG_GETDEFAULT == _MSG || MSG_RESET == _MSG ) )
-    {
-        TW_CAPABILITY *_pCap = (TW_CAPABILITY*)_pData;
-        char szType[32];
-        StringFromConType(szType, NCHARS(szType), _pCap->ConType);
-        SSTRCAT(szRc, NCHARS(szRc), szType);
-    }
-    else if( DG_CONTROL == _DG
-     && DAT_PENDINGXFERS == _DAT )
+    if (   (twmetrics.AppId != (TW_UINT32)((TWID_T)_pAppId->Id & 0xFFFF))
+        || ((DAT_TWDSM_DELIVER != twmetrics.DAT) && (DAT_TWDSM_RESPOND != twmetrics.DAT)))
     {
-        TW_PENDINGXFERS *pXfer = (TW_PENDINGXFERS*)_pData;
-        char szValue[32];
-        SSNPRINTF(szValue, NCHARS(szValue), NCHARS(szValue), " Count = %d", pXfer->Count==0xFFFF?-1:pXfer->Count);
-        SSTRCAT(szRc, NCHARS(szRc), szValue);
+      continue;
     }
-    else if( DG_CONTROL == _DG
-     && DAT_STATUS == _DAT )
+    StringFromTriplet(szTriplet,NCHARS(szTriplet),twmetrics.DG,twmetrics.DAT,twmetrics.MSG);
+    kLOG((kLOGINFO,"%.32s ds=%u %s count=%u mean=%uus p50=%uus p99=%uus max=%uus",
+          (char*)_pAppId->ProductName,
+          (unsigned int)twmetrics.DsId,
+          szTriplet,
+          (unsigned int)twmetrics.Calls,
+          (unsigned int)twmetrics.MeanUs,
+          (unsigned int)twmetrics.P50Us,
+          (unsigned int)twmetrics.P99Us,
+          (unsigned int)twmetrics.MaxUs));
+  }
+}
+
+
+
+/*
+* Each driver has its own queue, and we publish the number of drivers
+* that have something waiting.  This only runs when a message is
+* queued or picked up, so a quick walk is fine...
+*/
+void CTwnDsm::PublishCallbackDepth(TW_IDENTITY *_pAppId)
+{
+  TWID_T    ii;
+  TW_UINT32 depth;
+
+  if (0 == g_ptwndsmshm)
+  {
+    return;
+  }
+
+  depth = 0;
+  for (ii = 1; ii < MAX_NUM_DS; ii++)
+  {
+    if (pod.m_ptwndsmapps->DsCallbackIsWaiting(_pAppId,ii))
     {
-        TW_STATUS *pStatus = (TW_STATUS*)_pData;
-        char szStatus[32];
-        StringFromConditionCode(szStatus, NCHARS(szStatus), pStatus->ConditionCode);
-        SSTRCAT(szRc, NCHARS(szRc), szStatus);
+      depth++;
     }
   }
 
-  // ... and add a blank line
-  SSTRCAT(szRc,NCHARS(szRc),"\n");
-
-  g_ptwndsmlog->Indent(-1);
-  kLOG((kLOGINFO,szRc));
+  g_ptwndsmshm->SetCallbackDepth((TWID_T)_pAppId->Id,depth);
 }
 
+
+
 /*
 * DAT_NULL is used by a driver to send certain messages back to the
 * application, like MSG_XFERREADY...
@@ -2456,8 +4211,7 @@ TW_INT16 CTwnDsm::DSM_Null(TW_IDENTITY *_pAppId,
 {
   TW_CALLBACK2 *ptwcallback2 = 0;
   TW_INT16      result = TWRC_SUCCESS;
-  TW_MEMREF     MemRef = 0; 
-  bool          bPrinted = false;
+  UINT64        tickStart = DSM_GetTickNs();
 
   // Validate...
   if ( !pod.m_ptwndsmapps->AppValidateIds(_pAppId,_pDsId) )
@@ -2476,73 +4230,167 @@ TW_INT16 CTwnDsm::DSM_Null(TW_IDENTITY *_pAppId,
     return TWRC_FAILURE;
   }
 
+  // The application closed this driver, even if we didn't, so
+  // there's nobody to tell...
+  if (g_ptwndsmwarmpool->IsParked((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id))
+  {
+    kLOG((kLOGINFO,"%.32s is parked, dropping DAT_NULL 0x%04x",(char*)_pDsId->ProductName,(unsigned)_MSG));
+    return TWRC_FAILURE;
+  }
+
+  // Start the clock, it stops when the application gets it...
+  if (g_ptwndsmmetrics)
+  {
+    g_ptwndsmmetrics->Notify((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id,_MSG);
+  }
+
   // Get the current callback...
   ptwcallback2 = pod.m_ptwndsmapps->DsCallback2Get(_pAppId,(TWID_T)_pDsId->Id);
 
-  // We have something to call...
+  // Draw an arrow from here to the transfers that follow...
+  if (MSG_XFERREADY == _MSG)
+  {
+    kTRACE(Flow('s',(TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id));
+  }
+
+  // We have something to call, so hand it to the dispatcher if it's
+  // on, otherwise call it ourselves...
   if (   (0 != ptwcallback2)
     && (ptwcallback2->CallBackProc))
   {
-    // RefCon is returned back to the calling application in pData
-    // Unfortunately RefCon is defined as TW_INT32
-    // Application writers that want to store a pointer in RefCon
-    // on 64bit will need to store an index to local storage.
-    MemRef = (TW_MEMREF)ptwcallback2->RefCon;
-
-    // Set flag to prevent Application from sending a new message 
-    // before returning back from recieving this callback.
-    pod.m_ptwndsmapps->DsSetAppProcessingCallback(_pAppId,(TWID_T)_pDsId->Id,TRUE);
+    // Create a local copy of the AppIdentity
+    TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(_pAppId);
 
-    // We should have a try/catch around this...
-    // Send a message from DS to the Application.
-    // Rare case where the origin is the DS and dest is the App
-    try
-    {
-      // Create a local copy of the AppIdentity
-      TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(_pAppId);
-
-      // Print the triplets to stdout for information purposes
-      bPrinted = printTripletsInfo(NULL,&AppId,DG_CONTROL,DAT_NULL,_MSG,MemRef);
-
-	  // Send a pointer to the data...
-      result = ((DSMENTRYPROC)(ptwcallback2->CallBackProc))(
-          pod.m_ptwndsmapps->DsGetIdentity(&AppId,(TWID_T)_pDsId->Id),
-          &AppId,
-          DG_CONTROL,
-          DAT_NULL,
-          _MSG,
-          MemRef);
-    }
-    catch(...)
+    if (   !g_ptwndsmdispatch->IsEnabled()
+        || !g_ptwndsmdispatch->Post(&AppId,(TWID_T)_pDsId->Id,_MSG))
     {
-      pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
-      kLOG((kLOGERR,"Exception caught while App was processing message.  Returning Failure."));
-      result = TWRC_FAILURE;
+      result = DispatchCallback(&AppId,(TWID_T)_pDsId->Id,_MSG);
     }
-
-    pod.m_ptwndsmapps->DsSetAppProcessingCallback(_pAppId,(TWID_T)_pDsId->Id,FALSE);
   }
 
   // Application has not registered a callback. As a result, the msg will
   // be sent to the app the next time it forwards an event.
-  // Each App's DS has a callback structure.   This way multiple DS's can make
-  // a callback to a single app, and we are not going to lose MSG's
+  // Each App's DS has its own queue.   This way multiple DS's can make
+  // a callback to a single app, and a fast driver doesn't lose MSG's
+  // when it gets ahead of the app's DAT_EVENTs
   else
   {
-	  if (ptwcallback2)
-	  {
-		  if (ptwcallback2->Message != 0)
-		  {
-				char szMsg[64];
-				StringFromMsg(szMsg, NCHARS(szMsg), ptwcallback2->Message);
-				kLOG((kLOGERR, "%.32s NEVER retrieved DAT_EVENT / %s\n", _pAppId->ProductName, szMsg));
-		  }
-		  ptwcallback2->Message = _MSG;
-	  }
-	  pod.m_ptwndsmapps->DsCallbackSetWaiting(_pAppId,(TWID_T)_pDsId->Id,TRUE);
-      pod.m_ptwndsmapps->AppWakeup(_pAppId);
+    switch (pod.m_ptwndsmapps->DsEventPush(_pAppId,(TWID_T)_pDsId->Id,_MSG))
+    {
+      // Only a new message is worth waking the app for, the others
+      // were already there to be popped...
+      case dsmEvent_Queued:
+        PublishCallbackDepth(_pAppId);
+        kPROBE3(callback__queued,(TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id,_MSG);
+        pod.m_ptwndsmapps->AppWakeup(_pAppId);
+        break;
+      case dsmEvent_Coalesced:
+        if (g_ptwndsmlog)
+        {
+          char szMsg[64];
+          StringFromMsg(szMsg,NCHARS(szMsg),_MSG);
+          kLOG((kLOGINFO,"%.32s already has DAT_EVENT / %s waiting\n",_pAppId->ProductName,szMsg));
+        }
+        break;
+      default:
+      case dsmEvent_Full:
+        if (g_ptwndsmlog)
+        {
+          char szMsg[64];
+          StringFromMsg(szMsg,NCHARS(szMsg),_MSG);
+          kLOG((kLOGERR,"%.32s NEVER retrieved DAT_EVENT, dropping %s\n",_pAppId->ProductName,szMsg));
+        }
+        break;
+    }
+  }
+
+  // Log how it went...
+  if (g_ptwndsmmetrics)
+  {
+    g_ptwndsmmetrics->Record((TWID_T)_pAppId->Id,
+                             (TWID_T)_pDsId->Id,
+                             DG_CONTROL,DAT_NULL,_MSG,
+                             DSM_GetTickNs() - tickStart,
+                             result);
+  }
+
+  return result;
+}
+
+
+
+/*
+* Make the application's callback for a DAT_NULL message, from the
+* driver's thread or from the dispatcher's...
+*/
+TW_INT16 CTwnDsm::DispatchCallback(TW_IDENTITY *_pAppId,
+                                   TWID_T       _DsId,
+                                   TW_UINT16    _MSG)
+{
+  TW_CALLBACK2 *ptwcallback2 = 0;
+  TW_INT16      result = TWRC_SUCCESS;
+  TW_MEMREF     MemRef = 0; 
+  bool          bPrinted = false;
+
+  // Get the current callback, the application may have changed it
+  // while the message was waiting for the dispatcher...
+  ptwcallback2 = pod.m_ptwndsmapps->DsCallback2Get(_pAppId,_DsId);
+  if (   (0 == ptwcallback2)
+      || (0 == ptwcallback2->CallBackProc))
+  {
+    kLOG((kLOGERR,"%.32s has no callback for DAT_NULL...",(char*)_pAppId->ProductName));
+    return TWRC_FAILURE;
+  }
+
+  // RefCon is returned back to the calling application in pData
+  // Unfortunately RefCon is defined as TW_INT32
+  // Application writers that want to store a pointer in RefCon
+  // on 64bit will need to store an index to local storage.
+  MemRef = (TW_MEMREF)ptwcallback2->RefCon;
+
+  // Set flag to prevent Application from sending a new message 
+  // before returning back from recieving this callback.
+  pod.m_ptwndsmapps->DsSetAppProcessingCallback(_pAppId,_DsId,TRUE);
+
+  // The message has reached the application...
+  if (g_ptwndsmmetrics)
+  {
+    RecordLatency("deliver",_pAppId,_DsId,_MSG,g_ptwndsmmetrics->Deliver((TWID_T)_pAppId->Id,_DsId,_MSG));
+  }
+
+  // We should have a try/catch around this...
+  // Send a message from DS to the Application.
+  // Rare case where the origin is the DS and dest is the App
+  try
+  {
+    // Create a local copy of the AppIdentity
+    TW_IDENTITY AppId = *pod.m_ptwndsmapps->AppGetIdentity(_pAppId);
+
+    // Print the triplets to stdout for information purposes
+    bPrinted = printTripletsInfo(NULL,&AppId,DG_CONTROL,DAT_NULL,_MSG,MemRef);
+
+    // Send a pointer to the data...
+    CTwnDsmTraceScope tracescope("app","CallBackProc",AppId.ProductName);
+    kPROBE3(callback__entry,(TWID_T)AppId.Id,_DsId,_MSG);
+    result = ((DSMENTRYPROC)(ptwcallback2->CallBackProc))(
+        pod.m_ptwndsmapps->DsGetIdentity(&AppId,_DsId),
+        &AppId,
+        DG_CONTROL,
+        DAT_NULL,
+        _MSG,
+        MemRef);
+    kPROBE4(callback__return,(TWID_T)AppId.Id,_DsId,_MSG,result);
+    tracescope.SetResult(result);
+  }
+  catch(...)
+  {
+    pod.m_ptwndsmapps->AppSetConditionCode(_pAppId,TWCC_BUMMER);
+    kLOG((kLOGERR,"Exception caught while App was processing message.  Returning Failure."));
+    result = TWRC_FAILURE;
   }
 
+  pod.m_ptwndsmapps->DsSetAppProcessingCallback(_pAppId,_DsId,FALSE);
+
   // Log how it went...
   if (bPrinted)
   {
@@ -2554,6 +4402,26 @@ TW_INT16 CTwnDsm::DSM_Null(TW_IDENTITY *_pAppId,
 
 
 
+/*
+* Convert a triplet to a DG/DAT/MSG string...
+*/
+void CTwnDsm::StringFromTriplet(char      *_szTriplet,
+                          const int        _nChars,
+                          const TW_UINT32  _DG,
+                          const TW_UINT16  _DAT,
+                          const TW_UINT16  _MSG)
+{
+  char szDg[64];
+  char szDat[64];
+  char szMsg[64];
+  StringFromDg(szDg,NCHARS(szDg),_DG);
+  StringFromDat(szDat,NCHARS(szDat),_DAT);
+  StringFromMsg(szMsg,NCHARS(szMsg),_MSG);
+  SSNPRINTF(_szTriplet,_nChars,_nChars,"%s/%s/%s",szDg,szDat,szMsg);
+}
+
+
+
 /*
 * Convert a DG_ data group numerical value to a string...
 */
@@ -2594,6 +4462,7 @@ void CTwnDsm::StringFromDat(char     *_szDat,
   {
     default:
       SSNPRINTF(_szDat,_nChars,_nChars,"DAT_0x%04x",_DAT);
+      break;
 
     case DAT_NULL:
       SSTRCPY(_szDat,_nChars,"DAT_NULL");
@@ -2603,6 +4472,44 @@ void CTwnDsm::StringFromDat(char     *_szDat,
       SSTRCPY(_szDat,_nChars,"DAT_CUSTOMBASE");
       break;
 
+    case DAT_TWDSM_METRICS:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_METRICS");
+      break;
+
+    case DAT_TWDSM_MEMFD:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_MEMFD");
+      break;
+
+    case DAT_TWDSM_MEMXFERBATCH:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_MEMXFERBATCH");
+      break;
+
+    case DAT_TWDSM_IMAGEFRAME:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_IMAGEFRAME");
+      break;
+
+    case DAT_TWDSM_CONVERT:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_CONVERT");
+      break;
+    case DAT_TWDSM_ANALYSIS:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_ANALYSIS");
+      break;
+    case DAT_TWDSM_CHECKSUM:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_CHECKSUM");
+      break;
+    case DAT_TWDSM_EVENTFD:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_EVENTFD");
+      break;
+    case DAT_TWDSM_DELIVER:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_DELIVER");
+      break;
+    case DAT_TWDSM_RESPOND:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_RESPOND");
+      break;
+    case DAT_TWDSM_SUBMIT:
+      SSTRCPY(_szDat,_nChars,"DAT_TWDSM_SUBMIT");
+      break;
+
     case DAT_CAPABILITY:
       SSTRCPY(_szDat,_nChars,"DAT_CAPABILITY");
       break;
@@ -3755,37 +5662,39 @@ TW_HANDLE PASCAL DSM_MemAllocate (TW_UINT32 _bytes)
   // Windows...
   #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
     handle = (TW_HANDLE)::GlobalAlloc(GPTR,_bytes);
-  if (0 == handle)
-  {
-      kLOG((kLOGERR,"DSM_MemAllocate failed to allocate %ld bytes...",_bytes));
-      return (TW_HANDLE)NULL;
-  }
-  return handle;
   
   // MacOS
   #elif (TWNDSM_OS == TWNDSM_OS_MACOSX)
     handle = (TW_HANDLE)NewHandleClear(_bytes);
-  if (0 == handle)
-  {
-      kLOG((kLOGERR,"DSM_MemAllocate failed to allocate %ld bytes...",_bytes));
-      return (TW_HANDLE)NULL;
-  }
-  return handle;
 
   // Linux
   #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
-    handle = (TW_HANDLE)calloc(_bytes,1);
-  if (0 == handle)
+  if (g_ptwndsmpool && g_ptwndsmpool->IsEnabled())
   {
-      kLOG((kLOGERR,"DSM_MemAllocate failed to allocate %ld bytes...",_bytes));
-      return (TW_HANDLE)NULL;
+    handle = (TW_HANDLE)g_ptwndsmpool->Allocate(_bytes,g_ptwndsmpool->IsZeroing());
+  }
+  else
+  {
+    handle = (TW_HANDLE)calloc(_bytes,1);
   }
-  return handle;
 
   // Oops...
   #else
     #error Sorry, we do not recognize this system...
   #endif
+
+  if (0 == handle)
+  {
+      kLOG((kLOGERR,"DSM_MemAllocate failed to allocate %ld bytes...",_bytes));
+      return (TW_HANDLE)NULL;
+  }
+
+  // Remember who asked for it...
+  if (g_ptwndsmmemtrack)
+  {
+    g_ptwndsmmemtrack->Allocate(handle,_bytes,RETURNADDRESS());
+  }
+  return handle;
 }
 
 
@@ -3803,6 +5712,12 @@ void PASCAL DSM_MemFree (TW_HANDLE _handle)
     return;
   }
 
+  // Forget who had it...
+  if (g_ptwndsmmemtrack)
+  {
+    g_ptwndsmmemtrack->Free(_handle);
+  }
+
   // Windows...
   #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
     ::GlobalFree(_handle);
@@ -3813,7 +5728,14 @@ void PASCAL DSM_MemFree (TW_HANDLE _handle)
 
   // Linux...
   #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+  if (g_ptwndsmpool && g_ptwndsmpool->IsEnabled())
+  {
+    g_ptwndsmpool->Free(_handle);
+  }
+  else
+  {
     free(_handle);
+  }
 
   // Oops...
   #else
@@ -3834,6 +5756,10 @@ TW_MEMREF PASCAL DSM_MemLock (TW_HANDLE _handle)
     kLOG((kLOGERR,"attempting to lock null handle..."));
     return (TW_MEMREF)NULL;
   }
+  if (g_ptwndsmmemtrack)
+  {
+    g_ptwndsmmemtrack->Lock(_handle,true);
+  }
 
   // Windows...technically we shouldn't have to do the
   // lock, since we allocated with GPTR, but I'm nervous
@@ -3871,6 +5797,10 @@ void PASCAL DSM_MemUnlock (TW_HANDLE _handle)
     kLOG((kLOGERR,"attempting to unlock null handle..."));
     return;
   }
+  if (g_ptwndsmmemtrack)
+  {
+    g_ptwndsmmemtrack->Lock(_handle,false);
+  }
 
   // Windows...
   #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
@@ -3916,3 +5846,56 @@ void* DSM_LoadFunction(void* _pHandle, const char* _pszSymbol)
 #endif
   return pRet;
 }
+
+/*
+* A monotonic clock for measuring how long things take.  Never
+* use this for the time of day...
+*/
+UINT64 DSM_GetTickNs()
+{
+  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+    static LARGE_INTEGER s_frequency = { 0 };
+    LARGE_INTEGER counter;
+    if (0 == s_frequency.QuadPart)
+    {
+      ::QueryPerformanceFrequency(&s_frequency);
+    }
+    ::QueryPerformanceCounter(&counter);
+    return (UINT64)((counter.QuadPart / s_frequency.QuadPart) * 1000000000ULL)
+         + (UINT64)(((counter.QuadPart % s_frequency.QuadPart) * 1000000000ULL) / s_frequency.QuadPart);
+
+  #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ((UINT64)ts.tv_sec * 1000000000ULL) + (UINT64)ts.tv_nsec;
+
+  #else
+    #error Sorry, we do not recognize this system...
+  #endif
+}
+
+
+
+#if (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+/*
+* The Mac doesn't do pthread_condattr_setclock, so we go with the
+* time of day, which is fine for the naps our threads take...
+*/
+int DSM_CondTimedWait(pthread_cond_t  *_pcond,
+                      pthread_mutex_t *_pmutex,
+                      const UINT       _ms)
+{
+  timeval  tv;
+  timespec ts;
+
+  gettimeofday(&tv,NULL);
+  ts.tv_sec  = tv.tv_sec + (_ms / 1000);
+  ts.tv_nsec = (tv.tv_usec * 1000L) + ((long)(_ms % 1000) * 1000000L);
+  if (ts.tv_nsec >= 1000000000L)
+  {
+    ts.tv_sec  += 1;
+    ts.tv_nsec -= 1000000000L;
+  }
+  return pthread_cond_timedwait(_pcond,_pmutex,&ts);
+}
+#endif
@@ -137,6 +137,7 @@
   #include <windows.h>
   #include <direct.h>
   #include <share.h>
+  #include <intrin.h>
 
 #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
   #include <dirent.h>
@@ -145,8 +146,18 @@
   #include <errno.h>
   #include <stdarg.h>
   #include <time.h>
+  #include <pthread.h>
+  #include <sched.h>
+  #include <fcntl.h>
+  #include <sys/mman.h>
   #include <sys/syscall.h>
   #include <sys/time.h>
+  #if defined(HAVE_SYS_SDT_H)
+    #include <sys/sdt.h>
+  #endif
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    #include <sys/eventfd.h>
+  #endif
   #define gettid() syscall(SYS_gettid)
 
 #else
@@ -173,6 +184,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 /**
 * This is for IDEs like Visual Studio .Net 2003, that does not understand the SAL Annotations
@@ -186,9 +198,10 @@
 
 
 /**
-* Don't forget to include TWAIN...
+* Don't forget to include TWAIN, and our extensions to it...
 */
 #include "twain.h"
+#include "twaindsm.h"
 
 
 /**
@@ -243,6 +256,146 @@
 * @def GETTHREADID
 * get the thread ID
 *
+* @def GETPROCESSID
+* get the process ID
+*
+* @def MUTEX
+* the type of a lock we can use to protect data shared by threads
+*
+* @def MUTEXINIT(m)
+* initialize a MUTEX, call it once before using the lock
+* @param[in] m the MUTEX to initialize
+*
+* @def MUTEXDESTROY(m)
+* release a MUTEX, after which it can't be used
+* @param[in] m the MUTEX to destroy
+*
+* @def MUTEXLOCK(m)
+* take the lock, blocking until we get it
+* @param[in] m the MUTEX to lock
+*
+* @def MUTEXUNLOCK(m)
+* give the lock back
+* @param[in] m the MUTEX to unlock
+*
+* @def ATOMICADD32(p,v)
+* add to a 32-bit counter that other threads are also changing
+* @param[in,out] p pointer to the counter
+* @param[in] v the amount to add
+*
+* @def ATOMICADD64(p,v)
+* add to a 64-bit counter that other threads are also changing
+* @param[in,out] p pointer to the counter
+* @param[in] v the amount to add
+*
+* @def ATOMICCAS32(p,o,n)
+* replace a 32-bit value with n, but only if it's still o
+* @param[in,out] p pointer to the value
+* @param[in] o the value we expect to find
+* @param[in] n the value to put there
+* @return true if the swap happened
+*
+* @def ATOMICCAS64(p,o,n)
+* replace a 64-bit value with n, but only if it's still o
+* @param[in,out] p pointer to the value
+* @param[in] o the value we expect to find
+* @param[in] n the value to put there
+* @return true if the swap happened
+*
+* @def ATOMICCASPTR(p,o,n)
+* replace a pointer with n, but only if it's still o
+* @param[in,out] p pointer to the pointer
+* @param[in] o the pointer we expect to find
+* @param[in] n the pointer to put there
+* @return true if the swap happened
+*
+* @def MEMORYBARRIER
+* keep the compiler and the cpu from moving loads and stores across this point
+*
+* @def COND
+* a condition variable, always used with a MUTEX
+*
+* @def CONDINIT(c)
+* initialize a COND, call it once before using it
+* @param[in] c the COND to initialize
+*
+* @def CONDDESTROY(c)
+* release a COND, after which it can't be used
+* @param[in] c the COND to destroy
+*
+* @def CONDWAIT(c,m)
+* give up the MUTEX and sleep until the COND is signaled, then take
+* the MUTEX back.  Wakeups can be spurious, so always wait in a loop
+* @param[in] c the COND to wait on
+* @param[in] m the MUTEX we're holding
+*
+* @def CONDTIMEDWAIT(c,m,ms)
+* same as CONDWAIT, but give up after a while
+* @param[in] c the COND to wait on
+* @param[in] m the MUTEX we're holding
+* @param[in] ms how long to wait in milliseconds
+*
+* @def CONDSIGNAL(c)
+* wake up one thread that's waiting on the COND
+* @param[in] c the COND to signal
+*
+* @def CONDBROADCAST(c)
+* wake up every thread that's waiting on the COND
+* @param[in] c the COND to signal
+*
+* @def TLSKEY
+* a slot for a pointer that each thread has its own copy of
+*
+* @def TLSDESTRUCTOR(f)
+* declare the function that's called with a thread's pointer when
+* the thread exits, the pointer is a void* named _pv
+* @param[in] f the name of the function
+*
+* @def TLSCREATE(k,d)
+* get a TLSKEY
+* @param[out] k the TLSKEY
+* @param[in] d the function declared with TLSDESTRUCTOR
+* @return true if we got one
+*
+* @def TLSDELETE(k)
+* give back a TLSKEY
+* @param[in] k the TLSKEY
+*
+* @def TLSGET(k)
+* get this thread's pointer, it starts out as NULL
+* @param[in] k the TLSKEY
+*
+* @def TLSSET(k,v)
+* set this thread's pointer
+* @param[in] k the TLSKEY
+* @param[in] v the pointer
+*
+* @def THREAD
+* a handle to a thread
+*
+* @def THREADPROC(f)
+* declare the function a thread starts in, it takes a void* named
+* _pv and returns 0
+* @param[in] f the name of the function
+*
+* @def THREADCREATE(t,f,a)
+* start a thread
+* @param[out] t the THREAD
+* @param[in] f the function declared with THREADPROC
+* @param[in] a the argument for the function
+* @return true if the thread started
+*
+* @def THREADJOIN(t)
+* wait for a thread to finish, and release it
+* @param[in] t the THREAD
+*
+* @def THREADYIELD()
+* give the rest of our time slice to another thread
+*
+* @def RETURNADDRESS()
+* the address the current function is going to return to, which is
+* somewhere in whoever called us
+*
 * @def FOPEN
 * @param[out] pf pointer to the file to store the opened file
 * @param[in] name the path and name of the file to open
@@ -297,6 +450,37 @@
   #define STRNICMP _strnicmp
   #define DSMENTRY TW_UINT16 FAR PASCAL
   #define GETTHREADID ::GetCurrentThreadId
+  #define GETPROCESSID ::GetCurrentProcessId
+  #define MUTEX CRITICAL_SECTION
+  #define MUTEXINIT(m) ::InitializeCriticalSection(&(m))
+  #define MUTEXDESTROY(m) ::DeleteCriticalSection(&(m))
+  #define MUTEXLOCK(m) ::EnterCriticalSection(&(m))
+  #define MUTEXUNLOCK(m) ::LeaveCriticalSection(&(m))
+  #define ATOMICADD32(p,v) ::InterlockedExchangeAdd((volatile LONG*)(p),(LONG)(v))
+  #define ATOMICADD64(p,v) ::InterlockedExchangeAdd64((volatile LONGLONG*)(p),(LONGLONG)(v))
+  #define ATOMICCAS32(p,o,n) (::InterlockedCompareExchange((volatile LONG*)(p),(LONG)(n),(LONG)(o)) == (LONG)(o))
+  #define ATOMICCAS64(p,o,n) (::InterlockedCompareExchange64((volatile LONGLONG*)(p),(LONGLONG)(n),(LONGLONG)(o)) == (LONGLONG)(o))
+  #define ATOMICCASPTR(p,o,n) (::InterlockedCompareExchangePointer((PVOID volatile*)(p),(PVOID)(n),(PVOID)(o)) == (PVOID)(o))
+  #define MEMORYBARRIER ::MemoryBarrier()
+  #define COND CONDITION_VARIABLE
+  #define CONDINIT(c) ::InitializeConditionVariable(&(c))
+  #define CONDDESTROY(c)
+  #define CONDWAIT(c,m) ::SleepConditionVariableCS(&(c),&(m),INFINITE)
+  #define CONDTIMEDWAIT(c,m,ms) ::SleepConditionVariableCS(&(c),&(m),ms)
+  #define CONDSIGNAL(c) ::WakeConditionVariable(&(c))
+  #define CONDBROADCAST(c) ::WakeAllConditionVariable(&(c))
+  #define TLSKEY DWORD
+  #define TLSDESTRUCTOR(f) VOID WINAPI f(PVOID _pv)
+  #define TLSCREATE(k,d) (FLS_OUT_OF_INDEXES != ((k) = ::FlsAlloc(d)))
+  #define TLSDELETE(k) ::FlsFree(k)
+  #define TLSGET(k) ::FlsGetValue(k)
+  #define TLSSET(k,v) ::FlsSetValue(k,v)
+  #define THREAD HANDLE
+  #define THREADPROC(f) DWORD WINAPI f(LPVOID _pv)
+  #define THREADCREATE(t,f,a) (0 != ((t) = ::CreateThread(NULL,0,f,a,0,NULL)))
+  #define THREADJOIN(t) (::WaitForSingleObject(t,INFINITE),::CloseHandle(t))
+  #define THREADYIELD() ::SwitchToThread()
+  #define RETURNADDRESS() _ReturnAddress()
   #define FOPEN(pf, name, mode) pf = _fsopen(name, mode, _SH_DENYNO)
   #ifndef kTWAIN_DS_DIR
     #if TWNDSM_OS_64BIT
@@ -325,6 +509,37 @@
   #define UNLINK unlink
   #define STRNICMP strncasecmp
   #define GETTHREADID gettid
+  #define GETPROCESSID getpid
+  #define MUTEX pthread_mutex_t
+  #define MUTEXINIT(m) pthread_mutex_init(&(m),NULL)
+  #define MUTEXDESTROY(m) pthread_mutex_destroy(&(m))
+  #define MUTEXLOCK(m) pthread_mutex_lock(&(m))
+  #define MUTEXUNLOCK(m) pthread_mutex_unlock(&(m))
+  #define ATOMICADD32(p,v) __sync_fetch_and_add((p),(v))
+  #define ATOMICADD64(p,v) __sync_fetch_and_add((p),(v))
+  #define ATOMICCAS32(p,o,n) __sync_bool_compare_and_swap((p),(o),(n))
+  #define ATOMICCAS64(p,o,n) __sync_bool_compare_and_swap((p),(o),(n))
+  #define ATOMICCASPTR(p,o,n) __sync_bool_compare_and_swap((p),(o),(n))
+  #define MEMORYBARRIER __sync_synchronize()
+  #define COND pthread_cond_t
+  #define CONDINIT(c) pthread_cond_init(&(c),NULL)
+  #define CONDDESTROY(c) pthread_cond_destroy(&(c))
+  #define CONDWAIT(c,m) pthread_cond_wait(&(c),&(m))
+  #define CONDTIMEDWAIT(c,m,ms) DSM_CondTimedWait(&(c),&(m),ms)
+  #define CONDSIGNAL(c) pthread_cond_signal(&(c))
+  #define CONDBROADCAST(c) pthread_cond_broadcast(&(c))
+  #define TLSKEY pthread_key_t
+  #define TLSDESTRUCTOR(f) void f(void *_pv)
+  #define TLSCREATE(k,d) (0 == pthread_key_create(&(k),d))
+  #define TLSDELETE(k) pthread_key_delete(k)
+  #define TLSGET(k) pthread_getspecific(k)
+  #define TLSSET(k,v) pthread_setspecific(k,v)
+  #define THREAD pthread_t
+  #define THREADPROC(f) void *f(void *_pv)
+  #define THREADCREATE(t,f,a) (0 == pthread_create(&(t),NULL,f,a))
+  #define THREADJOIN(t) pthread_join(t,NULL)
+  #define THREADYIELD() sched_yield()
+  #define RETURNADDRESS() __builtin_return_address(0)
   #define FOPEN(pf,name,mode) pf = fopen(name,mode)
   #ifndef kTWAIN_DS_DIR
     #if (TWNDSM_OS == TWNDSM_OS_MACOSX)
@@ -334,6 +549,7 @@
     #endif
   #endif
   typedef unsigned int UINT;
+  typedef unsigned long long UINT64;
   typedef void* HINSTANCE;
   typedef void* HWND;
   #define DSMENTRY FAR PASCAL TW_UINT16
@@ -534,12 +750,81 @@ typedef enum
   dsmState_Open       = 3  /**< Source Manager is open. */
 } DSM_State;
 
+/**
+* What became of a DAT_NULL message queued for an application that
+* didn't register a callback...
+*/
+typedef enum
+{
+  dsmEvent_Queued    = 0, /**< Waiting for the application's DAT_EVENT. */
+  dsmEvent_Coalesced = 1, /**< The same message was already waiting. */
+  dsmEvent_Full      = 2  /**< No room, the message was dropped. */
+} DSM_EventPush;
+
+/**
+* Each module's part of a DS_SESSION, defined where they're used...
+*/
+struct READAHEAD_SESSION_;
+struct CONVERT_SESSION_;
+struct ANALYSIS_SESSION_;
+struct CHECKSUM_SESSION_;
+struct ACTOR_;
+struct AFFINITY_SESSION_;
+struct WARM_DS_;
+struct DISPATCH_SESSION_;
+
+/**
+* What the modules keep for one driver an application has open.  It
+* lives in the driver's DS_INFO, so a module gets to its part from the
+* ids without a table of its own.  The parts come and go with the
+* session: the modules add them from MSG_OPENDS on, and CTwnDsm has
+* every module let go of its part in CloseDS, or in MSG_CLOSEDSM for a
+* driver the application left open, before the driver is unloaded.
+* The warm pool's part is the exception, it's how a closed driver
+* stays parked, and it goes when the driver is taken back or really
+* closed.  Each module only touches its own pointer, under its own
+* mutex.  The callback dispatcher belongs to the application rather
+* than to one of its drivers, so it hangs off the application...
+*/
+typedef struct
+{
+  struct READAHEAD_SESSION_ *preadahead;  /**< CTwnDsmReadAhead's worker and ring */
+  struct CONVERT_SESSION_   *pconvert;    /**< CTwnDsmConvert's target format */
+  struct ANALYSIS_SESSION_  *panalysis;   /**< CTwnDsmAnalysis's page so far */
+  struct CHECKSUM_SESSION_  *pchecksum;   /**< CTwnDsmChecksum's image so far */
+  struct ACTOR_             *pactor;      /**< CTwnDsmActor's thread */
+  struct AFFINITY_SESSION_  *paffinity;   /**< CTwnDsmAffinity's placement */
+  struct WARM_DS_           *pwarm;       /**< CTwnDsmWarmPool's, while the driver is parked */
+} DS_SESSION;
+
 /**
 * This function wraps the function loading calls. Linux has a 
 * special way to check dlsym failures.
 */
 void* DSM_LoadFunction(void* _pHandle, const char* _pszSymbol);
 
+/**
+* Get a timestamp in nanoseconds from a clock that never goes
+* backwards.  It's only good for measuring how long something
+* took, it has nothing to do with the time of day...
+* @return nanoseconds since some arbitrary point in the past
+*/
+UINT64 DSM_GetTickNs();
+
+#if (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+/**
+* pthread_cond_timedwait wants a time of day, this takes a timeout,
+* it's what CONDTIMEDWAIT uses...
+* @param[in] _pcond the condition
+* @param[in] _pmutex the mutex we're holding
+* @param[in] _ms how long to wait in milliseconds
+* @return 0, or ETIMEDOUT if we gave up
+*/
+int DSM_CondTimedWait(pthread_cond_t  *_pcond,
+                      pthread_mutex_t *_pmutex,
+                      const UINT       _ms);
+#endif
+
 /**
 * @class CTwnDsmLog
 * Our logging class.  We use the impl to encapsulate the private
@@ -548,50 +833,1559 @@ void* DSM_LoadFunction(void* _pHandle, const char* _pszSymbol);
 * extern, because life is easier if we treat this object as globally
 * accessible (think of it like a service).
 */
-class CTwnDsmLogImpl;
-class CTwnDsmLog
+class CTwnDsmLogImpl;
+class CTwnDsmLog
+{
+  public:
+
+    /**
+    * The CTwnDsmLog constructor.
+    */
+    CTwnDsmLog();
+
+    /**
+    * The CTwnDsmLog destructor.
+    */
+    ~CTwnDsmLog();
+
+    /**
+    * The logging function.  This should only be access through
+    * the kLOG macro...
+    * @param[in] _doassert decides if we assert or not
+    * @param[in] _file the source file of the message 
+    * @param[in] _line the source line of the message 
+    * @param[in] _format the format of the message (same as sprintf) 
+    * @param[in] ... arguments to the format of the message 
+    */
+    void Log(const int         _doassert,
+             const char* const _file,
+             const int         _line,
+             const char* const _format,
+             ...);
+
+    /**
+    * Indent the logging to help with seeing recursive calls
+    * param[in] nChange Either +1 or -1 
+    */
+    void Indent(int nChange);
+
+    /**
+    * Tell us the name of the first application, for the %n in a
+    * TWAINDSM_LOG template.  Until then we hang on to the messages,
+    * after that we ignore the call...
+    * @param[in] _szName the application's ProductName
+    */
+    void SetAppName(const char* const _szName);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmLogImpl *m_ptwndsmlogimpl;
+};
+extern CTwnDsmLog *g_ptwndsmlog;
+
+
+
+/**
+* @class CTwnDsmTrace
+* Our tracing class.  When TWAINDSM_TRACE names a file we write
+* begin/end spans to it in the Chrome trace-event JSON format, so
+* the file can be dropped straight into chrome://tracing or the
+* Perfetto UI.  That lets us see how much time is spent in the DSM,
+* in the driver's DS_Entry, and in the application's callback.  Like
+* the logging class this one is treated as a global service.
+*/
+class CTwnDsmTraceImpl;
+class CTwnDsmTrace
+{
+  public:
+
+    /**
+    * The CTwnDsmTrace constructor.
+    */
+    CTwnDsmTrace();
+
+    /**
+    * The CTwnDsmTrace destructor.
+    */
+    ~CTwnDsmTrace();
+
+    /**
+    * Check if tracing is turned on.  Use this to avoid building
+    * strings that nobody is going to look at...
+    * @return true if we're writing a trace file
+    */
+    bool IsEnabled();
+
+    /**
+    * Start a span.  Spans nest, and must be ended on the same
+    * thread that began them...
+    * @param[in] _cat the category (dsm, ds, app)
+    * @param[in] _name the name of the span
+    * @param[in] _detail optional string shown with the span, or NULL
+    */
+    void Begin(const char* const _cat,
+               const char* const _name,
+               const char* const _detail);
+
+    /**
+    * End a span.
+    * @param[in] _cat the category used with Begin
+    * @param[in] _name the name used with Begin
+    * @param[in] _rc the TWRC_xxxx we're returning, or -1 if none
+    */
+    void End(const char* const _cat,
+             const char* const _name,
+             const int         _rc);
+
+    /**
+    * Flow events draw an arrow between spans.  We start one when
+    * a driver sends MSG_XFERREADY, step it on each transfer that
+    * follows, and finish it when the app ends the transfer.  Each
+    * must be called inside of a span, which it binds to...
+    * @param[in] _phase 's' to start, 't' to step, 'f' to finish
+    * @param[in] _AppId the application's id
+    * @param[in] _DsId the driver's id
+    */
+    void Flow(const char   _phase,
+              const TWID_T _AppId,
+              const TWID_T _DsId);
+
+    /**
+    * Counter events draw a graph.  We use them for the time a
+    * message waited for the application, and the time the application
+    * took to answer MSG_XFERREADY, one series per application/driver...
+    * @param[in] _name the name of the graph
+    * @param[in] _AppId the application's id
+    * @param[in] _DsId the driver's id
+    * @param[in] _ns the latency
+    */
+    void Counter(const char* const _name,
+                 const TWID_T      _AppId,
+                 const TWID_T      _DsId,
+                 const UINT64      _ns);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmTraceImpl *m_ptwndsmtraceimpl;
+};
+extern CTwnDsmTrace *g_ptwndsmtrace;
+
+/**
+* Begin a span for the life of a block of code, and end it no
+* matter how we leave the block, which is handy for functions
+* with lots of returns...
+*/
+class CTwnDsmTraceScope
+{
+  public:
+
+    /**
+    * Begin the span, if tracing is on...
+    * @param[in] _cat the category (dsm, ds, app)
+    * @param[in] _name the name of the span
+    * @param[in] _detail optional string shown with the span, or NULL
+    */
+    CTwnDsmTraceScope(const char* const _cat,
+                      const char* const _name,
+                      const char* const _detail)
+    {
+      m_cat = _cat;
+      m_name = _name;
+      m_rc = -1;
+      m_active = g_ptwndsmtrace && g_ptwndsmtrace->IsEnabled();
+      if (m_active)
+      {
+        g_ptwndsmtrace->Begin(m_cat,m_name,_detail);
+      }
+    }
+
+    /**
+    * End the span...
+    */
+    ~CTwnDsmTraceScope()
+    {
+      if (m_active && g_ptwndsmtrace)
+      {
+        g_ptwndsmtrace->End(m_cat,m_name,m_rc);
+      }
+    }
+
+    /**
+    * Remember the return code, so we can show it at the end...
+    * @param[in] _rc the TWRC_xxxx value
+    */
+    void SetResult(const int _rc)
+    {
+      m_rc = _rc;
+    }
+
+  private:
+    const char *m_cat;  /**< category of the span */
+    const char *m_name; /**< name of the span */
+    int         m_rc;   /**< return code, or -1 */
+    bool        m_active; /**< true if we called Begin */
+};
+
+/**
+* Define to write spans to the trace file.
+* @see CTwnDsmTrace
+*/
+#define kTRACE(a) if (g_ptwndsmtrace && g_ptwndsmtrace->IsEnabled()) g_ptwndsmtrace->a
+
+/**
+* @def kPROBE1(n,a)
+* @def kPROBE3(n,a,b,c)
+* @def kPROBE4(n,a,b,c,d)
+* @def kPROBE5(n,a,b,c,d,e)
+* @def kPROBE6(n,a,b,c,d,e,f)
+* USDT static probes for perf, bpftrace, systemtap and friends, under
+* the provider name twaindsm.  A probe is a nop until somebody attaches
+* to it, so they're always compiled in when we have sys/sdt.h, and
+* compiled out when we don't.  Here's what we have (ids are TWID_T,
+* a missing driver is 0, paths are char*):
+*   dsm__entry(appid,dsid,dg,dat,msg), dsm__return(appid,dsid,dg,dat,msg,rc)
+*   ds__entry(appid,dsid,dg,dat,msg), ds__return(appid,dsid,dg,dat,msg,rc)
+*   loadds__entry(path,dsid,keepopen), loadds__return(path,dsid,rc)
+*   scandsdir(path)
+*   callback__entry(appid,dsid,msg), callback__return(appid,dsid,msg,rc)
+*   callback__queued(appid,dsid,msg)
+*/
+#if defined(HAVE_SYS_SDT_H)
+  #define kPROBE1(n,a) DTRACE_PROBE1(twaindsm,n,a)
+  #define kPROBE3(n,a,b,c) DTRACE_PROBE3(twaindsm,n,a,b,c)
+  #define kPROBE4(n,a,b,c,d) DTRACE_PROBE4(twaindsm,n,a,b,c,d)
+  #define kPROBE5(n,a,b,c,d,e) DTRACE_PROBE5(twaindsm,n,a,b,c,d,e)
+  #define kPROBE6(n,a,b,c,d,e,f) DTRACE_PROBE6(twaindsm,n,a,b,c,d,e,f)
+#else
+  #define kPROBE1(n,a)
+  #define kPROBE3(n,a,b,c)
+  #define kPROBE4(n,a,b,c,d)
+  #define kPROBE5(n,a,b,c,d,e)
+  #define kPROBE6(n,a,b,c,d,e,f)
+#endif
+
+
+
+/**
+* @class CTwnDsmMetrics
+* Our metrics class.  We keep a row of counters and a log-linear
+* latency histogram for every application/driver/triplet that goes
+* through DSM_Entry.  Recording takes no locks, so it's safe to do
+* from the driver's threads.  The rows can be read back with the
+* DAT_TWDSM_METRICS triplet, or dumped to a file at MSG_CLOSEDSM.
+*/
+class CTwnDsmMetricsImpl;
+class CTwnDsmMetrics
+{
+  public:
+
+    /**
+    * The CTwnDsmMetrics constructor.
+    */
+    CTwnDsmMetrics();
+
+    /**
+    * The CTwnDsmMetrics destructor.
+    */
+    ~CTwnDsmMetrics();
+
+    /**
+    * Count a call and add its latency to the histogram.
+    * @param[in] _AppId id of app
+    * @param[in] _DsId id of driver, or 0 if the DSM handled it
+    * @param[in] _DG the Data Group
+    * @param[in] _DAT the Data Argument Type
+    * @param[in] _MSG the Message
+    * @param[in] _ns how long it took in nanoseconds
+    * @param[in] _rc the TWRC_xxxx we returned
+    */
+    void Record(const TWID_T    _AppId,
+                const TWID_T    _DsId,
+                const TW_UINT32 _DG,
+                const TW_UINT16 _DAT,
+                const TW_UINT16 _MSG,
+                const UINT64    _ns,
+                const TW_UINT16 _rc);
+
+    /**
+    * Look up the row named by AppId, DsId, DG, DAT and MSG, and
+    * fill in the rest of the structure.
+    * @param[in,out] _pMetrics the row to find
+    * @return true if we found it
+    */
+    bool Get(TW_TWDSM_METRICS *_pMetrics);
+
+    /**
+    * Get the next row after _pMetrics->Index, use an Index of 0
+    * to get the first one.
+    * @param[in,out] _pMetrics the cursor in, the row out
+    * @return true if we found one, false at the end of the list
+    */
+    bool GetNext(TW_TWDSM_METRICS *_pMetrics);
+
+    /**
+    * A driver sent a message with DAT_NULL, start the clock on its
+    * DAT_TWDSM_DELIVER row.
+    * @param[in] _AppId id of app
+    * @param[in] _DsId id of driver
+    * @param[in] _MSG the message
+    */
+    void Notify(const TWID_T    _AppId,
+                const TWID_T    _DsId,
+                const TW_UINT16 _MSG);
+
+    /**
+    * The application got a message, record how long it waited, and
+    * for MSG_XFERREADY start the clock on its DAT_TWDSM_RESPOND row.
+    * @param[in] _AppId id of app
+    * @param[in] _DsId id of driver
+    * @param[in] _MSG the message
+    * @return how long it waited in nanoseconds, or 0 if we don't know
+    */
+    UINT64 Deliver(const TWID_T    _AppId,
+                   const TWID_T    _DsId,
+                   const TW_UINT16 _MSG);
+
+    /**
+    * The application sent a DG_IMAGE triplet to a driver, record how
+    * long it took after MSG_XFERREADY, if this is the first one.
+    * @param[in] _AppId id of app
+    * @param[in] _DsId id of driver
+    * @return how long it took in nanoseconds, or 0 if it isn't the first
+    */
+    UINT64 Transfer(const TWID_T _AppId,
+                    const TWID_T _DsId);
+
+    /**
+    * Clear all of the rows for an application...
+    * @param[in] _AppId id of app
+    */
+    void Reset(const TWID_T _AppId);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmMetricsImpl *m_ptwndsmmetricsimpl;
+};
+extern CTwnDsmMetrics *g_ptwndsmmetrics;
+
+
+
+/**
+* @class CTwnDsmShm
+* Our shared memory class.  We publish a TW_TWDSM_SHM for this process
+* so that twaindsm-top (or anybody else) can watch us without asking.
+* The counters are atomic adds, the rest of a session is guarded by a
+* seqlock, so the readers never slow us down.  Everything quietly does
+* nothing if the segment couldn't be created.  Like the logging class
+* this one is treated as a global service.
+*/
+class CTwnDsmShmImpl;
+class CTwnDsmShm
+{
+  public:
+
+    /**
+    * The CTwnDsmShm constructor, creates the segment.
+    */
+    CTwnDsmShm();
+
+    /**
+    * The CTwnDsmShm destructor, removes the segment.
+    */
+    ~CTwnDsmShm();
+
+    /**
+    * Claim a session for an application that just opened the DSM.
+    * @param[in] _pAppId the application
+    */
+    void AddApp(const TW_IDENTITY *_pAppId);
+
+    /**
+    * Free an application's session.
+    * @param[in] _AppId id of app
+    */
+    void RemoveApp(const TWID_T _AppId);
+
+    /**
+    * Name the driver an application is talking to.
+    * @param[in] _AppId id of app
+    * @param[in] _pDsId the driver, or NULL when it's closed
+    */
+    void SetDs(const TWID_T       _AppId,
+               const TW_IDENTITY *_pDsId);
+
+    /**
+    * Say where the driver an application is talking to was placed.
+    * @param[in] _AppId id of app
+    * @param[in] _nNode the NUMA node, or -1
+    * @param[in] _nCpus how many CPUs it runs on, or 0
+    */
+    void SetPlacement(const TWID_T _AppId,
+                      const int    _nNode,
+                      const UINT   _nCpus);
+
+    /**
+    * Count a trip through DSM_Entry.
+    * @param[in] _AppId id of app
+    */
+    void Triplet(const TWID_T _AppId);
+
+    /**
+    * A call is going into a driver's DS_Entry.
+    * @param[in] _AppId id of app
+    */
+    void DsEnter(const TWID_T _AppId);
+
+    /**
+    * A call came back out of a driver's DS_Entry.
+    * @param[in] _AppId id of app
+    * @param[in] _bytes image bytes it transferred
+    */
+    void DsLeave(const TWID_T    _AppId,
+                 const TW_UINT32 _bytes);
+
+    /**
+    * Say how many messages are waiting for the application.
+    * @param[in] _AppId id of app
+    * @param[in] _depth number of drivers with a message pending
+    */
+    void SetCallbackDepth(const TWID_T    _AppId,
+                          const TW_UINT32 _depth);
+
+    /**
+    * Remember a TWRC_FAILURE.
+    * @param[in] _AppId id of app
+    * @param[in] _DsId id of driver, or 0 if the DSM failed it
+    * @param[in] _DG the Data Group
+    * @param[in] _DAT the Data Argument Type
+    * @param[in] _MSG the Message
+    * @param[in] _rc the TWRC_xxxx
+    * @param[in] _cc the TWCC_xxxx, if the DSM set one
+    */
+    void Error(const TWID_T    _AppId,
+               const TWID_T    _DsId,
+               const TW_UINT32 _DG,
+               const TW_UINT16 _DAT,
+               const TW_UINT16 _MSG,
+               const TW_UINT16 _rc,
+               const TW_UINT16 _cc);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmShmImpl *m_ptwndsmshmimpl;
+};
+extern CTwnDsmShm *g_ptwndsmshm;
+
+
+
+/**
+* @class CTwnDsmPool
+* Our memory pool.  When TWAINDSM_MEMPOOL is set, DSM_MemAllocate and
+* DSM_MemFree on Linux get their memory from here instead of calloc and
+* free.  Blocks are sorted into size classes, each thread keeps a few of
+* each size on hand, and a thread gives the extras back to the shared
+* lists, and the shared lists back to the system, when they've been
+* sitting around for a while.
+*
+* Unlike our other services this one isn't deleted along with CTwnDsm.
+* Applications and drivers can hang on to memory past MSG_CLOSEDSM, so
+* the pool has to be around to take it back.  Only the trim thread
+* comes and goes with CTwnDsm.
+*/
+class CTwnDsmPoolImpl;
+class CTwnDsmPool
+{
+  public:
+
+    /**
+    * The CTwnDsmPool constructor, checks TWAINDSM_MEMPOOL.
+    */
+    CTwnDsmPool();
+
+    /**
+    * The CTwnDsmPool destructor.
+    */
+    ~CTwnDsmPool();
+
+    /**
+    * Check if the pool is turned on.  This never changes, so it's
+    * safe to use it to decide who frees a block...
+    * @return true if DSM_MemAllocate should use us
+    */
+    bool IsEnabled();
+
+    /**
+    * Check if blocks from DSM_MemAllocate have to be zeroed.  That's
+    * the rule, but TWAINDSM_MEMPOOL=nozero lets us skip it for blocks
+    * we're reusing...
+    * @return true if we have to zero them
+    */
+    bool IsZeroing();
+
+    /**
+    * Get a block.
+    * @param[in] _bytes how much is needed
+    * @param[in] _bZero true if it has to be zeroed
+    * @return the block, or NULL
+    */
+    void *Allocate(const TW_UINT32 _bytes,
+                   const bool      _bZero);
+
+    /**
+    * Give a block back.  We can tell if it isn't one of ours, and
+    * hand it to free()...
+    * @param[in] _pv the block
+    */
+    void Free(void *_pv);
+
+    /**
+    * Start the thread that gives idle memory back to the system.
+    */
+    void StartTrim();
+
+    /**
+    * Stop the trim thread.
+    */
+    void StopTrim();
+
+    /**
+    * Get the memfd descriptor for a block, if it has one of its own
+    * (TWAINDSM_MEMPOOL=memfd, and a page or more).  The block won't
+    * be recycled for anybody else after this.
+    * @param[in] _pv the block
+    * @param[out] _pfd the memfd, it still belongs to us
+    * @param[out] _pOffset where the block starts in the file
+    * @param[out] _pLength the size the block was allocated with
+    * @return true if the block has a descriptor
+    */
+    bool GetMemfd(void      *_pv,
+                  int       *_pfd,
+                  TW_UINT32 *_pOffset,
+                  TW_UINT32 *_pLength);
+
+    /**
+    * Get the size of a block that GetMemfd would work on, without
+    * giving its descriptor out.
+    * @param[in] _pv the block
+    * @param[out] _pLength the size the block was allocated with
+    * @return true if we know it
+    */
+    bool GetSize(void      *_pv,
+                 TW_UINT32 *_pLength);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmPoolImpl *m_ptwndsmpoolimpl;
+};
+extern CTwnDsmPool *g_ptwndsmpool;
+
+
+
+/**
+* @class CTwnDsmMemTrack
+* Keeps track of who owns the memory from DSM_MemAllocate, when
+* TWAINDSM_MEMTRACK is set.  Every handle is tagged with the application
+* and driver whose DSM_Entry call the thread is in (or, outside of a
+* call, the last application the thread called us for), and we keep
+* live and peak bytes for each of them.  Every Nth allocation also
+* remembers the address it was called from, so we can say where the
+* handles that are still out came from.
+*/
+class CTwnDsmMemTrackImpl;
+class CTwnDsmMemTrack
+{
+  public:
+
+    /**
+    * The CTwnDsmMemTrack constructor, checks TWAINDSM_MEMTRACK.
+    */
+    CTwnDsmMemTrack();
+
+    /**
+    * The CTwnDsmMemTrack destructor.
+    */
+    ~CTwnDsmMemTrack();
+
+    /**
+    * Check if we're tracking.
+    * @return true if we are
+    */
+    bool IsEnabled();
+
+    /**
+    * A thread is coming into DSM_Entry, so anything it allocates until
+    * it leaves belongs to this application and driver.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver, or 0 for the DSM
+    * @return a cookie for Leave
+    */
+    UINT Enter(const TWID_T _AppId,
+               const TWID_T _DsId);
+
+    /**
+    * The thread is leaving DSM_Entry.
+    * @param[in] _uCookie what Enter returned
+    */
+    void Leave(const UINT _uCookie);
+
+    /**
+    * Remember a new handle.
+    * @param[in] _handle the handle
+    * @param[in] _bytes its size
+    * @param[in] _pSite where DSM_MemAllocate was called from
+    */
+    void Allocate(const TW_HANDLE  _handle,
+                  const TW_UINT32  _bytes,
+                  void            *_pSite);
+
+    /**
+    * Forget a handle.
+    * @param[in] _handle the handle
+    */
+    void Free(const TW_HANDLE _handle);
+
+    /**
+    * Count locks and unlocks on a handle.
+    * @param[in] _handle the handle
+    * @param[in] _bLock true for DSM_MemLock, false for DSM_MemUnlock
+    */
+    void Lock(const TW_HANDLE _handle,
+              const bool      _bLock);
+
+    /**
+    * Log what a driver still has out, after MSG_CLOSEDS.
+    * @param[in] _AppId the application
+    * @param[in] _szAppName its name
+    * @param[in] _DsId the driver
+    * @param[in] _szDsName its name
+    */
+    void ReportDs(const TWID_T  _AppId,
+                  const char   *_szAppName,
+                  const TWID_T  _DsId,
+                  const char   *_szDsName);
+
+    /**
+    * Log what an application and its drivers still have out, after
+    * MSG_CLOSEDSM.
+    * @param[in] _AppId the application
+    * @param[in] _szAppName its name
+    */
+    void ReportApp(const TWID_T  _AppId,
+                   const char   *_szAppName);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmMemTrackImpl *m_ptwndsmmemtrackimpl;
+};
+extern CTwnDsmMemTrack *g_ptwndsmmemtrack;
+
+
+
+/**
+* @class CTwnDsmReadAhead
+* Pipelines DAT_IMAGEMEMXFER, when TWAINDSM_READAHEAD is set.  The first
+* strip an application asks for starts a worker thread for the session
+* that keeps asking the driver for strips, into a ring of our own
+* buffers, while the application is busy with the ones it already has.
+* The application's calls are answered from the ring, in order, with
+* the driver's return codes and TW_IMAGEMEMXFER fields.  The worker
+* stops at the first return code that isn't TWRC_SUCCESS.
+*
+* A driver can only take one call at a time, so anything else sent to
+* the driver first waits for the worker to finish the strip it's on,
+* and stops it.  Strips it already has are kept, unless the message
+* is the end of the image (DAT_PENDINGXFERS, MSG_DISABLEDS).
+*
+* Drivers with a thread of their own (CTwnDsmActor) are left alone.
+* The worker's calls would queue on that thread behind whatever is
+* waiting for them.
+*/
+class CTwnDsmReadAheadImpl;
+class CTwnDsmReadAhead
+{
+  public:
+
+    /**
+    * The CTwnDsmReadAhead constructor, checks TWAINDSM_READAHEAD.
+    */
+    CTwnDsmReadAhead();
+
+    /**
+    * The CTwnDsmReadAhead destructor.  The workers stop with their
+    * drivers.
+    */
+    ~CTwnDsmReadAhead();
+
+    /**
+    * Check if read-ahead is turned on.
+    * @return true if TWAINDSM_READAHEAD gave us a ring size
+    */
+    bool IsEnabled();
+
+    /**
+    * Check if we're on the session's worker, which is where a driver
+    * that calls back during a strip makes its callback.  Anything
+    * sent to the same driver from there would wait on the worker
+    * forever, so the caller has to refuse it.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @return true if we're the worker
+    */
+    bool OnWorker(const TWID_T _AppId,
+                  const TWID_T _DsId);
+
+    /**
+    * Answer an application's DG_IMAGE/DAT_IMAGEMEMXFER/MSG_GET from the
+    * ring, starting the worker if it isn't running.
+    * @param[in] _pAppId the local copy of the application's identity
+    * @param[in] _DsId the driver
+    * @param[in,out] _pMemXfer the application's TW_IMAGEMEMXFER
+    * @param[out] _pbHandled false if the caller has to send it to the
+    *             driver itself
+    * @param[out] _pConditionCode the DSM's condition code, if it's
+    *             our failure and not the driver's
+    * @return a valid TWRC_xxxx return code
+    */
+    TW_UINT16 MemXfer(TW_IDENTITY     *_pAppId,
+                      const TWID_T     _DsId,
+                      TW_IMAGEMEMXFER *_pMemXfer,
+                      bool            *_pbHandled,
+                      TW_UINT16       *_pConditionCode);
+
+    /**
+    * Something other than a strip is about to go to the driver, so
+    * wait for the worker to get out of the way.  For DAT_EVENT and
+    * DAT_NULL the worker keeps reading, and we just take our turn.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in] _DAT what's being sent
+    * @param[in] _MSG what's being sent
+    * @return true if we have our turn, call Resume when the driver is done
+    */
+    bool Pause(const TWID_T    _AppId,
+               const TWID_T    _DsId,
+               const TW_UINT16 _DAT,
+               const TW_UINT16 _MSG);
+
+    /**
+    * Give the driver back to the worker after a Pause that returned true.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    */
+    void Resume(const TWID_T _AppId,
+                const TWID_T _DsId);
+
+    /**
+    * The driver is closing, stop the worker and free the ring.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    */
+    void Stop(const TWID_T _AppId,
+              const TWID_T _DsId);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmReadAheadImpl *m_ptwndsmreadaheadimpl;
+};
+extern CTwnDsmReadAhead *g_ptwndsmreadahead;
+
+
+
+/**
+* @class CTwnDsmFrame
+* Puts the strips or tiles of one DAT_IMAGEMEMXFER transfer together
+* into a single frame, for DAT_TWDSM_IMAGEFRAME.  The frame is sized
+* from DAT_IMAGEINFO, or doubled as it goes when the length isn't
+* known.  Each strip is pointed at the place in the frame where the
+* next rows go, so full width strips land where they belong and don't
+* have to be copied.  Anything else (tiles, odd strides) is moved into
+* place row by row.  Compressed and planar data is just appended.
+*
+* One of these lives on the stack for the length of the call, so it
+* doesn't need any locks.
+*/
+class CTwnDsmFrameImpl;
+class CTwnDsmFrame
+{
+  public:
+
+    /**
+    * The CTwnDsmFrame constructor.
+    */
+    CTwnDsmFrame();
+
+    /**
+    * The CTwnDsmFrame destructor, frees the frame unless Finish
+    * handed it off.
+    */
+    ~CTwnDsmFrame();
+
+    /**
+    * Size the frame.
+    * @param[in] _pImageInfo what the driver said about the image
+    * @param[in] _nPreferred the strip size from DAT_SETUPMEMXFER
+    * @return false if we couldn't get the memory
+    */
+    bool Begin(const TW_IMAGEINFO *_pImageInfo,
+               const TW_UINT32     _nPreferred);
+
+    /**
+    * Point the next strip at the frame, growing it if we have to.
+    * @param[out] _pMemXfer the TW_IMAGEMEMXFER for the driver
+    * @return false if we couldn't get the memory
+    */
+    bool Target(TW_IMAGEMEMXFER *_pMemXfer);
+
+    /**
+    * Put the strip the driver just sent where it belongs.
+    * @param[in] _pMemXfer the TW_IMAGEMEMXFER from the driver
+    * @return false if it doesn't fit, or we couldn't get the memory
+    */
+    bool Place(const TW_IMAGEMEMXFER *_pMemXfer);
+
+    /**
+    * Hand the frame off to the caller.
+    * @param[out] _pImageFrame gets the handle and the layout
+    */
+    void Finish(TW_TWDSM_IMAGEFRAME *_pImageFrame);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmFrameImpl *m_ptwndsmframeimpl;
+};
+
+
+
+/**
+* @class CTwnDsmConvert
+* Converts DAT_IMAGEMEMXFER strips to the pixel format an application
+* asked for with DAT_TWDSM_CONVERT.  DsEntry hands us every
+* DAT_IMAGEINFO (so we know what's coming, and can describe what we'll
+* turn it into) and every strip.  Each row goes through a row sized
+* scratch buffer and back into the application's buffer, so there's no
+* second strip buffer.  When the new format is bigger, we ask the driver
+* for fewer rows, so they still fit.
+*
+* The kernels come in plain C, SSSE3, AVX2 and NEON versions, and we
+* pick the best one the CPU has when we start.  NEON is only built with
+* TWNDSM_CONVERT_NEON.  twaindsm-convertcheck holds the SIMD kernels to
+* the plain C ones.
+*/
+class CTwnDsmConvertImpl;
+class CTwnDsmConvert
+{
+  public:
+
+    /**
+    * The CTwnDsmConvert constructor, picks the kernels.
+    */
+    CTwnDsmConvert();
+
+    /**
+    * The CTwnDsmConvert destructor.
+    */
+    ~CTwnDsmConvert();
+
+    /**
+    * Run every set of SIMD kernels the CPU can run against the plain
+    * C ones, for twaindsm-convertcheck.
+    * @param[in] _pfile where to say how each set did
+    * @return how many sets don't match
+    */
+    static int CheckKernels(FILE *_pfile);
+
+    /**
+    * Handle DAT_TWDSM_CONVERT.
+    * @param[in] _AppId the application
+    * @param[in] _MSG MSG_SET, MSG_GET or MSG_RESET
+    * @param[in,out] _pConvert the application's TW_TWDSM_CONVERT
+    * @return TWCC_SUCCESS, or the condition code for the application
+    */
+    TW_UINT16 Convert(const TWID_T      _AppId,
+                      const TW_UINT16   _MSG,
+                      TW_TWDSM_CONVERT *_pConvert);
+
+    /**
+    * The driver answered DAT_IMAGEINFO, remember the source format and
+    * change it to the one we'll deliver.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in,out] _pImageInfo what the driver said
+    */
+    void ImageInfo(const TWID_T  _AppId,
+                   const TWID_T  _DsId,
+                   TW_IMAGEINFO *_pImageInfo);
+
+    /**
+    * A strip is about to be asked for, make room for the conversion.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in,out] _pMemXfer the TW_IMAGEMEMXFER going to the driver
+    * @param[out] _pLength the application's Memory.Length, for After
+    * @param[out] _pConditionCode not TWCC_SUCCESS if a row won't fit,
+    *             and the driver shouldn't be called
+    * @return true if After has to be called
+    */
+    bool Before(const TWID_T     _AppId,
+                const TWID_T     _DsId,
+                TW_IMAGEMEMXFER *_pMemXfer,
+                TW_UINT32       *_pLength,
+                TW_UINT16       *_pConditionCode);
+
+    /**
+    * Convert the strip the driver just sent.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in,out] _pMemXfer the TW_IMAGEMEMXFER from the driver
+    * @param[in] _Length what Before gave back
+    * @return TWCC_SUCCESS, or the condition code for the application
+    */
+    TW_UINT16 After(const TWID_T     _AppId,
+                    const TWID_T     _DsId,
+                    TW_IMAGEMEMXFER *_pMemXfer,
+                    const TW_UINT32  _Length);
+
+    /**
+    * The driver is closing, forget what the application asked for.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    */
+    void Stop(const TWID_T _AppId,
+              const TWID_T _DsId);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmConvertImpl *m_ptwndsmconvertimpl;
+};
+extern CTwnDsmConvert *g_ptwndsmconvert;
+
+
+
+/**
+* @class CTwnDsmAnalysis
+* Adds up the numbers an application asked for with DAT_TWDSM_ANALYSIS
+* as DAT_IMAGEMEMXFER strips go by, so it can tell a blank page from a
+* real one at TWRC_XFERDONE, before it compresses or stores anything.
+* DsEntry hands us every DAT_IMAGEINFO and every strip, after any
+* conversion, so we see what the application sees.
+*
+* Each row is reduced to 8 bit luminance, if it isn't already, and
+* goes through an SSE2 or NEON kernel that counts ink and edges, and a
+* histogram.  Bilevel rows are counted a byte at a time, without being
+* unpacked.  NEON is only built with TWNDSM_CONVERT_NEON, and
+* twaindsm-analysischeck holds the SIMD kernel to the plain C one.
+*/
+class CTwnDsmAnalysisImpl;
+class CTwnDsmAnalysis
+{
+  public:
+
+    /**
+    * The CTwnDsmAnalysis constructor.
+    */
+    CTwnDsmAnalysis();
+
+    /**
+    * The CTwnDsmAnalysis destructor.
+    */
+    ~CTwnDsmAnalysis();
+
+    /**
+    * Run the SIMD kernel, if there is one, against the plain C one,
+    * for twaindsm-analysischeck.
+    * @param[in] _pfile where to say how it did
+    * @return 1 if it doesn't match, else 0
+    */
+    static int CheckKernels(FILE *_pfile);
+
+    /**
+    * Handle DAT_TWDSM_ANALYSIS.
+    * @param[in] _AppId the application
+    * @param[in] _MSG MSG_SET, MSG_GET or MSG_RESET
+    * @param[in,out] _pAnalysis the application's TW_TWDSM_ANALYSIS
+    * @return TWCC_SUCCESS, or the condition code for the application
+    */
+    TW_UINT16 Analysis(const TWID_T       _AppId,
+                       const TW_UINT16    _MSG,
+                       TW_TWDSM_ANALYSIS *_pAnalysis);
+
+    /**
+    * The driver answered DAT_IMAGEINFO, a new page is coming.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in] _pImageInfo what the application got
+    */
+    void ImageInfo(const TWID_T        _AppId,
+                   const TWID_T        _DsId,
+                   const TW_IMAGEINFO *_pImageInfo);
+
+    /**
+    * The driver answered DAT_IMAGEMEMXFER, add in the strip, and finish
+    * the page on TWRC_XFERDONE, or drop it on anything but TWRC_SUCCESS.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in] _pMemXfer what the application got
+    * @param[in] _rc the return code the application got
+    */
+    void MemXfer(const TWID_T           _AppId,
+                 const TWID_T           _DsId,
+                 const TW_IMAGEMEMXFER *_pMemXfer,
+                 const TW_INT16         _rc);
+
+    /**
+    * The driver is closing, forget what the application asked for.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    */
+    void Stop(const TWID_T _AppId,
+              const TWID_T _DsId);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmAnalysisImpl *m_ptwndsmanalysisimpl;
+};
+extern CTwnDsmAnalysis *g_ptwndsmanalysis;
+
+
+
+/**
+* @class CTwnDsmChecksum
+* When TWAINDSM_CHECKSUM is set, works out the CRC32C of every image as
+* it comes back from a driver, so an application can check it against
+* what it stored without another pass over the data.  Memory transfers
+* are done a strip at a time, as each one comes back from DS_Entry,
+* native transfers when the handle comes back, and file transfers by
+* reading the file.
+*
+* The last TWDSM_CHECKSUM_GUARD bytes of each DAT_IMAGEMEMXFER buffer
+* are held back from the driver and filled with a pattern, so a driver
+* that writes past the end is caught at the strip that did it.  The
+* guard is inside the application's buffer, so the overrun doesn't hurt
+* anything else.  With TWAINDSM_CHECKSUM=strict that strip fails with
+* TWCC_OPERATIONERROR.
+*
+* The ARMv8 kernel is only built with TWNDSM_CONVERT_NEON, and
+* twaindsm-checksumcheck holds every kernel to the CRC32C check value.
+*/
+class CTwnDsmChecksumImpl;
+class CTwnDsmChecksum
+{
+  public:
+
+    /**
+    * The CTwnDsmChecksum constructor, reads TWAINDSM_CHECKSUM and picks
+    * the kernel.
+    */
+    CTwnDsmChecksum();
+
+    /**
+    * The CTwnDsmChecksum destructor.
+    */
+    ~CTwnDsmChecksum();
+
+    /**
+    * Run the plain C kernel, and the CRC32C instructions if the CPU
+    * has them, against the check value, for twaindsm-checksumcheck.
+    * @param[in] _pfile where to say how each one did
+    * @return how many don't match
+    */
+    static int CheckKernels(FILE *_pfile);
+
+    /**
+    * Check if transfers are checksummed.
+    * @return true if TWAINDSM_CHECKSUM is set
+    */
+    bool IsEnabled();
+
+    /**
+    * Handle DAT_TWDSM_CHECKSUM.
+    * @param[in] _AppId the application
+    * @param[in] _MSG MSG_GET
+    * @param[in,out] _pChecksum the application's TW_TWDSM_CHECKSUM
+    * @return TWCC_SUCCESS, or the condition code for the application
+    */
+    TW_UINT16 Checksum(const TWID_T       _AppId,
+                       const TW_UINT16    _MSG,
+                       TW_TWDSM_CHECKSUM *_pChecksum);
+
+    /**
+    * A strip is about to be asked for, hold back the guard bytes.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in,out] _pMemXfer the TW_IMAGEMEMXFER going to the driver
+    * @return the Length to give back to After
+    */
+    TW_UINT32 Before(const TWID_T     _AppId,
+                     const TWID_T     _DsId,
+                     TW_IMAGEMEMXFER *_pMemXfer);
+
+    /**
+    * The strip came back, check the guard bytes and add it in.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in] _DAT DAT_IMAGEMEMXFER or DAT_IMAGEMEMFILEXFER
+    * @param[in,out] _pMemXfer the TW_IMAGEMEMXFER from the driver
+    * @param[in] _Length what Before gave back
+    * @param[in] _rc what the driver returned
+    * @return TWCC_SUCCESS, or the condition code for the application
+    */
+    TW_UINT16 After(const TWID_T     _AppId,
+                    const TWID_T     _DsId,
+                    const TW_UINT16  _DAT,
+                    TW_IMAGEMEMXFER *_pMemXfer,
+                    const TW_UINT32  _Length,
+                    const TW_INT16   _rc);
+
+    /**
+    * Anything else a driver answered, we want DAT_SETUPMEMXFER and
+    * DAT_SETUPFILEXFER, and the native and file transfers.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in] _DG the data group
+    * @param[in] _DAT the data argument type
+    * @param[in] _pData what the driver answered
+    * @param[in] _rc what the driver returned
+    */
+    void Returned(const TWID_T    _AppId,
+                  const TWID_T    _DsId,
+                  const TW_UINT32 _DG,
+                  const TW_UINT16 _DAT,
+                  TW_MEMREF       _pData,
+                  const TW_INT16  _rc);
+
+    /**
+    * The driver is closing, forget about it.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    */
+    void Stop(const TWID_T _AppId,
+              const TWID_T _DsId);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmChecksumImpl *m_ptwndsmchecksumimpl;
+};
+extern CTwnDsmChecksum *g_ptwndsmchecksum;
+
+
+
+/**
+* @class CTwnDsmDispatch
+* Makes an application's callbacks from a dispatcher thread, when
+* TWAINDSM_CALLBACKS=async is set, so DAT_NULL returns to the driver as
+* soon as the message is queued.  Each application gets one thread and
+* one ring, so messages arrive in the order the drivers sent them, one
+* callback at a time, with the same reentrancy checks as before.
+*
+* The driver gets TWRC_SUCCESS once the message is queued.  What the
+* callback returns is only logged, and a full ring makes the driver
+* wait for room.
+*/
+class CTwnDsmDispatchImpl;
+class CTwnDsmDispatch
+{
+  public:
+
+    /**
+    * The CTwnDsmDispatch constructor, checks TWAINDSM_CALLBACKS.
+    */
+    CTwnDsmDispatch();
+
+    /**
+    * The CTwnDsmDispatch destructor, joins the dispatchers that were
+    * stopped from themselves.
+    */
+    ~CTwnDsmDispatch();
+
+    /**
+    * Check if callbacks go through a dispatcher.
+    * @return true if TWAINDSM_CALLBACKS is async
+    */
+    bool IsEnabled();
+
+    /**
+    * Queue a message for the application's callback, starting the
+    * dispatcher if it isn't running.
+    * @param[in] _pAppId the local copy of the application's identity
+    * @param[in] _DsId the driver that sent it
+    * @param[in] _MSG the message
+    * @return false if the caller has to make the callback itself
+    */
+    bool Post(TW_IDENTITY     *_pAppId,
+              const TWID_T     _DsId,
+              const TW_UINT16  _MSG);
+
+    /**
+    * The driver is closing, drop its messages and wait for any
+    * callback that's carrying one.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    */
+    void Stop(const TWID_T _AppId,
+              const TWID_T _DsId);
+
+    /**
+    * The application is closing the DSM, stop its dispatcher.
+    * @param[in] _AppId the application
+    */
+    void StopApp(const TWID_T _AppId);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmDispatchImpl *m_ptwndsmdispatchimpl;
+};
+extern CTwnDsmDispatch *g_ptwndsmdispatch;
+
+
+
+/**
+* @class CTwnDsmActor
+* Gives each open driver a thread of its own, when TWAINDSM_ACTORS is
+* set.  Every call to the driver, from DSM_Entry, from our own workers,
+* or from DAT_TWDSM_SUBMIT and DSM_EntryAsync, runs on that thread in
+* the order it was made.  The driver always sees the same thread, and
+* one application thread can keep several drivers busy at once.
+*
+* DSM_Entry waits for its turn and its answer, as it always has.
+* DAT_TWDSM_SUBMIT doesn't wait, it gets a ticket that's collected
+* later, or with DSM_EntryAsync a callback when it's done.  Calls the driver makes back into us, and callbacks made on
+* the driver's thread, go straight to the driver.  CTwnDsmReadAhead
+* doesn't read ahead for these drivers.
+*/
+class CTwnDsmActorImpl;
+class CTwnDsmActor
+{
+  public:
+
+    /**
+    * The CTwnDsmActor constructor, checks TWAINDSM_ACTORS.
+    */
+    CTwnDsmActor();
+
+    /**
+    * The CTwnDsmActor destructor, joins the threads that were stopped
+    * from themselves.
+    */
+    ~CTwnDsmActor();
+
+    /**
+    * Check if drivers get threads of their own.
+    * @return true if TWAINDSM_ACTORS is set
+    */
+    bool IsEnabled();
+
+    /**
+    * Check if a driver has a thread of its own.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @return true if it does
+    */
+    bool IsRunning(const TWID_T _AppId,
+                   const TWID_T _DsId);
+
+    /**
+    * Start a thread for a driver that's about to be opened.
+    * @param[in] _pAppId the application
+    * @param[in] _pDsId the driver
+    * @return false if it didn't start, and the driver is called directly
+    */
+    bool Start(TW_IDENTITY *_pAppId,
+               TW_IDENTITY *_pDsId);
+
+    /**
+    * The driver is closed, stop its thread.  Anything still queued
+    * fails with TWCC_SEQERROR.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    */
+    void Stop(const TWID_T _AppId,
+              const TWID_T _DsId);
+
+    /**
+    * The application is closing the DSM, and its drivers' threads
+    * are already stopped, so throw away any tickets it didn't collect.
+    * @param[in] _AppId the application
+    */
+    void DropTickets(const TWID_T _AppId);
+
+    /**
+    * Make a call on the driver's thread, and wait for the answer.
+    * @param[in] _pAppId the application
+    * @param[in] _DsId the driver
+    * @param[in] _DG the data group
+    * @param[in] _DAT the data argument type
+    * @param[in] _MSG the message
+    * @param[in] _pData the data
+    * @param[out] _prc what the driver returned
+    * @return false if the caller has to make the call itself
+    */
+    bool Call(TW_IDENTITY *_pAppId,
+              TWID_T       _DsId,
+              TW_UINT32    _DG,
+              TW_UINT16    _DAT,
+              TW_UINT16    _MSG,
+              TW_MEMREF    _pData,
+              TW_UINT16   *_prc);
+
+    /**
+    * Queue a triplet for DAT_TWDSM_SUBMIT/MSG_SET or DSM_EntryAsync.
+    * A triplet with a callback gets one, instead of going on the
+    * ticket list.
+    * @param[in] _pAppId the application
+    * @param[in,out] _psubmit the triplet, we fill in Ticket
+    * @param[in] _pfnDone called on the driver's thread when it's done, or NULL
+    * @param[in] _pRefCon passed to _pfnDone
+    * @param[out] _pcc the condition code if we fail
+    * @return TWRC_SUCCESS or TWRC_FAILURE
+    */
+    TW_INT16 Submit(TW_IDENTITY     *_pAppId,
+                    TW_TWDSM_SUBMIT *_psubmit,
+                    DSMASYNCPROC     _pfnDone,
+                    TW_MEMREF        _pRefCon,
+                    TW_UINT16       *_pcc);
+
+    /**
+    * Wait for a ticket for DAT_TWDSM_SUBMIT/MSG_GET.
+    * @param[in] _pAppId the application
+    * @param[in,out] _psubmit the Ticket, we fill in the rest
+    * @param[out] _pcc the condition code if we fail
+    * @return TWRC_SUCCESS or TWRC_FAILURE
+    */
+    TW_INT16 Wait(TW_IDENTITY     *_pAppId,
+                  TW_TWDSM_SUBMIT *_psubmit,
+                  TW_UINT16       *_pcc);
+
+    /**
+    * Get any finished ticket for DAT_TWDSM_SUBMIT/MSG_GETNEXT.
+    * @param[in] _pAppId the application
+    * @param[out] _psubmit we fill it in
+    * @return TWRC_SUCCESS or TWRC_ENDOFLIST
+    */
+    TW_INT16 GetNext(TW_IDENTITY     *_pAppId,
+                     TW_TWDSM_SUBMIT *_psubmit);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmActorImpl *m_ptwndsmactorimpl;
+};
+extern CTwnDsmActor *g_ptwndsmactor;
+
+
+
+/**
+* @class CTwnDsmWarmPool
+* Keeps a driver open for a while after the application closes it,
+* when TWAINDSM_WARMPOOL is set to a number of seconds.  If the same
+* application opens it again in that time it gets it back straight
+* away, after a DAT_CAPABILITY/MSG_RESETALL, without the driver having
+* to find and set up the device again.
+*
+* As far as the application is concerned the driver is closed, and
+* triplets sent to it fail.  A thread closes it properly when its time
+* is up, and MSG_CLOSEDSM closes anything the application left here.
+*
+* The closing thread's MSG_CLOSEDS goes through the driver's own
+* thread, so we need TWAINDSM_ACTORS, and only park drivers that have
+* one.  Without it the pool stays off.
+*/
+class CTwnDsmWarmPoolImpl;
+class CTwnDsmWarmPool
+{
+  public:
+
+    /**
+    * The CTwnDsmWarmPool constructor, checks TWAINDSM_WARMPOOL.
+    */
+    CTwnDsmWarmPool();
+
+    /**
+    * The CTwnDsmWarmPool destructor, closes anything that's left.
+    */
+    ~CTwnDsmWarmPool();
+
+    /**
+    * Check if closed drivers are kept open.
+    * @return true if TWAINDSM_WARMPOOL is set and the actors are on
+    */
+    bool IsEnabled();
+
+    /**
+    * Keep a driver that the application is closing.
+    * @param[in] _pAppId the application
+    * @param[in] _pDsId the driver
+    * @return false if we can't, and the driver has to be closed
+    */
+    bool Park(TW_IDENTITY *_pAppId,
+              TW_IDENTITY *_pDsId);
+
+    /**
+    * Take a driver back for MSG_OPENDS.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @return true if it's still open, false if it has to be loaded
+    */
+    bool Take(const TWID_T _AppId,
+              const TWID_T _DsId);
+
+    /**
+    * Check if a driver is in the pool, so closed to the application.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @return true if it is
+    */
+    bool IsParked(const TWID_T _AppId,
+                  const TWID_T _DsId);
+
+    /**
+    * The application is closing the DSM, close all of its drivers.
+    * @param[in] _AppId the application
+    */
+    void StopApp(const TWID_T _AppId);
+
+  private:
+
+    /**
+    * The implementation pointer helps with encapulation.
+    */
+    CTwnDsmWarmPoolImpl *m_ptwndsmwarmpoolimpl;
+};
+extern CTwnDsmWarmPool *g_ptwndsmwarmpool;
+
+
+
+/**
+* @class CTwnDsmAffinity
+* Places each application/driver session on the CPUs and NUMA node its
+* device is attached to, when TWAINDSM_AFFINITY has a rule for the
+* driver.  The session's driver thread, read-ahead thread and callback
+* dispatcher are pinned there, they prefer that node for the pages they
+* fault in, and large DSM_MemAllocate blocks they make are bound to it.
+* Only Linux, everywhere else this does nothing.
+*/
+class CTwnDsmAffinityImpl;
+class CTwnDsmAffinity
 {
   public:
 
     /**
-    * The CTwnDsmLog constructor.
+    * The CTwnDsmAffinity constructor, reads TWAINDSM_AFFINITY.
     */
-    CTwnDsmLog();
+    CTwnDsmAffinity();
 
     /**
-    * The CTwnDsmLog destructor.
+    * The CTwnDsmAffinity destructor.
     */
-    ~CTwnDsmLog();
+    ~CTwnDsmAffinity();
 
     /**
-    * The logging function.  This should only be access through
-    * the kLOG macro...
-    * @param[in] _doassert decides if we assert or not
-    * @param[in] _file the source file of the message 
-    * @param[in] _line the source line of the message 
-    * @param[in] _format the format of the message (same as sprintf) 
-    * @param[in] ... arguments to the format of the message 
+    * Check if drivers are placed.
+    * @return true if TWAINDSM_AFFINITY has a rule we can use
     */
-    void Log(const int         _doassert,
-             const char* const _file,
-             const int         _line,
-             const char* const _format,
-             ...);
+    bool IsEnabled();
 
     /**
-    * Indent the logging to help with seeing recursive calls
-    * param[in] nChange Either +1 or -1 
+    * Work out where a session goes, at MSG_OPENDS.
+    * @param[in] _pAppId the application
+    * @param[in] _pDsId the driver
     */
-    void Indent(int nChange);
+    void Place(TW_IDENTITY *_pAppId,
+               TW_IDENTITY *_pDsId);
+
+    /**
+    * Forget a session, its driver is being unloaded.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    */
+    void Forget(const TWID_T _AppId,
+                const TWID_T _DsId);
+
+    /**
+    * Pin the calling thread to a session, or unpin it if the session
+    * wasn't placed.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    */
+    void Pin(const TWID_T _AppId,
+             const TWID_T _DsId);
+
+    /**
+    * Bind a mapping to the calling thread's node, if it has one.
+    * @param[in] _pv the mapping
+    * @param[in] _nBytes its length
+    * @param[in] _bMove move the pages it already has to the node
+    */
+    void BindMemory(void        *_pv,
+                    const UINT64 _nBytes,
+                    const bool   _bMove);
+
+    /**
+    * Get where a session was placed.
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[out] _pnNode the node, or -1
+    * @param[out] _pnCpus how many CPUs, or 0
+    * @return true if it was placed
+    */
+    bool Get(const TWID_T _AppId,
+             const TWID_T _DsId,
+             int         *_pnNode,
+             UINT        *_pnCpus);
+
+    /**
+    * Write an application's placements to the metrics file.
+    * @param[in] _pfile the file
+    * @param[in] _AppId the application
+    */
+    void Report(FILE        *_pfile,
+                const TWID_T _AppId);
 
   private:
 
     /**
     * The implementation pointer helps with encapulation.
     */
-    CTwnDsmLogImpl *m_ptwndsmlogimpl;
+    CTwnDsmAffinityImpl *m_ptwndsmaffinityimpl;
 };
-extern CTwnDsmLog *g_ptwndsmlog;
+extern CTwnDsmAffinity *g_ptwndsmaffinity;
 
 
 
@@ -687,6 +2481,14 @@ class CTwnDsmApps
     */
     TW_UINT16 AppGetConditionCode(TW_IDENTITY *_pAppId);
 
+    /**
+    * Get the condition code without resetting it, so the app can
+    * still get it with DAT_STATUS...
+    * @param[in] _pAppId id of app, or NULL if we have no apps
+    * @return TWCC_ value
+    */
+    TW_UINT16 AppPeekConditionCode(TW_IDENTITY *_pAppId);
+
     /**
     * Set the condition code
     * @param[in] _pAppId id of app, or NULL if we have no apps
@@ -724,6 +2526,27 @@ class CTwnDsmApps
     */
     TWID_T AppGetNumDs(TW_IDENTITY *_pAppId);
 
+    /**
+    * Start an enumeration of the application's drivers for
+    * MSG_GETFIRST.  Each application has its own cursor, over a
+    * snapshot of the list that doesn't change while it's walked...
+    * @param[in] _pAppId id of app
+    * @param[out] _pDsId gets the identity of the first driver
+    * @return TWRC_SUCCESS, TWRC_ENDOFLIST or TWRC_FAILURE
+    */
+    TW_INT16 DsGetFirst(TW_IDENTITY *_pAppId,
+                        TW_IDENTITY *_pDsId);
+
+    /**
+    * Continue the enumeration for MSG_GETNEXT...
+    * @param[in] _pAppId id of app
+    * @param[out] _pDsId gets the identity of the next driver
+    * @return TWRC_SUCCESS, TWRC_ENDOFLIST, or TWRC_FAILURE with
+    *         TWCC_SEQERROR if there's no MSG_GETFIRST to continue
+    */
+    TW_INT16 DsGetNext(TW_IDENTITY *_pAppId,
+                       TW_IDENTITY *_pDsId);
+
     /**
     * Poke the application to wake it up when sending a
     * DAT_NULL message to it...
@@ -731,6 +2554,28 @@ class CTwnDsmApps
     */
     void AppWakeup(TW_IDENTITY *_pAppId);
 
+    /**
+    * Check if AppWakeup has a way to reach the application, a window
+    * on Windows or an eventfd on Linux...
+    * @param[in] _pAppId id of app
+    * @return TRUE if it does
+    */
+    TW_BOOL AppHasWakeup(TW_IDENTITY *_pAppId);
+
+    /**
+    * Get the application's eventfd, making it the first time.  This
+    * is what AppWakeup pokes on Linux...
+    * @param[in] _pAppId id of app
+    * @return the descriptor, or -1 if we couldn't make one
+    */
+    TW_INT32 AppGetEventFd(TW_IDENTITY *_pAppId);
+
+    /**
+    * Close the application's eventfd, if it has one...
+    * @param[in] _pAppId id of app
+    */
+    void AppCloseEventFd(TW_IDENTITY *_pAppId);
+
     /**
     * Get a pointer to the identity of the specified driver...
     * @param[in] _pAppId id of app
@@ -760,6 +2605,16 @@ class CTwnDsmApps
     char *DsGetPath(TW_IDENTITY *_pAppId,
                     TWID_T       _DsId);
 
+    /**
+    * Check if the driver's file has changed since we loaded it, meaning
+    * that somebody has installed a new version...
+    * @param[in] _pAppId id of app
+    * @param[in] _DsId numeric id of driver
+    * @return true if it has changed, false if not or if it isn't loaded
+    */
+    bool DsIsStale(TW_IDENTITY *_pAppId,
+                   TWID_T       _DsId);
+
     /**
     * Get a pointer to TW_CALLBACK structure for the specified driver...
     * reason...
@@ -774,22 +2629,40 @@ class CTwnDsmApps
     * Test if the driver has a callback pending for attention...
     * @param[in] _pAppId id of app
     * @param[in] _DsId numeric id of driver
-    * @return TRUE if the driver needs its callback called
+    * @return TRUE if the driver has messages queued for DAT_EVENT
     */
     TW_BOOL DsCallbackIsWaiting(TW_IDENTITY *_pAppId,
                                 TWID_T       _DsId);
 
     /**
-    * Set the callback flag for the driver to TRUE if the callback
-    * needs to have its callback called, and set it to FALSE after
-    * the call has been made...
+    * Queue a DAT_NULL message for an application that has no callback,
+    * it picks it up with its next DAT_EVENT.  Safe to call from any
+    * driver thread...
     * @param[in] _pAppId id of app
     * @param[in] _DsId numeric id of driver
-    * @param[in] _Waiting the new state for the waiting flag
+    * @param[in] _MSG the message from the driver
+    * @return queued, coalesced with one already waiting, or full
     */
-    void DsCallbackSetWaiting(TW_IDENTITY *_pAppId,
+    DSM_EventPush DsEventPush(TW_IDENTITY *_pAppId,
                               TWID_T       _DsId,
-                              TW_BOOL     _Waiting);
+                              TW_UINT16    _MSG);
+
+    /**
+    * Take the oldest message waiting for the application...
+    * @param[in] _pAppId id of app
+    * @param[in] _DsId numeric id of driver
+    * @return the message, or 0 if nothing is waiting
+    */
+    TW_UINT16 DsEventPop(TW_IDENTITY *_pAppId,
+                         TWID_T       _DsId);
+
+    /**
+    * Throw away every message waiting for the application...
+    * @param[in] _pAppId id of app
+    * @param[in] _DsId numeric id of driver
+    */
+    void DsEventClear(TW_IDENTITY *_pAppId,
+                      TWID_T       _DsId);
 
     /**
     * Check if the DS is still processing last message
@@ -831,6 +2704,52 @@ class CTwnDsmApps
                                     TWID_T       _DsId,
                                     TW_BOOL      _Processing);
 
+    /**
+    * Check if the DS has been enabled, and not disabled since
+    * @param[in] _pAppId id of app
+    * @param[in] _DsId numeric id of driver
+    * @return TRUE if the DS is in state 5 or higher
+    */
+    TW_BOOL DsIsEnabled(TW_IDENTITY *_pAppId,
+                        TWID_T       _DsId);
+
+    /**
+    * Set the Enabled flag.
+    * @param[in] _pAppId id of app
+    * @param[in] _DsId numeric id of driver
+    * @param[in] _Enabled TRUE after MSG_ENABLEDS, FALSE after MSG_DISABLEDS
+    */
+    void DsSetEnabled(TW_IDENTITY *_pAppId,
+                      TWID_T       _DsId,
+                      TW_BOOL      _Enabled);
+
+    /**
+    * Get what the modules keep for a driver.  The modules ask from
+    * their own threads, so this doesn't log a bad id, it just says
+    * there's nothing...
+    * @param[in] _AppId numeric id of app
+    * @param[in] _DsId numeric id of driver
+    * @return the driver's DS_SESSION, or NULL
+    */
+    DS_SESSION *DsGetSession(const TWID_T _AppId,
+                             const TWID_T _DsId);
+
+    /**
+    * Get the application's callback dispatcher, see CTwnDsmDispatch...
+    * @param[in] _AppId numeric id of app
+    * @return the dispatcher, or NULL
+    */
+    struct DISPATCH_SESSION_ *AppGetDispatcher(const TWID_T _AppId);
+
+    /**
+    * Set the application's callback dispatcher...
+    * @param[in] _AppId numeric id of app
+    * @param[in] _pdispatch the dispatcher, or NULL
+    * @return false if there's no such application
+    */
+    bool AppSetDispatcher(const TWID_T              _AppId,
+                          struct DISPATCH_SESSION_ *_pdispatch);
+
     /**
     * Get number of allocated App slots (Last valid App ID +1)
     * @return number of allocated App slots (Last valid App ID +1)
@@ -894,6 +2813,30 @@ class CTwnDsm
                             TW_UINT16    _MSG,
                             TW_MEMREF    _pData);
 
+        /**
+        * The guts of DSM_EntryAsync.  The triplet is checked and queued
+        * for the driver's thread, the same as DAT_TWDSM_SUBMIT/MSG_SET.
+        * @param[in] _pOrigin Origin of message, an App
+        * @param[in] _pDest destination of message, a DS
+        * @param[in] _DG message id: DG_xxxx
+        * @param[in] _DAT message id: DAT_xxxx
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in] _pData the Data
+        * @param[in] _pfnDone called when it's done, or NULL for a ticket
+        * @param[in] _pRefCon passed to _pfnDone
+        * @param[out] _pTicket the ticket
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_UINT16 DSM_EntryAsync(TW_IDENTITY  *_pOrigin,
+                                 TW_IDENTITY  *_pDest,
+                                 TW_UINT32    _DG,
+                                 TW_UINT16    _DAT,
+                                 TW_UINT16    _MSG,
+                                 TW_MEMREF    _pData,
+                                 DSMASYNCPROC _pfnDone,
+                                 TW_MEMREF    _pRefCon,
+                                 TW_UINT32   *_pTicket);
+
         #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
         /**
         * Selection dialog, for apps that don't want to do GetFirst
@@ -921,12 +2864,331 @@ class CTwnDsm
         */
         DSM_State DSMGetState();
 
+        /**
+        * Ask the driver for a strip on behalf of CTwnDsmReadAhead.  The
+        * worker isn't in DSM_Entry, so this is how it gets to DsEntry.
+        * @param[in] _pAppId the copy of the application's identity
+        * @param[in] _DsId numeric id of driver
+        * @param[in,out] _pMemXfer the TW_IMAGEMEMXFER for the strip
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_UINT16 ReadAheadXfer(TW_IDENTITY     *_pAppId,
+                                TWID_T           _DsId,
+                                TW_IMAGEMEMXFER *_pMemXfer);
+
+        /**
+        * Make the application's callback for a DAT_NULL message.  The
+        * driver's thread gets here from DSM_Null, and the dispatcher's
+        * thread gets here for CTwnDsmDispatch.
+        * @param[in] _pAppId id of app
+        * @param[in] _DsId numeric id of driver
+        * @param[in] _MSG the message from the driver
+        * @return what the callback returned
+        */
+        TW_INT16 DispatchCallback(TW_IDENTITY *_pAppId,
+                                  TWID_T       _DsId,
+                                  TW_UINT16    _MSG);
+
+        /**
+        * Send a triplet to the driver from the driver's own thread,
+        * for CTwnDsmActor.  The caller is waiting in DsEntry...
+        * @param[in] _pAppId id of app
+        * @param[in] _DsId numeric id of driver
+        * @param[in] _DG the data group
+        * @param[in] _DAT the data argument type
+        * @param[in] _MSG the message
+        * @param[in] _pData the data
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_UINT16 ActorEntry(TW_IDENTITY *_pAppId,
+                             TWID_T       _DsId,
+                             TW_UINT32    _DG,
+                             TW_UINT16    _DAT,
+                             TW_UINT16    _MSG,
+                             TW_MEMREF    _pData);
+
+        /**
+        * Poke the application when a DAT_TWDSM_SUBMIT ticket is done,
+        * if it gave us a way to, for CTwnDsmActor...
+        * @param[in] _pAppId id of app
+        */
+        void ActorWakeup(TW_IDENTITY *_pAppId);
+
+        /**
+        * Close a driver for real, for CTwnDsmWarmPool, once the
+        * application has been away from it long enough...
+        * @param[in] _pAppId id of app
+        * @param[in] _pDsId id of driver
+        */
+        void WarmPoolClose(TW_IDENTITY *_pAppId,
+                           TW_IDENTITY *_pDsId);
+
+        /**
+        * Get what the modules keep for a driver, see DS_SESSION...
+        * @param[in] _AppId numeric id of app
+        * @param[in] _DsId numeric id of driver
+        * @return the record, or NULL if there's no such driver
+        */
+        DS_SESSION *DsSession(const TWID_T _AppId,
+                              const TWID_T _DsId);
+
+        /**
+        * Get the application's callback dispatcher, for CTwnDsmDispatch...
+        * @param[in] _AppId numeric id of app
+        * @return the dispatcher, or NULL
+        */
+        struct DISPATCH_SESSION_ *AppDispatcher(const TWID_T _AppId);
+
+        /**
+        * Set the application's callback dispatcher, for CTwnDsmDispatch...
+        * @param[in] _AppId numeric id of app
+        * @param[in] _pdispatch the dispatcher, or NULL
+        * @return false if there's no such application
+        */
+        bool AppSetDispatcher(const TWID_T              _AppId,
+                              struct DISPATCH_SESSION_ *_pdispatch);
+
 
     //
     // All of our private functions go here...
     //
     private:
 
+        /**
+        * Call the driver's DS_Entry.  Everything we send to a driver
+        * goes through here, so this is where we measure it...
+        * @param[in] _pAppId the local copy of the application's identity
+        * @param[in] _DsId numeric id of driver
+        * @param[in] _DG message id: DG_xxxx
+        * @param[in] _DAT message id: DAT_xxxx
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in] _pData the Data
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_UINT16 DsEntry(TW_IDENTITY *_pAppId,
+                          TWID_T       _DsId,
+                          TW_UINT32    _DG,
+                          TW_UINT16    _DAT,
+                          TW_UINT16    _MSG,
+                          TW_MEMREF    _pData);
+
+        /**
+        * The part of DsEntry that only runs when we're tracing, it wraps
+        * a span around the call to the driver.
+        * @param[in] _pAppId the local copy of the application's identity
+        * @param[in] _DsId numeric id of driver
+        * @param[in] _DG message id: DG_xxxx
+        * @param[in] _DAT message id: DAT_xxxx
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in] _pData the Data
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_UINT16 DsEntryTraced(TW_IDENTITY *_pAppId,
+                                TWID_T       _DsId,
+                                TW_UINT32    _DG,
+                                TW_UINT16    _DAT,
+                                TW_UINT16    _MSG,
+                                TW_MEMREF    _pData);
+
+        /**
+        * Handles the DAT_CUSTOMBASE triplets that belong to us, which
+        * are the ones sent to the DSM (a NULL pDest).
+        * @param[in] _pAppId Origin of message
+        * @param[in] _DAT data argument type: DAT_xxxx
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in,out] _pData the Data
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_INT16 DSM_Custom(TW_IDENTITY *_pAppId,
+                            TW_UINT16 _DAT,
+                            TW_UINT16 _MSG,
+                            TW_MEMREF _pData);
+
+        /**
+        * Returns per-triplet counters and latencies.
+        * @param[in] _pAppId Origin of message
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in,out] _pMetrics TW_TWDSM_METRICS structure
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_INT16 DSM_Metrics(TW_IDENTITY *_pAppId,
+                             TW_UINT16 _MSG,
+                             TW_TWDSM_METRICS *_pMetrics);
+
+        /**
+        * Returns the memfd descriptor for a handle.
+        * @param[in] _pAppId Origin of message
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in,out] _pMemfd TW_TWDSM_MEMFD structure
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_INT16 DSM_Memfd(TW_IDENTITY *_pAppId,
+                           TW_UINT16 _MSG,
+                           TW_TWDSM_MEMFD *_pMemfd);
+
+        /**
+        * Sends a vector of DAT_IMAGEMEMXFER to a driver.
+        * @param[in] _pAppId Origin of message
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in,out] _pBatch TW_TWDSM_MEMXFERBATCH structure
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_INT16 DSM_MemXferBatch(TW_IDENTITY *_pAppId,
+                                  TW_UINT16 _MSG,
+                                  TW_TWDSM_MEMXFERBATCH *_pBatch);
+
+        /**
+        * Gets a whole image from a driver in one frame.
+        * @param[in] _pAppId Origin of message
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in,out] _pImageFrame TW_TWDSM_IMAGEFRAME structure
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_INT16 DSM_ImageFrame(TW_IDENTITY *_pAppId,
+                                TW_UINT16 _MSG,
+                                TW_TWDSM_IMAGEFRAME *_pImageFrame);
+
+        /**
+        * Sets, gets or resets pixel conversion for a driver.
+        * @param[in] _pAppId Origin of message
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in,out] _pConvert TW_TWDSM_CONVERT structure
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_INT16 DSM_Convert(TW_IDENTITY *_pAppId,
+                             TW_UINT16 _MSG,
+                             TW_TWDSM_CONVERT *_pConvert);
+
+        /**
+        * Sets, gets or resets content analysis for a driver.
+        * @param[in] _pAppId Origin of message
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in,out] _pAnalysis TW_TWDSM_ANALYSIS structure
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_INT16 DSM_Analysis(TW_IDENTITY *_pAppId,
+                              TW_UINT16 _MSG,
+                              TW_TWDSM_ANALYSIS *_pAnalysis);
+
+        /**
+        * Gets the checksum of the last image from a driver.
+        * @param[in] _pAppId Origin of message
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in,out] _pChecksum TW_TWDSM_CHECKSUM structure
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_INT16 DSM_Checksum(TW_IDENTITY *_pAppId,
+                              TW_UINT16 _MSG,
+                              TW_TWDSM_CHECKSUM *_pChecksum);
+
+        /**
+        * Gets or closes the application's event descriptor.
+        * @param[in] _pAppId Origin of message
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in,out] _pEventFd TW_TWDSM_EVENTFD structure
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_INT16 DSM_EventFd(TW_IDENTITY *_pAppId,
+                             TW_UINT16 _MSG,
+                             TW_TWDSM_EVENTFD *_pEventFd);
+
+        /**
+        * Queues a triplet for a driver's thread, or collects one.
+        * @param[in] _pAppId Origin of message
+        * @param[in] _MSG message id: MSG_xxxx
+        * @param[in,out] _pSubmit TW_TWDSM_SUBMIT structure
+        * @param[in] _pfnDone for MSG_SET from DSM_EntryAsync, or NULL
+        * @param[in] _pRefCon passed to _pfnDone
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_INT16 DSM_Submit(TW_IDENTITY *_pAppId,
+                            TW_UINT16 _MSG,
+                            TW_TWDSM_SUBMIT *_pSubmit,
+                            DSMASYNCPROC _pfnDone,
+                            TW_MEMREF _pRefCon);
+
+        /**
+        * Get a driver back from the warm pool for MSG_OPENDS, and
+        * reset its capabilities.  If it won't reset it's closed.
+        * @param[in] _pAppId Origin of message
+        * @param[in,out] _pDsId the driver, we fill in its identity
+        * @return true if it's open, false if it has to be loaded
+        */
+        bool WarmPoolTake(TW_IDENTITY *_pAppId,
+                          TW_IDENTITY *_pDsId);
+
+        /**
+        * Have every module let go of its part of the driver's
+        * DS_SESSION.  A driver going into the warm pool keeps its
+        * thread and its placement, anything else is about to be
+        * unloaded, and loses those too.
+        * @param[in] _AppId numeric id of app
+        * @param[in] _DsId numeric id of driver
+        * @param[in] _bUnloading the driver is about to be unloaded
+        */
+        void StopSession(const TWID_T _AppId,
+                         const TWID_T _DsId,
+                         const bool   _bUnloading);
+
+        /**
+        * Check that a driver named by one of our triplets is open, and
+        * free to take a call.  Sets the condition code if it isn't.
+        * @param[in] _pAppId Origin of message
+        * @param[in] _DsId the driver
+        * @return true if we can call it
+        */
+        bool CustomDsIsReady(TW_IDENTITY *_pAppId,
+                             TWID_T _DsId);
+
+        /**
+        * Get one strip for DSM triplets, through read-ahead if it's on.
+        * @param[in] _pAppId the local copy of the application's identity
+        * @param[in] _DsId the driver
+        * @param[in,out] _pMemXfer the TW_IMAGEMEMXFER for the strip
+        * @return a valid TWRC_xxxx return code
+        */
+        TW_UINT16 DsMemXfer(TW_IDENTITY *_pAppId,
+                            TWID_T _DsId,
+                            TW_IMAGEMEMXFER *_pMemXfer);
+
+        /**
+        * Dump an application's metrics to the file named by
+        * TWAINDSM_METRICS, if there is one.  We do this at MSG_CLOSEDSM
+        * while we still know the names of the drivers...
+        * @param[in] _pAppId the application that's closing
+        */
+        void DumpMetrics(TW_IDENTITY *_pAppId);
+
+        /**
+        * Log an application's DAT_TWDSM_DELIVER and DAT_TWDSM_RESPOND
+        * rows at MSG_CLOSEDSM, so the latency shows up in the log even
+        * when there's no TWAINDSM_METRICS file...
+        * @param[in] _pAppId the application that's closing
+        */
+        void LogLatency(TW_IDENTITY *_pAppId);
+
+        /**
+        * Send one latency sample to the trace and the log.  Does
+        * nothing if _ns is 0, which means the clock wasn't running.
+        * @param[in] _szName "deliver" or "respond"
+        * @param[in] _pAppId the application
+        * @param[in] _DsId the driver
+        * @param[in] _MSG the message that was timed
+        * @param[in] _ns the latency in nanoseconds
+        */
+        void RecordLatency(const char* const _szName,
+                           TW_IDENTITY      *_pAppId,
+                           const TWID_T      _DsId,
+                           const TW_UINT16   _MSG,
+                           const UINT64      _ns);
+
+        /**
+        * Count the drivers with a message waiting for an application
+        * to pick up with DAT_EVENT, and publish it...
+        * @param[in] _pAppId the application
+        */
+        void PublishCallbackDepth(TW_IDENTITY *_pAppId);
+
         /**
         * Handles DAT_NULL calls from DS for Application.
         * @param[in] _pAppId Origin of message
@@ -1176,6 +3438,20 @@ class CTwnDsm
                           const int _nChars,
                           const TW_UINT32 _DG);
 
+        /**
+        * Translates the triplet passed in into a DG/DAT/MSG string
+        * @param[out] _szTriplet string to copy into
+        * @param[in] _nChars max chars in _szTriplet
+        * @param[in] _DG the TWAIN data group to translate
+        * @param[in] _DAT the TWAIN data argument type to translate
+        * @param[in] _MSG the TWAIN message to translate
+        */
+        void StringFromTriplet(char *_szTriplet,
+                               const int _nChars,
+                               const TW_UINT32 _DG,
+                               const TW_UINT16 _DAT,
+                               const TW_UINT16 _MSG);
+
         /**
         * Translates the _Cap passed in into a string and returns it
         * @param[out] _szCap string to copy into
@@ -1247,11 +3523,6 @@ class CTwnDsm
             */
             char m_DefaultDSPath[FILENAME_MAX];
 
-            /**
-            * The next id to test for GetFirst/GetNext...
-            */
-            TWID_T m_nextDsId;
-
             /**
             * The DS ID we end up with from SelectDlgProc.  This is only
             * used on the Windows platform.
@@ -1265,6 +3536,7 @@ class CTwnDsm
             TW_IDENTITY *m_pSelectDlgAppId;
         } pod; /**< Pieces of Data for the DSM class*/
 };
+extern CTwnDsm *g_ptwndsm;
 
 
 #endif // __DSM_H__
@@ -0,0 +1,424 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+
+/**
+* @file frame.cpp
+* Frame assembly.
+* Put the strips or tiles from DAT_IMAGEMEMXFER together into a single
+* frame for DAT_TWDSM_IMAGEFRAME.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* When we don't know how long the image is, start with this many
+* strips worth of frame, and double it as we go...
+* @see CTwnDsmFrame
+*/
+#define FRAME_UNKNOWNSTRIPS 8
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmFrameImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmFrameImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Make sure the frame holds at least this many bytes.  It at
+    * least doubles each time, so growing an ADF page a strip at a
+    * time doesn't get quadratic...
+    * @param[in] _nBytes how much we need
+    * @return false if we couldn't get the memory
+    */
+    bool Reserve(const UINT64 _nBytes);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      TW_HANDLE  m_hFrame;        /**< the frame, from DSM_MemAllocate */
+      char      *m_pFrame;        /**< the frame, locked */
+      TW_UINT32  m_nCapacity;     /**< the size of the frame */
+      TW_UINT32  m_nUsed;         /**< how much of it has data */
+      TW_UINT32  m_nOffset;       /**< where the next strip goes */
+      TW_UINT32  m_nPreferred;    /**< the size of each strip */
+      TW_UINT32  m_nStride;       /**< bytes from one row to the next */
+      TW_UINT32  m_nTight;        /**< bytes in a row with no padding */
+      char      *m_pScratch;      /**< where strips go once they stop landing in place */
+      bool       m_bStride;       /**< m_nStride is set */
+      bool       m_bAppend;       /**< compressed or planar, so just append */
+      TW_INT32   m_ImageWidth;    /**< from DAT_IMAGEINFO */
+      TW_INT32   m_ImageLength;   /**< from DAT_IMAGEINFO */
+      TW_INT32   m_nRows;         /**< the most rows we've seen */
+      TW_INT16   m_BitsPerPixel;  /**< from DAT_IMAGEINFO */
+      TW_UINT16  m_Compression;   /**< from the strips */
+      TW_UINT32  m_nStrips;       /**< strips placed */
+      TW_UINT32  m_nCopied;       /**< strips we had to move */
+    } pod;    /**< Pieces of data for CTwnDsmFrameImpl*/
+};
+
+
+
+/**
+* The constructor for our class...
+*/
+CTwnDsmFrame::CTwnDsmFrame()
+{
+  m_ptwndsmframeimpl = new CTwnDsmFrameImpl;
+}
+
+
+
+/**
+* The destructor for our class.  If the frame is still ours, it goes
+* back...
+*/
+CTwnDsmFrame::~CTwnDsmFrame()
+{
+  if (m_ptwndsmframeimpl)
+  {
+    if (m_ptwndsmframeimpl->pod.m_pScratch)
+    {
+      free(m_ptwndsmframeimpl->pod.m_pScratch);
+    }
+    if (m_ptwndsmframeimpl->pod.m_hFrame)
+    {
+      DSM_MemUnlock(m_ptwndsmframeimpl->pod.m_hFrame);
+      DSM_MemFree(m_ptwndsmframeimpl->pod.m_hFrame);
+    }
+    delete m_ptwndsmframeimpl;
+    m_ptwndsmframeimpl = 0;
+  }
+}
+
+
+
+/**
+* Size the frame from what the driver says about the image.  A
+* compressed frame is smaller than this, but we can't guess how
+* much, and it's better to waste some than to copy it...
+*/
+bool CTwnDsmFrame::Begin(const TW_IMAGEINFO *_pImageInfo,
+                         const TW_UINT32     _nPreferred)
+{
+  UINT64 nBytes;
+
+  m_ptwndsmframeimpl->pod.m_nPreferred   = _nPreferred;
+  m_ptwndsmframeimpl->pod.m_ImageWidth   = _pImageInfo->ImageWidth;
+  m_ptwndsmframeimpl->pod.m_ImageLength  = _pImageInfo->ImageLength;
+  m_ptwndsmframeimpl->pod.m_BitsPerPixel = _pImageInfo->BitsPerPixel;
+  m_ptwndsmframeimpl->pod.m_Compression  = _pImageInfo->Compression;
+  m_ptwndsmframeimpl->pod.m_bAppend      =    (TWCP_NONE != _pImageInfo->Compression)
+                                           || _pImageInfo->Planar
+                                           || (_pImageInfo->ImageWidth <= 0)
+                                           || (_pImageInfo->BitsPerPixel <= 0);
+  if (!m_ptwndsmframeimpl->pod.m_bAppend)
+  {
+    m_ptwndsmframeimpl->pod.m_nTight = (TW_UINT32)((((UINT64)_pImageInfo->ImageWidth * _pImageInfo->BitsPerPixel) + 7) / 8);
+  }
+
+  if ((_pImageInfo->ImageLength > 0) && (_pImageInfo->ImageWidth > 0) && (_pImageInfo->BitsPerPixel > 0))
+  {
+    nBytes = ((((UINT64)_pImageInfo->ImageWidth * _pImageInfo->BitsPerPixel) + 7) / 8) * (UINT64)_pImageInfo->ImageLength;
+  }
+  else
+  {
+    nBytes = (UINT64)_nPreferred * FRAME_UNKNOWNSTRIPS;
+  }
+
+  // The last strip still gets the whole _nPreferred...
+  return m_ptwndsmframeimpl->Reserve(nBytes + _nPreferred);
+}
+
+
+
+/**
+* Strips go right into the frame, unless we've already had to move
+* one, in which case the rest go to the scratch buffer...
+*/
+bool CTwnDsmFrame::Target(TW_IMAGEMEMXFER *_pMemXfer)
+{
+  memset(_pMemXfer,0,sizeof(*_pMemXfer));
+  _pMemXfer->Compression  = TWON_DONTCARE16;
+  _pMemXfer->BytesPerRow  = TWON_DONTCARE32;
+  _pMemXfer->Columns      = TWON_DONTCARE32;
+  _pMemXfer->Rows         = TWON_DONTCARE32;
+  _pMemXfer->XOffset      = TWON_DONTCARE32;
+  _pMemXfer->YOffset      = TWON_DONTCARE32;
+  _pMemXfer->BytesWritten = TWON_DONTCARE32;
+  _pMemXfer->Memory.Flags  = TWMF_APPOWNS | TWMF_POINTER;
+  _pMemXfer->Memory.Length = m_ptwndsmframeimpl->pod.m_nPreferred;
+
+  if (m_ptwndsmframeimpl->pod.m_pScratch)
+  {
+    _pMemXfer->Memory.TheMem = (TW_MEMREF)m_ptwndsmframeimpl->pod.m_pScratch;
+    return true;
+  }
+
+  if (!m_ptwndsmframeimpl->Reserve((UINT64)m_ptwndsmframeimpl->pod.m_nOffset + m_ptwndsmframeimpl->pod.m_nPreferred))
+  {
+    return false;
+  }
+  _pMemXfer->Memory.TheMem = (TW_MEMREF)(m_ptwndsmframeimpl->pod.m_pFrame + m_ptwndsmframeimpl->pod.m_nOffset);
+  return true;
+}
+
+
+
+/**
+* A full width strip that starts where the last one ended is already
+* where it belongs.  Anything else gets moved a row at a time...
+*/
+bool CTwnDsmFrame::Place(const TW_IMAGEMEMXFER *_pMemXfer)
+{
+  CTwnDsmFrameImpl::_pod *ppod = &m_ptwndsmframeimpl->pod;
+  char      *pSource;
+  TW_UINT32  nRowBytes;
+  TW_UINT32  ii;
+  UINT64  nEnd;
+
+  if (_pMemXfer->BytesWritten > ppod->m_nPreferred)
+  {
+    kLOG((kLOGERR,"strip of %u bytes is bigger than the buffer...",(unsigned int)_pMemXfer->BytesWritten));
+    return false;
+  }
+  ppod->m_nStrips++;
+  pSource = ppod->m_pScratch ? ppod->m_pScratch : (ppod->m_pFrame + ppod->m_nOffset);
+
+  // The driver compressed it after all, which is fine if it's the first
+  // strip, since nothing else has been put in the frame yet...
+  if (!ppod->m_bAppend && (TWCP_NONE != _pMemXfer->Compression))
+  {
+    if ((0 != ppod->m_nUsed) || ppod->m_pScratch)
+    {
+      kLOG((kLOGERR,"compression changed in the middle of the image..."));
+      return false;
+    }
+    ppod->m_bAppend = true;
+  }
+
+  // Compressed or planar, so just one after the other...
+  if (ppod->m_bAppend)
+  {
+    ppod->m_Compression = _pMemXfer->Compression;
+    ppod->m_nOffset += _pMemXfer->BytesWritten;
+    ppod->m_nUsed = ppod->m_nOffset;
+    return true;
+  }
+
+  // Check the layout, we're going to trust it from here on...
+  nRowBytes = (TW_UINT32)((((UINT64)_pMemXfer->Columns * ppod->m_BitsPerPixel) + 7) / 8);
+  if (   ((UINT64)_pMemXfer->XOffset + _pMemXfer->Columns > (UINT64)ppod->m_ImageWidth)
+      || (_pMemXfer->BytesPerRow < nRowBytes)
+      || (((UINT64)_pMemXfer->XOffset * ppod->m_BitsPerPixel) % 8)
+      || (   (0 != _pMemXfer->Rows)
+          && (((UINT64)(_pMemXfer->Rows - 1) * _pMemXfer->BytesPerRow) + nRowBytes > _pMemXfer->BytesWritten)))
+  {
+    kLOG((kLOGERR,"strip layout doesn't fit the image...%ux%u at %u,%u, %u bytes per row",
+          (unsigned int)_pMemXfer->Columns,(unsigned int)_pMemXfer->Rows,
+          (unsigned int)_pMemXfer->XOffset,(unsigned int)_pMemXfer->YOffset,
+          (unsigned int)_pMemXfer->BytesPerRow));
+    return false;
+  }
+
+  // The first full width strip picks the stride, so a driver that pads
+  // its rows doesn't have to be copied...
+  if (!ppod->m_bStride)
+  {
+    ppod->m_nStride = ppod->m_nTight;
+    if (   (0 == _pMemXfer->XOffset)
+        && (0 == _pMemXfer->YOffset)
+        && ((TW_INT32)_pMemXfer->Columns == ppod->m_ImageWidth))
+    {
+      ppod->m_nStride = _pMemXfer->BytesPerRow;
+    }
+    ppod->m_bStride = true;
+  }
+  nEnd = ((UINT64)_pMemXfer->YOffset + _pMemXfer->Rows) * ppod->m_nStride;
+  if (nEnd > 0xFFFFFFFF)
+  {
+    kLOG((kLOGERR,"frame is too big..."));
+    return false;
+  }
+  if ((TW_INT32)(_pMemXfer->YOffset + _pMemXfer->Rows) > ppod->m_nRows)
+  {
+    ppod->m_nRows = (TW_INT32)(_pMemXfer->YOffset + _pMemXfer->Rows);
+  }
+
+  // Already where it belongs...
+  if (   !ppod->m_pScratch
+      && (0 == _pMemXfer->XOffset)
+      && ((TW_INT32)_pMemXfer->Columns == ppod->m_ImageWidth)
+      && (_pMemXfer->BytesPerRow == ppod->m_nStride)
+      && ((UINT64)_pMemXfer->YOffset * ppod->m_nStride == ppod->m_nOffset))
+  {
+    ppod->m_nUsed = ppod->m_nOffset + _pMemXfer->BytesWritten;
+    if (!m_ptwndsmframeimpl->Reserve(nEnd))
+    {
+      return false;
+    }
+    ppod->m_nOffset = (TW_UINT32)nEnd;
+    ppod->m_nUsed = (TW_UINT32)nEnd;
+    return true;
+  }
+
+  // It has to be moved.  Nothing's been put past m_nOffset, so the
+  // strip can sit there until we get it into the scratch buffer, and
+  // from here on the driver writes to the scratch buffer...
+  ppod->m_nCopied++;
+  if (!ppod->m_pScratch)
+  {
+    ppod->m_pScratch = (char*)malloc(ppod->m_nPreferred);
+    if (0 == ppod->m_pScratch)
+    {
+      kLOG((kLOGERR,"unable to allocate a scratch strip..."));
+      return false;
+    }
+    memcpy(ppod->m_pScratch,pSource,_pMemXfer->BytesWritten);
+    pSource = ppod->m_pScratch;
+  }
+  if (!m_ptwndsmframeimpl->Reserve(nEnd))
+  {
+    return false;
+  }
+  for (ii = 0; ii < _pMemXfer->Rows; ii++)
+  {
+    memcpy(ppod->m_pFrame + (((UINT64)_pMemXfer->YOffset + ii) * ppod->m_nStride) + (((UINT64)_pMemXfer->XOffset * ppod->m_BitsPerPixel) / 8),
+           pSource + ((UINT64)ii * _pMemXfer->BytesPerRow),
+           nRowBytes);
+  }
+  if (nEnd > ppod->m_nUsed)
+  {
+    ppod->m_nUsed = (TW_UINT32)nEnd;
+  }
+  return true;
+}
+
+
+
+/**
+* The frame is the caller's now...
+*/
+void CTwnDsmFrame::Finish(TW_TWDSM_IMAGEFRAME *_pImageFrame)
+{
+  CTwnDsmFrameImpl::_pod *ppod = &m_ptwndsmframeimpl->pod;
+
+  DSM_MemUnlock(ppod->m_hFrame);
+  _pImageFrame->hFrame       = ppod->m_hFrame;
+  _pImageFrame->Length       = ppod->m_nUsed;
+  _pImageFrame->ImageWidth   = ppod->m_ImageWidth;
+  _pImageFrame->BitsPerPixel = ppod->m_BitsPerPixel;
+  _pImageFrame->Compression  = ppod->m_Compression;
+  _pImageFrame->Strips       = ppod->m_nStrips;
+  _pImageFrame->Copied       = ppod->m_nCopied;
+  if (ppod->m_bAppend)
+  {
+    _pImageFrame->BytesPerRow = 0;
+    _pImageFrame->ImageLength = ppod->m_ImageLength;
+  }
+  else
+  {
+    _pImageFrame->BytesPerRow = ppod->m_nStride;
+    _pImageFrame->ImageLength = ppod->m_nRows;
+  }
+  ppod->m_hFrame = 0;
+  ppod->m_pFrame = 0;
+}
+
+
+
+/**
+* DSM_MemAllocate doesn't have a realloc, so this is allocate, copy
+* and free...
+*/
+bool CTwnDsmFrameImpl::Reserve(const UINT64 _nBytes)
+{
+  TW_HANDLE  hFrame;
+  char      *pFrame;
+  UINT64  nCapacity;
+
+  if (_nBytes <= pod.m_nCapacity)
+  {
+    return true;
+  }
+
+  nCapacity = (UINT64)pod.m_nCapacity * 2;
+  if (nCapacity < _nBytes)
+  {
+    nCapacity = _nBytes;
+  }
+  if (nCapacity > 0xFFFFFFFF)
+  {
+    nCapacity = 0xFFFFFFFF;
+    if (nCapacity < _nBytes)
+    {
+      kLOG((kLOGERR,"frame is too big..."));
+      return false;
+    }
+  }
+
+  hFrame = DSM_MemAllocate((TW_UINT32)nCapacity);
+  if (0 == hFrame)
+  {
+    kLOG((kLOGERR,"unable to allocate a %u byte frame...",(unsigned int)nCapacity));
+    return false;
+  }
+  pFrame = (char*)DSM_MemLock(hFrame);
+
+  if (pod.m_hFrame)
+  {
+    memcpy(pFrame,pod.m_pFrame,pod.m_nUsed);
+    DSM_MemUnlock(pod.m_hFrame);
+    DSM_MemFree(pod.m_hFrame);
+  }
+  pod.m_hFrame = hFrame;
+  pod.m_pFrame = pFrame;
+  pod.m_nCapacity = (TW_UINT32)nCapacity;
+  return true;
+}
@@ -52,12 +52,34 @@
 */
 #define kLOGMODEENV "TWAINDSM_LOGMODE"
 
+/**
+* Enviroment varible of the size in bytes (a K, M or G suffix is
+* okay) at which we start a new log file.  If it's not set, the
+* file grows forever...
+* @see CTwnDsmLog
+*/
+#define kLOGSIZEENV "TWAINDSM_LOGSIZE"
+
+/**
+* Enviroment varible of how many old log files to keep when we
+* start a new one, the default is 5...
+* @see CTwnDsmLog
+*/
+#define kLOGCOUNTENV "TWAINDSM_LOGCOUNT"
+
 /**
 * Maximum message length we can handle...
 * @see CTwnDsmLog
 */
 #define TWNDSM_MAX_MSG 1024
 
+/**
+* How much we'll hold on to while we wait for the name of the
+* application, if the log path needs it...
+* @see CTwnDsmLog
+*/
+#define TWNDSM_MAX_PENDING 65536
+
 
 
 /**
@@ -72,6 +94,30 @@ class CTwnDsmLogImpl
       memset(&pod,0,sizeof(pod));
     }
 
+    /**
+    * Turn the template into a path, and open the log...
+    * @param[in] _szAppName the application name for %n, or NULL
+    */
+    void Open(const char* const _szAppName);
+
+    /**
+    * Hang on to a message until we have a file to put it in...
+    * @param[in] _szMessage the message
+    */
+    void Pend(const char* const _szMessage);
+
+    /**
+    * Our rotation thread, it waits for Log to tell it the file
+    * is too big...
+    */
+    void RotateLoop();
+
+    /**
+    * Move the old files out of the way, path.1 becomes path.2 and
+    * so on, and the current file becomes path.1...
+    */
+    void Shift();
+
   public:
     // If you add a class in future, (and I can't imagine why you
     // would) declare it here and not in the pod, or the memset
@@ -85,9 +131,21 @@ class CTwnDsmLogImpl
     {
       FILE *m_plog;                  /**< where we'll dump information. */
       char *m_message;               /**< buffer for our messages. */
+      char  m_logtemplate[FILENAME_MAX]; /**< TWAINDSM_LOG, %p, %n and %d not expanded. */
       char  m_logpath[FILENAME_MAX]; /**< where we put the file. */
       char  m_logmode[16];           /**< how we fopen the file. */
       int   m_nIndent;               /**< how far to indent the log message */
+      char *m_pending;               /**< messages waiting for the file to be opened. */
+      UINT  m_npending;              /**< bytes in m_pending. */
+      UINT  m_ndropped;              /**< messages that didn't fit in m_pending. */
+      long  m_maxsize;               /**< rotate when the file gets this big, or 0. */
+      int   m_count;                 /**< how many old files we keep. */
+      bool  m_bRotate;               /**< Log wants the rotation thread to go. */
+      bool  m_bQuit;                 /**< the rotation thread should exit. */
+      bool  m_bThread;               /**< the rotation thread is running. */
+      MUTEX m_mutex;                 /**< one message at a time. */
+      COND  m_cond;                  /**< wakes up the rotation thread. */
+      THREAD m_thread;               /**< the rotation thread. */
     } pod;    /**< Pieces of data for CTwnDsmAppsImpl*/
 };
 
@@ -102,17 +160,31 @@ class CTwnDsmLogImpl
 * this environmental to "a+" will cause the log information to be
 * appended to an existing file (a new one will still be created if
 * needed...
+*
+* The path can have %p (process id), %n (the ProductName of the
+* first application to open the DSM), %d (the date as YYYYMMDD) and
+* %% in it, so that lots of processes can log without fighting.  We
+* open the file right away, unless we need %n, in which case we keep
+* the messages until SetAppName tells us what it is.
+*
+* TWAINDSM_LOGSIZE and TWAINDSM_LOGCOUNT turn on rotation.  Log just
+* notices the file is too big, a thread does the rest...
 */
 CTwnDsmLog::CTwnDsmLog()
 {
+  char  szEnv[FILENAME_MAX];
+  char *pszEnd;
+
   // Init stuff...
   m_ptwndsmlogimpl = new CTwnDsmLogImpl;
+  MUTEXINIT(m_ptwndsmlogimpl->pod.m_mutex);
+  CONDINIT(m_ptwndsmlogimpl->pod.m_cond);
 
   // see if a logfile is to be used
-  SGETENV(m_ptwndsmlogimpl->pod.m_logpath,NCHARS(m_ptwndsmlogimpl->pod.m_logpath),kLOGENV);
+  SGETENV(m_ptwndsmlogimpl->pod.m_logtemplate,NCHARS(m_ptwndsmlogimpl->pod.m_logtemplate),kLOGENV);
 
   // If we have a path, then get our mode...
-  if (m_ptwndsmlogimpl->pod.m_logpath[0])
+  if (m_ptwndsmlogimpl->pod.m_logtemplate[0])
   {
     SGETENV(m_ptwndsmlogimpl->pod.m_logmode,NCHARS(m_ptwndsmlogimpl->pod.m_logmode),kLOGMODEENV);
     if (!m_ptwndsmlogimpl->pod.m_logmode[0])
@@ -121,12 +193,50 @@ CTwnDsmLog::CTwnDsmLog()
       SSTRCPY(m_ptwndsmlogimpl->pod.m_logmode,sizeof(m_ptwndsmlogimpl->pod.m_logmode),"w");
     }
 
+    // How big can it get?
+    SGETENV(szEnv,NCHARS(szEnv),kLOGSIZEENV);
+    if (szEnv[0])
+    {
+      m_ptwndsmlogimpl->pod.m_maxsize = strtol(szEnv,&pszEnd,10);
+      switch (*pszEnd)
+      {
+        case 'k': case 'K': m_ptwndsmlogimpl->pod.m_maxsize *= 1024L; break;
+        case 'm': case 'M': m_ptwndsmlogimpl->pod.m_maxsize *= 1024L * 1024L; break;
+        case 'g': case 'G': m_ptwndsmlogimpl->pod.m_maxsize *= 1024L * 1024L * 1024L; break;
+        default: break;
+      }
+      if (m_ptwndsmlogimpl->pod.m_maxsize < 0)
+      {
+        m_ptwndsmlogimpl->pod.m_maxsize = 0;
+      }
+      m_ptwndsmlogimpl->pod.m_count = 5;
+      SGETENV(szEnv,NCHARS(szEnv),kLOGCOUNTENV);
+      if (szEnv[0])
+      {
+        m_ptwndsmlogimpl->pod.m_count = atoi(szEnv);
+        if (m_ptwndsmlogimpl->pod.m_count < 0)
+        {
+          m_ptwndsmlogimpl->pod.m_count = 0;
+        }
+      }
+    }
+
     // Only bother to allocate a buffer if logging is on...
     m_ptwndsmlogimpl->pod.m_message = (char*)calloc(TWNDSM_MAX_MSG,1);
     if (!m_ptwndsmlogimpl->pod.m_message)
     {
       kPANIC("Unable to allocate a buffer for logging...");
     }
+
+    // Open it now, or wait for the application's name...
+    if (strstr(m_ptwndsmlogimpl->pod.m_logtemplate,"%n"))
+    {
+      m_ptwndsmlogimpl->pod.m_pending = (char*)calloc(TWNDSM_MAX_PENDING,1);
+    }
+    else
+    {
+      m_ptwndsmlogimpl->Open(0);
+    }
   }
 }
 
@@ -140,6 +250,14 @@ CTwnDsmLog::~CTwnDsmLog()
 {
   if (m_ptwndsmlogimpl)
   {
+    if (m_ptwndsmlogimpl->pod.m_bThread)
+    {
+      MUTEXLOCK(m_ptwndsmlogimpl->pod.m_mutex);
+      m_ptwndsmlogimpl->pod.m_bQuit = true;
+      CONDSIGNAL(m_ptwndsmlogimpl->pod.m_cond);
+      MUTEXUNLOCK(m_ptwndsmlogimpl->pod.m_mutex);
+      THREADJOIN(m_ptwndsmlogimpl->pod.m_thread);
+    }
     if (m_ptwndsmlogimpl->pod.m_plog)
     {
       fclose(m_ptwndsmlogimpl->pod.m_plog);
@@ -148,6 +266,12 @@ CTwnDsmLog::~CTwnDsmLog()
     {
       free(m_ptwndsmlogimpl->pod.m_message);
     }
+    if (m_ptwndsmlogimpl->pod.m_pending)
+    {
+      free(m_ptwndsmlogimpl->pod.m_pending);
+    }
+    CONDDESTROY(m_ptwndsmlogimpl->pod.m_cond);
+    MUTEXDESTROY(m_ptwndsmlogimpl->pod.m_mutex);
     delete m_ptwndsmlogimpl;
     m_ptwndsmlogimpl = 0;
   }
@@ -177,7 +301,7 @@ void CTwnDsmLog::Log(const int         _doassert,
                      ...)
 {
   // We've nothing to do, so bail...
-  if (0 == m_ptwndsmlogimpl->pod.m_logpath[0])
+  if (0 == m_ptwndsmlogimpl->pod.m_logtemplate[0])
   {
     return;
   }
@@ -202,17 +326,8 @@ void CTwnDsmLog::Log(const int         _doassert,
     #error Sorry, we do not recognize this system...
   #endif
 
-  // If we have no log yet, try to get one...
-  if (0 == m_ptwndsmlogimpl->pod.m_plog)
-  {
-    FOPEN(m_ptwndsmlogimpl->pod.m_plog,m_ptwndsmlogimpl->pod.m_logpath,m_ptwndsmlogimpl->pod.m_logmode);
-    if (0 == m_ptwndsmlogimpl->pod.m_plog)
-    {
-      fprintf(stderr,"DSM: Error - logging has been disabled because logfile could not be opened: file=<%s>, mode=<%s>, errno=%d\r\n",m_ptwndsmlogimpl->pod.m_logpath,m_ptwndsmlogimpl->pod.m_logmode,errno);
-      m_ptwndsmlogimpl->pod.m_logpath[0] = 0;
-    }
-    return;
-  }
+  // One message at a time, they all share the buffer...
+  MUTEXLOCK(m_ptwndsmlogimpl->pod.m_mutex);
 
   // Trim the filename down to just the filename, no path...
   file = 0;
@@ -288,9 +403,27 @@ void CTwnDsmLog::Log(const int         _doassert,
   #endif
   va_end(valist);
 
-  // Write the message...
-  fprintf(m_ptwndsmlogimpl->pod.m_plog,"%s\r\n",m_ptwndsmlogimpl->pod.m_message);
-  fflush(m_ptwndsmlogimpl->pod.m_plog);
+  // Write the message, or hang on to it if we don't have a file yet...
+  if (m_ptwndsmlogimpl->pod.m_plog)
+  {
+    fprintf(m_ptwndsmlogimpl->pod.m_plog,"%s\r\n",m_ptwndsmlogimpl->pod.m_message);
+    fflush(m_ptwndsmlogimpl->pod.m_plog);
+
+    // Too big?  Let the thread deal with it...
+    if (   m_ptwndsmlogimpl->pod.m_bThread
+        && !m_ptwndsmlogimpl->pod.m_bRotate
+        && (ftell(m_ptwndsmlogimpl->pod.m_plog) >= m_ptwndsmlogimpl->pod.m_maxsize))
+    {
+      m_ptwndsmlogimpl->pod.m_bRotate = true;
+      CONDSIGNAL(m_ptwndsmlogimpl->pod.m_cond);
+    }
+  }
+  else
+  {
+    m_ptwndsmlogimpl->Pend(m_ptwndsmlogimpl->pod.m_message);
+  }
+
+  MUTEXUNLOCK(m_ptwndsmlogimpl->pod.m_mutex);
 
   // Do the assert, if asked for...
   if (_doassert)
@@ -301,5 +434,251 @@ void CTwnDsmLog::Log(const int         _doassert,
 
 void CTwnDsmLog::Indent(int nChange)
 {
+  // Log reads this while it holds the lock, so we change it there too...
+  MUTEXLOCK(m_ptwndsmlogimpl->pod.m_mutex);
   m_ptwndsmlogimpl->pod.m_nIndent += nChange;
+  MUTEXUNLOCK(m_ptwndsmlogimpl->pod.m_mutex);
+}
+
+
+
+/**
+* We finally know who the application is, so we can open the log
+* and write out everything we've been saving...
+*/
+void CTwnDsmLog::SetAppName(const char* const _szName)
+{
+  // Nothing to do, or it's already done...
+  if (   (0 == m_ptwndsmlogimpl->pod.m_logtemplate[0])
+      || (0 != m_ptwndsmlogimpl->pod.m_plog))
+  {
+    return;
+  }
+
+  MUTEXLOCK(m_ptwndsmlogimpl->pod.m_mutex);
+  if (0 == m_ptwndsmlogimpl->pod.m_plog)
+  {
+    m_ptwndsmlogimpl->Open(_szName);
+    if (m_ptwndsmlogimpl->pod.m_plog && m_ptwndsmlogimpl->pod.m_pending)
+    {
+      fwrite(m_ptwndsmlogimpl->pod.m_pending,1,m_ptwndsmlogimpl->pod.m_npending,m_ptwndsmlogimpl->pod.m_plog);
+      if (m_ptwndsmlogimpl->pod.m_ndropped)
+      {
+        fprintf(m_ptwndsmlogimpl->pod.m_plog,"[%u messages were lost waiting for the log to open]\r\n",m_ptwndsmlogimpl->pod.m_ndropped);
+      }
+      fflush(m_ptwndsmlogimpl->pod.m_plog);
+    }
+    if (m_ptwndsmlogimpl->pod.m_pending)
+    {
+      free(m_ptwndsmlogimpl->pod.m_pending);
+      m_ptwndsmlogimpl->pod.m_pending = 0;
+    }
+  }
+  MUTEXUNLOCK(m_ptwndsmlogimpl->pod.m_mutex);
+}
+
+
+
+/**
+* The rotation thread just runs the loop...
+*/
+static THREADPROC(LogRotateThread)
+{
+  ((CTwnDsmLogImpl*)_pv)->RotateLoop();
+  return 0;
+}
+
+
+
+/**
+* Expand the template and open the file.  If we can't, we say so
+* on stderr and turn logging off...
+*/
+void CTwnDsmLogImpl::Open(const char* const _szAppName)
+{
+  char *pszIn;
+  char *pszOut;
+  char *pszEnd;
+  char  szDate[16];
+  int   ii;
+
+  // Today's date...
+  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+    SYSTEMTIME st;
+    GetLocalTime(&st);
+    SSNPRINTF(szDate,NCHARS(szDate),NCHARS(szDate),"%04d%02d%02d",(int)st.wYear,(int)st.wMonth,(int)st.wDay);
+  #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+    time_t t = time(0);
+    tm tm;
+    localtime_r(&t,&tm);
+    SSNPRINTF(szDate,NCHARS(szDate),NCHARS(szDate),"%04d%02d%02d",tm.tm_year + 1900,tm.tm_mon + 1,tm.tm_mday);
+  #else
+    #error Sorry, we do not recognize this system...
+  #endif
+
+  // Expand the template, leave room for the ".N" Shift puts on the end...
+  pszOut = pod.m_logpath;
+  pszEnd = &pod.m_logpath[NCHARS(pod.m_logpath) - 8];
+  for (pszIn = pod.m_logtemplate; *pszIn && (pszOut < pszEnd); pszIn++)
+  {
+    if ((pszIn[0] != '%') || (0 == pszIn[1]))
+    {
+      *pszOut++ = *pszIn;
+      continue;
+    }
+    pszIn++;
+    switch (*pszIn)
+    {
+      case 'p':
+        SSNPRINTF(pszOut,pszEnd - pszOut,pszEnd - pszOut,"%u",(UINT)GETPROCESSID());
+        pszOut += strlen(pszOut);
+        break;
+      case 'd':
+        SSNPRINTF(pszOut,pszEnd - pszOut,pszEnd - pszOut,"%s",szDate);
+        pszOut += strlen(pszOut);
+        break;
+      case 'n':
+        // Only the characters that are safe in a filename everywhere...
+        for (ii = 0; _szAppName && _szAppName[ii] && (ii < 32) && (pszOut < pszEnd); ii++)
+        {
+          char c = _szAppName[ii];
+          *pszOut++ = (   ((c >= 'a') && (c <= 'z'))
+                       || ((c >= 'A') && (c <= 'Z'))
+                       || ((c >= '0') && (c <= '9'))
+                       || (c == '-') || (c == '.')) ? c : '_';
+        }
+        break;
+      default:
+        *pszOut++ = *pszIn;
+        break;
+    }
+  }
+  *pszOut = 0;
+
+  FOPEN(pod.m_plog,pod.m_logpath,pod.m_logmode);
+  if (0 == pod.m_plog)
+  {
+    fprintf(stderr,"DSM: Error - logging has been disabled because logfile could not be opened: file=<%s>, mode=<%s>, errno=%d\r\n",pod.m_logpath,pod.m_logmode,errno);
+    pod.m_logtemplate[0] = 0;
+    return;
+  }
+
+  // Start the rotation thread, if we need one...
+  if (pod.m_maxsize > 0)
+  {
+    pod.m_bThread = THREADCREATE(pod.m_thread,LogRotateThread,this);
+    if (!pod.m_bThread)
+    {
+      fprintf(stderr,"DSM: Error - unable to start the log rotation thread, the log will not be rotated\r\n");
+    }
+  }
+}
+
+
+
+/**
+* Keep the message in a buffer until the file is open.  If we run
+* out of room, we just count what we lose...
+*/
+void CTwnDsmLogImpl::Pend(const char* const _szMessage)
+{
+  UINT nChars = (UINT)strlen(_szMessage);
+
+  if (   (0 == pod.m_pending)
+      || ((pod.m_npending + nChars + 2) > TWNDSM_MAX_PENDING))
+  {
+    pod.m_ndropped++;
+    return;
+  }
+
+  memcpy(&pod.m_pending[pod.m_npending],_szMessage,nChars);
+  memcpy(&pod.m_pending[pod.m_npending + nChars],"\r\n",2);
+  pod.m_npending += nChars + 2;
+}
+
+
+
+/**
+* Wait for Log to tell us the file is too big.  On Linux and the Mac
+* we can rename a file that's open, so Log keeps writing while we shift
+* the old files, and only waits for us to swap in the new one.  Windows
+* won't let us do that, so there we hold the lock for the whole thing...
+*/
+void CTwnDsmLogImpl::RotateLoop()
+{
+  MUTEXLOCK(pod.m_mutex);
+  for (;;)
+  {
+    while (!pod.m_bRotate && !pod.m_bQuit)
+    {
+      CONDWAIT(pod.m_cond,pod.m_mutex);
+    }
+    if (pod.m_bQuit)
+    {
+      break;
+    }
+
+    #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+      fclose(pod.m_plog);
+      pod.m_plog = 0;
+      Shift();
+      FOPEN(pod.m_plog,pod.m_logpath,"w");
+      if (0 == pod.m_plog)
+      {
+        fprintf(stderr,"DSM: Error - logging has been disabled because logfile could not be opened: file=<%s>, errno=%d\r\n",pod.m_logpath,errno);
+        pod.m_logtemplate[0] = 0;
+        break;
+      }
+    #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+      FILE *plog;
+      MUTEXUNLOCK(pod.m_mutex);
+      Shift();
+      FOPEN(plog,pod.m_logpath,"w");
+      MUTEXLOCK(pod.m_mutex);
+      if (0 == plog)
+      {
+        // Keep writing to the old one, it's better than nothing...
+        fprintf(stderr,"DSM: Error - log rotation has been disabled because logfile could not be opened: file=<%s>, errno=%d\r\n",pod.m_logpath,errno);
+        pod.m_maxsize = 0;
+        pod.m_bRotate = false;
+        break;
+      }
+      fclose(pod.m_plog);
+      pod.m_plog = plog;
+    #else
+      #error Sorry, we do not recognize this system...
+    #endif
+
+    pod.m_bRotate = false;
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+}
+
+
+
+/**
+* With a count of zero there are no old files, we just start over...
+*/
+void CTwnDsmLogImpl::Shift()
+{
+  char szFrom[FILENAME_MAX];
+  char szTo[FILENAME_MAX];
+  int  ii;
+
+  if (pod.m_count <= 0)
+  {
+    UNLINK(pod.m_logpath);
+    return;
+  }
+
+  SSNPRINTF(szTo,NCHARS(szTo),NCHARS(szTo),"%s.%d",pod.m_logpath,pod.m_count);
+  UNLINK(szTo);
+  for (ii = pod.m_count - 1; ii >= 1; ii--)
+  {
+    SSNPRINTF(szFrom,NCHARS(szFrom),NCHARS(szFrom),"%s.%d",pod.m_logpath,ii);
+    SSNPRINTF(szTo,NCHARS(szTo),NCHARS(szTo),"%s.%d",pod.m_logpath,ii + 1);
+    rename(szFrom,szTo);
+  }
+  SSNPRINTF(szTo,NCHARS(szTo),NCHARS(szTo),"%s.1",pod.m_logpath);
+  rename(pod.m_logpath,szTo);
 }
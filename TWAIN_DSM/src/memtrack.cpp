@@ -0,0 +1,861 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+
+/**
+* @file memtrack.cpp
+* Memory tracking.
+* Tag the handles from DSM_MemAllocate with the application and driver
+* that asked for them, so we can say who's leaking.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* Enviroment varible to turn tracking on.  Set it to 1, or to N to
+* remember the call site of every Nth allocation instead of every
+* 64th...
+* @see CTwnDsmMemTrack
+*/
+#define kMEMTRACKENV "TWAINDSM_MEMTRACK"
+
+/**
+* The handle table is split up, each piece with its own lock, so
+* threads don't line up behind each other.  Must be a power of two...
+* @see CTwnDsmMemTrack
+*/
+#define MEMTRACK_STRIPES 64
+
+/**
+* Number of application/driver pairs we can keep counters for.  Must
+* be a power of two...
+* @see CTwnDsmMemTrack
+*/
+#define MEMTRACK_OWNERS 256
+
+/**
+* How many call sites a report lists...
+* @see CTwnDsmMemTrack
+*/
+#define MEMTRACK_SITES 8
+
+/**
+* How many call sites we keep names for.  We name a site the first
+* time we sample it, because by the time we report, the driver it's
+* in has usually been unloaded...
+* @see CTwnDsmMemTrack
+*/
+#define MEMTRACK_SITENAMES 64
+
+/**
+* How an owner is packed into a UINT: the top bit is set while the
+* thread is inside of DSM_Entry, then 15 bits of application id and
+* 16 bits of driver id...
+* @see CTwnDsmMemTrack
+*/
+#define MEMTRACK_INSIDE 0x80000000
+#define MEMTRACK_APPMASK 0x7FFF0000
+#define MEMTRACK_OWNER(app,ds) ((((UINT)(app) << 16) & MEMTRACK_APPMASK) | ((UINT)(ds) & 0xFFFF))
+
+
+
+/**
+* One handle...
+*/
+typedef struct
+{
+  void *pHandle;  /**< the handle, NULL if the slot is empty */
+  void *pSite;    /**< who allocated it, NULL if it wasn't sampled */
+  UINT  Bytes;    /**< its size */
+  UINT  Owner;    /**< MEMTRACK_OWNER */
+  UINT  Locks;    /**< DSM_MemLock calls less DSM_MemUnlock calls */
+} MEMTRACK_ENTRY;
+
+/**
+* A piece of the handle table, an open addressed hash table with
+* linear probing...
+*/
+typedef struct
+{
+  MUTEX           mutex;    /**< guards the rest */
+  MEMTRACK_ENTRY *aentry;   /**< the slots */
+  UINT            nSize;    /**< number of slots, a power of two */
+  UINT            nCount;   /**< number of slots in use */
+} MEMTRACK_STRIPE;
+
+/**
+* The counters for an owner.  The key is the owner plus one, so that
+* zero means the row is free...
+*/
+typedef struct
+{
+  volatile UINT   Key;      /**< MEMTRACK_OWNER + 1 */
+  volatile UINT   Handles;  /**< handles still out */
+  volatile UINT64 Bytes;    /**< bytes still out */
+  volatile UINT64 Peak;     /**< the most Bytes has ever been */
+  volatile UINT64 Allocs;   /**< every allocation */
+} MEMTRACK_OWNERROW;
+
+/**
+* A call site, when we're putting a report together...
+*/
+typedef struct
+{
+  void   *pSite;    /**< the address */
+  UINT    Handles;  /**< handles still out from here */
+  UINT64  Bytes;    /**< bytes still out from here */
+} MEMTRACK_SITE;
+
+/**
+* A call site's name...
+*/
+typedef struct
+{
+  void *pSite;       /**< the address */
+  char  szName[96];  /**< module+offset */
+} MEMTRACK_SITENAME;
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmMemTrackImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmMemTrackImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Hash a handle...
+    * @param[in] _pv the handle
+    * @return the hash, the low bits pick the stripe
+    */
+    static UINT Hash(const void *_pv)
+    {
+      return (UINT)((((UINT64)(size_t)_pv >> 4) * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+
+    /**
+    * Find the counters for an owner, adding them if we need to...
+    * @param[in] _owner the owner
+    * @return the row, or NULL if the table is full
+    */
+    MEMTRACK_OWNERROW *FindOwner(const UINT _owner);
+
+    /**
+    * Take a handle out of a stripe, you must be holding its lock...
+    * @param[in] _pstripe the stripe
+    * @param[in] _pHandle the handle
+    * @param[out] _pentry what we took out
+    * @return true if it was there
+    */
+    bool Remove(MEMTRACK_STRIPE *_pstripe,
+                const void      *_pHandle,
+                MEMTRACK_ENTRY  *_pentry);
+
+    /**
+    * Name a call site, if we haven't already...
+    * @param[in] _pSite the address
+    */
+    void NameSite(void *_pSite);
+
+    /**
+    * Get the name of a call site...
+    * @param[out] _szSite where to put it
+    * @param[in] _nChars the size of _szSite
+    * @param[in] _pSite the address
+    */
+    void GetSiteName(char       *_szSite,
+                     const int   _nChars,
+                     void       *_pSite);
+
+    /**
+    * Log one row of counters, and where its handles came from...
+    * @param[in] _prow the row
+    * @param[in] _szAppName the application's name
+    * @param[in] _szDsName the driver's name, or NULL
+    */
+    void ReportRow(const MEMTRACK_OWNERROW *_prow,
+                   const char              *_szAppName,
+                   const char              *_szDsName);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      bool              m_bEnabled;                    /**< TWAINDSM_MEMTRACK is set */
+      bool              m_bKey;                        /**< m_key is good */
+      TLSKEY            m_key;                         /**< each thread's owner */
+      UINT              m_nSample;                     /**< remember every Nth call site */
+      volatile UINT     m_nAllocs;                     /**< counts allocations for sampling */
+      MEMTRACK_STRIPE   m_astripe[MEMTRACK_STRIPES];   /**< the handles */
+      MEMTRACK_OWNERROW m_aowner[MEMTRACK_OWNERS];     /**< the counters */
+      MUTEX             m_mutexSites;                  /**< guards the site names */
+      UINT              m_nSiteNames;                  /**< how many we have */
+      MEMTRACK_SITENAME m_asitename[MEMTRACK_SITENAMES]; /**< the site names */
+    } pod;    /**< Pieces of data for CTwnDsmMemTrackImpl*/
+};
+
+
+
+/**
+* Turn a code address into something a person can look up, like
+* libfoo.so+0x1234...
+*/
+static void StringFromSite(char       *_szSite,
+                           const int   _nChars,
+                           void       *_pSite)
+{
+  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+    HMODULE hmodule = 0;
+    char    szPath[FILENAME_MAX];
+    if (   ::GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,(LPCSTR)_pSite,&hmodule)
+        && ::GetModuleFileNameA(hmodule,szPath,NCHARS(szPath)))
+    {
+      const char *szName = strrchr(szPath,PATH_SEPERATOR);
+      SSNPRINTF(_szSite,_nChars,_nChars,"%s+0x%lx",szName ? szName + 1 : szPath,(unsigned long)((char*)_pSite - (char*)hmodule));
+      return;
+    }
+
+  #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+    Dl_info dlinfo;
+    if (dladdr(_pSite,&dlinfo) && dlinfo.dli_fname)
+    {
+      const char *szName = strrchr(dlinfo.dli_fname,PATH_SEPERATOR);
+      SSNPRINTF(_szSite,_nChars,_nChars,"%s+0x%lx",szName ? szName + 1 : dlinfo.dli_fname,(unsigned long)((char*)_pSite - (char*)dlinfo.dli_fbase));
+      return;
+    }
+
+  #else
+    #error Sorry, we do not recognize this system...
+  #endif
+
+  SSNPRINTF(_szSite,_nChars,_nChars,"%p",_pSite);
+}
+
+
+
+/**
+* The constructor for our class...
+*/
+CTwnDsmMemTrack::CTwnDsmMemTrack()
+{
+  char szEnv[32];
+  int  ii;
+
+  m_ptwndsmmemtrackimpl = new CTwnDsmMemTrackImpl;
+  for (ii = 0; ii < MEMTRACK_STRIPES; ii++)
+  {
+    MUTEXINIT(m_ptwndsmmemtrackimpl->pod.m_astripe[ii].mutex);
+  }
+  MUTEXINIT(m_ptwndsmmemtrackimpl->pod.m_mutexSites);
+
+  SGETENV(szEnv,NCHARS(szEnv),kMEMTRACKENV);
+  if (szEnv[0] && strcmp(szEnv,"0"))
+  {
+    m_ptwndsmmemtrackimpl->pod.m_bKey = TLSCREATE(m_ptwndsmmemtrackimpl->pod.m_key,0);
+    if (!m_ptwndsmmemtrackimpl->pod.m_bKey)
+    {
+      kLOG((kLOGERR,"unable to get a TLS key, memory tracking is off..."));
+      return;
+    }
+    m_ptwndsmmemtrackimpl->pod.m_nSample = (UINT)atoi(szEnv);
+    if (m_ptwndsmmemtrackimpl->pod.m_nSample <= 1)
+    {
+      m_ptwndsmmemtrackimpl->pod.m_nSample = 64;
+    }
+    m_ptwndsmmemtrackimpl->pod.m_bEnabled = true;
+    kLOG((kLOGINFO,"memory tracking is on, sampling every %u allocations",m_ptwndsmmemtrackimpl->pod.m_nSample));
+  }
+}
+
+
+
+/**
+* The destructor for our class...
+*/
+CTwnDsmMemTrack::~CTwnDsmMemTrack()
+{
+  int ii;
+
+  if (m_ptwndsmmemtrackimpl)
+  {
+    if (m_ptwndsmmemtrackimpl->pod.m_bKey)
+    {
+      TLSDELETE(m_ptwndsmmemtrackimpl->pod.m_key);
+    }
+    for (ii = 0; ii < MEMTRACK_STRIPES; ii++)
+    {
+      if (m_ptwndsmmemtrackimpl->pod.m_astripe[ii].aentry)
+      {
+        free(m_ptwndsmmemtrackimpl->pod.m_astripe[ii].aentry);
+      }
+      MUTEXDESTROY(m_ptwndsmmemtrackimpl->pod.m_astripe[ii].mutex);
+    }
+    MUTEXDESTROY(m_ptwndsmmemtrackimpl->pod.m_mutexSites);
+    delete m_ptwndsmmemtrackimpl;
+    m_ptwndsmmemtrackimpl = 0;
+  }
+}
+
+
+
+/**
+* TWAINDSM_MEMTRACK is set...
+*/
+bool CTwnDsmMemTrack::IsEnabled()
+{
+  return m_ptwndsmmemtrackimpl->pod.m_bEnabled;
+}
+
+
+
+/**
+* The owner lives in the thread's TLS slot, packed into the pointer,
+* so there's nothing to allocate or clean up...
+*/
+UINT CTwnDsmMemTrack::Enter(const TWID_T _AppId,
+                            const TWID_T _DsId)
+{
+  UINT uPrevious;
+
+  if (!m_ptwndsmmemtrackimpl->pod.m_bEnabled)
+  {
+    return 0;
+  }
+  uPrevious = (UINT)(size_t)TLSGET(m_ptwndsmmemtrackimpl->pod.m_key);
+  TLSSET(m_ptwndsmmemtrackimpl->pod.m_key,(void*)(size_t)(MEMTRACK_INSIDE | MEMTRACK_OWNER(_AppId,_DsId)));
+  return uPrevious;
+}
+
+
+
+/**
+* If we're going back into an outer DSM_Entry call (we're in a
+* callback) put its owner back.  If we're going back to the
+* application, anything it allocates from here on is its own...
+*/
+void CTwnDsmMemTrack::Leave(const UINT _uCookie)
+{
+  UINT uCurrent;
+
+  if (!m_ptwndsmmemtrackimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+  if (_uCookie & MEMTRACK_INSIDE)
+  {
+    TLSSET(m_ptwndsmmemtrackimpl->pod.m_key,(void*)(size_t)_uCookie);
+  }
+  else
+  {
+    uCurrent = (UINT)(size_t)TLSGET(m_ptwndsmmemtrackimpl->pod.m_key);
+    TLSSET(m_ptwndsmmemtrackimpl->pod.m_key,(void*)(size_t)(uCurrent & MEMTRACK_APPMASK));
+  }
+}
+
+
+
+/**
+* Add the handle to its stripe, growing the stripe if it's half
+* full, and charge it to the owner...
+*/
+void CTwnDsmMemTrack::Allocate(const TW_HANDLE  _handle,
+                               const TW_UINT32  _bytes,
+                               void            *_pSite)
+{
+  MEMTRACK_ENTRY     entry;
+  MEMTRACK_ENTRY     entryOld;
+  MEMTRACK_STRIPE   *pstripe;
+  MEMTRACK_OWNERROW *prow;
+  UINT               hash;
+  UINT               ii;
+  bool               bOld;
+
+  if (!m_ptwndsmmemtrackimpl->pod.m_bEnabled || (0 == _handle))
+  {
+    return;
+  }
+
+  memset(&entry,0,sizeof(entry));
+  entry.pHandle = (void*)_handle;
+  entry.Bytes   = _bytes;
+  entry.Owner   = (UINT)(size_t)TLSGET(m_ptwndsmmemtrackimpl->pod.m_key) & ~MEMTRACK_INSIDE;
+  if (0 == (ATOMICADD32(&m_ptwndsmmemtrackimpl->pod.m_nAllocs,1) % m_ptwndsmmemtrackimpl->pod.m_nSample))
+  {
+    entry.pSite = _pSite;
+    m_ptwndsmmemtrackimpl->NameSite(_pSite);
+  }
+
+  hash = CTwnDsmMemTrackImpl::Hash(entry.pHandle);
+  pstripe = &m_ptwndsmmemtrackimpl->pod.m_astripe[hash & (MEMTRACK_STRIPES - 1)];
+  hash /= MEMTRACK_STRIPES;
+
+  MUTEXLOCK(pstripe->mutex);
+
+  // The handle was freed behind our back (with free or GlobalFree)
+  // and the address came around again...
+  bOld = m_ptwndsmmemtrackimpl->Remove(pstripe,entry.pHandle,&entryOld);
+
+  // Grow...
+  if ((pstripe->nCount + 1) * 2 > pstripe->nSize)
+  {
+    UINT            nSize = pstripe->nSize ? (pstripe->nSize * 2) : 64;
+    MEMTRACK_ENTRY *aentry = (MEMTRACK_ENTRY*)calloc(nSize,sizeof(MEMTRACK_ENTRY));
+    if (0 == aentry)
+    {
+      MUTEXUNLOCK(pstripe->mutex);
+      kLOG((kLOGERR,"unable to grow the memory tracking table..."));
+      return;
+    }
+    for (ii = 0; ii < pstripe->nSize; ii++)
+    {
+      if (pstripe->aentry[ii].pHandle)
+      {
+        UINT jj = (CTwnDsmMemTrackImpl::Hash(pstripe->aentry[ii].pHandle) / MEMTRACK_STRIPES) & (nSize - 1);
+        while (aentry[jj].pHandle)
+        {
+          jj = (jj + 1) & (nSize - 1);
+        }
+        aentry[jj] = pstripe->aentry[ii];
+      }
+    }
+    if (pstripe->aentry)
+    {
+      free(pstripe->aentry);
+    }
+    pstripe->aentry = aentry;
+    pstripe->nSize = nSize;
+  }
+
+  // Add...
+  for (ii = hash & (pstripe->nSize - 1); pstripe->aentry[ii].pHandle; ii = (ii + 1) & (pstripe->nSize - 1))
+  {
+    // just looking for an empty slot...
+  }
+  pstripe->aentry[ii] = entry;
+  pstripe->nCount++;
+
+  MUTEXUNLOCK(pstripe->mutex);
+
+  // Settle up with the owners...
+  if (bOld && (0 != (prow = m_ptwndsmmemtrackimpl->FindOwner(entryOld.Owner))))
+  {
+    ATOMICADD32(&prow->Handles,(UINT)-1);
+    ATOMICADD64(&prow->Bytes,(UINT64)0 - entryOld.Bytes);
+  }
+  prow = m_ptwndsmmemtrackimpl->FindOwner(entry.Owner);
+  if (prow)
+  {
+    UINT64 bytes;
+    UINT64 peak;
+    ATOMICADD32(&prow->Handles,1);
+    ATOMICADD64(&prow->Allocs,1);
+    bytes = ATOMICADD64(&prow->Bytes,(UINT64)_bytes) + _bytes;
+    for (peak = prow->Peak; (bytes > peak) && !ATOMICCAS64(&prow->Peak,peak,bytes); peak = prow->Peak)
+    {
+      // somebody else moved the peak, try again...
+    }
+  }
+}
+
+
+
+/**
+* Take the handle out of the table, and give the owner credit.  We
+* don't complain about handles we don't know, they could have been
+* allocated before we started...
+*/
+void CTwnDsmMemTrack::Free(const TW_HANDLE _handle)
+{
+  MEMTRACK_ENTRY     entry;
+  MEMTRACK_STRIPE   *pstripe;
+  MEMTRACK_OWNERROW *prow;
+  bool               bFound;
+
+  if (!m_ptwndsmmemtrackimpl->pod.m_bEnabled || (0 == _handle))
+  {
+    return;
+  }
+
+  pstripe = &m_ptwndsmmemtrackimpl->pod.m_astripe[CTwnDsmMemTrackImpl::Hash((void*)_handle) & (MEMTRACK_STRIPES - 1)];
+  MUTEXLOCK(pstripe->mutex);
+  bFound = m_ptwndsmmemtrackimpl->Remove(pstripe,(void*)_handle,&entry);
+  MUTEXUNLOCK(pstripe->mutex);
+
+  if (bFound && (0 != (prow = m_ptwndsmmemtrackimpl->FindOwner(entry.Owner))))
+  {
+    ATOMICADD32(&prow->Handles,(UINT)-1);
+    ATOMICADD64(&prow->Bytes,(UINT64)0 - entry.Bytes);
+  }
+}
+
+
+
+/**
+* Bump the lock count...
+*/
+void CTwnDsmMemTrack::Lock(const TW_HANDLE _handle,
+                           const bool      _bLock)
+{
+  MEMTRACK_STRIPE *pstripe;
+  UINT             hash;
+  UINT             ii;
+
+  if (!m_ptwndsmmemtrackimpl->pod.m_bEnabled || (0 == _handle))
+  {
+    return;
+  }
+
+  hash = CTwnDsmMemTrackImpl::Hash((void*)_handle);
+  pstripe = &m_ptwndsmmemtrackimpl->pod.m_astripe[hash & (MEMTRACK_STRIPES - 1)];
+  hash /= MEMTRACK_STRIPES;
+
+  MUTEXLOCK(pstripe->mutex);
+  if (pstripe->nSize)
+  {
+    for (ii = hash & (pstripe->nSize - 1); pstripe->aentry[ii].pHandle; ii = (ii + 1) & (pstripe->nSize - 1))
+    {
+      if (pstripe->aentry[ii].pHandle == (void*)_handle)
+      {
+        if (_bLock)
+        {
+          pstripe->aentry[ii].Locks++;
+        }
+        else if (pstripe->aentry[ii].Locks)
+        {
+          pstripe->aentry[ii].Locks--;
+        }
+        break;
+      }
+    }
+  }
+  MUTEXUNLOCK(pstripe->mutex);
+}
+
+
+
+/**
+* One row, for the driver...
+*/
+void CTwnDsmMemTrack::ReportDs(const TWID_T  _AppId,
+                               const char   *_szAppName,
+                               const TWID_T  _DsId,
+                               const char   *_szDsName)
+{
+  MEMTRACK_OWNERROW *prow;
+
+  if (!m_ptwndsmmemtrackimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+  prow = m_ptwndsmmemtrackimpl->FindOwner(MEMTRACK_OWNER(_AppId,_DsId));
+  if (prow)
+  {
+    m_ptwndsmmemtrackimpl->ReportRow(prow,_szAppName,_szDsName);
+  }
+}
+
+
+
+/**
+* Every row that belongs to the application, including its own...
+*/
+void CTwnDsmMemTrack::ReportApp(const TWID_T  _AppId,
+                                const char   *_szAppName)
+{
+  int ii;
+
+  if (!m_ptwndsmmemtrackimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+  for (ii = 0; ii < MEMTRACK_OWNERS; ii++)
+  {
+    MEMTRACK_OWNERROW *prow = &m_ptwndsmmemtrackimpl->pod.m_aowner[ii];
+    if (prow->Key && (((prow->Key - 1) & MEMTRACK_APPMASK) == (MEMTRACK_OWNER(_AppId,0))))
+    {
+      m_ptwndsmmemtrackimpl->ReportRow(prow,_szAppName,0);
+    }
+  }
+}
+
+
+
+/**
+* Linear probing.  Rows are never given back, so if we hit an
+* empty one the key isn't in the table...
+*/
+MEMTRACK_OWNERROW *CTwnDsmMemTrackImpl::FindOwner(const UINT _owner)
+{
+  UINT ii;
+  UINT key = _owner + 1;
+  UINT hash = (UINT)((key * 0x9E3779B97F4A7C15ULL) >> 40);
+
+  for (ii = 0; ii < MEMTRACK_OWNERS; ii++)
+  {
+    MEMTRACK_OWNERROW *prow = &pod.m_aowner[(hash + ii) & (MEMTRACK_OWNERS - 1)];
+    if (prow->Key == key)
+    {
+      return prow;
+    }
+    if (0 == prow->Key)
+    {
+      // Somebody may beat us to it, and it may even be for our key...
+      if (ATOMICCAS32(&prow->Key,(UINT)0,key) || (prow->Key == key))
+      {
+        return prow;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+
+/**
+* Linear probing means we can't just empty the slot, or we'd cut off
+* anything that probed past it.  So we pull back the entries after it
+* that are allowed to move...
+*/
+bool CTwnDsmMemTrackImpl::Remove(MEMTRACK_STRIPE *_pstripe,
+                                 const void      *_pHandle,
+                                 MEMTRACK_ENTRY  *_pentry)
+{
+  UINT mask;
+  UINT ii;
+  UINT jj;
+  UINT home;
+
+  if (0 == _pstripe->nSize)
+  {
+    return false;
+  }
+  mask = _pstripe->nSize - 1;
+
+  for (ii = (Hash(_pHandle) / MEMTRACK_STRIPES) & mask; _pstripe->aentry[ii].pHandle != _pHandle; ii = (ii + 1) & mask)
+  {
+    if (0 == _pstripe->aentry[ii].pHandle)
+    {
+      return false;
+    }
+  }
+  *_pentry = _pstripe->aentry[ii];
+
+  for (jj = (ii + 1) & mask; _pstripe->aentry[jj].pHandle; jj = (jj + 1) & mask)
+  {
+    // An entry can move back to ii, if ii isn't before its home...
+    home = (Hash(_pstripe->aentry[jj].pHandle) / MEMTRACK_STRIPES) & mask;
+    if (((jj - home) & mask) >= ((jj - ii) & mask))
+    {
+      _pstripe->aentry[ii] = _pstripe->aentry[jj];
+      ii = jj;
+    }
+  }
+  memset(&_pstripe->aentry[ii],0,sizeof(MEMTRACK_ENTRY));
+  _pstripe->nCount--;
+
+  return true;
+}
+
+
+
+/**
+* Log the counters, then walk the handles to see which call sites
+* the ones still out came from.  This is slow, but it only happens
+* when things are closing...
+*/
+void CTwnDsmMemTrackImpl::ReportRow(const MEMTRACK_OWNERROW *_prow,
+                                    const char              *_szAppName,
+                                    const char              *_szDsName)
+{
+  MEMTRACK_SITE asite[MEMTRACK_SITES];
+  UINT          owner = _prow->Key - 1;
+  UINT          nSites = 0;
+  UINT          nUnsampled = 0;
+  UINT          nLocked = 0;
+  UINT          ii;
+  UINT          jj;
+  UINT          ss;
+  char          szDs[64];
+  char          szSite[FILENAME_MAX];
+
+  if (_szDsName)
+  {
+    SSNPRINTF(szDs,NCHARS(szDs),NCHARS(szDs),"%.32s",_szDsName);
+  }
+  else if (owner & 0xFFFF)
+  {
+    SSNPRINTF(szDs,NCHARS(szDs),NCHARS(szDs),"driver %u",owner & 0xFFFF);
+  }
+  else
+  {
+    SSTRCPY(szDs,NCHARS(szDs),"itself");
+  }
+
+  kLOG((kLOGINFO,"memtrack: %.32s / %s: %u handles (%llu bytes) still out, peak %llu bytes, %llu allocations",
+        _szAppName,
+        szDs,
+        (unsigned int)_prow->Handles,
+        (unsigned long long)_prow->Bytes,
+        (unsigned long long)_prow->Peak,
+        (unsigned long long)_prow->Allocs));
+  if (0 == _prow->Handles)
+  {
+    return;
+  }
+
+  // Gather up the call sites...
+  memset(asite,0,sizeof(asite));
+  for (ss = 0; ss < MEMTRACK_STRIPES; ss++)
+  {
+    MEMTRACK_STRIPE *pstripe = &pod.m_astripe[ss];
+    MUTEXLOCK(pstripe->mutex);
+    for (ii = 0; ii < pstripe->nSize; ii++)
+    {
+      MEMTRACK_ENTRY *pentry = &pstripe->aentry[ii];
+      if ((0 == pentry->pHandle) || (pentry->Owner != owner))
+      {
+        continue;
+      }
+      if (pentry->Locks)
+      {
+        nLocked++;
+      }
+      if (0 == pentry->pSite)
+      {
+        nUnsampled++;
+        continue;
+      }
+      for (jj = 0; (jj < nSites) && (asite[jj].pSite != pentry->pSite); jj++)
+      {
+        // looking for the site...
+      }
+      if (jj == nSites)
+      {
+        if (nSites == MEMTRACK_SITES)
+        {
+          nUnsampled++;
+          continue;
+        }
+        asite[nSites++].pSite = pentry->pSite;
+      }
+      asite[jj].Handles++;
+      asite[jj].Bytes += pentry->Bytes;
+    }
+    MUTEXUNLOCK(pstripe->mutex);
+  }
+
+  for (jj = 0; jj < nSites; jj++)
+  {
+    GetSiteName(szSite,NCHARS(szSite),asite[jj].pSite);
+    kLOG((kLOGINFO,"memtrack:   %u handles (%llu bytes) from %s",
+          asite[jj].Handles,
+          (unsigned long long)asite[jj].Bytes,
+          szSite));
+  }
+  if (nUnsampled)
+  {
+    kLOG((kLOGINFO,"memtrack:   %u handles not sampled",nUnsampled));
+  }
+  if (nLocked)
+  {
+    kLOG((kLOGINFO,"memtrack:   %u handles still locked",nLocked));
+  }
+}
+
+
+
+/**
+* There are only a handful of places that allocate, so a quick walk
+* is fine...
+*/
+void CTwnDsmMemTrackImpl::NameSite(void *_pSite)
+{
+  UINT ii;
+
+  MUTEXLOCK(pod.m_mutexSites);
+  for (ii = 0; ii < pod.m_nSiteNames; ii++)
+  {
+    if (pod.m_asitename[ii].pSite == _pSite)
+    {
+      MUTEXUNLOCK(pod.m_mutexSites);
+      return;
+    }
+  }
+  if (pod.m_nSiteNames < MEMTRACK_SITENAMES)
+  {
+    pod.m_asitename[pod.m_nSiteNames].pSite = _pSite;
+    StringFromSite(pod.m_asitename[pod.m_nSiteNames].szName,NCHARS(pod.m_asitename[pod.m_nSiteNames].szName),_pSite);
+    pod.m_nSiteNames++;
+  }
+  MUTEXUNLOCK(pod.m_mutexSites);
+}
+
+
+
+/**
+* If we didn't have room to name it, try now...
+*/
+void CTwnDsmMemTrackImpl::GetSiteName(char       *_szSite,
+                                      const int   _nChars,
+                                      void       *_pSite)
+{
+  UINT ii;
+
+  MUTEXLOCK(pod.m_mutexSites);
+  for (ii = 0; ii < pod.m_nSiteNames; ii++)
+  {
+    if (pod.m_asitename[ii].pSite == _pSite)
+    {
+      SSTRCPY(_szSite,_nChars,pod.m_asitename[ii].szName);
+      MUTEXUNLOCK(pod.m_mutexSites);
+      return;
+    }
+  }
+  MUTEXUNLOCK(pod.m_mutexSites);
+
+  StringFromSite(_szSite,_nChars,_pSite);
+}
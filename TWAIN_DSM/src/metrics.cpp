@@ -0,0 +1,601 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+/**
+* @file metrics.cpp
+* Metrics.
+* Keep call counts and latency histograms for every triplet that
+* goes through the Data Source Manager.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* Number of rows we can keep.  Must be a power of two.  Each row is
+* an application/driver/triplet, so this is a lot more than we expect
+* to ever see...
+* @see CTwnDsmMetrics
+*/
+#define TWNDSM_METRICS_ROWS 512
+
+/**
+* Number of sub-buckets per power of two, as a shift.  Three bits
+* gives us eight, which keeps any value within about 6% of the truth.
+* @see CTwnDsmMetrics
+*/
+#define TWNDSM_METRICS_SUBBITS 3
+
+/**
+* Number of buckets in a histogram.  With nanoseconds and three sub
+* bits, 320 buckets takes us past half an hour...
+* @see CTwnDsmMetrics
+*/
+#define TWNDSM_METRICS_BUCKETS 320
+
+
+
+/**
+* One row.  The key is all zeros until somebody claims it...
+*/
+typedef struct
+{
+  volatile UINT64 Key;                              /**< app, ds, dg, dat and msg packed together */
+  volatile UINT64 Calls;                            /**< how many times we've seen it */
+  volatile UINT64 Errors;                           /**< how many came back TWRC_FAILURE */
+  volatile UINT64 TotalNs;                          /**< for the mean */
+  volatile UINT64 MaxNs;                            /**< the worst one */
+  volatile UINT64 StampNs;                          /**< for the latency rows, when the wait started */
+  volatile UINT   aBucket[TWNDSM_METRICS_BUCKETS];  /**< the histogram */
+} METRICS_ROW;
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmMetricsImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmMetricsImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Pack the identity of a row into a key.  The app id is never zero,
+    * so neither is the key...
+    * @return the key
+    */
+    static UINT64 MakeKey(const TWID_T    _AppId,
+                          const TWID_T    _DsId,
+                          const TW_UINT32 _DG,
+                          const TW_UINT16 _DAT,
+                          const TW_UINT16 _MSG)
+    {
+      return ((UINT64)(_AppId & 0xFFFF) << 48)
+           | ((UINT64)(_DsId & 0xFF) << 40)
+           | ((UINT64)(_DG & 0xFF) << 32)
+           | ((UINT64)_DAT << 16)
+           | (UINT64)_MSG;
+    }
+
+    /**
+    * Find the row for a key, optionally claiming an empty one...
+    * @param[in] _key the key to find
+    * @param[in] _bCreate true if we should claim a row for a new key
+    * @return the row or NULL
+    */
+    METRICS_ROW *Find(const UINT64 _key,
+                      const bool   _bCreate);
+
+    /**
+    * Take the stamp from a latency row, so only one caller gets it...
+    * @param[in] _prow the row
+    * @param[in] _tickNow the time now
+    * @return how long ago the stamp was, or 0 if there wasn't one
+    */
+    static UINT64 TakeStamp(METRICS_ROW  *_prow,
+                            const UINT64  _tickNow)
+    {
+      UINT64 stamp;
+
+      do
+      {
+        stamp = _prow->StampNs;
+        if (0 == stamp)
+        {
+          return 0;
+        }
+      } while (!ATOMICCAS64(&_prow->StampNs,stamp,(UINT64)0));
+
+      return (_tickNow > stamp) ? (_tickNow - stamp) : 1;
+    }
+
+    /**
+    * Convert a latency to a bucket...
+    * @param[in] _ns the latency
+    * @return the bucket index
+    */
+    static int BucketFromNs(const UINT64 _ns);
+
+    /**
+    * Convert a bucket back to a latency, we use the middle of its range...
+    * @param[in] _bucket the bucket index
+    * @return the latency
+    */
+    static UINT64 NsFromBucket(const int _bucket);
+
+    /**
+    * Fill in a TW_TWDSM_METRICS from a row...
+    * @param[in] _prow the row
+    * @param[out] _pMetrics where it goes
+    */
+    static void Fill(const METRICS_ROW *_prow,
+                     TW_TWDSM_METRICS  *_pMetrics);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      METRICS_ROW *m_arow;      /**< the table, an open hash */
+      volatile UINT m_dropped;  /**< calls we couldn't record because the table was full */
+    } pod;    /**< Pieces of data for CTwnDsmMetricsImpl*/
+};
+
+
+
+/**
+* The constructor for our class.  The table is big enough that we
+* don't want it in the object itself...
+*/
+CTwnDsmMetrics::CTwnDsmMetrics()
+{
+  m_ptwndsmmetricsimpl = new CTwnDsmMetricsImpl;
+  m_ptwndsmmetricsimpl->pod.m_arow = (METRICS_ROW*)calloc(TWNDSM_METRICS_ROWS,sizeof(METRICS_ROW));
+  if (0 == m_ptwndsmmetricsimpl->pod.m_arow)
+  {
+    kLOG((kLOGERR,"Unable to allocate the metrics table, metrics are disabled..."));
+  }
+}
+
+
+
+/**
+* The destructor for our class...
+*/
+CTwnDsmMetrics::~CTwnDsmMetrics()
+{
+  if (m_ptwndsmmetricsimpl)
+  {
+    if (m_ptwndsmmetricsimpl->pod.m_dropped)
+    {
+      kLOG((kLOGINFO,"metrics table was full, %u calls were not recorded",m_ptwndsmmetricsimpl->pod.m_dropped));
+    }
+    if (m_ptwndsmmetricsimpl->pod.m_arow)
+    {
+      free(m_ptwndsmmetricsimpl->pod.m_arow);
+    }
+    delete m_ptwndsmmetricsimpl;
+    m_ptwndsmmetricsimpl = 0;
+  }
+}
+
+
+
+/**
+* Record a call.  This is on the hot path, so it's nothing but
+* atomic adds, and a compare-and-swap the first time we see a
+* triplet...
+*/
+void CTwnDsmMetrics::Record(const TWID_T    _AppId,
+                            const TWID_T    _DsId,
+                            const TW_UINT32 _DG,
+                            const TW_UINT16 _DAT,
+                            const TW_UINT16 _MSG,
+                            const UINT64    _ns,
+                            const TW_UINT16 _rc)
+{
+  METRICS_ROW *prow;
+  UINT64       maxns;
+
+  if ((0 == m_ptwndsmmetricsimpl->pod.m_arow) || (0 == _AppId))
+  {
+    return;
+  }
+
+  prow = m_ptwndsmmetricsimpl->Find(CTwnDsmMetricsImpl::MakeKey(_AppId,_DsId,_DG,_DAT,_MSG),true);
+  if (0 == prow)
+  {
+    ATOMICADD32(&m_ptwndsmmetricsimpl->pod.m_dropped,1);
+    return;
+  }
+
+  ATOMICADD64(&prow->Calls,1);
+  if (TWRC_FAILURE == _rc)
+  {
+    ATOMICADD64(&prow->Errors,1);
+  }
+  ATOMICADD64(&prow->TotalNs,_ns);
+  ATOMICADD32(&prow->aBucket[CTwnDsmMetricsImpl::BucketFromNs(_ns)],1);
+
+  // Only loop if we really have a new max...
+  maxns = prow->MaxNs;
+  while ((_ns > maxns) && !ATOMICCAS64(&prow->MaxNs,maxns,_ns))
+  {
+    maxns = prow->MaxNs;
+  }
+}
+
+
+
+/**
+* Look up one row...
+*/
+bool CTwnDsmMetrics::Get(TW_TWDSM_METRICS *_pMetrics)
+{
+  METRICS_ROW *prow;
+
+  if (0 == m_ptwndsmmetricsimpl->pod.m_arow)
+  {
+    return false;
+  }
+
+  prow = m_ptwndsmmetricsimpl->Find(CTwnDsmMetricsImpl::MakeKey(_pMetrics->AppId,
+                                                                _pMetrics->DsId,
+                                                                _pMetrics->DG,
+                                                                _pMetrics->DAT,
+                                                                _pMetrics->MSG),false);
+  if ((0 == prow) || (0 == prow->Calls))
+  {
+    return false;
+  }
+
+  m_ptwndsmmetricsimpl->Fill(prow,_pMetrics);
+  _pMetrics->Index = (TW_UINT32)(prow - m_ptwndsmmetricsimpl->pod.m_arow) + 1;
+  return true;
+}
+
+
+
+/**
+* Walk the table.  Index is one more than the row we last returned,
+* so zero starts at the top...
+*/
+bool CTwnDsmMetrics::GetNext(TW_TWDSM_METRICS *_pMetrics)
+{
+  TW_UINT32 ii;
+
+  if (0 == m_ptwndsmmetricsimpl->pod.m_arow)
+  {
+    return false;
+  }
+
+  for (ii = _pMetrics->Index; ii < TWNDSM_METRICS_ROWS; ii++)
+  {
+    METRICS_ROW *prow = &m_ptwndsmmetricsimpl->pod.m_arow[ii];
+    if ((0 != prow->Key) && (0 != prow->Calls))
+    {
+      m_ptwndsmmetricsimpl->Fill(prow,_pMetrics);
+      _pMetrics->Index = ii + 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+
+/**
+* Start the clock on a message.  If the same message is already
+* waiting we keep the older stamp, since that's the one the
+* application is going to get...
+*/
+void CTwnDsmMetrics::Notify(const TWID_T    _AppId,
+                            const TWID_T    _DsId,
+                            const TW_UINT16 _MSG)
+{
+  METRICS_ROW *prow;
+
+  if ((0 == m_ptwndsmmetricsimpl->pod.m_arow) || (0 == _AppId))
+  {
+    return;
+  }
+
+  prow = m_ptwndsmmetricsimpl->Find(CTwnDsmMetricsImpl::MakeKey(_AppId,_DsId,DG_CONTROL,DAT_TWDSM_DELIVER,_MSG),true);
+  if (0 == prow)
+  {
+    ATOMICADD32(&m_ptwndsmmetricsimpl->pod.m_dropped,1);
+    return;
+  }
+  (void)ATOMICCAS64(&prow->StampNs,(UINT64)0,DSM_GetTickNs());
+}
+
+
+
+/**
+* Stop the clock on a message, and start it on the transfer if it
+* was MSG_XFERREADY...
+*/
+UINT64 CTwnDsmMetrics::Deliver(const TWID_T    _AppId,
+                               const TWID_T    _DsId,
+                               const TW_UINT16 _MSG)
+{
+  METRICS_ROW *prow;
+  UINT64       tickNow;
+  UINT64       ns = 0;
+
+  if ((0 == m_ptwndsmmetricsimpl->pod.m_arow) || (0 == _AppId))
+  {
+    return 0;
+  }
+
+  tickNow = DSM_GetTickNs();
+  prow = m_ptwndsmmetricsimpl->Find(CTwnDsmMetricsImpl::MakeKey(_AppId,_DsId,DG_CONTROL,DAT_TWDSM_DELIVER,_MSG),false);
+  if (0 != prow)
+  {
+    ns = m_ptwndsmmetricsimpl->TakeStamp(prow,tickNow);
+    if (ns)
+    {
+      Record(_AppId,_DsId,DG_CONTROL,DAT_TWDSM_DELIVER,_MSG,ns,TWRC_SUCCESS);
+    }
+  }
+
+  if (MSG_XFERREADY == _MSG)
+  {
+    prow = m_ptwndsmmetricsimpl->Find(CTwnDsmMetricsImpl::MakeKey(_AppId,_DsId,DG_CONTROL,DAT_TWDSM_RESPOND,MSG_XFERREADY),true);
+    if (0 != prow)
+    {
+      prow->StampNs = tickNow;
+    }
+  }
+
+  return ns;
+}
+
+
+
+/**
+* Stop the clock on the application's answer to MSG_XFERREADY.  Only
+* the first DG_IMAGE triplet after it finds a stamp...
+*/
+UINT64 CTwnDsmMetrics::Transfer(const TWID_T _AppId,
+                                const TWID_T _DsId)
+{
+  METRICS_ROW *prow;
+  UINT64       ns;
+
+  if ((0 == m_ptwndsmmetricsimpl->pod.m_arow) || (0 == _AppId))
+  {
+    return 0;
+  }
+
+  prow = m_ptwndsmmetricsimpl->Find(CTwnDsmMetricsImpl::MakeKey(_AppId,_DsId,DG_CONTROL,DAT_TWDSM_RESPOND,MSG_XFERREADY),false);
+  if ((0 == prow) || (0 == prow->StampNs))
+  {
+    return 0;
+  }
+
+  ns = m_ptwndsmmetricsimpl->TakeStamp(prow,DSM_GetTickNs());
+  if (ns)
+  {
+    Record(_AppId,_DsId,DG_CONTROL,DAT_TWDSM_RESPOND,MSG_XFERREADY,ns,TWRC_SUCCESS);
+  }
+  return ns;
+}
+
+
+
+/**
+* Clear an application's rows.  We keep the keys, so the rows
+* stay claimed for the next application to get this id.  This
+* should only be done when the application isn't making calls...
+*/
+void CTwnDsmMetrics::Reset(const TWID_T _AppId)
+{
+  int ii;
+
+  if (0 == m_ptwndsmmetricsimpl->pod.m_arow)
+  {
+    return;
+  }
+
+  for (ii = 0; ii < TWNDSM_METRICS_ROWS; ii++)
+  {
+    METRICS_ROW *prow = &m_ptwndsmmetricsimpl->pod.m_arow[ii];
+    if ((prow->Key >> 48) == (UINT64)(_AppId & 0xFFFF))
+    {
+      UINT64 key = prow->Key;
+      memset((void*)prow,0,sizeof(*prow));
+      prow->Key = key;
+    }
+  }
+}
+
+
+
+/**
+* Linear probing.  Rows are never given back, so if we hit an
+* empty one the key isn't in the table...
+*/
+METRICS_ROW *CTwnDsmMetricsImpl::Find(const UINT64 _key,
+                                      const bool   _bCreate)
+{
+  UINT ii;
+  UINT hash;
+
+  hash = (UINT)((_key * 0x9E3779B97F4A7C15ULL) >> 40);
+  for (ii = 0; ii < TWNDSM_METRICS_ROWS; ii++)
+  {
+    METRICS_ROW *prow = &pod.m_arow[(hash + ii) & (TWNDSM_METRICS_ROWS - 1)];
+    if (prow->Key == _key)
+    {
+      return prow;
+    }
+    if (0 == prow->Key)
+    {
+      if (!_bCreate)
+      {
+        return 0;
+      }
+      // Somebody may beat us to it, and it may even be for our key...
+      if (ATOMICCAS64(&prow->Key,(UINT64)0,_key) || (prow->Key == _key))
+      {
+        return prow;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+
+/**
+* Values under 8 get their own bucket.  After that each power of two
+* is split into eight buckets...
+*/
+int CTwnDsmMetricsImpl::BucketFromNs(const UINT64 _ns)
+{
+  int    exponent;
+  int    bucket;
+  UINT64 ns = _ns;
+
+  if (ns < (1 << TWNDSM_METRICS_SUBBITS))
+  {
+    return (int)ns;
+  }
+
+  for (exponent = 0; (ns >> exponent) > 1; exponent++)
+  {
+    // just counting...
+  }
+
+  bucket = (1 << TWNDSM_METRICS_SUBBITS)
+         + ((exponent - TWNDSM_METRICS_SUBBITS) << TWNDSM_METRICS_SUBBITS)
+         + (int)((ns >> (exponent - TWNDSM_METRICS_SUBBITS)) & ((1 << TWNDSM_METRICS_SUBBITS) - 1));
+
+  return (bucket < TWNDSM_METRICS_BUCKETS) ? bucket : (TWNDSM_METRICS_BUCKETS - 1);
+}
+
+
+
+/**
+* The reverse of BucketFromNs...
+*/
+UINT64 CTwnDsmMetricsImpl::NsFromBucket(const int _bucket)
+{
+  int    exponent;
+  UINT64 mantissa;
+
+  if (_bucket < (1 << TWNDSM_METRICS_SUBBITS))
+  {
+    return (UINT64)_bucket;
+  }
+
+  exponent = ((_bucket - (1 << TWNDSM_METRICS_SUBBITS)) >> TWNDSM_METRICS_SUBBITS) + TWNDSM_METRICS_SUBBITS;
+  mantissa = (1 << TWNDSM_METRICS_SUBBITS) + (_bucket & ((1 << TWNDSM_METRICS_SUBBITS) - 1));
+
+  // The bottom of the bucket plus half its width...
+  return (mantissa << (exponent - TWNDSM_METRICS_SUBBITS))
+       + ((UINT64)1 << (exponent - TWNDSM_METRICS_SUBBITS)) / 2;
+}
+
+
+
+/**
+* Work out the percentiles.  We read the counters without a lock,
+* so a row that's being updated may be off by a call or two, which
+* is fine for this purpose...
+*/
+void CTwnDsmMetricsImpl::Fill(const METRICS_ROW *_prow,
+                              TW_TWDSM_METRICS  *_pMetrics)
+{
+  int    ii;
+  int    pp;
+  UINT64 calls;
+  UINT64 count;
+  UINT64 maxns;
+  UINT64 aThreshold[4];
+  UINT64 aNs[4];
+
+  _pMetrics->AppId = (TW_UINT32)(_prow->Key >> 48);
+  _pMetrics->DsId  = (TW_UINT32)((_prow->Key >> 40) & 0xFF);
+  _pMetrics->DG    = (TW_UINT32)((_prow->Key >> 32) & 0xFF);
+  _pMetrics->DAT   = (TW_UINT16)((_prow->Key >> 16) & 0xFFFF);
+  _pMetrics->MSG   = (TW_UINT16)(_prow->Key & 0xFFFF);
+
+  // Use the histogram's total, so the percentiles agree with each other...
+  calls = 0;
+  for (ii = 0; ii < TWNDSM_METRICS_BUCKETS; ii++)
+  {
+    calls += _prow->aBucket[ii];
+  }
+
+  _pMetrics->Calls  = (TW_UINT32)_prow->Calls;
+  _pMetrics->Errors = (TW_UINT32)_prow->Errors;
+  _pMetrics->MeanUs = calls ? (TW_UINT32)((_prow->TotalNs / calls) / 1000) : 0;
+  _pMetrics->MaxUs  = (TW_UINT32)(_prow->MaxNs / 1000);
+
+  // p50, p90, p99 and p99.9, rounded up so a single call counts...
+  aThreshold[0] = (calls * 500 + 999) / 1000;
+  aThreshold[1] = (calls * 900 + 999) / 1000;
+  aThreshold[2] = (calls * 990 + 999) / 1000;
+  aThreshold[3] = (calls * 999 + 999) / 1000;
+  memset(aNs,0,sizeof(aNs));
+  count = 0;
+  pp = 0;
+  for (ii = 0; (ii < TWNDSM_METRICS_BUCKETS) && (pp < 4); ii++)
+  {
+    count += _prow->aBucket[ii];
+    while ((pp < 4) && (count > 0) && (count >= aThreshold[pp]))
+    {
+      aNs[pp++] = NsFromBucket(ii);
+    }
+  }
+
+  // The histogram can't be worse than the max...
+  maxns = _prow->MaxNs;
+  _pMetrics->P50Us  = (TW_UINT32)(((aNs[0] < maxns) ? aNs[0] : maxns) / 1000);
+  _pMetrics->P90Us  = (TW_UINT32)(((aNs[1] < maxns) ? aNs[1] : maxns) / 1000);
+  _pMetrics->P99Us  = (TW_UINT32)(((aNs[2] < maxns) ? aNs[2] : maxns) / 1000);
+  _pMetrics->P999Us = (TW_UINT32)(((aNs[3] < maxns) ? aNs[3] : maxns) / 1000);
+}
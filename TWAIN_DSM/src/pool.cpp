@@ -0,0 +1,1402 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+
+/**
+* @file pool.cpp
+* Memory pool.
+* A size class allocator with per-thread caches for DSM_MemAllocate
+* and DSM_MemFree, so capability containers and transfer buffers
+* don't churn the heap.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* Enviroment varible to turn the pool on.  Set it to 1 to use the
+* pool, or to a comma separated list of options: nozero skips zeroing
+* blocks we reuse, populate faults in new large blocks up front,
+* hugepages asks for transparent huge pages for large blocks, and memfd
+* gives every block of a page or more a memfd file of its own, so it
+* can be shared...
+* @see CTwnDsmPool
+*/
+#define kPOOLENV "TWAINDSM_MEMPOOL"
+
+/**
+* Number of size classes.  Class 0 is 32 bytes, after that there
+* are four classes for each power of two, ending at 1MB.  Bigger
+* blocks go straight to the system...
+* @see CTwnDsmPool
+*/
+#define POOL_CLASSES 61
+
+/**
+* The biggest block we pool...
+* @see CTwnDsmPool
+*/
+#define POOL_MAXBYTES (1024 * 1024)
+
+/**
+* The class we put in the header of a block that's too big to pool.
+* On Linux these get their own mapping, so a page of image data
+* doesn't sit in the heap...
+* @see CTwnDsmPool
+*/
+#define POOL_LARGE 0xFFFF
+
+/**
+* How many freed large mappings we hang on to, so the next page can
+* have them without faulting in fresh memory.  We'll only reuse one
+* that's no more than twice the size needed...
+* @see CTwnDsmPool
+*/
+#define POOL_LARGECACHE 4
+
+/**
+* With memfd on, anything a page or bigger takes the large block path,
+* so it gets a memfd file of its own, sealed at its size.  Anything
+* smaller couldn't be mapped without its neighbours, so it comes from
+* the heap like it always does...
+* @see CTwnDsmPool
+*/
+#ifndef MFD_CLOEXEC
+  #define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+  #define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+  #define F_ADD_SEALS   1033
+  #define F_SEAL_SEAL   0x0001
+  #define F_SEAL_SHRINK 0x0002
+  #define F_SEAL_GROW   0x0004
+#endif
+
+/**
+* How much of a class a thread hangs on to, and how much the shared
+* lists hang on to, before they give some back...
+* @see CTwnDsmPool
+*/
+#define POOL_CACHEBYTES  (256 * 1024)
+#define POOL_GLOBALBYTES (1024 * 1024)
+
+/**
+* How often the trim thread looks around, in milliseconds...
+* @see CTwnDsmPool
+*/
+#define POOL_TRIMMS 2000
+
+/**
+* Header magic for blocks that are out, and blocks that are free.
+* The second one lets us catch double frees...
+* @see CTwnDsmPool
+*/
+#define POOL_MAGIC     0x4C4F4F50  // "POOL"
+#define POOL_FREEMAGIC 0x45455246  // "FREE"
+
+
+
+/**
+* Every block starts with one of these, it keeps the caller's
+* memory 16 byte aligned...
+*/
+typedef struct
+{
+  UINT Magic;     /**< POOL_MAGIC or POOL_FREEMAGIC */
+  UINT Bytes;     /**< what the caller asked for */
+  UINT Class;     /**< the size class, or POOL_LARGE */
+  UINT Reserved;  /**< the mapping's length, for POOL_LARGE */
+} POOL_HEADER;
+
+/**
+* A free list, the link lives in the first word of the caller's
+* part of the block...
+*/
+typedef struct
+{
+  POOL_HEADER *pHead;   /**< first free block */
+  UINT         nCount;  /**< how many are on the list */
+} POOL_LIST;
+
+/**
+* A memfd file and where it's mapped.  Each one holds a single large
+* block...
+*/
+typedef struct
+{
+  char   *pBase;    /**< the mapping */
+  size_t  nLength;  /**< its length */
+  int     fd;       /**< the memfd */
+  bool    bShared;  /**< DAT_TWDSM_MEMFD gave the fd out, so don't recycle it */
+} POOL_ARENA;
+
+/**
+* A thread's cache.  The owner is the only one who uses it, except for
+* the trim thread, so the lock is almost never contended...
+*/
+typedef struct POOL_CACHE_
+{
+  MUTEX               mutex;               /**< guards the lists */
+  POOL_LIST           alist[POOL_CLASSES]; /**< one list per class */
+  UINT                nOps;                /**< allocs and frees, to spot idle caches */
+  UINT                nOpsLast;            /**< nOps at the last trim */
+  bool                bDead;               /**< the thread has exited */
+  struct POOL_CACHE_ *pNext;               /**< the next cache */
+} POOL_CACHE;
+
+/**
+* One of the shared lists...
+*/
+typedef struct
+{
+  MUTEX     mutex;     /**< guards the list */
+  POOL_LIST list;      /**< the blocks */
+  UINT      nOps;      /**< to spot idle lists */
+  UINT      nOpsLast;  /**< nOps at the last trim */
+} POOL_GLOBAL;
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmPoolImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmPoolImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Pick the class for a size...
+    * @param[in] _bytes the size
+    * @return the class, or POOL_LARGE
+    */
+    static UINT ClassFromBytes(const TW_UINT32 _bytes);
+
+    /**
+    * The size of the blocks in a class...
+    * @param[in] _class the class
+    * @return bytes, not counting the header
+    */
+    static UINT BytesFromClass(const UINT _class);
+
+    /**
+    * Get this thread's cache, making one if it doesn't have one...
+    * @return the cache, or NULL
+    */
+    POOL_CACHE *GetCache();
+
+    /**
+    * Move blocks from a list to the shared list for their class...
+    * @param[in,out] _plist the list
+    * @param[in] _class the class
+    * @param[in] _nKeep how many to leave on _plist
+    */
+    void GiveBack(POOL_LIST  *_plist,
+                  const UINT  _class,
+                  const UINT  _nKeep);
+
+    /**
+    * Go through the caches and shared lists looking for memory
+    * nobody is using...
+    */
+    void Trim();
+
+    /**
+    * The trim thread...
+    */
+    void TrimLoop();
+
+    /**
+    * Get a large block, from the recycle cache if we have one that
+    * fits, or from a new mapping...
+    * @param[in] _bytes how much is needed
+    * @param[in] _bZero true if it has to be zeroed
+    * @return the block's header, or NULL
+    */
+    POOL_HEADER *LargeAllocate(const TW_UINT32 _bytes,
+                               const bool      _bZero);
+
+    /**
+    * Put a large block in the recycle cache, or unmap it...
+    * @param[in] _pheader the block's header
+    */
+    void LargeFree(POOL_HEADER *_pheader);
+
+    /**
+    * Unmap the mappings in the recycle cache...
+    * @param[in] _bAll true to unmap them even if they're in use
+    */
+    void LargeTrim(const bool _bAll);
+
+    /**
+    * Unmap a large block...
+    * @param[in] _pheader the block's header
+    */
+    void LargeUnmap(POOL_HEADER *_pheader);
+
+    /**
+    * Make an arena of its own, for a large block...
+    * @param[in] _nLength the size, a multiple of the page size
+    * @return the mapping, or NULL
+    */
+    void *ArenaMap(const size_t _nLength);
+
+    /**
+    * Get rid of an arena made by ArenaMap...
+    * @param[in] _pv the mapping
+    */
+    void ArenaUnmap(void *_pv);
+
+    /**
+    * Find the arena an address is in...
+    * @param[in] _pv the address
+    * @param[out] _parena a copy of the arena
+    * @param[in] _bShare true to mark it as given out
+    * @return true if we found it
+    */
+    bool ArenaFind(const void *_pv,
+                   POOL_ARENA *_parena,
+                   const bool  _bShare);
+
+    /**
+    * Find the block that owns an arena...
+    * @param[in] _pv the caller's part of the block
+    * @param[out] _parena a copy of the arena
+    * @param[in] _bShare true to mark it as given out
+    * @return the block's header, or NULL if it isn't a whole arena
+    */
+    POOL_HEADER *ArenaBlock(const void *_pv,
+                            POOL_ARENA *_parena,
+                            const bool  _bShare);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      bool         m_bEnabled;               /**< TWAINDSM_MEMPOOL is set */
+      bool         m_bZero;                  /**< zero the blocks we reuse */
+      bool         m_bPopulate;              /**< MAP_POPULATE large blocks */
+      bool         m_bHugePages;             /**< MADV_HUGEPAGE large blocks */
+      UINT         m_nPageSize;              /**< the system's page size */
+      MUTEX        m_mutexLarge;             /**< guards the recycle cache */
+      POOL_HEADER *m_apLarge[POOL_LARGECACHE]; /**< large blocks to reuse */
+      UINT         m_nLargeOps;              /**< to spot an idle recycle cache */
+      UINT         m_nLargeOpsLast;          /**< m_nLargeOps at the last trim */
+      bool         m_bMemfd;                 /**< blocks come from memfd arenas */
+      MUTEX        m_mutexArenas;            /**< guards the arenas */
+      POOL_ARENA  *m_aarena;                 /**< every arena */
+      UINT         m_nArenas;                /**< how many there are */
+      UINT         m_nArenasMax;             /**< how many m_aarena can hold */
+      bool         m_bKey;                   /**< m_key is good */
+      TLSKEY       m_key;                    /**< each thread's POOL_CACHE */
+      MUTEX        m_mutexCaches;            /**< guards m_pCaches */
+      POOL_CACHE  *m_pCaches;                /**< every thread's cache */
+      POOL_GLOBAL  m_aglobal[POOL_CLASSES];  /**< the shared lists */
+      MUTEX        m_mutexTrim;              /**< guards the trim flags */
+      COND         m_condTrim;               /**< wakes the trim thread early */
+      THREAD       m_threadTrim;             /**< the trim thread */
+      bool         m_bTrim;                  /**< the trim thread is running */
+      bool         m_bQuit;                  /**< the trim thread should exit */
+    } pod;    /**< Pieces of data for CTwnDsmPoolImpl*/
+};
+
+
+
+/**
+* Push a block onto a list...
+*/
+static inline void ListPush(POOL_LIST   *_plist,
+                            POOL_HEADER *_pheader)
+{
+  *(POOL_HEADER**)(_pheader + 1) = _plist->pHead;
+  _plist->pHead = _pheader;
+  _plist->nCount++;
+}
+
+/**
+* Pop a block off a list, or NULL if it's empty...
+*/
+static inline POOL_HEADER *ListPop(POOL_LIST *_plist)
+{
+  POOL_HEADER *pheader = _plist->pHead;
+  if (pheader)
+  {
+    _plist->pHead = *(POOL_HEADER**)(pheader + 1);
+    _plist->nCount--;
+  }
+  return pheader;
+}
+
+/**
+* The most blocks of a class a list should keep...
+*/
+static inline UINT ListLimit(const UINT _class,
+                             const UINT _bytes)
+{
+  UINT nLimit = _bytes / CTwnDsmPoolImpl::BytesFromClass(_class);
+  return (nLimit < 4) ? 4 : nLimit;
+}
+
+
+
+/**
+* A thread is exiting, mark its cache so the trim thread can empty
+* it and free it...
+*/
+static TLSDESTRUCTOR(PoolCacheDestructor)
+{
+  POOL_CACHE *pcache = (POOL_CACHE*)_pv;
+  if (pcache)
+  {
+    MUTEXLOCK(pcache->mutex);
+    pcache->bDead = true;
+    MUTEXUNLOCK(pcache->mutex);
+  }
+}
+
+/**
+* The trim thread just runs the loop...
+*/
+static THREADPROC(PoolTrimThread)
+{
+  ((CTwnDsmPoolImpl*)_pv)->TrimLoop();
+  return 0;
+}
+
+
+
+/**
+* The constructor for our class.  Once we decide if we're on, we
+* can never change our mind, since the blocks we hand out aren't
+* the same as the ones calloc hands out...
+*/
+CTwnDsmPool::CTwnDsmPool()
+{
+  char szEnv[FILENAME_MAX];
+  int  ii;
+
+  m_ptwndsmpoolimpl = new CTwnDsmPoolImpl;
+  MUTEXINIT(m_ptwndsmpoolimpl->pod.m_mutexCaches);
+  MUTEXINIT(m_ptwndsmpoolimpl->pod.m_mutexTrim);
+  MUTEXINIT(m_ptwndsmpoolimpl->pod.m_mutexLarge);
+  MUTEXINIT(m_ptwndsmpoolimpl->pod.m_mutexArenas);
+  CONDINIT(m_ptwndsmpoolimpl->pod.m_condTrim);
+  for (ii = 0; ii < POOL_CLASSES; ii++)
+  {
+    MUTEXINIT(m_ptwndsmpoolimpl->pod.m_aglobal[ii].mutex);
+  }
+
+  SGETENV(szEnv,NCHARS(szEnv),kPOOLENV);
+  if (szEnv[0] && strcmp(szEnv,"0"))
+  {
+    m_ptwndsmpoolimpl->pod.m_bKey = TLSCREATE(m_ptwndsmpoolimpl->pod.m_key,PoolCacheDestructor);
+    m_ptwndsmpoolimpl->pod.m_bEnabled = true;
+    m_ptwndsmpoolimpl->pod.m_bZero = (0 == strstr(szEnv,"nozero"));
+    m_ptwndsmpoolimpl->pod.m_bPopulate = (0 != strstr(szEnv,"populate"));
+    m_ptwndsmpoolimpl->pod.m_bHugePages = (0 != strstr(szEnv,"hugepages"));
+    #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+      m_ptwndsmpoolimpl->pod.m_nPageSize = (UINT)sysconf(_SC_PAGESIZE);
+      m_ptwndsmpoolimpl->pod.m_bMemfd = (0 != strstr(szEnv,"memfd"));
+      if (m_ptwndsmpoolimpl->pod.m_bMemfd)
+      {
+        m_ptwndsmpoolimpl->pod.m_bHugePages = false;
+      }
+    #endif
+    kLOG((kLOGINFO,"memory pool is on%s%s%s%s",
+          m_ptwndsmpoolimpl->pod.m_bZero ? "" : ", reused blocks are not zeroed",
+          m_ptwndsmpoolimpl->pod.m_bPopulate ? ", populating large blocks" : "",
+          m_ptwndsmpoolimpl->pod.m_bHugePages ? ", huge pages for large blocks" : "",
+          m_ptwndsmpoolimpl->pod.m_bMemfd ? ", memfd for blocks of a page or more" : ""));
+  }
+}
+
+
+
+/**
+* The destructor for our class.  Blocks that are still out stay where
+* they are, the application or the driver may still be using them, so
+* we only get rid of the ones on our lists.  A memfd arena still in
+* the table after the recycle cache is emptied belongs to a live block,
+* so it keeps its mapping and its fd...
+*/
+CTwnDsmPool::~CTwnDsmPool()
+{
+  int ii;
+
+  if (m_ptwndsmpoolimpl)
+  {
+    StopTrim();
+    if (m_ptwndsmpoolimpl->pod.m_bKey)
+    {
+      TLSDELETE(m_ptwndsmpoolimpl->pod.m_key);
+    }
+    while (m_ptwndsmpoolimpl->pod.m_pCaches)
+    {
+      POOL_CACHE *pcache = m_ptwndsmpoolimpl->pod.m_pCaches;
+      m_ptwndsmpoolimpl->pod.m_pCaches = pcache->pNext;
+      for (ii = 0; ii < POOL_CLASSES; ii++)
+      {
+        POOL_HEADER *pheader;
+        while (0 != (pheader = ListPop(&pcache->alist[ii])))
+        {
+          free(pheader);
+        }
+      }
+      MUTEXDESTROY(pcache->mutex);
+      free(pcache);
+    }
+    for (ii = 0; ii < POOL_CLASSES; ii++)
+    {
+      POOL_HEADER *pheader;
+      while (0 != (pheader = ListPop(&m_ptwndsmpoolimpl->pod.m_aglobal[ii].list)))
+      {
+        free(pheader);
+      }
+      MUTEXDESTROY(m_ptwndsmpoolimpl->pod.m_aglobal[ii].mutex);
+    }
+    m_ptwndsmpoolimpl->LargeTrim(true);
+    if (m_ptwndsmpoolimpl->pod.m_nArenas)
+    {
+      kLOG((kLOGINFO,"leaving %u memfd blocks mapped, they're still in use",m_ptwndsmpoolimpl->pod.m_nArenas));
+    }
+    if (m_ptwndsmpoolimpl->pod.m_aarena)
+    {
+      free(m_ptwndsmpoolimpl->pod.m_aarena);
+    }
+    MUTEXDESTROY(m_ptwndsmpoolimpl->pod.m_mutexArenas);
+    MUTEXDESTROY(m_ptwndsmpoolimpl->pod.m_mutexLarge);
+    CONDDESTROY(m_ptwndsmpoolimpl->pod.m_condTrim);
+    MUTEXDESTROY(m_ptwndsmpoolimpl->pod.m_mutexTrim);
+    MUTEXDESTROY(m_ptwndsmpoolimpl->pod.m_mutexCaches);
+    delete m_ptwndsmpoolimpl;
+    m_ptwndsmpoolimpl = 0;
+  }
+}
+
+
+
+/**
+* TWAINDSM_MEMPOOL is set, and never changes after the constructor...
+*/
+bool CTwnDsmPool::IsEnabled()
+{
+  return m_ptwndsmpoolimpl->pod.m_bEnabled;
+}
+
+/**
+* Do we zero what we reuse?
+*/
+bool CTwnDsmPool::IsZeroing()
+{
+  return m_ptwndsmpoolimpl->pod.m_bZero;
+}
+
+
+
+/**
+* Get a block.  Try this thread's cache, then the shared list, and
+* then the system.  Blocks from the system are already zeroed, so
+* we only have to zero the ones we reuse...
+*/
+void *CTwnDsmPool::Allocate(const TW_UINT32 _bytes,
+                            const bool      _bZero)
+{
+  UINT         cls;
+  POOL_CACHE  *pcache;
+  POOL_HEADER *pheader = 0;
+
+  cls = CTwnDsmPoolImpl::ClassFromBytes(_bytes);
+
+  // Too big for a size class, or big enough to be shared...
+  if (   (POOL_LARGE == cls)
+      || (m_ptwndsmpoolimpl->pod.m_bMemfd && (_bytes >= m_ptwndsmpoolimpl->pod.m_nPageSize)))
+  {
+    pheader = m_ptwndsmpoolimpl->LargeAllocate(_bytes,_bZero);
+    return pheader ? (void*)(pheader + 1) : 0;
+  }
+
+  // This thread's cache...
+  pcache = m_ptwndsmpoolimpl->GetCache();
+  if (pcache)
+  {
+    MUTEXLOCK(pcache->mutex);
+    pcache->nOps++;
+    pheader = ListPop(&pcache->alist[cls]);
+    MUTEXUNLOCK(pcache->mutex);
+  }
+
+  // The shared list...
+  if (0 == pheader)
+  {
+    POOL_GLOBAL *pglobal = &m_ptwndsmpoolimpl->pod.m_aglobal[cls];
+    MUTEXLOCK(pglobal->mutex);
+    pglobal->nOps++;
+    pheader = ListPop(&pglobal->list);
+    MUTEXUNLOCK(pglobal->mutex);
+  }
+
+  // Reuse it...
+  if (pheader)
+  {
+    if (_bZero)
+    {
+      memset(pheader + 1,0,_bytes);
+    }
+  }
+
+  // The system...
+  else
+  {
+    pheader = (POOL_HEADER*)calloc(sizeof(POOL_HEADER) + CTwnDsmPoolImpl::BytesFromClass(cls),1);
+    if (0 == pheader)
+    {
+      return 0;
+    }
+  }
+
+  pheader->Magic = POOL_MAGIC;
+  pheader->Bytes = _bytes;
+  pheader->Class = cls;
+  return (void*)(pheader + 1);
+}
+
+
+
+/**
+* Give a block back to this thread's cache.  If the cache is getting
+* fat, half of that class goes to the shared list...
+*/
+void CTwnDsmPool::Free(void *_pv)
+{
+  POOL_HEADER *pheader;
+  POOL_CACHE  *pcache;
+  POOL_LIST    listExtra;
+  POOL_ARENA   arena;
+  UINT         cls;
+
+  pheader = ((POOL_HEADER*)_pv) - 1;
+  if (POOL_FREEMAGIC == pheader->Magic)
+  {
+    kLOG((kLOGERR,"ignoring attempt to free a handle twice..."));
+    return;
+  }
+  if ((POOL_MAGIC != pheader->Magic) || ((POOL_LARGE != pheader->Class) && (pheader->Class >= POOL_CLASSES)))
+  {
+    // Anything inside a memfd arena belongs to the arena, not to
+    // malloc, so the best we can do is leave it for ArenaUnmap...
+    if (m_ptwndsmpoolimpl->pod.m_bMemfd && m_ptwndsmpoolimpl->ArenaFind(_pv,&arena,false))
+    {
+      kLOG((kLOGERR,"handle is inside a memfd arena but isn't a block, not freeing it..."));
+      return;
+    }
+    kLOG((kLOGERR,"handle didn't come from DSM_MemAllocate, passing it to free..."));
+    free(_pv);
+    return;
+  }
+
+  cls = pheader->Class;
+  pheader->Magic = POOL_FREEMAGIC;
+  if (POOL_LARGE == cls)
+  {
+    m_ptwndsmpoolimpl->LargeFree(pheader);
+    return;
+  }
+
+  // No cache, so it goes straight to the shared list...
+  pcache = m_ptwndsmpoolimpl->GetCache();
+  if (0 == pcache)
+  {
+    memset(&listExtra,0,sizeof(listExtra));
+    ListPush(&listExtra,pheader);
+    m_ptwndsmpoolimpl->GiveBack(&listExtra,cls,0);
+    return;
+  }
+
+  memset(&listExtra,0,sizeof(listExtra));
+  MUTEXLOCK(pcache->mutex);
+  pcache->nOps++;
+  ListPush(&pcache->alist[cls],pheader);
+  if (pcache->alist[cls].nCount > ListLimit(cls,POOL_CACHEBYTES))
+  {
+    // Take the extras off the top, and deal with them after we unlock...
+    while (pcache->alist[cls].nCount > (ListLimit(cls,POOL_CACHEBYTES) / 2))
+    {
+      ListPush(&listExtra,ListPop(&pcache->alist[cls]));
+    }
+  }
+  MUTEXUNLOCK(pcache->mutex);
+
+  if (listExtra.nCount)
+  {
+    m_ptwndsmpoolimpl->GiveBack(&listExtra,cls,0);
+  }
+}
+
+
+
+/**
+* Only blocks with an arena of their own have a descriptor.  Once it's
+* out, whoever has it can see the pages for as long as they like, so
+* the block won't be recycled for somebody else...
+*/
+bool CTwnDsmPool::GetMemfd(void      *_pv,
+                           int       *_pfd,
+                           TW_UINT32 *_pOffset,
+                           TW_UINT32 *_pLength)
+{
+  POOL_HEADER *pheader;
+  POOL_ARENA   arena;
+
+  pheader = m_ptwndsmpoolimpl->ArenaBlock(_pv,&arena,true);
+  if (0 == pheader)
+  {
+    return false;
+  }
+
+  *_pfd     = arena.fd;
+  *_pOffset = (TW_UINT32)sizeof(POOL_HEADER);
+  *_pLength = pheader->Bytes;
+  return true;
+}
+
+
+
+/**
+* The same blocks as GetMemfd, but this doesn't give anything out...
+*/
+bool CTwnDsmPool::GetSize(void      *_pv,
+                          TW_UINT32 *_pLength)
+{
+  POOL_HEADER *pheader;
+  POOL_ARENA   arena;
+
+  pheader = m_ptwndsmpoolimpl->ArenaBlock(_pv,&arena,false);
+  if (0 == pheader)
+  {
+    return false;
+  }
+
+  *_pLength = pheader->Bytes;
+  return true;
+}
+
+
+
+/**
+* Start the trim thread...
+*/
+void CTwnDsmPool::StartTrim()
+{
+  if (!m_ptwndsmpoolimpl->pod.m_bEnabled || m_ptwndsmpoolimpl->pod.m_bTrim)
+  {
+    return;
+  }
+  m_ptwndsmpoolimpl->pod.m_bQuit = false;
+  m_ptwndsmpoolimpl->pod.m_bTrim = THREADCREATE(m_ptwndsmpoolimpl->pod.m_threadTrim,PoolTrimThread,m_ptwndsmpoolimpl);
+  if (!m_ptwndsmpoolimpl->pod.m_bTrim)
+  {
+    kLOG((kLOGERR,"unable to start the memory pool trim thread..."));
+  }
+}
+
+/**
+* Stop the trim thread, and wait for it...
+*/
+void CTwnDsmPool::StopTrim()
+{
+  if (!m_ptwndsmpoolimpl->pod.m_bTrim)
+  {
+    return;
+  }
+  MUTEXLOCK(m_ptwndsmpoolimpl->pod.m_mutexTrim);
+  m_ptwndsmpoolimpl->pod.m_bQuit = true;
+  CONDSIGNAL(m_ptwndsmpoolimpl->pod.m_condTrim);
+  MUTEXUNLOCK(m_ptwndsmpoolimpl->pod.m_mutexTrim);
+  THREADJOIN(m_ptwndsmpoolimpl->pod.m_threadTrim);
+  m_ptwndsmpoolimpl->pod.m_bTrim = false;
+}
+
+
+
+/**
+* 32 bytes and under is class 0.  After that it's the power of two,
+* and which quarter of it we're in...
+*/
+UINT CTwnDsmPoolImpl::ClassFromBytes(const TW_UINT32 _bytes)
+{
+  UINT n;
+  UINT exponent;
+
+  if (_bytes <= 32)
+  {
+    return 0;
+  }
+  if (_bytes > POOL_MAXBYTES)
+  {
+    return POOL_LARGE;
+  }
+
+  n = _bytes - 1;
+  for (exponent = 5; (n >> (exponent + 1)) != 0; exponent++)
+  {
+    // just counting...
+  }
+  return 1 + ((exponent - 5) * 4) + ((n >> (exponent - 2)) & 3);
+}
+
+/**
+* The reverse of ClassFromBytes, rounded up to the top of the class...
+*/
+UINT CTwnDsmPoolImpl::BytesFromClass(const UINT _class)
+{
+  UINT exponent;
+
+  if (0 == _class)
+  {
+    return 32;
+  }
+  exponent = ((_class - 1) / 4) + 5;
+  return (5 + ((_class - 1) % 4)) << (exponent - 2);
+}
+
+
+
+/**
+* The first time a thread shows up, give it a cache.  If we can't,
+* the thread just uses the shared lists...
+*/
+POOL_CACHE *CTwnDsmPoolImpl::GetCache()
+{
+  POOL_CACHE *pcache;
+
+  if (!pod.m_bKey)
+  {
+    return 0;
+  }
+
+  pcache = (POOL_CACHE*)TLSGET(pod.m_key);
+  if (pcache)
+  {
+    return pcache;
+  }
+
+  pcache = (POOL_CACHE*)calloc(1,sizeof(POOL_CACHE));
+  if (0 == pcache)
+  {
+    return 0;
+  }
+  MUTEXINIT(pcache->mutex);
+
+  MUTEXLOCK(pod.m_mutexCaches);
+  pcache->pNext = pod.m_pCaches;
+  pod.m_pCaches = pcache;
+  MUTEXUNLOCK(pod.m_mutexCaches);
+
+  TLSSET(pod.m_key,pcache);
+  return pcache;
+}
+
+
+
+/**
+* The shared list takes what it has room for, the system gets the
+* rest...
+*/
+void CTwnDsmPoolImpl::GiveBack(POOL_LIST  *_plist,
+                               const UINT  _class,
+                               const UINT  _nKeep)
+{
+  POOL_GLOBAL *pglobal = &pod.m_aglobal[_class];
+  POOL_HEADER *pheader;
+  POOL_LIST    listFree;
+
+  memset(&listFree,0,sizeof(listFree));
+  MUTEXLOCK(pglobal->mutex);
+  while (_plist->nCount > _nKeep)
+  {
+    pheader = ListPop(_plist);
+    if (pglobal->list.nCount < ListLimit(_class,POOL_GLOBALBYTES))
+    {
+      ListPush(&pglobal->list,pheader);
+    }
+    else
+    {
+      ListPush(&listFree,pheader);
+    }
+  }
+  MUTEXUNLOCK(pglobal->mutex);
+
+  while (0 != (pheader = ListPop(&listFree)))
+  {
+    free(pheader);
+  }
+}
+
+
+
+/**
+* Caches that haven't been used since the last time give back half
+* of what they have, dead ones give back everything and go away.
+* Shared lists that nobody touched give half back to the system...
+*/
+void CTwnDsmPoolImpl::Trim()
+{
+  POOL_CACHE **ppcache;
+  POOL_CACHE  *pcache;
+  POOL_CACHE  *pDead = 0;
+  POOL_LIST    alist[POOL_CLASSES];
+  int          ii;
+
+  MUTEXLOCK(pod.m_mutexCaches);
+  for (ppcache = &pod.m_pCaches; *ppcache; )
+  {
+    pcache = *ppcache;
+    memset(alist,0,sizeof(alist));
+    MUTEXLOCK(pcache->mutex);
+    if (pcache->bDead || (pcache->nOps == pcache->nOpsLast))
+    {
+      for (ii = 0; ii < POOL_CLASSES; ii++)
+      {
+        UINT nKeep = pcache->bDead ? 0 : (pcache->alist[ii].nCount / 2);
+        while (pcache->alist[ii].nCount > nKeep)
+        {
+          ListPush(&alist[ii],ListPop(&pcache->alist[ii]));
+        }
+      }
+    }
+    pcache->nOpsLast = pcache->nOps;
+    MUTEXUNLOCK(pcache->mutex);
+
+    for (ii = 0; ii < POOL_CLASSES; ii++)
+    {
+      if (alist[ii].nCount)
+      {
+        GiveBack(&alist[ii],ii,0);
+      }
+    }
+
+    // The thread is gone, so nobody else can see this cache...
+    if (pcache->bDead)
+    {
+      *ppcache = pcache->pNext;
+      pcache->pNext = pDead;
+      pDead = pcache;
+    }
+    else
+    {
+      ppcache = &pcache->pNext;
+    }
+  }
+  MUTEXUNLOCK(pod.m_mutexCaches);
+
+  while (pDead)
+  {
+    pcache = pDead;
+    pDead = pcache->pNext;
+    MUTEXDESTROY(pcache->mutex);
+    free(pcache);
+  }
+
+  for (ii = 0; ii < POOL_CLASSES; ii++)
+  {
+    POOL_GLOBAL *pglobal = &pod.m_aglobal[ii];
+    POOL_LIST    listFree;
+    POOL_HEADER *pheader;
+
+    memset(&listFree,0,sizeof(listFree));
+    MUTEXLOCK(pglobal->mutex);
+    if (pglobal->nOps == pglobal->nOpsLast)
+    {
+      UINT nKeep = pglobal->list.nCount / 2;
+      while (pglobal->list.nCount > nKeep)
+      {
+        ListPush(&listFree,ListPop(&pglobal->list));
+      }
+    }
+    pglobal->nOpsLast = pglobal->nOps;
+    MUTEXUNLOCK(pglobal->mutex);
+
+    while (0 != (pheader = ListPop(&listFree)))
+    {
+      free(pheader);
+    }
+  }
+
+  LargeTrim(false);
+}
+
+
+
+/**
+* Nap, trim, repeat...
+*/
+void CTwnDsmPoolImpl::TrimLoop()
+{
+  MUTEXLOCK(pod.m_mutexTrim);
+  while (!pod.m_bQuit)
+  {
+    CONDTIMEDWAIT(pod.m_condTrim,pod.m_mutexTrim,POOL_TRIMMS);
+    if (pod.m_bQuit)
+    {
+      break;
+    }
+    MUTEXUNLOCK(pod.m_mutexTrim);
+    Trim();
+    MUTEXLOCK(pod.m_mutexTrim);
+  }
+  MUTEXUNLOCK(pod.m_mutexTrim);
+}
+
+
+
+/**
+* On Linux a large block gets its own anonymous mapping.  New mappings
+* come from the kernel already zeroed, so there's no memset, and unless
+* populate is on the pages aren't faulted in until the driver writes
+* them, which puts them on the driver's NUMA node.  A recycled mapping
+* is bound again, since the last owner may have been on another node,
+* and only needs the part the last owner could have written zeroed, and
+* anything past the new size goes back to the kernel with
+* MADV_DONTNEED, which zeroes it for free on the next touch (or
+* MADV_REMOVE for memfd, since its pages belong to the file).
+*
+* Bytes is always what the owner asked for, and the mapping past it is
+* always zero, even with nozero, so the next owner only has to worry
+* about what this one could reach.  Everywhere else we just use
+* calloc...
+*/
+POOL_HEADER *CTwnDsmPoolImpl::LargeAllocate(const TW_UINT32 _bytes,
+                                            const bool      _bZero)
+{
+  POOL_HEADER *pheader = 0;
+
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    UINT64 length;
+    int    ii;
+    int    iBest = -1;
+
+    // Round up to a whole number of pages, and make sure it fits in
+    // our header...
+    length = ((UINT64)sizeof(POOL_HEADER) + _bytes + pod.m_nPageSize - 1) & ~((UINT64)pod.m_nPageSize - 1);
+    if (length > 0xFFFFFFFF)
+    {
+      kLOG((kLOGERR,"DSM_MemAllocate can't map %u bytes...",(unsigned)_bytes));
+      return 0;
+    }
+
+    // Look for the smallest cached mapping that fits...
+    MUTEXLOCK(pod.m_mutexLarge);
+    pod.m_nLargeOps++;
+    for (ii = 0; ii < POOL_LARGECACHE; ii++)
+    {
+      if (   pod.m_apLarge[ii]
+          && (pod.m_apLarge[ii]->Reserved >= length)
+          && ((pod.m_apLarge[ii]->Reserved / 2) <= length)
+          && ((-1 == iBest) || (pod.m_apLarge[ii]->Reserved < pod.m_apLarge[iBest]->Reserved)))
+      {
+        iBest = ii;
+      }
+    }
+    if (-1 != iBest)
+    {
+      pheader = pod.m_apLarge[iBest];
+      pod.m_apLarge[iBest] = 0;
+    }
+    MUTEXUNLOCK(pod.m_mutexLarge);
+
+    // Reuse it.  What the last owner had past the new size goes...
+    if (pheader)
+    {
+      if (pheader->Bytes > _bytes)
+      {
+        UINT64 tail = ((UINT64)sizeof(POOL_HEADER) + _bytes + pod.m_nPageSize - 1) & ~((UINT64)pod.m_nPageSize - 1);
+        UINT64 end  = ((UINT64)sizeof(POOL_HEADER) + pheader->Bytes + pod.m_nPageSize - 1) & ~((UINT64)pod.m_nPageSize - 1);
+        if (end > tail)
+        {
+          madvise((char*)pheader + tail,end - tail,pod.m_bMemfd ? MADV_REMOVE : MADV_DONTNEED);
+        }
+        memset((char*)(pheader + 1) + _bytes,0,(size_t)(tail - sizeof(POOL_HEADER) - _bytes));
+      }
+      // ...and what's left is only zeroed if we have to...
+      if (_bZero)
+      {
+        memset(pheader + 1,0,(pheader->Bytes < _bytes) ? pheader->Bytes : _bytes);
+      }
+      pheader->Bytes = _bytes;
+      // ...and it moves to this thread's node, if it has one...
+      if (g_ptwndsmaffinity)
+      {
+        g_ptwndsmaffinity->BindMemory(pheader,pheader->Reserved,true);
+      }
+    }
+
+    // A new mapping...
+    else
+    {
+      int   flags = MAP_PRIVATE | MAP_ANONYMOUS;
+      void *pv;
+      #ifdef MAP_POPULATE
+        if (pod.m_bPopulate)
+        {
+          flags |= MAP_POPULATE;
+        }
+      #endif
+      if (pod.m_bMemfd)
+      {
+        pv = ArenaMap((size_t)length);
+      }
+      else
+      {
+        pv = mmap(0,(size_t)length,PROT_READ|PROT_WRITE,flags,-1,0);
+      }
+      if ((MAP_FAILED == pv) || (0 == pv))
+      {
+        kLOG((kLOGERR,"DSM_MemAllocate failed to map %u bytes, errno %d...",(unsigned)_bytes,errno));
+        return 0;
+      }
+      #ifdef MADV_HUGEPAGE
+        if (pod.m_bHugePages)
+        {
+          madvise(pv,(size_t)length,MADV_HUGEPAGE);
+        }
+      #endif
+      // A placed session's buffer stays on its node...
+      if (g_ptwndsmaffinity)
+      {
+        g_ptwndsmaffinity->BindMemory(pv,length,false);
+      }
+      pheader = (POOL_HEADER*)pv;
+      pheader->Bytes = _bytes;
+      pheader->Reserved = (UINT)length;
+    }
+
+  #else
+    pheader = (POOL_HEADER*)calloc(sizeof(POOL_HEADER) + _bytes,1);
+    if (0 == pheader)
+    {
+      return 0;
+    }
+    pheader->Bytes = _bytes;
+    (void)_bZero;
+  #endif
+
+  pheader->Magic = POOL_MAGIC;
+  pheader->Class = POOL_LARGE;
+  return pheader;
+}
+
+
+
+/**
+* Hang on to a large block if there's room, otherwise give it back.
+* One whose memfd went to somebody else always goes back, or they'd
+* be looking at the next owner's pages...
+*/
+void CTwnDsmPoolImpl::LargeFree(POOL_HEADER *_pheader)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    int        ii;
+    POOL_ARENA arena;
+
+    if (pod.m_bMemfd && ArenaFind(_pheader,&arena,false) && arena.bShared)
+    {
+      LargeUnmap(_pheader);
+      return;
+    }
+
+    MUTEXLOCK(pod.m_mutexLarge);
+    pod.m_nLargeOps++;
+    for (ii = 0; ii < POOL_LARGECACHE; ii++)
+    {
+      if (0 == pod.m_apLarge[ii])
+      {
+        pod.m_apLarge[ii] = _pheader;
+        MUTEXUNLOCK(pod.m_mutexLarge);
+        return;
+      }
+    }
+    MUTEXUNLOCK(pod.m_mutexLarge);
+    LargeUnmap(_pheader);
+
+  #else
+    free(_pheader);
+  #endif
+}
+
+
+
+/**
+* Unmap everything in the recycle cache if nobody has used it since
+* the last time we looked...
+*/
+void CTwnDsmPoolImpl::LargeTrim(const bool _bAll)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    POOL_HEADER *apheader[POOL_LARGECACHE];
+    int          ii;
+
+    memset(apheader,0,sizeof(apheader));
+    MUTEXLOCK(pod.m_mutexLarge);
+    if (_bAll || (pod.m_nLargeOps == pod.m_nLargeOpsLast))
+    {
+      memcpy(apheader,pod.m_apLarge,sizeof(apheader));
+      memset(pod.m_apLarge,0,sizeof(pod.m_apLarge));
+    }
+    pod.m_nLargeOpsLast = pod.m_nLargeOps;
+    MUTEXUNLOCK(pod.m_mutexLarge);
+
+    for (ii = 0; ii < POOL_LARGECACHE; ii++)
+    {
+      if (apheader[ii])
+      {
+        LargeUnmap(apheader[ii]);
+      }
+    }
+
+  #else
+    (void)_bAll;
+  #endif
+}
+
+
+
+/**
+* Large blocks are either anonymous mappings or arenas of their own...
+*/
+void CTwnDsmPoolImpl::LargeUnmap(POOL_HEADER *_pheader)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    if (pod.m_bMemfd)
+    {
+      ArenaUnmap(_pheader);
+    }
+    else
+    {
+      munmap(_pheader,_pheader->Reserved);
+    }
+
+  #else
+    free(_pheader);
+  #endif
+}
+
+
+
+/**
+* A memfd file, mapped shared, so whoever we hand the fd to sees the
+* same pages we do.  It starts out zeroed, like any new file, and it's
+* sealed at its size, so they can't shrink it out from under us...
+*/
+void *CTwnDsmPoolImpl::ArenaMap(const size_t _nLength)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    POOL_ARENA arena;
+    int        flags = MAP_SHARED;
+
+    memset(&arena,0,sizeof(arena));
+    arena.nLength = _nLength;
+    arena.fd = (int)syscall(SYS_memfd_create,"twaindsm",MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    if (arena.fd < 0)
+    {
+      kLOG((kLOGERR,"memfd_create failed, errno %d...",errno));
+      return 0;
+    }
+    if (0 != ftruncate(arena.fd,(off_t)_nLength))
+    {
+      kLOG((kLOGERR,"unable to size a memfd to %lu bytes, errno %d...",(unsigned long)_nLength,errno));
+      close(arena.fd);
+      return 0;
+    }
+    if (0 != fcntl(arena.fd,F_ADD_SEALS,F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL))
+    {
+      kLOG((kLOGERR,"unable to seal a memfd, errno %d...",errno));
+      close(arena.fd);
+      return 0;
+    }
+    #ifdef MAP_POPULATE
+      if (pod.m_bPopulate)
+      {
+        flags |= MAP_POPULATE;
+      }
+    #endif
+    arena.pBase = (char*)mmap(0,_nLength,PROT_READ|PROT_WRITE,flags,arena.fd,0);
+    if (MAP_FAILED == (void*)arena.pBase)
+    {
+      kLOG((kLOGERR,"unable to map a memfd of %lu bytes, errno %d...",(unsigned long)_nLength,errno));
+      close(arena.fd);
+      return 0;
+    }
+
+    MUTEXLOCK(pod.m_mutexArenas);
+    if (pod.m_nArenas == pod.m_nArenasMax)
+    {
+      UINT        nMax = pod.m_nArenasMax ? (pod.m_nArenasMax * 2) : 16;
+      POOL_ARENA *aarena = (POOL_ARENA*)realloc(pod.m_aarena,nMax * sizeof(POOL_ARENA));
+      if (0 == aarena)
+      {
+        MUTEXUNLOCK(pod.m_mutexArenas);
+        kLOG((kLOGERR,"unable to grow the arena table..."));
+        munmap(arena.pBase,_nLength);
+        close(arena.fd);
+        return 0;
+      }
+      pod.m_aarena = aarena;
+      pod.m_nArenasMax = nMax;
+    }
+    pod.m_aarena[pod.m_nArenas++] = arena;
+    MUTEXUNLOCK(pod.m_mutexArenas);
+
+    return arena.pBase;
+
+  #else
+    (void)_nLength;
+    return 0;
+  #endif
+}
+
+
+
+/**
+* Close the memfd, and fill the hole in the table with the last
+* arena...
+*/
+void CTwnDsmPoolImpl::ArenaUnmap(void *_pv)
+{
+  #if (TWNDSM_OS == TWNDSM_OS_LINUX)
+    POOL_ARENA arena;
+    UINT       ii;
+
+    MUTEXLOCK(pod.m_mutexArenas);
+    for (ii = 0; ii < pod.m_nArenas; ii++)
+    {
+      if (pod.m_aarena[ii].pBase == (char*)_pv)
+      {
+        break;
+      }
+    }
+    if (ii == pod.m_nArenas)
+    {
+      MUTEXUNLOCK(pod.m_mutexArenas);
+      kLOG((kLOGERR,"unmapping an arena we don't know about..."));
+      return;
+    }
+    arena = pod.m_aarena[ii];
+    pod.m_nArenas--;
+    if (ii != pod.m_nArenas)
+    {
+      pod.m_aarena[ii] = pod.m_aarena[pod.m_nArenas];
+    }
+    MUTEXUNLOCK(pod.m_mutexArenas);
+
+    munmap(arena.pBase,arena.nLength);
+    close(arena.fd);
+
+  #else
+    (void)_pv;
+  #endif
+}
+
+
+
+/**
+* There aren't many arenas, so a walk is fine...
+*/
+bool CTwnDsmPoolImpl::ArenaFind(const void *_pv,
+                                POOL_ARENA *_parena,
+                                const bool  _bShare)
+{
+  UINT ii;
+  bool bFound = false;
+
+  MUTEXLOCK(pod.m_mutexArenas);
+  for (ii = 0; ii < pod.m_nArenas; ii++)
+  {
+    if (((const char*)_pv >= pod.m_aarena[ii].pBase) && ((const char*)_pv < (pod.m_aarena[ii].pBase + pod.m_aarena[ii].nLength)))
+    {
+      if (_bShare)
+      {
+        pod.m_aarena[ii].bShared = true;
+      }
+      *_parena = pod.m_aarena[ii];
+      bFound = true;
+      break;
+    }
+  }
+  MUTEXUNLOCK(pod.m_mutexArenas);
+
+  return bFound;
+}
+
+
+
+/**
+* The header of a block with an arena of its own is the first thing
+* in the arena...
+*/
+POOL_HEADER *CTwnDsmPoolImpl::ArenaBlock(const void *_pv,
+                                         POOL_ARENA *_parena,
+                                         const bool  _bShare)
+{
+  POOL_HEADER *pheader;
+
+  if (!pod.m_bMemfd || (0 == _pv))
+  {
+    return 0;
+  }
+  pheader = ((POOL_HEADER*)_pv) - 1;
+  if (!ArenaFind(pheader,_parena,false) || ((char*)pheader != _parena->pBase))
+  {
+    return 0;
+  }
+  if ((POOL_MAGIC != pheader->Magic) || (POOL_LARGE != pheader->Class))
+  {
+    return 0;
+  }
+  if (_bShare)
+  {
+    ArenaFind(pheader,_parena,true);
+  }
+  return pheader;
+}
@@ -0,0 +1,633 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+
+/**
+* @file readahead.cpp
+* Read-ahead.
+* Keep the driver busy with the next strips of a memory transfer while
+* the application is working on the last one.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* Enviroment varible to turn read-ahead on.  Set it to the number of
+* strips to keep in the ring, 1 gets you the minimum of 2...
+* @see CTwnDsmReadAhead
+*/
+#define kREADAHEADENV "TWAINDSM_READAHEAD"
+
+/**
+* The most strips we'll keep in a ring...
+* @see CTwnDsmReadAhead
+*/
+#define READAHEAD_MAXSLOTS    16
+
+
+
+/**
+* One strip in the ring...
+*/
+typedef struct
+{
+  char            *pBuffer;   /**< our buffer */
+  TW_UINT16        rc;        /**< what the driver returned */
+  TW_IMAGEMEMXFER  memxfer;   /**< what the driver filled in */
+} READAHEAD_SLOT;
+
+/**
+* One application/driver session, hung on the driver's DS_SESSION.
+* The worker adds to the tail of the ring, the application takes from
+* the head...
+*/
+typedef struct READAHEAD_SESSION_
+{
+  TWID_T          AppId;       /**< the application */
+  TWID_T          DsId;        /**< the driver */
+  TW_IDENTITY     identity;    /**< our copy of the application's identity */
+  TW_IMAGEMEMXFER memxferTemplate; /**< the application's first request, the worker sends copies */
+  MUTEX           mutex;       /**< guards the rest */
+  MUTEX           mutexDriver; /**< held by whoever is in the driver, the worker or an event */
+  COND            condReady;   /**< a strip is ready, or the worker is done */
+  COND            condSpace;   /**< a slot is free, or the worker should stop */
+  THREAD          thread;      /**< the worker */
+  UINT64          nThreadId;   /**< the worker's id, while bRunning */
+  bool            bThread;     /**< the worker needs to be joined */
+  bool            bRunning;    /**< the worker hasn't finished */
+  bool            bStop;       /**< the worker should stop after this strip */
+  UINT            nHead;       /**< the next slot to hand out */
+  UINT            nCount;      /**< how many slots are ready */
+  UINT            nSlots;      /**< the size of the ring */
+  UINT            nBytes;      /**< the size of our buffers */
+  READAHEAD_SLOT  aslot[READAHEAD_MAXSLOTS]; /**< the ring */
+} READAHEAD_SESSION;
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmReadAheadImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmReadAheadImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Get the driver's session from its DS_SESSION...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @param[in] _bCreate add it if it isn't there
+    * @return the session, or NULL
+    */
+    READAHEAD_SESSION *Find(const TWID_T _AppId,
+                            const TWID_T _DsId,
+                            const bool   _bCreate);
+
+    /**
+    * Tell the worker to stop, and wait for it.  Only the thread
+    * that sends to the driver calls this, so we're the only ones who
+    * ever join...
+    * @param[in] _psession the session
+    */
+    void Quiesce(READAHEAD_SESSION *_psession);
+
+    /**
+    * The worker...
+    * @param[in] _psession its session
+    */
+    static void Worker(READAHEAD_SESSION *_psession);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      bool               m_bEnabled;       /**< TWAINDSM_READAHEAD is set */
+      UINT               m_nSlots;         /**< strips in each ring */
+      MUTEX              m_mutex;          /**< guards DS_SESSION.preadahead */
+    } pod;    /**< Pieces of data for CTwnDsmReadAheadImpl*/
+};
+
+
+
+/**
+* The worker thread just runs the loop...
+*/
+static THREADPROC(ReadAheadThread)
+{
+  CTwnDsmReadAheadImpl::Worker((READAHEAD_SESSION*)_pv);
+  return 0;
+}
+
+
+
+/**
+* The constructor for our class...
+*/
+CTwnDsmReadAhead::CTwnDsmReadAhead()
+{
+  char szEnv[32];
+  int  nSlots;
+
+  m_ptwndsmreadaheadimpl = new CTwnDsmReadAheadImpl;
+  MUTEXINIT(m_ptwndsmreadaheadimpl->pod.m_mutex);
+
+  SGETENV(szEnv,NCHARS(szEnv),kREADAHEADENV);
+  nSlots = atoi(szEnv);
+  if (nSlots > 0)
+  {
+    if (nSlots < 2)
+    {
+      nSlots = 2;
+    }
+    else if (nSlots > READAHEAD_MAXSLOTS)
+    {
+      nSlots = READAHEAD_MAXSLOTS;
+    }
+    m_ptwndsmreadaheadimpl->pod.m_nSlots = (UINT)nSlots;
+    m_ptwndsmreadaheadimpl->pod.m_bEnabled = true;
+    kLOG((kLOGINFO,"read-ahead is on, %d strips",nSlots));
+  }
+}
+
+
+
+/**
+* The destructor for our class.  The workers were stopped when their
+* sessions ended...
+*/
+CTwnDsmReadAhead::~CTwnDsmReadAhead()
+{
+  if (m_ptwndsmreadaheadimpl)
+  {
+    MUTEXDESTROY(m_ptwndsmreadaheadimpl->pod.m_mutex);
+    delete m_ptwndsmreadaheadimpl;
+    m_ptwndsmreadaheadimpl = 0;
+  }
+}
+
+
+
+/**
+* TWAINDSM_READAHEAD gave us a ring size...
+*/
+bool CTwnDsmReadAhead::IsEnabled()
+{
+  return m_ptwndsmreadaheadimpl->pod.m_bEnabled;
+}
+
+
+
+/**
+* The worker writes its id before it goes near the driver, and we
+* read it under the session's mutex...
+*/
+bool CTwnDsmReadAhead::OnWorker(const TWID_T _AppId,
+                                const TWID_T _DsId)
+{
+  READAHEAD_SESSION *psession;
+  bool               bWorker;
+
+  if (!m_ptwndsmreadaheadimpl->pod.m_bEnabled)
+  {
+    return false;
+  }
+  psession = m_ptwndsmreadaheadimpl->Find(_AppId,_DsId,false);
+  if (0 == psession)
+  {
+    return false;
+  }
+
+  MUTEXLOCK(psession->mutex);
+  bWorker = psession->bRunning && (psession->nThreadId == (UINT64)GETTHREADID());
+  MUTEXUNLOCK(psession->mutex);
+
+  return bWorker;
+}
+
+
+
+/**
+* Hand out the strip at the head of the ring, waiting for it if we
+* have to...
+*/
+TW_UINT16 CTwnDsmReadAhead::MemXfer(TW_IDENTITY     *_pAppId,
+                                    const TWID_T     _DsId,
+                                    TW_IMAGEMEMXFER *_pMemXfer,
+                                    bool            *_pbHandled,
+                                    TW_UINT16       *_pConditionCode)
+{
+  READAHEAD_SESSION *psession;
+  READAHEAD_SLOT    *pslot;
+  TW_UINT16          rc;
+  char              *pDest;
+  UINT               ii;
+
+  *_pbHandled = false;
+  *_pConditionCode = TWCC_SUCCESS;
+  if (   !m_ptwndsmreadaheadimpl->pod.m_bEnabled
+      || (0 == _pMemXfer)
+      || (0 == _pMemXfer->Memory.TheMem)
+      || (0 == _pMemXfer->Memory.Length)
+      || (TWON_DONTCARE32 == _pMemXfer->Memory.Length))
+  {
+    return TWRC_FAILURE;
+  }
+
+  // A driver with a thread of its own makes its calls in order on
+  // that thread, so the worker's strips would be queued behind the
+  // call (a DAT_TWDSM_SUBMIT ticket, say) that's waiting for them.
+  // Without a session Pause has nothing to stop either...
+  if (g_ptwndsmactor->IsRunning((TWID_T)_pAppId->Id,_DsId))
+  {
+    return TWRC_FAILURE;
+  }
+
+  psession = m_ptwndsmreadaheadimpl->Find((TWID_T)_pAppId->Id,_DsId,true);
+  if (0 == psession)
+  {
+    return TWRC_FAILURE;
+  }
+
+  MUTEXLOCK(psession->mutex);
+
+  // Nothing waiting and nobody working, so start the worker, sizing
+  // our buffers to match the application's...
+  if ((0 == psession->nCount) && !psession->bRunning)
+  {
+    MUTEXUNLOCK(psession->mutex);
+    m_ptwndsmreadaheadimpl->Quiesce(psession);
+    MUTEXLOCK(psession->mutex);
+
+    if (psession->nBytes != _pMemXfer->Memory.Length)
+    {
+      for (ii = 0; ii < m_ptwndsmreadaheadimpl->pod.m_nSlots; ii++)
+      {
+        if (psession->aslot[ii].pBuffer)
+        {
+          free(psession->aslot[ii].pBuffer);
+        }
+        psession->aslot[ii].pBuffer = (char*)malloc(_pMemXfer->Memory.Length);
+        if (0 == psession->aslot[ii].pBuffer)
+        {
+          kLOG((kLOGERR,"unable to allocate read-ahead buffers..."));
+          psession->nBytes = 0;
+          MUTEXUNLOCK(psession->mutex);
+          return TWRC_FAILURE;
+        }
+      }
+      psession->nBytes = _pMemXfer->Memory.Length;
+    }
+
+    psession->identity = *_pAppId;
+    psession->memxferTemplate = *_pMemXfer;
+    psession->nHead = 0;
+    psession->bStop = false;
+    psession->bRunning = true;
+    psession->bThread = THREADCREATE(psession->thread,ReadAheadThread,psession);
+    if (!psession->bThread)
+    {
+      kLOG((kLOGERR,"unable to start a read-ahead worker..."));
+      psession->bRunning = false;
+      MUTEXUNLOCK(psession->mutex);
+      return TWRC_FAILURE;
+    }
+  }
+
+  // Wait for the strip...
+  while ((0 == psession->nCount) && psession->bRunning)
+  {
+    CONDWAIT(psession->condReady,psession->mutex);
+  }
+  if (0 == psession->nCount)
+  {
+    // The worker gave up without a word, let the caller try...
+    MUTEXUNLOCK(psession->mutex);
+    return TWRC_FAILURE;
+  }
+  *_pbHandled = true;
+
+  // It has to fit...
+  pslot = &psession->aslot[psession->nHead];
+  if (   ((TWRC_SUCCESS == pslot->rc) || (TWRC_XFERDONE == pslot->rc))
+      && (pslot->memxfer.BytesWritten > _pMemXfer->Memory.Length))
+  {
+    MUTEXUNLOCK(psession->mutex);
+    kLOG((kLOGERR,"read-ahead strip is %u bytes, the buffer is only %u...",
+          (unsigned int)pslot->memxfer.BytesWritten,(unsigned int)_pMemXfer->Memory.Length));
+    *_pConditionCode = TWCC_BADVALUE;
+    return TWRC_FAILURE;
+  }
+
+  // Give the application what the driver gave us...
+  rc = pslot->rc;
+  if ((TWRC_SUCCESS == rc) || (TWRC_XFERDONE == rc))
+  {
+    if (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+    {
+      pDest = (char*)DSM_MemLock((TW_HANDLE)_pMemXfer->Memory.TheMem);
+    }
+    else
+    {
+      pDest = (char*)_pMemXfer->Memory.TheMem;
+    }
+    if (pDest)
+    {
+      memcpy(pDest,pslot->pBuffer,pslot->memxfer.BytesWritten);
+    }
+    if (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+    {
+      DSM_MemUnlock((TW_HANDLE)_pMemXfer->Memory.TheMem);
+    }
+  }
+  _pMemXfer->Compression  = pslot->memxfer.Compression;
+  _pMemXfer->BytesPerRow  = pslot->memxfer.BytesPerRow;
+  _pMemXfer->Columns      = pslot->memxfer.Columns;
+  _pMemXfer->Rows         = pslot->memxfer.Rows;
+  _pMemXfer->XOffset      = pslot->memxfer.XOffset;
+  _pMemXfer->YOffset      = pslot->memxfer.YOffset;
+  _pMemXfer->BytesWritten = pslot->memxfer.BytesWritten;
+
+  psession->nHead = (psession->nHead + 1) % psession->nSlots;
+  psession->nCount--;
+  CONDSIGNAL(psession->condSpace);
+  MUTEXUNLOCK(psession->mutex);
+
+  // That was the last one, so the worker is on its way out...
+  if (TWRC_SUCCESS != rc)
+  {
+    m_ptwndsmreadaheadimpl->Quiesce(psession);
+  }
+
+  return rc;
+}
+
+
+
+/**
+* Stop the worker.  Strips it's already read are kept for the next
+* DAT_IMAGEMEMXFER, unless the application is done with the image.
+* Events don't change the transfer, and an application pumping its
+* message loop sends one after every strip, so for those the worker
+* keeps going and we only wait for the strip it's on...
+*/
+bool CTwnDsmReadAhead::Pause(const TWID_T    _AppId,
+                             const TWID_T    _DsId,
+                             const TW_UINT16 _DAT,
+                             const TW_UINT16 _MSG)
+{
+  READAHEAD_SESSION *psession;
+
+  if (!m_ptwndsmreadaheadimpl->pod.m_bEnabled)
+  {
+    return false;
+  }
+  psession = m_ptwndsmreadaheadimpl->Find(_AppId,_DsId,false);
+  if (0 == psession)
+  {
+    return false;
+  }
+
+  if (   ((DAT_EVENT == _DAT) && (MSG_PROCESSEVENT == _MSG))
+      || (DAT_NULL == _DAT))
+  {
+    MUTEXLOCK(psession->mutexDriver);
+    return true;
+  }
+
+  m_ptwndsmreadaheadimpl->Quiesce(psession);
+
+  if (   (DAT_PENDINGXFERS == _DAT)
+      || ((DAT_USERINTERFACE == _DAT) && (MSG_DISABLEDS == _MSG)))
+  {
+    MUTEXLOCK(psession->mutex);
+    if (psession->nCount)
+    {
+      kLOG((kLOGINFO,"read-ahead dropping %u strips",psession->nCount));
+    }
+    psession->nCount = 0;
+    psession->nHead = 0;
+    MUTEXUNLOCK(psession->mutex);
+  }
+
+  return false;
+}
+
+
+
+/**
+* The driver is done with the event, let the worker back in...
+*/
+void CTwnDsmReadAhead::Resume(const TWID_T _AppId,
+                              const TWID_T _DsId)
+{
+  READAHEAD_SESSION *psession;
+
+  psession = m_ptwndsmreadaheadimpl->Find(_AppId,_DsId,false);
+  if (psession)
+  {
+    MUTEXUNLOCK(psession->mutexDriver);
+  }
+}
+
+
+
+/**
+* Stop the worker and give back the session...
+*/
+void CTwnDsmReadAhead::Stop(const TWID_T _AppId,
+                            const TWID_T _DsId)
+{
+  DS_SESSION        *pdssession;
+  READAHEAD_SESSION *psession;
+  UINT               ii;
+
+  if (!m_ptwndsmreadaheadimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+  psession = m_ptwndsmreadaheadimpl->Find(_AppId,_DsId,false);
+  if (0 == psession)
+  {
+    return;
+  }
+
+  m_ptwndsmreadaheadimpl->Quiesce(psession);
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  MUTEXLOCK(m_ptwndsmreadaheadimpl->pod.m_mutex);
+  pdssession->preadahead = 0;
+  MUTEXUNLOCK(m_ptwndsmreadaheadimpl->pod.m_mutex);
+
+  for (ii = 0; ii < READAHEAD_MAXSLOTS; ii++)
+  {
+    if (psession->aslot[ii].pBuffer)
+    {
+      free(psession->aslot[ii].pBuffer);
+    }
+  }
+  CONDDESTROY(psession->condSpace);
+  CONDDESTROY(psession->condReady);
+  MUTEXDESTROY(psession->mutexDriver);
+  MUTEXDESTROY(psession->mutex);
+  free(psession);
+}
+
+
+
+/**
+* The ring is made the first time the application asks for a strip,
+* and Stop takes it off the DS_SESSION...
+*/
+READAHEAD_SESSION *CTwnDsmReadAheadImpl::Find(const TWID_T _AppId,
+                                              const TWID_T _DsId,
+                                              const bool   _bCreate)
+{
+  DS_SESSION        *pdssession;
+  READAHEAD_SESSION *psession;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return 0;
+  }
+
+  MUTEXLOCK(pod.m_mutex);
+  psession = pdssession->preadahead;
+  if ((0 == psession) && _bCreate)
+  {
+    psession = (READAHEAD_SESSION*)calloc(1,sizeof(READAHEAD_SESSION));
+    if (psession)
+    {
+      psession->AppId = _AppId;
+      psession->DsId = _DsId;
+      psession->nSlots = pod.m_nSlots;
+      MUTEXINIT(psession->mutex);
+      MUTEXINIT(psession->mutexDriver);
+      CONDINIT(psession->condReady);
+      CONDINIT(psession->condSpace);
+      pdssession->preadahead = psession;
+    }
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+
+  return psession;
+}
+
+
+
+/**
+* The worker only checks bStop between strips, so this waits for
+* the one it's on...
+*/
+void CTwnDsmReadAheadImpl::Quiesce(READAHEAD_SESSION *_psession)
+{
+  bool bThread;
+
+  MUTEXLOCK(_psession->mutex);
+  _psession->bStop = true;
+  CONDSIGNAL(_psession->condSpace);
+  bThread = _psession->bThread;
+  _psession->bThread = false;
+  MUTEXUNLOCK(_psession->mutex);
+
+  if (bThread)
+  {
+    THREADJOIN(_psession->thread);
+  }
+}
+
+
+
+/**
+* Ask for strips until the ring is full, the driver says something
+* other than TWRC_SUCCESS, or we're told to stop...
+*/
+void CTwnDsmReadAheadImpl::Worker(READAHEAD_SESSION *_psession)
+{
+  TW_IMAGEMEMXFER memxfer;
+  TW_UINT16       rc;
+  UINT            nSlots = _psession->nSlots;
+  UINT            nTail;
+
+  // Run where the session was placed, if it was, so the strips land
+  // in memory on the same node...
+  g_ptwndsmaffinity->Pin(_psession->AppId,_psession->DsId);
+
+  MUTEXLOCK(_psession->mutex);
+  _psession->nThreadId = (UINT64)GETTHREADID();
+  while (!_psession->bStop)
+  {
+    // Wait for room...
+    if (_psession->nCount == nSlots)
+    {
+      CONDWAIT(_psession->condSpace,_psession->mutex);
+      continue;
+    }
+    nTail = (_psession->nHead + _psession->nCount) % nSlots;
+    MUTEXUNLOCK(_psession->mutex);
+
+    memxfer = _psession->memxferTemplate;
+    memxfer.Memory.Flags  = TWMF_APPOWNS | TWMF_POINTER;
+    memxfer.Memory.Length = _psession->nBytes;
+    memxfer.Memory.TheMem = (TW_MEMREF)_psession->aslot[nTail].pBuffer;
+    MUTEXLOCK(_psession->mutexDriver);
+    rc = g_ptwndsm->ReadAheadXfer(&_psession->identity,_psession->DsId,&memxfer);
+    MUTEXUNLOCK(_psession->mutexDriver);
+
+    MUTEXLOCK(_psession->mutex);
+    _psession->aslot[nTail].rc = rc;
+    _psession->aslot[nTail].memxfer = memxfer;
+    _psession->nCount++;
+    CONDSIGNAL(_psession->condReady);
+    if (TWRC_SUCCESS != rc)
+    {
+      break;
+    }
+  }
+  _psession->bRunning = false;
+  _psession->nThreadId = 0;
+  CONDSIGNAL(_psession->condReady);
+  MUTEXUNLOCK(_psession->mutex);
+}
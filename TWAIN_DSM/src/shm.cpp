@@ -0,0 +1,520 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+
+/**
+* @file shm.cpp
+* Shared memory.
+* Publish live counters for this process in a named shared memory
+* segment, where twaindsm-top can find them.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* Enviroment varible to turn the segment off, set it to 0...
+* @see CTwnDsmShm
+*/
+#define kSHMENV "TWAINDSM_SHM"
+
+/**
+* How many times we go around for the seqlock before we decide the
+* session is wedged and skip the change...
+*/
+#define SHM_MAXSPINS 1000000
+
+/**
+* How many times we'll clear out a stale segment with our name...
+*/
+#define SHM_MAXTRIES 3
+
+/**
+* The readers depend on the counters being aligned, so make sure
+* nobody has rearranged the structures in twaindsm.h...
+*/
+typedef char SHM_CHECK_SESSION[((sizeof(TW_TWDSM_SHMSESSION) % 8) == 0) ? 1 : -1];
+typedef char SHM_CHECK_HEADER[(((sizeof(TW_TWDSM_SHM) - sizeof(((TW_TWDSM_SHM*)0)->aSession)) % 8) == 0) ? 1 : -1];
+typedef char SHM_CHECK_BYTES[((offsetof(TW_TWDSM_SHMSESSION,Bytes) % 8) == 0) ? 1 : -1];
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmShmImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmShmImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Find an application's session.  The slot comes from the id,
+    * so there's no searching...
+    * @param[in] _AppId id of app
+    * @return the session or NULL
+    */
+    TW_TWDSM_SHMSESSION *Session(const TWID_T _AppId)
+    {
+      TW_TWDSM_SHMSESSION *psession;
+      if ((0 == pod.m_pshm) || (0 == _AppId))
+      {
+        return 0;
+      }
+      psession = &pod.m_pshm->aSession[_AppId % TWDSM_SHM_SESSIONS];
+      return (psession->AppId == (TW_UINT32)_AppId) ? psession : 0;
+    }
+
+    /**
+    * Take the seqlock, making Seq odd...
+    * @param[in] _psession the session to change
+    * @return false if it never came free, leave the session alone
+    */
+    static bool WriteBegin(TW_TWDSM_SHMSESSION *_psession);
+
+    /**
+    * Give up the seqlock, making Seq even again...
+    * @param[in] _psession the session we changed
+    */
+    static void WriteEnd(TW_TWDSM_SHMSESSION *_psession);
+
+    /**
+    * Get the name of our process, without any path...
+    * @param[out] _szName where it goes
+    * @param[in] _nChars room in _szName
+    */
+    static void GetProcessName(char      *_szName,
+                               const int  _nChars);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      TW_TWDSM_SHM *m_pshm;        /**< the segment, or NULL if we don't have one */
+      char          m_szName[64];  /**< the segment's name */
+      #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+        HANDLE      m_hmapping;    /**< the file mapping */
+      #endif
+    } pod;    /**< Pieces of data for CTwnDsmShmImpl*/
+};
+
+
+
+/**
+* The constructor for our class.  Create and map the segment.  We fill
+* in the magic last, so nobody trusts the header before it's done...
+*/
+CTwnDsmShm::CTwnDsmShm()
+{
+  char          szEnv[FILENAME_MAX];
+  TW_TWDSM_SHM *pshm = 0;
+
+  m_ptwndsmshmimpl = new CTwnDsmShmImpl;
+
+  // The only way to say no...
+  SGETENV(szEnv,NCHARS(szEnv),kSHMENV);
+  if (0 == strcmp(szEnv,"0"))
+  {
+    return;
+  }
+
+  SSNPRINTF(m_ptwndsmshmimpl->pod.m_szName,NCHARS(m_ptwndsmshmimpl->pod.m_szName),NCHARS(m_ptwndsmshmimpl->pod.m_szName),
+            "%s%u",TWDSM_SHM_PREFIX,(UINT)GETPROCESSID());
+
+  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+    m_ptwndsmshmimpl->pod.m_hmapping = ::CreateFileMappingA(INVALID_HANDLE_VALUE,NULL,PAGE_READWRITE,0,sizeof(TW_TWDSM_SHM),m_ptwndsmshmimpl->pod.m_szName);
+    if (0 == m_ptwndsmshmimpl->pod.m_hmapping)
+    {
+      kLOG((kLOGERR,"Unable to create the shared memory segment: %s",m_ptwndsmshmimpl->pod.m_szName));
+      return;
+    }
+    if (ERROR_ALREADY_EXISTS == ::GetLastError())
+    {
+      kLOG((kLOGERR,"%s already exists, not using it",m_ptwndsmshmimpl->pod.m_szName));
+      ::CloseHandle(m_ptwndsmshmimpl->pod.m_hmapping);
+      m_ptwndsmshmimpl->pod.m_hmapping = 0;
+      return;
+    }
+    pshm = (TW_TWDSM_SHM*)::MapViewOfFile(m_ptwndsmshmimpl->pod.m_hmapping,FILE_MAP_WRITE,0,0,sizeof(TW_TWDSM_SHM));
+    if (0 == pshm)
+    {
+      kLOG((kLOGERR,"Unable to map the shared memory segment: %s",m_ptwndsmshmimpl->pod.m_szName));
+      ::CloseHandle(m_ptwndsmshmimpl->pod.m_hmapping);
+      m_ptwndsmshmimpl->pod.m_hmapping = 0;
+      return;
+    }
+  #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+    int         fd;
+    int         nTry;
+    void       *pv;
+    struct stat st;
+
+    // The name is easy to guess, so it has to be a segment we made.
+    // One that's already there is either left over from a process
+    // that had our pid, which we can throw away, or it belongs to
+    // somebody else, in which case we go without...
+    fd = -1;
+    for (nTry = 0; nTry < SHM_MAXTRIES; nTry++)
+    {
+      fd = shm_open(m_ptwndsmshmimpl->pod.m_szName,O_CREAT|O_EXCL|O_RDWR,0644);
+      if ((fd >= 0) || (EEXIST != errno))
+      {
+        break;
+      }
+      fd = shm_open(m_ptwndsmshmimpl->pod.m_szName,O_RDONLY,0);
+      if (fd < 0)
+      {
+        continue;
+      }
+      if (   (0 != fstat(fd,&st))
+          || (st.st_uid != geteuid())
+          || (0 != (st.st_mode & (S_IWGRP|S_IWOTH))))
+      {
+        kLOG((kLOGERR,"%s already exists and isn't ours (uid %u, mode %o), not using it",
+              m_ptwndsmshmimpl->pod.m_szName,(UINT)st.st_uid,(UINT)(st.st_mode & 0777)));
+        close(fd);
+        return;
+      }
+      close(fd);
+      fd = -1;
+      kLOG((kLOGINFO,"removing stale shared memory segment: %s",m_ptwndsmshmimpl->pod.m_szName));
+      shm_unlink(m_ptwndsmshmimpl->pod.m_szName);
+    }
+    if (fd < 0)
+    {
+      kLOG((kLOGERR,"Unable to create the shared memory segment: %s, errno %d",m_ptwndsmshmimpl->pod.m_szName,errno));
+      return;
+    }
+    pv = MAP_FAILED;
+    if (0 == ftruncate(fd,sizeof(TW_TWDSM_SHM)))
+    {
+      pv = mmap(0,sizeof(TW_TWDSM_SHM),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    }
+    close(fd);
+    if (MAP_FAILED == pv)
+    {
+      kLOG((kLOGERR,"Unable to map the shared memory segment: %s",m_ptwndsmshmimpl->pod.m_szName));
+      shm_unlink(m_ptwndsmshmimpl->pod.m_szName);
+      return;
+    }
+    pshm = (TW_TWDSM_SHM*)pv;
+  #else
+    #error Sorry, we do not recognize this system...
+  #endif
+
+  // A new mapping is all zeros, so we only need the header...
+  pshm->Version   = TWDSM_SHM_VERSION;
+  pshm->Size      = sizeof(TW_TWDSM_SHM);
+  pshm->Pid       = (TW_UINT32)GETPROCESSID();
+  pshm->StartTime = (TW_UINT32)time(0);
+  pshm->Sessions  = TWDSM_SHM_SESSIONS;
+  CTwnDsmShmImpl::GetProcessName((char*)pshm->ProcessName,NCHARS(pshm->ProcessName));
+  MEMORYBARRIER;
+  pshm->Magic     = TWDSM_SHM_MAGIC;
+
+  m_ptwndsmshmimpl->pod.m_pshm = pshm;
+  kLOG((kLOGINFO,"shared memory segment: %s",m_ptwndsmshmimpl->pod.m_szName));
+}
+
+
+
+/**
+* The destructor for our class.  Unmap and remove the segment, anybody
+* still looking at it keeps their copy until they let go...
+*/
+CTwnDsmShm::~CTwnDsmShm()
+{
+  if (m_ptwndsmshmimpl)
+  {
+    if (m_ptwndsmshmimpl->pod.m_pshm)
+    {
+      #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+        ::UnmapViewOfFile(m_ptwndsmshmimpl->pod.m_pshm);
+        ::CloseHandle(m_ptwndsmshmimpl->pod.m_hmapping);
+      #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+        munmap(m_ptwndsmshmimpl->pod.m_pshm,sizeof(TW_TWDSM_SHM));
+        shm_unlink(m_ptwndsmshmimpl->pod.m_szName);
+      #else
+        #error Sorry, we do not recognize this system...
+      #endif
+    }
+    delete m_ptwndsmshmimpl;
+    m_ptwndsmshmimpl = 0;
+  }
+}
+
+
+
+/**
+* Claim a session.  The slot is the id modulo the number of sessions,
+* if somebody else still has it we go without...
+*/
+void CTwnDsmShm::AddApp(const TW_IDENTITY *_pAppId)
+{
+  TW_TWDSM_SHMSESSION *psession;
+
+  if ((0 == m_ptwndsmshmimpl->pod.m_pshm) || (0 == _pAppId) || (0 == _pAppId->Id))
+  {
+    return;
+  }
+
+  psession = &m_ptwndsmshmimpl->pod.m_pshm->aSession[(TWID_T)_pAppId->Id % TWDSM_SHM_SESSIONS];
+  if ((0 != psession->AppId) && ((TW_UINT32)(TWID_T)_pAppId->Id != psession->AppId))
+  {
+    kLOG((kLOGINFO,"no shared memory session for %.32s, slot is in use",_pAppId->ProductName));
+    return;
+  }
+
+  if (!CTwnDsmShmImpl::WriteBegin(psession))
+  {
+    return;
+  }
+  memset((char*)psession + sizeof(psession->Seq),0,sizeof(*psession) - sizeof(psession->Seq));
+  psession->AppId = (TW_UINT32)(TWID_T)_pAppId->Id;
+  memcpy(psession->AppName,_pAppId->ProductName,sizeof(psession->AppName));
+  psession->Node = -1;
+  CTwnDsmShmImpl::WriteEnd(psession);
+}
+
+
+
+/**
+* Free a session...
+*/
+void CTwnDsmShm::RemoveApp(const TWID_T _AppId)
+{
+  TW_TWDSM_SHMSESSION *psession = m_ptwndsmshmimpl->Session(_AppId);
+  if (psession && CTwnDsmShmImpl::WriteBegin(psession))
+  {
+    psession->AppId = 0;
+    CTwnDsmShmImpl::WriteEnd(psession);
+  }
+}
+
+
+
+/**
+* Name the driver, or clear it...
+*/
+void CTwnDsmShm::SetDs(const TWID_T       _AppId,
+                       const TW_IDENTITY *_pDsId)
+{
+  TW_TWDSM_SHMSESSION *psession = m_ptwndsmshmimpl->Session(_AppId);
+  if (psession && CTwnDsmShmImpl::WriteBegin(psession))
+  {
+    if (_pDsId)
+    {
+      memcpy(psession->DsName,_pDsId->ProductName,sizeof(psession->DsName));
+    }
+    else
+    {
+      memset(psession->DsName,0,sizeof(psession->DsName));
+      psession->Node = -1;
+      psession->Cpus = 0;
+    }
+    CTwnDsmShmImpl::WriteEnd(psession);
+  }
+}
+
+
+
+/**
+* Say where the driver's threads run...
+*/
+void CTwnDsmShm::SetPlacement(const TWID_T _AppId,
+                              const int    _nNode,
+                              const UINT   _nCpus)
+{
+  TW_TWDSM_SHMSESSION *psession = m_ptwndsmshmimpl->Session(_AppId);
+  if (psession && CTwnDsmShmImpl::WriteBegin(psession))
+  {
+    psession->Node = (TW_INT32)_nNode;
+    psession->Cpus = (TW_UINT32)_nCpus;
+    CTwnDsmShmImpl::WriteEnd(psession);
+  }
+}
+
+
+
+/**
+* The counters are on the hot path, so they're just atomic adds,
+* with no seqlock...
+*/
+void CTwnDsmShm::Triplet(const TWID_T _AppId)
+{
+  TW_TWDSM_SHMSESSION *psession = m_ptwndsmshmimpl->Session(_AppId);
+  if (psession)
+  {
+    ATOMICADD32(&psession->Triplets,1);
+  }
+}
+
+void CTwnDsmShm::DsEnter(const TWID_T _AppId)
+{
+  TW_TWDSM_SHMSESSION *psession = m_ptwndsmshmimpl->Session(_AppId);
+  if (psession)
+  {
+    ATOMICADD32(&psession->InFlight,1);
+  }
+}
+
+void CTwnDsmShm::DsLeave(const TWID_T    _AppId,
+                         const TW_UINT32 _bytes)
+{
+  TW_TWDSM_SHMSESSION *psession = m_ptwndsmshmimpl->Session(_AppId);
+  if (psession)
+  {
+    ATOMICADD32(&psession->InFlight,(TW_UINT32)-1);
+    if (_bytes)
+    {
+      ATOMICADD64(&psession->Bytes,(TW_TWDSM_UINT64)_bytes);
+    }
+  }
+}
+
+void CTwnDsmShm::SetCallbackDepth(const TWID_T    _AppId,
+                                  const TW_UINT32 _depth)
+{
+  TW_TWDSM_SHMSESSION *psession = m_ptwndsmshmimpl->Session(_AppId);
+  if (psession)
+  {
+    psession->CallbackDepth = _depth;
+  }
+}
+
+
+
+/**
+* Remember the last failure.  This takes the seqlock, since a reader
+* needs to see all of the fields from the same error...
+*/
+void CTwnDsmShm::Error(const TWID_T    _AppId,
+                       const TWID_T    _DsId,
+                       const TW_UINT32 _DG,
+                       const TW_UINT16 _DAT,
+                       const TW_UINT16 _MSG,
+                       const TW_UINT16 _rc,
+                       const TW_UINT16 _cc)
+{
+  TW_TWDSM_SHMSESSION *psession = m_ptwndsmshmimpl->Session(_AppId);
+  if (psession && CTwnDsmShmImpl::WriteBegin(psession))
+  {
+    psession->LastTime = (TW_UINT32)time(0);
+    psession->LastDsId = (TW_UINT32)_DsId;
+    psession->LastDG   = _DG;
+    psession->LastDAT  = _DAT;
+    psession->LastMSG  = _MSG;
+    psession->LastRC   = _rc;
+    psession->LastCC   = _cc;
+    CTwnDsmShmImpl::WriteEnd(psession);
+  }
+}
+
+
+
+/**
+* Writers are rare (open, close, errors), but they can come from
+* more than one thread, so we take the lock with a compare-and-swap
+* on an even Seq.  A Seq that stays odd means a writer is gone, and
+* the counters aren't worth hanging a triplet over...
+*/
+bool CTwnDsmShmImpl::WriteBegin(TW_TWDSM_SHMSESSION *_psession)
+{
+  TW_UINT32 seq = 0;
+  int       nSpins;
+  for (nSpins = 0; nSpins < SHM_MAXSPINS; nSpins++)
+  {
+    seq = _psession->Seq;
+    if (!(seq & 1) && ATOMICCAS32(&_psession->Seq,seq,seq + 1))
+    {
+      MEMORYBARRIER;
+      return true;
+    }
+    // Somebody else is writing, they won't be long...
+  }
+  kLOG((kLOGERR,"shared memory session for AppId %u is stuck, Seq %u, skipping it",(UINT)_psession->AppId,(UINT)seq));
+  return false;
+}
+
+void CTwnDsmShmImpl::WriteEnd(TW_TWDSM_SHMSESSION *_psession)
+{
+  MEMORYBARRIER;
+  ATOMICADD32(&_psession->Seq,1);
+}
+
+
+
+/**
+* Every system has its own way of doing this...
+*/
+void CTwnDsmShmImpl::GetProcessName(char      *_szName,
+                                    const int  _nChars)
+{
+  char  szPath[FILENAME_MAX];
+  char *pszName;
+
+  szPath[0] = 0;
+  #if (TWNDSM_CMP == TWNDSM_CMP_VISUALCPP)
+    ::GetModuleFileNameA(NULL,szPath,NCHARS(szPath));
+    szPath[NCHARS(szPath) - 1] = 0;
+    pszName = strrchr(szPath,'\\');
+  #elif (TWNDSM_OS == TWNDSM_OS_MACOSX)
+    SSTRCPY(szPath,NCHARS(szPath),getprogname());
+    pszName = 0;
+  #elif (TWNDSM_CMP == TWNDSM_CMP_GNUGPP)
+    FILE *pfile = fopen("/proc/self/comm","r");
+    if (pfile)
+    {
+      if (0 == fgets(szPath,NCHARS(szPath),pfile))
+      {
+        szPath[0] = 0;
+      }
+      fclose(pfile);
+    }
+    szPath[strcspn(szPath,"\r\n")] = 0;
+    pszName = 0;
+  #else
+    #error Sorry, we do not recognize this system...
+  #endif
+
+  SSTRNCPY(_szName,_nChars,pszName ? &pszName[1] : szPath,_nChars - 1);
+}
@@ -0,0 +1,506 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+/**
+* @file trace.cpp
+* Trace spans.
+* Write begin/end spans for the DSM, the drivers and the application
+* callbacks in the Chrome trace-event JSON format.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* Enviroment varible of the path to the trace file.  If it's not
+* set, then we don't trace.
+* @see CTwnDsmTrace
+*/
+#define kTRACEENV "TWAINDSM_TRACE"
+
+/**
+* Maximum number of flows we can track at one time, one for each
+* application/driver pair that's sent a MSG_XFERREADY...
+* @see CTwnDsmTrace
+*/
+#define TWNDSM_MAX_FLOWS 64
+
+/**
+* Maximum length of a single event after escaping...
+* @see CTwnDsmTrace
+*/
+#define TWNDSM_MAX_EVENT 1024
+
+/**
+* How many times the DSM has been opened in this process.  It outlives
+* CTwnDsmTrace, so each session can have a file of its own...
+* @see CTwnDsmTrace
+*/
+static UINT s_nTraceSessions = 0;
+
+
+
+/**
+* A flow that's waiting for its transfers...
+*/
+typedef struct
+{
+  TWID_T    AppId;  /**< the application */
+  TWID_T    DsId;   /**< the driver */
+  TW_UINT32 FlowId; /**< the id that ties the arrows together */
+} TRACE_FLOW;
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmTraceImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmTraceImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Write one event to the file.  The caller has already built the
+    * body of the event, we add the stuff common to all of them...
+    * @param[in] _phase the Chrome phase character
+    * @param[in] _cat the category
+    * @param[in] _name the name
+    * @param[in] _extra more fields for the event, must start with a comma, or be empty
+    */
+    void Write(const char        _phase,
+               const char* const _cat,
+               const char* const _name,
+               const char* const _extra);
+
+    /**
+    * Copy a string, escaping anything that would break the JSON...
+    * @param[out] _szDst where the string goes
+    * @param[in] _nChars room in _szDst
+    * @param[in] _szSrc the string to escape
+    */
+    static void Escape(char             *_szDst,
+                       const int         _nChars,
+                       const char* const _szSrc);
+
+    /**
+    * Work out the file for this session.  %p is the process id, %n
+    * is the session, and %% is a percent sign.  Without a %n, every
+    * session after the first gets .N on the end, so it doesn't wipe
+    * out the one before it...
+    * @param[out] _szDst the path
+    * @param[in] _nChars room in _szDst
+    * @param[in] _szSrc TWAINDSM_TRACE
+    * @param[in] _nSession the session, starting at 1
+    */
+    static void ExpandPath(char             *_szDst,
+                           const int         _nChars,
+                           const char* const _szSrc,
+                           const UINT        _nSession);
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      FILE      *m_ptrace;                      /**< where we'll dump the events. */
+      char       m_tracepath[FILENAME_MAX];     /**< where we put the file. */
+      bool       m_bFirst;                      /**< true until we've written an event. */
+      UINT64     m_tickStart;                   /**< ticks when we started, to keep ts small. */
+      UINT       m_pid;                         /**< our process id. */
+      MUTEX      m_mutex;                       /**< drivers can call us from their own threads. */
+      TRACE_FLOW m_aflow[TWNDSM_MAX_FLOWS];     /**< flows waiting on transfers. */
+      TW_UINT32  m_nextFlowId;                  /**< the next flow id to hand out. */
+    } pod;    /**< Pieces of data for CTwnDsmTraceImpl*/
+};
+
+
+
+/**
+* The constructor for our class.  If TWAINDSM_TRACE has a path in
+* it, then we'll open the file and start the JSON array.  The file
+* is always wiped clean, because a partial trace from a previous
+* run would make a mess of the timeline, but each session in this
+* process gets a file of its own...
+*/
+CTwnDsmTrace::CTwnDsmTrace()
+{
+  char szEnv[FILENAME_MAX];
+
+  // Init stuff...
+  m_ptwndsmtraceimpl = new CTwnDsmTraceImpl;
+  MUTEXINIT(m_ptwndsmtraceimpl->pod.m_mutex);
+
+  // see if a tracefile is to be used
+  SGETENV(szEnv,NCHARS(szEnv),kTRACEENV);
+  if (0 == szEnv[0])
+  {
+    return;
+  }
+  s_nTraceSessions++;
+  CTwnDsmTraceImpl::ExpandPath(m_ptwndsmtraceimpl->pod.m_tracepath,NCHARS(m_ptwndsmtraceimpl->pod.m_tracepath),szEnv,s_nTraceSessions);
+
+  FOPEN(m_ptwndsmtraceimpl->pod.m_ptrace,m_ptwndsmtraceimpl->pod.m_tracepath,"w");
+  if (0 == m_ptwndsmtraceimpl->pod.m_ptrace)
+  {
+    kLOG((kLOGERR,"tracing has been disabled because tracefile could not be opened: file=<%s>",m_ptwndsmtraceimpl->pod.m_tracepath));
+    m_ptwndsmtraceimpl->pod.m_tracepath[0] = 0;
+    return;
+  }
+
+  // The array is all Chrome needs, and it'll tolerate a missing
+  // closing bracket if we crash...
+  fprintf(m_ptwndsmtraceimpl->pod.m_ptrace,"[\n");
+  m_ptwndsmtraceimpl->pod.m_bFirst = true;
+  m_ptwndsmtraceimpl->pod.m_tickStart = DSM_GetTickNs();
+  m_ptwndsmtraceimpl->pod.m_pid = (UINT)GETPROCESSID();
+  m_ptwndsmtraceimpl->pod.m_nextFlowId = 1;
+}
+
+
+
+/**
+* The destructor for our class.  Close the JSON array and the
+* file, and destroy our implementation class...
+*/
+CTwnDsmTrace::~CTwnDsmTrace()
+{
+  if (m_ptwndsmtraceimpl)
+  {
+    if (m_ptwndsmtraceimpl->pod.m_ptrace)
+    {
+      fprintf(m_ptwndsmtraceimpl->pod.m_ptrace,"\n]\n");
+      fclose(m_ptwndsmtraceimpl->pod.m_ptrace);
+    }
+    MUTEXDESTROY(m_ptwndsmtraceimpl->pod.m_mutex);
+    delete m_ptwndsmtraceimpl;
+    m_ptwndsmtraceimpl = 0;
+  }
+}
+
+
+
+/**
+* Are we tracing?
+*/
+bool CTwnDsmTrace::IsEnabled()
+{
+  return (0 != m_ptwndsmtraceimpl->pod.m_ptrace);
+}
+
+
+
+/**
+* Start a span...
+*/
+void CTwnDsmTrace::Begin(const char* const _cat,
+                         const char* const _name,
+                         const char* const _detail)
+{
+  char szDetail[TWNDSM_MAX_EVENT / 2];
+  char szExtra[TWNDSM_MAX_EVENT];
+
+  if (!IsEnabled())
+  {
+    return;
+  }
+
+  szExtra[0] = 0;
+  if (_detail && _detail[0])
+  {
+    CTwnDsmTraceImpl::Escape(szDetail,NCHARS(szDetail),_detail);
+    SSNPRINTF(szExtra,NCHARS(szExtra),NCHARS(szExtra),",\"args\":{\"detail\":\"%s\"}",szDetail);
+  }
+  m_ptwndsmtraceimpl->Write('B',_cat,_name,szExtra);
+}
+
+
+
+/**
+* End a span...
+*/
+void CTwnDsmTrace::End(const char* const _cat,
+                       const char* const _name,
+                       const int         _rc)
+{
+  char szExtra[64];
+
+  if (!IsEnabled())
+  {
+    return;
+  }
+
+  szExtra[0] = 0;
+  if (_rc >= 0)
+  {
+    SSNPRINTF(szExtra,NCHARS(szExtra),NCHARS(szExtra),",\"args\":{\"rc\":%d}",_rc);
+  }
+  m_ptwndsmtraceimpl->Write('E',_cat,_name,szExtra);
+}
+
+
+
+/**
+* Start, step or finish a flow.  We only allow one flow per
+* application/driver pair, a new MSG_XFERREADY replaces the old
+* one...
+*/
+void CTwnDsmTrace::Flow(const char   _phase,
+                        const TWID_T _AppId,
+                        const TWID_T _DsId)
+{
+  int        ii;
+  TW_UINT32  FlowId = 0;
+  TRACE_FLOW *pflow = 0;
+  char       szExtra[64];
+
+  if (!IsEnabled())
+  {
+    return;
+  }
+
+  // Find our pair...
+  MUTEXLOCK(m_ptwndsmtraceimpl->pod.m_mutex);
+  for (ii = 0; (0 == pflow) && (ii < TWNDSM_MAX_FLOWS); ii++)
+  {
+    if (   (m_ptwndsmtraceimpl->pod.m_aflow[ii].FlowId != 0)
+        && (m_ptwndsmtraceimpl->pod.m_aflow[ii].AppId == _AppId)
+        && (m_ptwndsmtraceimpl->pod.m_aflow[ii].DsId == _DsId))
+    {
+      pflow = &m_ptwndsmtraceimpl->pod.m_aflow[ii];
+    }
+  }
+
+  // ...or an empty slot, if we're starting one...
+  if ('s' == _phase)
+  {
+    for (ii = 0; (0 == pflow) && (ii < TWNDSM_MAX_FLOWS); ii++)
+    {
+      if (0 == m_ptwndsmtraceimpl->pod.m_aflow[ii].FlowId)
+      {
+        pflow = &m_ptwndsmtraceimpl->pod.m_aflow[ii];
+      }
+    }
+  }
+
+  // Start hands out a new id, the others need one to work with...
+  if ('s' == _phase)
+  {
+    if (pflow)
+    {
+      pflow->AppId = _AppId;
+      pflow->DsId = _DsId;
+      pflow->FlowId = m_ptwndsmtraceimpl->pod.m_nextFlowId++;
+      FlowId = pflow->FlowId;
+    }
+  }
+  else if (pflow)
+  {
+    FlowId = pflow->FlowId;
+    if ('f' == _phase)
+    {
+      memset(pflow,0,sizeof(*pflow));
+    }
+  }
+  MUTEXUNLOCK(m_ptwndsmtraceimpl->pod.m_mutex);
+
+  // Nothing to draw...
+  if (0 == FlowId)
+  {
+    return;
+  }
+
+  // Bind to the enclosing span, not the next one...
+  SSNPRINTF(szExtra,NCHARS(szExtra),NCHARS(szExtra),",\"id\":%u,\"bp\":\"e\"",(unsigned int)FlowId);
+  m_ptwndsmtraceimpl->Write(_phase,"flow","MSG_XFERREADY",szExtra);
+}
+
+
+
+/**
+* Add a point to a graph.  The series is named for the pair, so each
+* session gets its own line...
+*/
+void CTwnDsmTrace::Counter(const char* const _name,
+                           const TWID_T      _AppId,
+                           const TWID_T      _DsId,
+                           const UINT64      _ns)
+{
+  char szExtra[96];
+
+  if (!IsEnabled())
+  {
+    return;
+  }
+
+  SSNPRINTF(szExtra,NCHARS(szExtra),NCHARS(szExtra),",\"args\":{\"app%u_ds%u_us\":%llu.%03u}",
+            (unsigned int)_AppId,
+            (unsigned int)_DsId,
+            (unsigned long long)(_ns / 1000),
+            (unsigned int)(_ns % 1000));
+  m_ptwndsmtraceimpl->Write('C',"latency",_name,szExtra);
+}
+
+
+
+/**
+* Write an event.  Timestamps are in microseconds, which is what
+* Chrome expects, but we keep the fraction so short calls don't
+* all collapse to zero...
+*/
+void CTwnDsmTraceImpl::Write(const char        _phase,
+                             const char* const _cat,
+                             const char* const _name,
+                             const char* const _extra)
+{
+  char   szName[256];
+  UINT64 tick;
+
+  Escape(szName,NCHARS(szName),_name);
+  tick = DSM_GetTickNs() - pod.m_tickStart;
+
+  MUTEXLOCK(pod.m_mutex);
+  if (pod.m_ptrace)
+  {
+    fprintf(pod.m_ptrace,
+            "%s{\"ph\":\"%c\",\"cat\":\"%s\",\"name\":\"%s\",\"ts\":%llu.%03u,\"pid\":%u,\"tid\":%u%s}",
+            pod.m_bFirst ? "" : ",\n",
+            _phase,
+            _cat,
+            szName,
+            (unsigned long long)(tick / 1000),
+            (unsigned int)(tick % 1000),
+            pod.m_pid,
+            (unsigned int)GETTHREADID(),
+            _extra ? _extra : "");
+    pod.m_bFirst = false;
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+}
+
+
+
+/**
+* Escape a string for JSON.  Windows paths are full of backslashes,
+* and product names can have anything in them...
+*/
+void CTwnDsmTraceImpl::Escape(char             *_szDst,
+                              const int         _nChars,
+                              const char* const _szSrc)
+{
+  int ii;
+  int jj = 0;
+
+  for (ii = 0; _szSrc[ii] && (jj < (_nChars - 3)); ii++)
+  {
+    unsigned char ch = (unsigned char)_szSrc[ii];
+    if (('"' == ch) || ('\\' == ch))
+    {
+      _szDst[jj++] = '\\';
+      _szDst[jj++] = (char)ch;
+    }
+    else if (ch < ' ')
+    {
+      _szDst[jj++] = ' ';
+    }
+    else
+    {
+      _szDst[jj++] = (char)ch;
+    }
+  }
+  _szDst[jj] = 0;
+}
+
+
+
+/**
+* Copy the path a character at a time, filling in the escapes as we
+* go...
+*/
+void CTwnDsmTraceImpl::ExpandPath(char             *_szDst,
+                                  const int         _nChars,
+                                  const char* const _szSrc,
+                                  const UINT        _nSession)
+{
+  char szNumber[32];
+  int  ii;
+  int  jj = 0;
+  int  kk;
+  bool bSession = false;
+
+  for (ii = 0; _szSrc[ii] && (jj < (_nChars - 1)); ii++)
+  {
+    szNumber[0] = 0;
+    if (('%' == _szSrc[ii]) && ('p' == _szSrc[ii + 1]))
+    {
+      SSNPRINTF(szNumber,NCHARS(szNumber),NCHARS(szNumber),"%u",(UINT)GETPROCESSID());
+    }
+    else if (('%' == _szSrc[ii]) && ('n' == _szSrc[ii + 1]))
+    {
+      SSNPRINTF(szNumber,NCHARS(szNumber),NCHARS(szNumber),"%u",_nSession);
+      bSession = true;
+    }
+    else if (('%' == _szSrc[ii]) && ('%' == _szSrc[ii + 1]))
+    {
+      SSTRCPY(szNumber,NCHARS(szNumber),"%");
+    }
+    else
+    {
+      _szDst[jj++] = _szSrc[ii];
+      continue;
+    }
+    ii++;
+    for (kk = 0; szNumber[kk] && (jj < (_nChars - 1)); kk++)
+    {
+      _szDst[jj++] = szNumber[kk];
+    }
+  }
+  _szDst[jj] = 0;
+
+  if (!bSession && (_nSession > 1))
+  {
+    SSNPRINTF(szNumber,NCHARS(szNumber),NCHARS(szNumber),".%u",_nSession);
+    if ((jj + (int)strlen(szNumber)) < _nChars)
+    {
+      SSTRCAT(_szDst,_nChars,szNumber);
+    }
+  }
+}
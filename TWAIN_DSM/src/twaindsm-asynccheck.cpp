@@ -0,0 +1,413 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+/**
+* @file twaindsm-asynccheck.cpp
+* DSM_EntryAsync check.
+* Open the stub driver (twaindsm-stubds) with TWAINDSM_ACTORS and
+* TWAINDSM_READAHEAD on, and transfer its images a strip at a time,
+* one image with tickets collected by DAT_TWDSM_SUBMIT, one with
+* DSMASYNCPROC callbacks, and one with co_await on CTwnDsmAwait (or
+* callbacks again, without C++20).  Every strip has to come back the
+* way the stub wrote it.  ctest gives it a timeout, since the way this
+* goes wrong is that it never comes back at all.
+*
+* Usage: twaindsm-asynccheck
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "twaindsmawait.h"
+
+
+
+/**
+* How we send a strip...
+*/
+typedef enum
+{
+  kHOWTICKET,     /**< DSM_EntryAsync, then DAT_TWDSM_SUBMIT/MSG_GET */
+  kHOWCALLBACK,   /**< DSM_EntryAsync with a DSMASYNCPROC */
+  kHOWAWAIT       /**< co_await CTwnDsmAwait */
+} CHECK_HOW;
+
+static const char *s_aszHow[] = { "ticket", "callback", "co_await" };
+
+
+
+/**
+* The application, the driver, and how many things went wrong...
+*/
+static TW_IDENTITY s_twidentityApp;
+static TW_IDENTITY s_twidentityDs;
+static int         s_nFailed;
+
+/**
+* A callback, or a coroutine, hands its answer to the main thread
+* through these...
+*/
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  s_cond = PTHREAD_COND_INITIALIZER;
+static bool            s_bDone;
+static TW_TWDSM_SUBMIT s_twsubmit;
+
+
+
+/**
+* Post an answer, from the driver's thread...
+*/
+static void Post(const TW_TWDSM_SUBMIT *_psubmit)
+{
+  pthread_mutex_lock(&s_mutex);
+  s_twsubmit = *_psubmit;
+  s_bDone = true;
+  pthread_cond_signal(&s_cond);
+  pthread_mutex_unlock(&s_mutex);
+}
+
+
+
+/**
+* Wait for it, on ours...
+*/
+static TW_TWDSM_SUBMIT Collect()
+{
+  TW_TWDSM_SUBMIT twsubmit;
+
+  pthread_mutex_lock(&s_mutex);
+  while (!s_bDone)
+  {
+    pthread_cond_wait(&s_cond,&s_mutex);
+  }
+  s_bDone = false;
+  twsubmit = s_twsubmit;
+  pthread_mutex_unlock(&s_mutex);
+
+  return twsubmit;
+}
+
+
+
+/**
+* The DSMASYNCPROC...
+*/
+static void TW_CALLINGSTYLE AsyncDone(pTW_IDENTITY     _pOrigin,
+                                      pTW_TWDSM_SUBMIT _pSubmit,
+                                      TW_MEMREF        _pRefCon)
+{
+  (void)_pOrigin;
+  (void)_pRefCon;
+  Post(_pSubmit);
+}
+
+
+
+#if defined(TWDSM_HAS_COROUTINES)
+
+/**
+* Just enough of a coroutine type to run one to the end...
+*/
+struct CheckTask
+{
+  struct promise_type
+  {
+    CheckTask get_return_object() { return CheckTask(); }
+    std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+    std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+    void return_void() {}
+    void unhandled_exception() {}
+  };
+};
+
+/**
+* One strip, by co_await.  We pick up on the driver's thread...
+*/
+static CheckTask AwaitStrip(TW_IMAGEMEMXFER *_pMemXfer)
+{
+  TW_TWDSM_SUBMIT twsubmit = co_await CTwnDsmAwait(&s_twidentityApp,&s_twidentityDs,DG_IMAGE,DAT_IMAGEMEMXFER,MSG_GET,(TW_MEMREF)_pMemXfer);
+  Post(&twsubmit);
+}
+
+#endif
+
+
+
+/**
+* Send a triplet to the driver the way we're asked to, and wait for
+* the answer...
+*/
+static TW_UINT16 Send(CHECK_HOW  _how,
+                      TW_UINT32  _DG,
+                      TW_UINT16  _DAT,
+                      TW_UINT16  _MSG,
+                      TW_MEMREF  _pData)
+{
+  TW_TWDSM_SUBMIT twsubmit;
+  TW_UINT32       uTicket = 0;
+  TW_UINT16       rc;
+
+  memset(&twsubmit,0,sizeof(twsubmit));
+  switch (_how)
+  {
+    case kHOWTICKET:
+      rc = DSM_EntryAsync(&s_twidentityApp,&s_twidentityDs,_DG,_DAT,_MSG,_pData,0,0,&uTicket);
+      if (TWRC_SUCCESS != rc)
+      {
+        printf("DSM_EntryAsync didn't queue a ticket\n");
+        return TWRC_FAILURE;
+      }
+      twsubmit.Ticket = uTicket;
+      rc = DSM_Entry(&s_twidentityApp,0,DG_CONTROL,DAT_TWDSM_SUBMIT,MSG_GET,(TW_MEMREF)&twsubmit);
+      if ((TWRC_SUCCESS != rc) || (twsubmit.Ticket != uTicket))
+      {
+        printf("DAT_TWDSM_SUBMIT/MSG_GET didn't hand back ticket %u\n",(unsigned int)uTicket);
+        return TWRC_FAILURE;
+      }
+      return twsubmit.ReturnCode;
+
+    case kHOWCALLBACK:
+      rc = DSM_EntryAsync(&s_twidentityApp,&s_twidentityDs,_DG,_DAT,_MSG,_pData,AsyncDone,0,&uTicket);
+      if (TWRC_SUCCESS != rc)
+      {
+        printf("DSM_EntryAsync didn't queue a callback\n");
+        return TWRC_FAILURE;
+      }
+      twsubmit = Collect();
+      if (twsubmit.Ticket != uTicket)
+      {
+        printf("the callback was for ticket %u, not %u\n",(unsigned int)twsubmit.Ticket,(unsigned int)uTicket);
+        return TWRC_FAILURE;
+      }
+      return twsubmit.ReturnCode;
+
+    case kHOWAWAIT:
+      #if defined(TWDSM_HAS_COROUTINES)
+        if ((DG_IMAGE == _DG) && (DAT_IMAGEMEMXFER == _DAT))
+        {
+          AwaitStrip((TW_IMAGEMEMXFER*)_pData);
+          twsubmit = Collect();
+          return twsubmit.ReturnCode;
+        }
+      #endif
+      return Send(kHOWCALLBACK,_DG,_DAT,_MSG,_pData);
+  }
+
+  return TWRC_FAILURE;
+}
+
+
+
+/**
+* Check a strip against what the stub writes, see StubPixel in
+* twaindsm-stubds.cpp...
+*/
+static bool CheckStrip(const TW_IMAGEMEMXFER *_pMemXfer,
+                       const TW_IMAGEINFO    *_pImageInfo,
+                       TW_UINT32             *_pnRow)
+{
+  const TW_UINT8 *pRow;
+  TW_UINT32       rr;
+  TW_UINT32       cc;
+
+  if (   (_pMemXfer->YOffset != *_pnRow)
+      || (_pMemXfer->Columns != (TW_UINT32)_pImageInfo->ImageWidth)
+      || (_pMemXfer->BytesPerRow != (TW_UINT32)_pImageInfo->ImageWidth)
+      || (0 == _pMemXfer->Rows)
+      || (_pMemXfer->BytesWritten != (_pMemXfer->Rows * _pMemXfer->BytesPerRow)))
+  {
+    printf("strip at row %u has YOffset %u, %u rows, %u bytes\n",
+           (unsigned int)*_pnRow,(unsigned int)_pMemXfer->YOffset,
+           (unsigned int)_pMemXfer->Rows,(unsigned int)_pMemXfer->BytesWritten);
+    return false;
+  }
+
+  for (rr = 0; rr < _pMemXfer->Rows; rr++)
+  {
+    pRow = (const TW_UINT8*)_pMemXfer->Memory.TheMem + (rr * _pMemXfer->BytesPerRow);
+    for (cc = 0; cc < _pMemXfer->Columns; cc++)
+    {
+      if (pRow[cc] != (TW_UINT8)(((*_pnRow + rr) * 3) + cc))
+      {
+        printf("row %u column %u is %u\n",(unsigned int)(*_pnRow + rr),(unsigned int)cc,(unsigned int)pRow[cc]);
+        return false;
+      }
+    }
+  }
+
+  *_pnRow += _pMemXfer->Rows;
+  return true;
+}
+
+
+
+/**
+* One image, strip by strip...
+*/
+static bool CheckImage(CHECK_HOW _how)
+{
+  TW_IMAGEINFO    twimageinfo;
+  TW_SETUPMEMXFER twsetupmemxfer;
+  TW_IMAGEMEMXFER twmemxfer;
+  TW_UINT8       *pBuffer;
+  TW_UINT32       nRow = 0;
+  TW_UINT32       nStrips = 0;
+  TW_UINT16       rc;
+  bool            bOk = true;
+
+  memset(&twimageinfo,0,sizeof(twimageinfo));
+  memset(&twsetupmemxfer,0,sizeof(twsetupmemxfer));
+  if (   (TWRC_SUCCESS != DSM_Entry(&s_twidentityApp,&s_twidentityDs,DG_IMAGE,DAT_IMAGEINFO,MSG_GET,(TW_MEMREF)&twimageinfo))
+      || (TWRC_SUCCESS != DSM_Entry(&s_twidentityApp,&s_twidentityDs,DG_CONTROL,DAT_SETUPMEMXFER,MSG_GET,(TW_MEMREF)&twsetupmemxfer))
+      || (0 == twsetupmemxfer.Preferred))
+  {
+    printf("%s: no DAT_IMAGEINFO or DAT_SETUPMEMXFER\n",s_aszHow[_how]);
+    return false;
+  }
+
+  pBuffer = (TW_UINT8*)malloc(twsetupmemxfer.Preferred);
+  if (0 == pBuffer)
+  {
+    printf("%s: malloc failed\n",s_aszHow[_how]);
+    return false;
+  }
+
+  do
+  {
+    memset(&twmemxfer,0,sizeof(twmemxfer));
+    twmemxfer.Memory.Flags  = TWMF_APPOWNS | TWMF_POINTER;
+    twmemxfer.Memory.Length = twsetupmemxfer.Preferred;
+    twmemxfer.Memory.TheMem = (TW_MEMREF)pBuffer;
+    rc = Send(_how,DG_IMAGE,DAT_IMAGEMEMXFER,MSG_GET,(TW_MEMREF)&twmemxfer);
+    if ((TWRC_SUCCESS == rc) || (TWRC_XFERDONE == rc))
+    {
+      nStrips++;
+      if (!CheckStrip(&twmemxfer,&twimageinfo,&nRow))
+      {
+        bOk = false;
+        break;
+      }
+    }
+  } while (TWRC_SUCCESS == rc);
+
+  if (bOk && ((TWRC_XFERDONE != rc) || (nRow != (TW_UINT32)twimageinfo.ImageLength)))
+  {
+    printf("%s: the image ended with rc %u at row %u\n",s_aszHow[_how],(unsigned int)rc,(unsigned int)nRow);
+    bOk = false;
+  }
+  if (bOk)
+  {
+    printf("%s: %u strips, %u rows\n",s_aszHow[_how],(unsigned int)nStrips,(unsigned int)nRow);
+  }
+
+  free(pBuffer);
+  return bOk;
+}
+
+
+
+/**
+* Open the stub, transfer its images, and say how it went...
+*/
+int main()
+{
+  TW_USERINTERFACE twuserinterface;
+  TW_PENDINGXFERS  twpendingxfers;
+  int              nImage;
+
+  // These have to be set before the DSM starts...
+  setenv("TWAINDSM_ACTORS","1",1);
+  setenv("TWAINDSM_READAHEAD","4",1);
+
+  memset(&s_twidentityApp,0,sizeof(s_twidentityApp));
+  s_twidentityApp.Version.MajorNum = 1;
+  s_twidentityApp.ProtocolMajor = 2;
+  s_twidentityApp.ProtocolMinor = 4;
+  s_twidentityApp.SupportedGroups = DF_APP2 | DG_CONTROL | DG_IMAGE;
+  strcpy((char*)s_twidentityApp.Manufacturer,"TWAIN Working Group");
+  strcpy((char*)s_twidentityApp.ProductFamily,"Check");
+  strcpy((char*)s_twidentityApp.ProductName,"twaindsm-asynccheck");
+
+  memset(&s_twidentityDs,0,sizeof(s_twidentityDs));
+  if (   (TWRC_SUCCESS != DSM_Entry(&s_twidentityApp,0,DG_CONTROL,DAT_PARENT,MSG_OPENDSM,0))
+      || (TWRC_SUCCESS != DSM_Entry(&s_twidentityApp,0,DG_CONTROL,DAT_IDENTITY,MSG_GETFIRST,(TW_MEMREF)&s_twidentityDs))
+      || (TWRC_SUCCESS != DSM_Entry(&s_twidentityApp,0,DG_CONTROL,DAT_IDENTITY,MSG_OPENDS,(TW_MEMREF)&s_twidentityDs)))
+  {
+    printf("unable to open the stub driver\n");
+    return 1;
+  }
+
+  memset(&twuserinterface,0,sizeof(twuserinterface));
+  if (TWRC_SUCCESS != Send(kHOWCALLBACK,DG_CONTROL,DAT_USERINTERFACE,MSG_ENABLEDS,(TW_MEMREF)&twuserinterface))
+  {
+    printf("MSG_ENABLEDS failed\n");
+    s_nFailed++;
+  }
+
+  for (nImage = 0; 0 == s_nFailed; nImage++)
+  {
+    if (!CheckImage((CHECK_HOW)(nImage % 3)))
+    {
+      s_nFailed++;
+    }
+    memset(&twpendingxfers,0,sizeof(twpendingxfers));
+    if (TWRC_SUCCESS != DSM_Entry(&s_twidentityApp,&s_twidentityDs,DG_CONTROL,DAT_PENDINGXFERS,MSG_ENDXFER,(TW_MEMREF)&twpendingxfers))
+    {
+      printf("MSG_ENDXFER failed\n");
+      s_nFailed++;
+    }
+    if (0 == twpendingxfers.Count)
+    {
+      break;
+    }
+  }
+  if ((0 == s_nFailed) && (2 != nImage))
+  {
+    printf("the stub has 3 images, we got %d\n",nImage + 1);
+    s_nFailed++;
+  }
+
+  if (TWRC_SUCCESS != Send(kHOWTICKET,DG_CONTROL,DAT_USERINTERFACE,MSG_DISABLEDS,(TW_MEMREF)&twuserinterface))
+  {
+    printf("MSG_DISABLEDS failed\n");
+    s_nFailed++;
+  }
+  DSM_Entry(&s_twidentityApp,0,DG_CONTROL,DAT_IDENTITY,MSG_CLOSEDS,(TW_MEMREF)&s_twidentityDs);
+  DSM_Entry(&s_twidentityApp,0,DG_CONTROL,DAT_PARENT,MSG_CLOSEDSM,0);
+
+  if (s_nFailed)
+  {
+    printf("%d check(s) failed\n",s_nFailed);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,218 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+/**
+* @file twaindsm-stubds.cpp
+* Stub driver.
+* Just enough of a driver for twaindsm-asynccheck: a gray image of
+* kSTUBWIDTH by kSTUBHEIGHT, in strips of kSTUBROWS rows, the same
+* image kSTUBIMAGES times.  Each pixel is a function of where it is,
+* so the test can check every strip it gets back.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include <string.h>
+#include "twain.h"
+
+
+
+/**
+* The image, and the size of the strips we like...
+*/
+#define kSTUBWIDTH  64
+#define kSTUBHEIGHT 48
+#define kSTUBROWS   8
+#define kSTUBIMAGES 3
+
+
+
+/**
+* What we remember between calls.  The DSM only ever has one of us
+* open in the test, so there's only one of these...
+*/
+static TW_UINT32 s_nRow;       /**< the next row to send */
+static TW_UINT16 s_nPending;   /**< images left, including this one */
+
+
+
+/**
+* The value the test expects at a pixel...
+*/
+static TW_UINT8 StubPixel(TW_UINT32 _nRow,
+                          TW_UINT32 _nColumn)
+{
+  return (TW_UINT8)((_nRow * 3) + _nColumn);
+}
+
+
+
+/**
+* One strip, into the application's buffer...
+*/
+static TW_UINT16 StubMemXfer(TW_IMAGEMEMXFER *_pMemXfer)
+{
+  TW_UINT8  *pRow;
+  TW_UINT32  nRows;
+  TW_UINT32  rr;
+  TW_UINT32  cc;
+
+  if (   (0 == s_nPending)
+      || (s_nRow >= kSTUBHEIGHT)
+      || (0 == _pMemXfer->Memory.TheMem)
+      || (_pMemXfer->Memory.Flags & TWMF_HANDLE)
+      || (_pMemXfer->Memory.Length < kSTUBWIDTH))
+  {
+    return TWRC_FAILURE;
+  }
+
+  nRows = _pMemXfer->Memory.Length / kSTUBWIDTH;
+  if (nRows > kSTUBROWS)
+  {
+    nRows = kSTUBROWS;
+  }
+  if (nRows > (kSTUBHEIGHT - s_nRow))
+  {
+    nRows = kSTUBHEIGHT - s_nRow;
+  }
+
+  for (rr = 0; rr < nRows; rr++)
+  {
+    pRow = (TW_UINT8*)_pMemXfer->Memory.TheMem + (rr * kSTUBWIDTH);
+    for (cc = 0; cc < kSTUBWIDTH; cc++)
+    {
+      pRow[cc] = StubPixel(s_nRow + rr,cc);
+    }
+  }
+
+  _pMemXfer->Compression  = TWCP_NONE;
+  _pMemXfer->BytesPerRow  = kSTUBWIDTH;
+  _pMemXfer->Columns      = kSTUBWIDTH;
+  _pMemXfer->Rows         = nRows;
+  _pMemXfer->XOffset      = 0;
+  _pMemXfer->YOffset      = s_nRow;
+  _pMemXfer->BytesWritten = nRows * kSTUBWIDTH;
+  s_nRow += nRows;
+
+  return (s_nRow >= kSTUBHEIGHT) ? TWRC_XFERDONE : TWRC_SUCCESS;
+}
+
+
+
+/**
+* The driver's entry point...
+*/
+TW_UINT16 TW_CALLINGSTYLE DS_Entry(pTW_IDENTITY _pOrigin,
+                                   TW_UINT32    _DG,
+                                   TW_UINT16    _DAT,
+                                   TW_UINT16    _MSG,
+                                   TW_MEMREF    _pData)
+{
+  TW_IDENTITY     *pIdentity;
+  TW_IMAGEINFO    *pImageInfo;
+  TW_SETUPMEMXFER *pSetupMemXfer;
+  TW_UINT32        Id;
+
+  (void)_pOrigin;
+  (void)_DG;
+
+  switch (_DAT)
+  {
+    case DAT_IDENTITY:
+      if (MSG_GET == _MSG)
+      {
+        pIdentity = (TW_IDENTITY*)_pData;
+        Id = (TW_UINT32)pIdentity->Id;
+        memset(pIdentity,0,sizeof(TW_IDENTITY));
+        pIdentity->Id = Id;
+        pIdentity->Version.MajorNum = 1;
+        pIdentity->ProtocolMajor = 2;
+        pIdentity->ProtocolMinor = 4;
+        pIdentity->SupportedGroups = DF_DS2 | DG_CONTROL | DG_IMAGE;
+        strcpy((char*)pIdentity->Manufacturer,"TWAIN Working Group");
+        strcpy((char*)pIdentity->ProductFamily,"Stub");
+        strcpy((char*)pIdentity->ProductName,"twaindsm stub");
+      }
+      return TWRC_SUCCESS;
+
+    case DAT_ENTRYPOINT:
+    case DAT_CAPABILITY:
+      return TWRC_SUCCESS;
+
+    case DAT_STATUS:
+      ((TW_STATUS*)_pData)->ConditionCode = TWCC_SUCCESS;
+      return TWRC_SUCCESS;
+
+    case DAT_USERINTERFACE:
+      if (MSG_ENABLEDS == _MSG)
+      {
+        s_nRow = 0;
+        s_nPending = kSTUBIMAGES;
+      }
+      return TWRC_SUCCESS;
+
+    case DAT_IMAGEINFO:
+      pImageInfo = (TW_IMAGEINFO*)_pData;
+      memset(pImageInfo,0,sizeof(TW_IMAGEINFO));
+      pImageInfo->ImageWidth = kSTUBWIDTH;
+      pImageInfo->ImageLength = kSTUBHEIGHT;
+      pImageInfo->SamplesPerPixel = 1;
+      pImageInfo->BitsPerSample[0] = 8;
+      pImageInfo->BitsPerPixel = 8;
+      pImageInfo->PixelType = TWPT_GRAY;
+      pImageInfo->Compression = TWCP_NONE;
+      return TWRC_SUCCESS;
+
+    case DAT_SETUPMEMXFER:
+      pSetupMemXfer = (TW_SETUPMEMXFER*)_pData;
+      pSetupMemXfer->MinBufSize = kSTUBWIDTH;
+      pSetupMemXfer->MaxBufSize = kSTUBWIDTH * kSTUBHEIGHT;
+      pSetupMemXfer->Preferred = kSTUBWIDTH * kSTUBROWS;
+      return TWRC_SUCCESS;
+
+    case DAT_IMAGEMEMXFER:
+      return StubMemXfer((TW_IMAGEMEMXFER*)_pData);
+
+    case DAT_PENDINGXFERS:
+      if ((MSG_ENDXFER == _MSG) && s_nPending)
+      {
+        s_nPending--;
+      }
+      else if (MSG_RESET == _MSG)
+      {
+        s_nPending = 0;
+      }
+      s_nRow = 0;
+      ((TW_PENDINGXFERS*)_pData)->Count = s_nPending;
+      return TWRC_SUCCESS;
+
+    default:
+      return TWRC_FAILURE;
+  }
+}
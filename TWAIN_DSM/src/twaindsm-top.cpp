@@ -0,0 +1,372 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+
+/**
+* @file twaindsm-top.cpp
+* Live viewer.
+* Show every process on this machine that's using the Data Source
+* Manager, and what its applications are doing, by reading the shared
+* memory segments described in twaindsm.h.  We only ever read them, so
+* we can't hurt anybody, and nobody has to answer us.
+*
+* Usage: twaindsm-top [-d seconds] [-n iterations]
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "twaindsm.h"
+
+
+
+/**
+* Where the segments show up...
+*/
+#define SHMDIR "/dev/shm"
+
+/**
+* How many sessions we remember from one sample to the next, so we
+* can work out the rates...
+*/
+#define MAXSAMPLES 256
+
+
+
+/**
+* What we remember about a session...
+*/
+typedef struct
+{
+  TW_UINT32 Pid;        /**< the process */
+  TW_UINT32 AppId;      /**< the application */
+  TW_UINT32 Triplets;   /**< triplets at the last sample */
+  TW_TWDSM_UINT64 Bytes;/**< bytes at the last sample */
+  int       bSeen;      /**< still around on this pass */
+} SAMPLE;
+
+static SAMPLE s_asample[MAXSAMPLES];       /**< the last sample of each session */
+static SAMPLE s_asamplenext[MAXSAMPLES];   /**< this pass, becomes s_asample */
+static int    s_nsamples;                  /**< how many are in s_asample */
+static int    s_nsamplesnext;              /**< how many are in s_asamplenext */
+
+
+
+/**
+* Copy a session out of the segment, using the seqlock to make sure
+* we didn't catch the DSM in the middle of changing it...
+* @param[in] _psession the session in the segment
+* @param[out] _pcopy where we put it
+* @return true if we got a clean copy
+*/
+static bool ReadSession(const volatile TW_TWDSM_SHMSESSION *_psession,
+                        TW_TWDSM_SHMSESSION                *_pcopy)
+{
+  int       tries;
+  TW_UINT32 seq;
+
+  for (tries = 0; tries < 100; tries++)
+  {
+    seq = _psession->Seq;
+    if (seq & 1)
+    {
+      continue;
+    }
+    __sync_synchronize();
+    memcpy(_pcopy,(const void*)_psession,sizeof(*_pcopy));
+    __sync_synchronize();
+    if (seq == _psession->Seq)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+
+/**
+* Find the last sample for a session, and remember this one...
+* @param[in] _pid the process
+* @param[in] _psession the session
+* @return the last sample, or NULL if this is the first time
+*/
+static const SAMPLE *Sample(const TW_UINT32            _pid,
+                            const TW_TWDSM_SHMSESSION *_psession)
+{
+  int ii;
+
+  if (s_nsamplesnext < MAXSAMPLES)
+  {
+    s_asamplenext[s_nsamplesnext].Pid      = _pid;
+    s_asamplenext[s_nsamplesnext].AppId    = _psession->AppId;
+    s_asamplenext[s_nsamplesnext].Triplets = _psession->Triplets;
+    s_asamplenext[s_nsamplesnext].Bytes    = _psession->Bytes;
+    s_nsamplesnext++;
+  }
+
+  for (ii = 0; ii < s_nsamples; ii++)
+  {
+    if ((s_asample[ii].Pid == _pid) && (s_asample[ii].AppId == _psession->AppId))
+    {
+      return &s_asample[ii];
+    }
+  }
+
+  return 0;
+}
+
+
+
+/**
+* Show one segment...
+* @param[in] _szName the name of the segment in /dev/shm
+* @param[in] _seconds time since the last sample
+* @return true if it was a live DSM
+*/
+static bool ShowSegment(const char *_szName,
+                        const double _seconds)
+{
+  int                   fd;
+  int                   ii;
+  char                  szPath[64];
+  struct stat           st;
+  void                 *pv;
+  const TW_TWDSM_SHM   *pshm;
+  TW_TWDSM_SHMSESSION   session;
+  const SAMPLE         *psample;
+  double                tps;
+  double                mbps;
+  char                  szLast[64];
+  char                  szNode[32];
+
+  snprintf(szPath,sizeof(szPath),"/%s",_szName);
+  fd = shm_open(szPath,O_RDONLY,0);
+  if (fd < 0)
+  {
+    return false;
+  }
+  if ((0 != fstat(fd,&st)) || ((size_t)st.st_size < sizeof(TW_TWDSM_SHM)))
+  {
+    close(fd);
+    return false;
+  }
+  pv = mmap(0,sizeof(TW_TWDSM_SHM),PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (MAP_FAILED == pv)
+  {
+    return false;
+  }
+  pshm = (const TW_TWDSM_SHM*)pv;
+
+  // Make sure it's one of ours, that we understand it, and that
+  // whoever made it is still with us...
+  if (   (TWDSM_SHM_MAGIC != pshm->Magic)
+      || (TWDSM_SHM_VERSION != pshm->Version)
+      || (sizeof(TW_TWDSM_SHM) != pshm->Size)
+      || ((0 != kill((pid_t)pshm->Pid,0)) && (EPERM != errno)))
+  {
+    munmap(pv,sizeof(TW_TWDSM_SHM));
+    return false;
+  }
+
+  printf("%-7u %-16.16s\n",(unsigned int)pshm->Pid,(const char*)pshm->ProcessName);
+
+  for (ii = 0; (ii < TWDSM_SHM_SESSIONS) && (ii < (int)pshm->Sessions); ii++)
+  {
+    if (   !ReadSession(&pshm->aSession[ii],&session)
+        || (0 == session.AppId))
+    {
+      continue;
+    }
+
+    // No rates until we've seen it twice...
+    psample = Sample(pshm->Pid,&session);
+    tps  = 0;
+    mbps = 0;
+    if (psample && (_seconds > 0))
+    {
+      tps  = (double)(TW_UINT32)(session.Triplets - psample->Triplets) / _seconds;
+      mbps = (double)(TW_TWDSM_UINT64)(session.Bytes - psample->Bytes) / (1024.0 * 1024.0) / _seconds;
+    }
+
+    szLast[0] = 0;
+    if (session.LastTime)
+    {
+      struct tm tm;
+      time_t    t = (time_t)session.LastTime;
+      localtime_r(&t,&tm);
+      snprintf(szLast,sizeof(szLast),"%02d:%02d:%02d rc=%u cc=%u %u/0x%04x/0x%04x",
+               tm.tm_hour,tm.tm_min,tm.tm_sec,
+               (unsigned int)session.LastRC,
+               (unsigned int)session.LastCC,
+               (unsigned int)session.LastDG,
+               (unsigned int)session.LastDAT,
+               (unsigned int)session.LastMSG);
+    }
+
+    szNode[0] = 0;
+    if (session.Node >= 0)
+    {
+      snprintf(szNode,sizeof(szNode),"%d/%u",(int)session.Node,(unsigned int)session.Cpus);
+    }
+
+    printf("  %-3u %-20.20s %-20.20s %-8s %9.1f %9.2f %8u %5u  %s\n",
+           (unsigned int)session.AppId,
+           (const char*)session.AppName,
+           session.DsName[0] ? (const char*)session.DsName : "-",
+           szNode[0] ? szNode : "-",
+           tps,
+           mbps,
+           (unsigned int)session.InFlight,
+           (unsigned int)session.CallbackDepth,
+           szLast);
+  }
+
+  munmap(pv,sizeof(TW_TWDSM_SHM));
+  return true;
+}
+
+
+
+/**
+* Show everybody...
+* @param[in] _seconds time since the last sample
+*/
+static void ShowAll(const double _seconds)
+{
+  DIR           *pdir;
+  struct dirent *pdirent;
+  int            nprocesses;
+
+  printf("%-7s %-16s\n","PID","PROCESS");
+  printf("  %-3s %-20s %-20s %-8s %9s %9s %8s %5s  %s\n",
+         "APP","NAME","DRIVER","NODE/CPU","TRIP/S","MB/S","INFLIGHT","CBQ","LAST ERROR");
+
+  s_nsamplesnext = 0;
+  nprocesses = 0;
+  pdir = opendir(SHMDIR);
+  if (pdir)
+  {
+    while (0 != (pdirent = readdir(pdir)))
+    {
+      if (0 == strncmp(pdirent->d_name,&TWDSM_SHM_PREFIX[1],strlen(&TWDSM_SHM_PREFIX[1])))
+      {
+        if (ShowSegment(pdirent->d_name,_seconds))
+        {
+          nprocesses++;
+        }
+      }
+    }
+    closedir(pdir);
+  }
+
+  if (0 == nprocesses)
+  {
+    printf("(no processes are using the DSM)\n");
+  }
+
+  memcpy(s_asample,s_asamplenext,sizeof(s_asample));
+  s_nsamples = s_nsamplesnext;
+}
+
+
+
+/**
+* Our entry point...
+*/
+int main(int argc, char *argv[])
+{
+  int             ii;
+  int             iterations = 0;
+  double          delay = 1.0;
+  double          seconds = 0;
+  struct timespec tsLast;
+  struct timespec tsNow;
+
+  for (ii = 1; ii < argc; ii++)
+  {
+    if (!strcmp(argv[ii],"-d") && ((ii + 1) < argc))
+    {
+      delay = atof(argv[++ii]);
+    }
+    else if (!strcmp(argv[ii],"-n") && ((ii + 1) < argc))
+    {
+      iterations = atoi(argv[++ii]);
+    }
+    else
+    {
+      fprintf(stderr,"usage: %s [-d seconds] [-n iterations]\n",argv[0]);
+      return 1;
+    }
+  }
+  if (delay <= 0)
+  {
+    delay = 1.0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC,&tsLast);
+  for (ii = 0; (0 == iterations) || (ii < iterations); ii++)
+  {
+    // Clear the screen when we're on a terminal...
+    if (isatty(STDOUT_FILENO))
+    {
+      printf("\033[H\033[2J");
+    }
+    ShowAll(seconds);
+    fflush(stdout);
+
+    if ((0 != iterations) && ((ii + 1) >= iterations))
+    {
+      break;
+    }
+    usleep((useconds_t)(delay * 1000000));
+    clock_gettime(CLOCK_MONOTONIC,&tsNow);
+    seconds = (double)(tsNow.tv_sec - tsLast.tv_sec) + (double)(tsNow.tv_nsec - tsLast.tv_nsec) / 1e9;
+    tsLast = tsNow;
+    if (!isatty(STDOUT_FILENO))
+    {
+      printf("\n");
+    }
+  }
+
+  return 0;
+}
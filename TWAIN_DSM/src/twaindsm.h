@@ -0,0 +1,498 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+/**
+* @file twaindsm.h
+* Extensions to TWAIN that are handled by this Data Source Manager.
+*
+* These triplets use values from the DAT_CUSTOMBASE range.  That range
+* normally belongs to the drivers, so the DSM only treats them as its own
+* when they are sent with a NULL pDest.  Sent to a driver (with a non-NULL
+* pDest), they're passed along untouched, just like any other custom DAT.
+*
+* An application that sends these to some other DSM will get back
+* TWRC_FAILURE / TWCC_BADPROTOCOL, so it's safe to probe for them.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#ifndef __TWAINDSM_H__
+#define __TWAINDSM_H__
+
+#include "twain.h"
+
+
+/* Set the packing to match twain.h */
+#ifdef TWH_CMP_MSC
+    #pragma pack (push, before_twaindsm)
+    #pragma pack (2)
+#elif defined(TWH_CMP_GNU)
+    #if defined(__APPLE__) /* cf: Mac version of TWAIN.h */
+        #pragma options align = power
+    #else
+        #pragma pack (push, before_twaindsm)
+        #pragma pack (2)
+    #endif
+#elif defined(TWH_CMP_BORLAND)
+    #pragma option -a2
+#endif
+
+
+/****************************************************************************
+ * Data Argument Types                                                      *
+ ****************************************************************************/
+
+/* Per-triplet call counts and latency percentiles.  Operations are     *
+ * MSG_GET (look up the row named by AppId/DsId/DG/DAT/MSG), MSG_GETFIRST *
+ * and MSG_GETNEXT (walk every row, TWRC_ENDOFLIST at the end), and      *
+ * MSG_RESET (clear the calling application's rows).                     */
+#define DAT_TWDSM_METRICS        (DAT_CUSTOMBASE + 0x0100)
+
+/* The memfd behind a handle from DSM_MemAllocate, so another process can *
+ * map it without a copy.  Only MSG_GET.  This only works on Linux, with  *
+ * TWAINDSM_MEMPOOL=memfd, otherwise it's TWRC_FAILURE/TWCC_BADVALUE.     */
+#define DAT_TWDSM_MEMFD          (DAT_CUSTOMBASE + 0x0101)
+
+/* DG_IMAGE/DAT_IMAGEMEMXFER/MSG_GET for a whole vector of strips in one  *
+ * call to DSM_Entry.  Only MSG_GET.  The DSM calls the driver once for   *
+ * each descriptor, and stops at the first return code other than        *
+ * TWRC_SUCCESS, which it returns.                                        */
+#define DAT_TWDSM_MEMXFERBATCH   (DAT_CUSTOMBASE + 0x0102)
+
+/* A whole image from a driver in state 6, in one frame, instead of the  *
+ * DAT_IMAGEMEMXFER loop.  Only MSG_GET.  The DSM gets DAT_IMAGEINFO and  *
+ * DAT_SETUPMEMXFER from the driver, and then asks for strips right into  *
+ * the frame.  The return code is the driver's last one, and you still   *
+ * send DAT_PENDINGXFERS/MSG_ENDXFER afterwards.                          */
+#define DAT_TWDSM_IMAGEFRAME     (DAT_CUSTOMBASE + 0x0103)
+
+/* Have the DSM convert DAT_IMAGEMEMXFER strips from a driver to another  *
+ * pixel format as they arrive.  MSG_SET turns it on for a driver,        *
+ * MSG_RESET turns it off, and MSG_GET says what's set, and which SIMD    *
+ * kernels the DSM is using.  DAT_IMAGEINFO from the driver describes the *
+ * image after conversion, so ask for it after MSG_SET.                   */
+#define DAT_TWDSM_CONVERT        (DAT_CUSTOMBASE + 0x0104)
+
+/* Have the DSM look at DAT_IMAGEMEMXFER strips from a driver as they go  *
+ * by, and add up a luminance histogram, ink coverage and edge density    *
+ * for each page.  MSG_SET turns it on for a driver, MSG_RESET turns it   *
+ * off, and MSG_GET gets the numbers for the last page that ended with    *
+ * TWRC_XFERDONE.  The DSM needs DAT_IMAGEINFO from the driver for each   *
+ * page, so ask for it before the transfer.                               */
+#define DAT_TWDSM_ANALYSIS       (DAT_CUSTOMBASE + 0x0105)
+
+/* The CRC32C of the last image a driver transferred, and how many of its *
+ * strips ran past TW_MEMORY.Length.  Only MSG_GET.  This only works with *
+ * TWAINDSM_CHECKSUM set in the environment, otherwise it's               *
+ * TWRC_FAILURE/TWCC_BADPROTOCOL, and it's TWCC_SEQERROR until the first  *
+ * TWRC_XFERDONE.                                                         */
+#define DAT_TWDSM_CHECKSUM       (DAT_CUSTOMBASE + 0x0106)
+
+/* A descriptor that polls readable when a driver sends a DAT_NULL        *
+ * message to an application that didn't register a callback, so it can   *
+ * sleep in poll or epoll instead of spinning on DAT_EVENT.  MSG_GET      *
+ * makes it the first time and returns it, MSG_RESET closes it.  This     *
+ * only works on Linux, otherwise it's TWRC_FAILURE/TWCC_BADPROTOCOL.     */
+#define DAT_TWDSM_EVENTFD        (DAT_CUSTOMBASE + 0x0107)
+
+/* These two are never sent, they only name DAT_TWDSM_METRICS rows, with  *
+ * a DG of DG_CONTROL and the MSG the driver sent with DAT_NULL.          *
+ * DAT_TWDSM_DELIVER is the time from the driver's DAT_NULL to the        *
+ * application getting the message, in its callback or from DAT_EVENT.    *
+ * DAT_TWDSM_RESPOND is the time from the application getting             *
+ * MSG_XFERREADY to its first DG_IMAGE triplet to that driver.            */
+#define DAT_TWDSM_DELIVER        (DAT_CUSTOMBASE + 0x0108)
+#define DAT_TWDSM_RESPOND        (DAT_CUSTOMBASE + 0x0109)
+
+/* Run a triplet on a driver's own thread without waiting for it.  This   *
+ * only works with TWAINDSM_ACTORS set in the environment, otherwise it's *
+ * TWRC_FAILURE/TWCC_BADPROTOCOL.  MSG_SET queues the triplet and returns *
+ * a Ticket.  MSG_GET waits for that Ticket and MSG_GETNEXT returns any   *
+ * finished one without waiting, or TWRC_ENDOFLIST.                       */
+#define DAT_TWDSM_SUBMIT         (DAT_CUSTOMBASE + 0x010A)
+
+
+/****************************************************************************
+ * Shared Memory                                                            *
+ ****************************************************************************/
+
+/* Every process using the DSM publishes a TW_TWDSM_SHM to a named shared *
+ * memory segment, so tools like twaindsm-top can watch it from outside.  *
+ * The name is the prefix followed by the process id in decimal.  Set     *
+ * TWAINDSM_SHM=0 in the environment to turn it off.                      */
+#ifdef TWH_CMP_MSC
+    #define TWDSM_SHM_PREFIX     "Local\\twaindsm."
+#else
+    #define TWDSM_SHM_PREFIX     "/twaindsm."
+#endif
+#define TWDSM_SHM_MAGIC          0x4D534454   /* "TDSM" */
+#define TWDSM_SHM_VERSION        3
+#define TWDSM_SHM_SESSIONS       16
+
+/* The byte counter is 64 bits, so a busy scanner doesn't wrap it.       */
+#ifdef TWH_CMP_MSC
+    typedef unsigned __int64     TW_TWDSM_UINT64;
+#else
+    typedef unsigned long long   TW_TWDSM_UINT64;
+#endif
+
+
+/****************************************************************************
+ * Pixel Conversion                                                         *
+ ****************************************************************************/
+
+/* TW_TWDSM_CONVERT Format.  The source can be 1 bit bilevel, or 8 or 16  *
+ * bit gray or RGB, uncompressed and chunky.  Gray can go to anything,    *
+ * RGB can't go to gray.  16 bit samples are in the machine's byte order. */
+#define TWDSM_FORMAT_NONE        0
+#define TWDSM_FORMAT_GRAY8       1
+#define TWDSM_FORMAT_RGB8        2
+#define TWDSM_FORMAT_RGBA8       3
+
+/* TW_TWDSM_CONVERT Flags.  SWAPRB if the driver sends BGR, INVERT if it  *
+ * sends TWPF_VANILLA, LSBFIRST if its ICAP_BITORDER is TWBO_LSBFIRST.    */
+#define TWDSM_CONVERT_SWAPRB     0x0001
+#define TWDSM_CONVERT_INVERT     0x0002
+#define TWDSM_CONVERT_LSBFIRST   0x0004
+
+/* TW_TWDSM_CONVERT Kernels, the fastest the machine has.  Set            *
+ * TWAINDSM_CONVERT=scalar in the environment to check the others         *
+ * against the plain C versions.                                          */
+#define TWDSM_KERNELS_SCALAR     0
+#define TWDSM_KERNELS_SSSE3      1
+#define TWDSM_KERNELS_AVX2       2
+#define TWDSM_KERNELS_NEON       3
+
+
+/****************************************************************************
+ * Content Analysis                                                         *
+ ****************************************************************************/
+
+/* TW_TWDSM_ANALYSIS Flags, for bilevel, gray and RGB from 8 to 32 bits   *
+ * per pixel, and 16 bit gray, uncompressed and chunky.  INVERT if the    *
+ * driver sends TWPF_VANILLA, LSBFIRST if its ICAP_BITORDER is            *
+ * TWBO_LSBFIRST.  These describe what the application gets, so they're   *
+ * after any DAT_TWDSM_CONVERT.                                           */
+#define TWDSM_ANALYSIS_INVERT    0x0001
+#define TWDSM_ANALYSIS_LSBFIRST  0x0002
+
+/* TW_TWDSM_ANALYSIS defaults for InkThreshold and BlankCoverage.  A     *
+ * pixel is ink if its luminance is below InkThreshold, and a page is     *
+ * blank if less than BlankCoverage/10000 of it is ink.  Two neighbours   *
+ * on a row are an edge if they differ by TWDSM_ANALYSIS_EDGESTEP or more. */
+#define TWDSM_ANALYSIS_INK       128
+#define TWDSM_ANALYSIS_BLANK     20
+#define TWDSM_ANALYSIS_EDGESTEP  32
+
+
+/****************************************************************************
+ * Checksums                                                                *
+ ****************************************************************************/
+
+/* TW_TWDSM_CHECKSUM Kernels, the CRC32C instructions the machine has.    *
+ * Set TWAINDSM_CHECKSUM=scalar in the environment to use the plain C     *
+ * version.                                                               */
+#define TWDSM_CHECKSUM_SCALAR    0
+#define TWDSM_CHECKSUM_SSE42     1
+#define TWDSM_CHECKSUM_ARMV8     2
+
+/* How many bytes the DSM holds back at the end of each DAT_IMAGEMEMXFER  *
+ * buffer, and fills with a pattern, to catch a driver writing past the   *
+ * Length it was given.                                                   */
+#define TWDSM_CHECKSUM_GUARD     64
+
+
+/****************************************************************************
+ * Structures                                                               *
+ ****************************************************************************/
+
+/* DAT_TWDSM_METRICS, one row for each application/driver/triplet the DSM *
+ * has seen.  Latencies are in microseconds, and cover the whole trip     *
+ * through DSM_Entry, including the time spent in the driver (or, for    *
+ * DAT_NULL, in the application's callback).  Index is the cursor for    *
+ * MSG_GETFIRST/MSG_GETNEXT, leave it alone between calls.  A DsId of 0  *
+ * means the triplet was handled by the DSM.                             */
+typedef struct {
+   TW_UINT32  Index;
+   TW_UINT32  AppId;
+   TW_UINT32  DsId;
+   TW_UINT32  DG;
+   TW_UINT16  DAT;
+   TW_UINT16  MSG;
+   TW_UINT32  Calls;
+   TW_UINT32  Errors;
+   TW_UINT32  MeanUs;
+   TW_UINT32  P50Us;
+   TW_UINT32  P90Us;
+   TW_UINT32  P99Us;
+   TW_UINT32  P999Us;
+   TW_UINT32  MaxUs;
+} TW_TWDSM_METRICS, FAR * pTW_TWDSM_METRICS;
+
+/* DAT_TWDSM_MEMFD, fill in hMem and the DSM fills in the rest.  Only     *
+ * handles of a page or more have an fd, and it holds that handle and     *
+ * nothing else, sealed at its size.  The fd still belongs to the DSM, so *
+ * pass it along (with SCM_RIGHTS) or dup it, but don't close it.  The    *
+ * pages aren't reused for another handle after DSM_MemFree.  Length is   *
+ * what the handle was allocated with.  Offset is where the block starts  *
+ * in the file and isn't page aligned, so the consumer maps from 0.       */
+typedef struct {
+   TW_HANDLE  hMem;
+   TW_INT32   Fd;
+   TW_UINT32  Offset;
+   TW_UINT32  Length;
+} TW_TWDSM_MEMFD, FAR * pTW_TWDSM_MEMFD;
+
+/* DAT_TWDSM_EVENTFD, the DSM fills in Fd, an eventfd that's nonblocking  *
+ * and close-on-exec, one for each application.  It's the DSM's, so don't *
+ * close it.  When it polls readable, read 8 bytes from it first, then    *
+ * send DAT_EVENT/MSG_PROCESSEVENT to each open driver until it stops     *
+ * returning TWRC_DSEVENT, so nothing sent in between is missed.  Pending *
+ * is how many drivers had messages waiting when MSG_GET returned.        */
+typedef struct {
+   TW_INT32   Fd;
+   TW_UINT32  Pending;
+} TW_TWDSM_EVENTFD, FAR * pTW_TWDSM_EVENTFD;
+
+/* DAT_TWDSM_SUBMIT, fill in DsId, DG, DAT, MSG and pData for MSG_SET,    *
+ * and the DSM fills in Ticket.  pData belongs to the driver until the    *
+ * triplet is done, so leave it alone.  Triplets for one driver run in    *
+ * the order they're sent, including DSM_Entry calls, which wait their    *
+ * turn.  For MSG_GET fill in Ticket, for MSG_GETNEXT the DSM fills it    *
+ * in, and either way the DSM fills in the rest.  ReturnCode is what the  *
+ * triplet returned, and ConditionCode is the driver's DAT_STATUS if that *
+ * was TWRC_FAILURE.  Each Ticket can be collected once.  The eventfd     *
+ * from DAT_TWDSM_EVENTFD is bumped when a triplet finishes.              */
+typedef struct {
+   TW_UINT32  Ticket;
+   TW_UINT32  DsId;
+   TW_UINT32  DG;
+   TW_UINT16  DAT;
+   TW_UINT16  MSG;
+   TW_MEMREF  pData;
+   TW_UINT16  ReturnCode;
+   TW_UINT16  ConditionCode;
+} TW_TWDSM_SUBMIT, FAR * pTW_TWDSM_SUBMIT;
+
+/* DAT_TWDSM_MEMXFERBATCH, fill in DsId, Count and pMemXfer, and set up   *
+ * each descriptor the way you would for DAT_IMAGEMEMXFER.  The DSM sets  *
+ * Delivered to the number of descriptors with data in them (counting the *
+ * one that got TWRC_XFERDONE), and ReturnCode to the last return code    *
+ * from the driver.  On TWRC_FAILURE ask the driver for its DAT_STATUS,   *
+ * unless Delivered is 0 and the DSM's own DAT_STATUS isn't TWCC_SUCCESS. */
+typedef struct {
+   TW_UINT32         DsId;
+   TW_UINT32         Count;
+   TW_UINT32         Delivered;
+   TW_UINT16         ReturnCode;
+   TW_UINT16         Reserved;
+   pTW_IMAGEMEMXFER  pMemXfer;
+} TW_TWDSM_MEMXFERBATCH, FAR * pTW_TWDSM_MEMXFERBATCH;
+
+/* DAT_TWDSM_IMAGEFRAME, fill in DsId and the DSM fills in the rest when  *
+ * it returns TWRC_XFERDONE.  hFrame comes from DSM_MemAllocate, it's     *
+ * yours, free it with DSM_MemFree.  Length is how much of it has image   *
+ * data.  For uncompressed, chunky data, row N starts at N * BytesPerRow, *
+ * and ImageLength is the number of rows, which may not be what           *
+ * DAT_IMAGEINFO said.  Otherwise BytesPerRow is 0 and the strips are one *
+ * after the other.  Strips counts the DAT_IMAGEMEMXFER calls, and Copied *
+ * how many of those had to be moved into place.                          */
+typedef struct {
+   TW_UINT32  DsId;
+   TW_HANDLE  hFrame;
+   TW_UINT32  Length;
+   TW_UINT32  BytesPerRow;
+   TW_INT32   ImageWidth;
+   TW_INT32   ImageLength;
+   TW_INT16   BitsPerPixel;
+   TW_UINT16  Compression;
+   TW_UINT32  Strips;
+   TW_UINT32  Copied;
+} TW_TWDSM_IMAGEFRAME, FAR * pTW_TWDSM_IMAGEFRAME;
+
+/* DAT_TWDSM_CONVERT, fill in DsId, and Format and Flags for MSG_SET.     *
+ * Kernels is filled in by the DSM.                                       */
+typedef struct {
+   TW_UINT32  DsId;
+   TW_UINT16  Format;
+   TW_UINT16  Flags;
+   TW_UINT16  Kernels;
+   TW_UINT16  Reserved;
+} TW_TWDSM_CONVERT, FAR * pTW_TWDSM_CONVERT;
+
+/* DAT_TWDSM_ANALYSIS, fill in DsId, and Flags, InkThreshold (1 to 256)   *
+ * and BlankCoverage for MSG_SET, 0 gets the defaults.  MSG_GET fills in  *
+ * the rest for the last page, or fails with TWCC_SEQERROR if there       *
+ * hasn't been one yet.  Page counts the pages since MSG_SET.             *
+ * InkCoverage and EdgeDensity are in 1/10000ths, of the pixels and of    *
+ * the pairs of neighbours on a row.  Bilevel pixels go into Histogram[0] *
+ * and Histogram[255].                                                    */
+typedef struct {
+   TW_UINT32  DsId;
+   TW_UINT16  Flags;
+   TW_UINT16  InkThreshold;
+   TW_UINT16  BlankCoverage;
+   TW_BOOL    Blank;
+   TW_UINT32  Page;
+   TW_UINT32  Pixels;
+   TW_UINT32  InkPixels;
+   TW_UINT32  Edges;
+   TW_UINT16  InkCoverage;
+   TW_UINT16  EdgeDensity;
+   TW_UINT32  Histogram[256];
+} TW_TWDSM_ANALYSIS, FAR * pTW_TWDSM_ANALYSIS;
+
+/* DAT_TWDSM_CHECKSUM, fill in DsId.  Crc32c covers the BytesWritten of   *
+ * each strip, one after the other, or the native handle, or the file,    *
+ * of the last transfer that ended with TWRC_XFERDONE.  Dat says which    *
+ * one it was.  Transfers and Overruns count since MSG_OPENDS, Overruns   *
+ * being the strips that wrote into the guard bytes.                      */
+typedef struct {
+   TW_UINT32  DsId;
+   TW_UINT32  Crc32c;
+   TW_UINT32  Bytes;
+   TW_UINT32  Strips;
+   TW_UINT32  Transfers;
+   TW_UINT32  Overruns;
+   TW_UINT16  Dat;
+   TW_UINT16  Kernels;
+} TW_TWDSM_CHECKSUM, FAR * pTW_TWDSM_CHECKSUM;
+
+/* One application's session in the shared memory segment.  The counters *
+ * only ever go up, and wrap at 32 bits (Bytes at 64), so a reader takes  *
+ * the difference between two samples to get a rate.  Seq is a seqlock: it's odd while   *
+ * the DSM is changing the session, so a reader copies the session, and   *
+ * tries again if Seq was odd or changed during the copy.  AppId is 0 if  *
+ * the slot is free.  The Last* fields describe the last TWRC_FAILURE,    *
+ * LastTime is in seconds since 1970.  Node is the NUMA node the open     *
+ * driver was placed on with TWAINDSM_AFFINITY, or -1, and Cpus is how    *
+ * many CPUs its threads may use, or 0.  All of the TW_UINT32 fields are  *
+ * on four byte boundaries, and Bytes on an eight byte one, don't move    *
+ * them around.                                                           */
+typedef struct {
+   TW_UINT32  Seq;
+   TW_UINT32  AppId;
+   TW_TWDSM_UINT64 Bytes;
+   TW_UINT32  Triplets;
+   TW_UINT32  InFlight;
+   TW_UINT32  CallbackDepth;
+   TW_UINT32  LastTime;
+   TW_UINT32  LastDG;
+   TW_UINT16  LastDAT;
+   TW_UINT16  LastMSG;
+   TW_UINT16  LastRC;
+   TW_UINT16  LastCC;
+   TW_UINT32  LastDsId;
+   TW_STR32   AppName;
+   TW_STR32   DsName;
+   TW_INT32   Node;
+   TW_UINT32  Cpus;
+   TW_UINT32  Reserved;
+} TW_TWDSM_SHMSESSION, FAR * pTW_TWDSM_SHMSESSION;
+
+/* The whole segment.  Check Magic, Version and Size before using it.     *
+ * A process that crashes leaves its segment behind, so readers should    *
+ * make sure Pid is still running.  StartTime is in seconds since 1970.   */
+typedef struct {
+   TW_UINT32  Magic;
+   TW_UINT32  Version;
+   TW_UINT32  Size;
+   TW_UINT32  Pid;
+   TW_UINT32  StartTime;
+   TW_UINT32  Sessions;
+   TW_STR64   ProcessName;
+   TW_UINT16  Reserved[3];
+   TW_TWDSM_SHMSESSION aSession[TWDSM_SHM_SESSIONS];
+} TW_TWDSM_SHM, FAR * pTW_TWDSM_SHM;
+
+
+/****************************************************************************
+ * Asynchronous Entry Point                                                 *
+ ****************************************************************************/
+
+/* Called when a DSM_EntryAsync triplet is done, on the driver's thread.  *
+ * pSubmit has the Ticket, ReturnCode and ConditionCode, and is only good *
+ * until this returns.  Calls to the same driver from here go straight to *
+ * it, but don't wait on its other tickets, they're queued behind you.    */
+typedef void (TW_CALLINGSTYLE *DSMASYNCPROC)(pTW_IDENTITY     pOrigin,
+                                             pTW_TWDSM_SUBMIT pSubmit,
+                                             TW_MEMREF        pRefCon);
+
+/* DSM_Entry without the wait, exported next to it.  Needs an open driver *
+ * and TWAINDSM_ACTORS, and takes the same triplets as DAT_TWDSM_SUBMIT.  *
+ * It returns TWRC_SUCCESS once the triplet is queued, with *pTicket      *
+ * filled in, or TWRC_FAILURE with the reason in the DSM's DAT_STATUS.    *
+ * With pfnDone the DSM calls it with pRefCon when the triplet is done,   *
+ * and the ticket is gone after that.  Without it, collect the ticket     *
+ * with DAT_TWDSM_SUBMIT, the same as one from MSG_SET.  twaindsmawait.h  *
+ * has a C++20 awaitable built on it.  TWAINDSM_READAHEAD doesn't apply   *
+ * to these drivers: its strips would wait on the driver's thread behind  *
+ * the DAT_IMAGEMEMXFER that's waiting for them, so each strip is read    *
+ * when it's asked for, the same as without read-ahead.                  */
+#ifdef  __cplusplus
+extern "C" {
+#endif  /* __cplusplus */
+
+TW_UINT16 TW_CALLINGSTYLE DSM_EntryAsync(pTW_IDENTITY pOrigin,
+                                         pTW_IDENTITY pDest,
+                                         TW_UINT32    DG,
+                                         TW_UINT16    DAT,
+                                         TW_UINT16    MSG,
+                                         TW_MEMREF    pData,
+                                         DSMASYNCPROC pfnDone,
+                                         TW_MEMREF    pRefCon,
+                                         pTW_UINT32   pTicket);
+
+typedef TW_UINT16 (TW_CALLINGSTYLE *DSMENTRYASYNCPROC)(pTW_IDENTITY pOrigin,
+                                                  pTW_IDENTITY pDest,
+                                                  TW_UINT32    DG,
+                                                  TW_UINT16    DAT,
+                                                  TW_UINT16    MSG,
+                                                  TW_MEMREF    pData,
+                                                  DSMASYNCPROC pfnDone,
+                                                  TW_MEMREF    pRefCon,
+                                                  pTW_UINT32   pTicket);
+#ifdef  __cplusplus
+}
+#endif  /* cplusplus */
+
+
+/* Restore the previous packing alignment */
+#ifdef TWH_CMP_MSC
+    #pragma pack (pop, before_twaindsm)
+#elif defined(TWH_CMP_GNU)
+    #if defined(__APPLE__) /* cf: Mac version of TWAIN.h */
+        #pragma options align = reset
+    #else
+        #pragma pack (pop, before_twaindsm)
+    #endif
+#elif defined(TWH_CMP_BORLAND)
+    #pragma option -a.
+#endif
+
+#endif /* __TWAINDSM_H__ */
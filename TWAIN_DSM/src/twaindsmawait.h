@@ -0,0 +1,175 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+/**
+* @file twaindsmawait.h
+* A C++20 awaitable for DSM_EntryAsync.
+*
+* co_await a CTwnDsmAwait to send a triplet to a driver without tying
+* up a thread while it runs.  The coroutine picks up again on the
+* driver's thread when the triplet is done, so hop back to your own
+* executor before doing anything that isn't for that driver.  The
+* result is the TW_TWDSM_SUBMIT for the triplet, and if it couldn't be
+* queued at all its ReturnCode is TWRC_FAILURE and its ConditionCode
+* comes from the DSM's DAT_STATUS.
+*
+* Without C++20 coroutines this header is empty, so it's safe to
+* include anywhere twaindsm.h is.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#ifndef __TWAINDSMAWAIT_H__
+#define __TWAINDSMAWAIT_H__
+
+#include "twaindsm.h"
+
+#if defined(__cplusplus) && defined(__has_include)
+  #if __has_include(<coroutine>) && ((__cplusplus >= 202002L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 202002L)))
+    #define TWDSM_HAS_COROUTINES 1
+  #endif
+#endif
+
+#if defined(TWDSM_HAS_COROUTINES)
+
+#include <coroutine>
+#include <string.h>
+
+/**
+* @class CTwnDsmAwait
+* One triplet for one driver, awaited once.  It has to outlive the
+* co_await, which it does if it's a temporary in the co_await
+* expression...
+*/
+class CTwnDsmAwait
+{
+  public:
+
+    /**
+    * Takes the same arguments as DSM_Entry, and sends nothing yet.
+    * @param[in] _pOrigin the application
+    * @param[in] _pDest the driver
+    * @param[in] _DG the data group
+    * @param[in] _DAT the data argument type
+    * @param[in] _MSG the message
+    * @param[in,out] _pData the data, the driver's until we resume
+    */
+    CTwnDsmAwait(pTW_IDENTITY _pOrigin,
+                 pTW_IDENTITY _pDest,
+                 TW_UINT32    _DG,
+                 TW_UINT16    _DAT,
+                 TW_UINT16    _MSG,
+                 TW_MEMREF    _pData) :
+      m_pOrigin(_pOrigin),
+      m_pDest(_pDest),
+      m_DG(_DG),
+      m_DAT(_DAT),
+      m_MSG(_MSG),
+      m_pData(_pData)
+    {
+      memset(&m_twsubmit,0,sizeof(m_twsubmit));
+    }
+
+    /**
+    * It's never done before it's sent.
+    * @return false
+    */
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+
+    /**
+    * Queue the triplet.  Once it's queued it can finish, and resume
+    * the coroutine, before DSM_EntryAsync returns, so we mustn't touch
+    * ourselves after that.
+    * @param[in] _handle the coroutine
+    * @return false if it wasn't queued, so keep going
+    */
+    bool await_suspend(std::coroutine_handle<> _handle) noexcept
+    {
+      TW_UINT32 uTicket;
+      TW_STATUS twstatus;
+
+      m_handle = _handle;
+      if (TWRC_SUCCESS == DSM_EntryAsync(m_pOrigin,m_pDest,m_DG,m_DAT,m_MSG,m_pData,Done,(TW_MEMREF)this,&uTicket))
+      {
+        return true;
+      }
+
+      memset(&twstatus,0,sizeof(twstatus));
+      m_twsubmit.ReturnCode = TWRC_FAILURE;
+      m_twsubmit.ConditionCode = TWCC_BUMMER;
+      if (TWRC_SUCCESS == DSM_Entry(m_pOrigin,0,DG_CONTROL,DAT_STATUS,MSG_GET,(TW_MEMREF)&twstatus))
+      {
+        m_twsubmit.ConditionCode = twstatus.ConditionCode;
+      }
+      return false;
+    }
+
+    /**
+    * What the driver said.
+    * @return the Ticket, ReturnCode and ConditionCode
+    */
+    TW_TWDSM_SUBMIT await_resume() const noexcept
+    {
+      return m_twsubmit;
+    }
+
+  private:
+
+    /**
+    * The DSMASYNCPROC, on the driver's thread.
+    * @param[in] _pOrigin the application
+    * @param[in] _pSubmit the answer
+    * @param[in] _pRefCon us
+    */
+    static void TW_CALLINGSTYLE Done(pTW_IDENTITY     _pOrigin,
+                                     pTW_TWDSM_SUBMIT _pSubmit,
+                                     TW_MEMREF        _pRefCon)
+    {
+      CTwnDsmAwait *pawait = (CTwnDsmAwait*)_pRefCon;
+      (void)_pOrigin;
+      pawait->m_twsubmit = *_pSubmit;
+      pawait->m_handle.resume();
+    }
+
+    pTW_IDENTITY            m_pOrigin;   /**< the application */
+    pTW_IDENTITY            m_pDest;     /**< the driver */
+    TW_UINT32               m_DG;        /**< the data group */
+    TW_UINT16               m_DAT;       /**< the data argument type */
+    TW_UINT16               m_MSG;       /**< the message */
+    TW_MEMREF               m_pData;     /**< the data */
+    TW_TWDSM_SUBMIT         m_twsubmit;  /**< the answer */
+    std::coroutine_handle<> m_handle;    /**< who to resume */
+};
+
+#endif /* TWDSM_HAS_COROUTINES */
+
+#endif /* __TWAINDSMAWAIT_H__ */
@@ -0,0 +1,518 @@
+/***************************************************************************
+ * TWAIN Data Source Manager version 2.1
+ * Manages image acquisition data sources used by a machine.
+ * Copyright © 2007 TWAIN Working Group:
+ * Adobe Systems Incorporated,AnyDoc Software Inc., Eastman Kodak Company,
+ * Fujitsu Computer Products of America, JFL Peripheral Solutions Inc.,
+ * Ricoh Corporation, and Xerox Corporation.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact the TWAIN Working Group by emailing the Technical Subcommittee at
+ * twainwg@twain.org or mailing us at 13090 Hwy 9, Suite 3, Boulder Creek, CA 95006.
+ *
+ ***************************************************************************/
+
+
+/**
+* @file warmpool.cpp
+* Warm drivers.
+* Keep a driver open for a while after the application closes it, so
+* that opening it again doesn't have to wait for the device.
+* @author TWAIN Working Group
+* @date March 2007
+*/
+
+#include "dsm.h"
+
+
+
+/**
+* Enviroment varible with the grace period in seconds...
+* @see CTwnDsmWarmPool
+*/
+#define kWARMPOOLENV "TWAINDSM_WARMPOOL"
+
+/**
+* The longest we'll keep a driver...
+* @see CTwnDsmWarmPool
+*/
+#define WARMPOOL_MAXSECONDS 3600
+
+
+
+/**
+* One driver that's being kept warm, hung on its DS_SESSION and on
+* our list.  It stays on both while it closes...
+*/
+typedef struct WARM_DS_
+{
+  struct WARM_DS_ *pwarmNext; /**< the next driver on m_pwarmList */
+  TWID_T       AppId;       /**< the application */
+  TWID_T       DsId;        /**< the driver */
+  TW_IDENTITY  appidentity; /**< our copy of the application's identity */
+  TW_IDENTITY  dsidentity;  /**< our copy of the driver's identity */
+  UINT64       tickExpire;  /**< when we close it, from DSM_GetTickNs */
+  bool         bClosing;    /**< somebody is closing it right now */
+} WARM_DS;
+
+
+
+/**
+* Our implementation class where we hide our attributes...
+*/
+class CTwnDsmWarmPoolImpl
+{
+  public:
+    /// Make sure we're squeaky clean...
+    CTwnDsmWarmPoolImpl()
+    {
+      memset(&pod,0,sizeof(pod));
+    }
+
+    /**
+    * Find a driver, the caller holds the mutex...
+    * @param[in] _AppId the application
+    * @param[in] _DsId the driver
+    * @return the driver, or NULL
+    */
+    WARM_DS *Find(const TWID_T _AppId,
+                  const TWID_T _DsId);
+
+    /**
+    * Take a driver off its DS_SESSION and our list, and free it.  The
+    * caller holds the mutex...
+    * @param[in] _pwarm the driver
+    */
+    void Forget(WARM_DS *_pwarm);
+
+    /**
+    * Close a driver we've marked as closing, and forget it.  The
+    * caller holds the mutex, we let go of it while the driver closes...
+    * @param[in] _pwarm the driver
+    */
+    void Close(WARM_DS *_pwarm);
+
+    /**
+    * The thread that closes drivers when their time is up...
+    */
+    void Reaper();
+
+  public:
+    // If you add a class in future, declare it here and not in
+    // the pod, or the memset we do in the constructor will ruin
+    // your day...
+
+    /**
+    * We use a pod system because it help prevents us from
+    * making dumb initialization mistakes...
+    */
+    struct _pod
+    {
+      bool         m_bEnabled;       /**< TWAINDSM_WARMPOOL is set */
+      UINT64       m_nsGrace;        /**< how long we keep a driver */
+      MUTEX        m_mutex;          /**< guards the rest, and DS_SESSION.pwarm */
+      COND         m_cond;           /**< a driver came or went, or we're stopping */
+      THREAD       m_thread;         /**< the reaper */
+      bool         m_bThread;        /**< the reaper needs to be joined */
+      bool         m_bStop;          /**< the reaper should stop */
+      WARM_DS     *m_pwarmList;      /**< the drivers */
+    } pod;    /**< Pieces of data for CTwnDsmWarmPoolImpl*/
+};
+
+
+
+/**
+* The reaper just runs the loop...
+*/
+static THREADPROC(WarmPoolThread)
+{
+  ((CTwnDsmWarmPoolImpl*)_pv)->Reaper();
+  return 0;
+}
+
+
+
+/**
+* The constructor for our class...
+*/
+CTwnDsmWarmPool::CTwnDsmWarmPool()
+{
+  char szEnv[32];
+  int  nSeconds;
+
+  m_ptwndsmwarmpoolimpl = new CTwnDsmWarmPoolImpl;
+  MUTEXINIT(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+  CONDINIT(m_ptwndsmwarmpoolimpl->pod.m_cond);
+
+  SGETENV(szEnv,NCHARS(szEnv),kWARMPOOLENV);
+  nSeconds = atoi(szEnv);
+
+  // The reaper closes drivers on their own threads, a driver that's
+  // only ever seen the application's thread mustn't see ours...
+  if ((nSeconds > 0) && !g_ptwndsmactor->IsEnabled())
+  {
+    kLOG((kLOGERR,"%s needs TWAINDSM_ACTORS, closed drivers won't be kept open",kWARMPOOLENV));
+    return;
+  }
+
+  if (nSeconds > 0)
+  {
+    if (nSeconds > WARMPOOL_MAXSECONDS)
+    {
+      nSeconds = WARMPOOL_MAXSECONDS;
+    }
+    m_ptwndsmwarmpoolimpl->pod.m_nsGrace = (UINT64)nSeconds * 1000000000ULL;
+    m_ptwndsmwarmpoolimpl->pod.m_bEnabled = true;
+    kLOG((kLOGINFO,"closed drivers are kept open for %d seconds",nSeconds));
+  }
+}
+
+
+
+/**
+* The destructor for our class.  Applications should have closed the
+* DSM by now, which empties the pool, but if one didn't we still close
+* its drivers properly...
+*/
+CTwnDsmWarmPool::~CTwnDsmWarmPool()
+{
+  WARM_DS *pwarm;
+
+  if (m_ptwndsmwarmpoolimpl)
+  {
+    MUTEXLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+    m_ptwndsmwarmpoolimpl->pod.m_bStop = true;
+    CONDBROADCAST(m_ptwndsmwarmpoolimpl->pod.m_cond);
+    MUTEXUNLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+    if (m_ptwndsmwarmpoolimpl->pod.m_bThread)
+    {
+      THREADJOIN(m_ptwndsmwarmpoolimpl->pod.m_thread);
+    }
+
+    MUTEXLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+    while (0 != (pwarm = m_ptwndsmwarmpoolimpl->pod.m_pwarmList))
+    {
+      pwarm->bClosing = true;
+      m_ptwndsmwarmpoolimpl->Close(pwarm);
+    }
+    MUTEXUNLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+
+    CONDDESTROY(m_ptwndsmwarmpoolimpl->pod.m_cond);
+    MUTEXDESTROY(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+    delete m_ptwndsmwarmpoolimpl;
+    m_ptwndsmwarmpoolimpl = 0;
+  }
+}
+
+
+
+/**
+* TWAINDSM_WARMPOOL gave us a grace period, and the actors are on...
+*/
+bool CTwnDsmWarmPool::IsEnabled()
+{
+  return m_ptwndsmwarmpoolimpl->pod.m_bEnabled;
+}
+
+
+
+/**
+* Hang on to the driver, and make sure the reaper is running.  A
+* driver whose thread didn't start is called on whatever thread calls
+* us, so it's closed now, on the application's thread...
+*/
+bool CTwnDsmWarmPool::Park(TW_IDENTITY *_pAppId,
+                           TW_IDENTITY *_pDsId)
+{
+  DS_SESSION *pdssession;
+  WARM_DS    *pwarm;
+
+  if (!m_ptwndsmwarmpoolimpl->pod.m_bEnabled)
+  {
+    return false;
+  }
+  pdssession = g_ptwndsm->DsSession((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id);
+  if (0 == pdssession)
+  {
+    return false;
+  }
+  if (!g_ptwndsmactor->IsRunning((TWID_T)_pAppId->Id,(TWID_T)_pDsId->Id))
+  {
+    kLOG((kLOGINFO,"%.32s doesn't have a thread of its own, closing it",(char*)_pDsId->ProductName));
+    return false;
+  }
+
+  pwarm = (WARM_DS*)calloc(1,sizeof(WARM_DS));
+  if (0 == pwarm)
+  {
+    kLOG((kLOGERR,"calloc failed keeping %.32s warm, closing it",(char*)_pDsId->ProductName));
+    return false;
+  }
+  pwarm->AppId = (TWID_T)_pAppId->Id;
+  pwarm->DsId = (TWID_T)_pDsId->Id;
+  pwarm->appidentity = *_pAppId;
+  pwarm->dsidentity = *_pDsId;
+  pwarm->tickExpire = DSM_GetTickNs() + m_ptwndsmwarmpoolimpl->pod.m_nsGrace;
+
+  MUTEXLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+  if (!m_ptwndsmwarmpoolimpl->pod.m_bThread)
+  {
+    m_ptwndsmwarmpoolimpl->pod.m_bThread = THREADCREATE(m_ptwndsmwarmpoolimpl->pod.m_thread,WarmPoolThread,m_ptwndsmwarmpoolimpl);
+  }
+  if (!m_ptwndsmwarmpoolimpl->pod.m_bThread || pdssession->pwarm)
+  {
+    MUTEXUNLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+    free(pwarm);
+    kLOG((kLOGINFO,"unable to keep %.32s warm, closing it",(char*)_pDsId->ProductName));
+    return false;
+  }
+  pdssession->pwarm = pwarm;
+  pwarm->pwarmNext = m_ptwndsmwarmpoolimpl->pod.m_pwarmList;
+  m_ptwndsmwarmpoolimpl->pod.m_pwarmList = pwarm;
+  CONDBROADCAST(m_ptwndsmwarmpoolimpl->pod.m_cond);
+  MUTEXUNLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+
+  kLOG((kLOGINFO,"keeping %.32s warm for %.32s",(char*)_pDsId->ProductName,(char*)_pAppId->ProductName));
+  return true;
+}
+
+
+
+/**
+* Take the driver back.  If the reaper got to it first we wait for it
+* to finish, so the caller can load the driver from scratch...
+*/
+bool CTwnDsmWarmPool::Take(const TWID_T _AppId,
+                           const TWID_T _DsId)
+{
+  WARM_DS *pwarm;
+
+  if (!m_ptwndsmwarmpoolimpl->pod.m_bEnabled)
+  {
+    return false;
+  }
+
+  MUTEXLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+  while (   (0 != (pwarm = m_ptwndsmwarmpoolimpl->Find(_AppId,_DsId)))
+         && pwarm->bClosing)
+  {
+    CONDWAIT(m_ptwndsmwarmpoolimpl->pod.m_cond,m_ptwndsmwarmpoolimpl->pod.m_mutex);
+  }
+  if (pwarm)
+  {
+    m_ptwndsmwarmpoolimpl->Forget(pwarm);
+    CONDBROADCAST(m_ptwndsmwarmpoolimpl->pod.m_cond);
+  }
+  MUTEXUNLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+
+  return (0 != pwarm);
+}
+
+
+
+/**
+* Is the driver closed as far as the application knows...
+*/
+bool CTwnDsmWarmPool::IsParked(const TWID_T _AppId,
+                               const TWID_T _DsId)
+{
+  bool bParked;
+
+  if (!m_ptwndsmwarmpoolimpl->pod.m_bEnabled)
+  {
+    return false;
+  }
+
+  MUTEXLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+  bParked = (0 != m_ptwndsmwarmpoolimpl->Find(_AppId,_DsId));
+  MUTEXUNLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+
+  return bParked;
+}
+
+
+
+/**
+* Close everything the application left with us, waiting for anything
+* the reaper is already closing...
+*/
+void CTwnDsmWarmPool::StopApp(const TWID_T _AppId)
+{
+  WARM_DS *pwarm;
+  WARM_DS *pwarmClosing;
+  UINT     nClosed = 0;
+
+  if (!m_ptwndsmwarmpoolimpl->pod.m_bEnabled)
+  {
+    return;
+  }
+
+  // Close drivers that aren't closing, and wait for the ones that are...
+  MUTEXLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+  for (;;)
+  {
+    pwarmClosing = 0;
+    for (pwarm = m_ptwndsmwarmpoolimpl->pod.m_pwarmList; pwarm; pwarm = pwarm->pwarmNext)
+    {
+      if (pwarm->AppId == _AppId)
+      {
+        if (!pwarm->bClosing)
+        {
+          break;
+        }
+        pwarmClosing = pwarm;
+      }
+    }
+    if (0 == pwarm)
+    {
+      pwarm = pwarmClosing;
+    }
+    if (0 == pwarm)
+    {
+      break;
+    }
+    if (pwarm->bClosing)
+    {
+      CONDWAIT(m_ptwndsmwarmpoolimpl->pod.m_cond,m_ptwndsmwarmpoolimpl->pod.m_mutex);
+      continue;
+    }
+    pwarm->bClosing = true;
+    m_ptwndsmwarmpoolimpl->Close(pwarm);
+    nClosed++;
+  }
+  MUTEXUNLOCK(m_ptwndsmwarmpoolimpl->pod.m_mutex);
+
+  if (nClosed)
+  {
+    kLOG((kLOGINFO,"closed %u warm drivers",nClosed));
+  }
+}
+
+
+
+/**
+* It's on the driver's DS_SESSION, if it's anywhere...
+*/
+WARM_DS *CTwnDsmWarmPoolImpl::Find(const TWID_T _AppId,
+                                   const TWID_T _DsId)
+{
+  DS_SESSION *pdssession;
+
+  pdssession = g_ptwndsm->DsSession(_AppId,_DsId);
+  if (0 == pdssession)
+  {
+    return 0;
+  }
+
+  return pdssession->pwarm;
+}
+
+
+
+/**
+* The DS_SESSION isn't ours once the driver is gone, so it's only
+* touched if it still points at us...
+*/
+void CTwnDsmWarmPoolImpl::Forget(WARM_DS *_pwarm)
+{
+  DS_SESSION  *pdssession;
+  WARM_DS    **ppwarm;
+
+  pdssession = g_ptwndsm->DsSession(_pwarm->AppId,_pwarm->DsId);
+  if (pdssession && (pdssession->pwarm == _pwarm))
+  {
+    pdssession->pwarm = 0;
+  }
+  for (ppwarm = &pod.m_pwarmList; *ppwarm; ppwarm = &(*ppwarm)->pwarmNext)
+  {
+    if (*ppwarm == _pwarm)
+    {
+      *ppwarm = _pwarm->pwarmNext;
+      break;
+    }
+  }
+  free(_pwarm);
+}
+
+
+
+/**
+* The driver stays on its DS_SESSION while it closes, so nobody can
+* open it until it's really closed...
+*/
+void CTwnDsmWarmPoolImpl::Close(WARM_DS *_pwarm)
+{
+  TW_IDENTITY appidentity = _pwarm->appidentity;
+  TW_IDENTITY dsidentity = _pwarm->dsidentity;
+
+  MUTEXUNLOCK(pod.m_mutex);
+  kLOG((kLOGINFO,"closing warm driver %.32s",(char*)dsidentity.ProductName));
+  g_ptwndsm->WarmPoolClose(&appidentity,&dsidentity);
+  MUTEXLOCK(pod.m_mutex);
+
+  Forget(_pwarm);
+  CONDBROADCAST(pod.m_cond);
+}
+
+
+
+/**
+* Sleep until the next driver is due, and close it...
+*/
+void CTwnDsmWarmPoolImpl::Reaper()
+{
+  WARM_DS *pwarm;
+  WARM_DS *pwarmNext;
+  UINT64   tickNow;
+  UINT64   nsWait;
+
+  MUTEXLOCK(pod.m_mutex);
+  while (!pod.m_bStop)
+  {
+    // Find the one that's due first...
+    pwarm = 0;
+    for (pwarmNext = pod.m_pwarmList; pwarmNext; pwarmNext = pwarmNext->pwarmNext)
+    {
+      if (   !pwarmNext->bClosing
+          && ((0 == pwarm) || (pwarmNext->tickExpire < pwarm->tickExpire)))
+      {
+        pwarm = pwarmNext;
+      }
+    }
+
+    // Nothing to do...
+    if (0 == pwarm)
+    {
+      CONDWAIT(pod.m_cond,pod.m_mutex);
+      continue;
+    }
+
+    // Not yet, check again when it's due, or when something changes...
+    tickNow = DSM_GetTickNs();
+    if (pwarm->tickExpire > tickNow)
+    {
+      nsWait = pwarm->tickExpire - tickNow;
+      CONDTIMEDWAIT(pod.m_cond,pod.m_mutex,(UINT)((nsWait / 1000000ULL) + 1));
+      continue;
+    }
+
+    // Time's up...
+    pwarm->bClosing = true;
+    Close(pwarm);
+  }
+  MUTEXUNLOCK(pod.m_mutex);
+}
@@ -40,8 +40,11 @@ rm -rf $RPM_BUILD_ROOT
 %files
 %defattr(-,root,root,-)
 /usr/local/include/twain.h
+/usr/local/include/twaindsm.h
+/usr/local/include/twaindsmawait.h
 /usr/local/lib/libtwaindsm*
 /usr/local/lib/twain
+/usr/local/bin/twaindsm-top
 %doc doc/*
 
 %changelog
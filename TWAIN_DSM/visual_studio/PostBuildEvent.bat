@@ -12,10 +12,14 @@ mkdir "%Pub%\bin\twain32" > NUL 2>&1
 mkdir "%Pub%\bin\twain64" > NUL 2>&1
 
 ::
-:: Copy the header file...
+:: Copy the header files...
 ::
 echo copy "%ProjectDir%\..\src\twain.h" to "%Pub%\include\twain"
 xcopy "%ProjectDir%\..\src\twain.h" "%Pub%\include\twain" /r /y /q
+echo copy "%ProjectDir%\..\src\twaindsm.h" to "%Pub%\include\twain"
+xcopy "%ProjectDir%\..\src\twaindsm.h" "%Pub%\include\twain" /r /y /q
+echo copy "%ProjectDir%\..\src\twaindsmawait.h" to "%Pub%\include\twain"
+xcopy "%ProjectDir%\..\src\twaindsmawait.h" "%Pub%\include\twain" /r /y /q
 
 ::
 :: Copy the binary...